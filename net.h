@@ -16,20 +16,89 @@
 // int netlocalport(NET *sh)
 // int netsend(INET *sh, char *buf, int len)
 // int netrecv(INET *sh, char *buf, int maxlen)
+// int netcompress(NET *sh, enum netcompression alg, int level, int autoflush)
+// int netflush(NET *sh)
+// int netsetrate(NET *sh, long rate, long burst)
+// int netrategroup(int group, long rate, long burst)
+// int netsetrategroup(NET *sh, int group)
+// int netrecordsizing(NET *sh, int smallsize, int threshold, int idlems)
+// int netsettimeout(NET *sh, enum nettimeouts kind, int ms)
+// int nettimernext()
+// int nettimerexpire()
+// int netreconnect(NET *sh, int maxattempts)
+// int netshutdown(NET *sh)
+// int netclosemode(NET *sh, enum netclosemodes mode)
+// int netfdstats(struct netfdstats *st)
+// int netsourceaddrs(char **addrs, int naddrs)
+// int netsourceportrange(int lo, int hi)
+// int netbusypoll(NET *sh, int spinus, int cpu)
+// int netzerocopy(NET *sh, int threshold)
+// int netidlememory(NET *sh, int bufbytes)
+// int nethandshakepool(int threads)
+// int netbufpool(int bufsize, int maxbufs)
+// char *netrecv_borrow(NET *sh, int *len)
+// void netrecv_release(char *buf)
+// int netsetcork(NET *sh, int threshold)
+// int netreadahead(NET *sh, int bufbytes)
+// int netcipherprofile(enum netcipherprofiles profile)
+// int netpinspki(char *hostname, char **pins, int npins)
+// int netcertcache(int ttlsecs)
+// int netbreakerstate(char *hostname, int port, struct netbreakerstats *st)
+// int netendpointstats(char *hostname, int port, struct netendpointstats *st, int max)
+// NET *nethedgeconnect(char *hostname, int port, enum netflags flags)
+// int nethedgerequest(NET **sh, char *request, int len, char *response, int maxlen)
+// int nethedgeconfig(int percentile, int mindelayms, int maxdelayms, int budget)
+// int nethedgestats(struct nethedgestats *st)
 // int netclose(NET *sh)
 //
-// link with: -lssl -lcrypto 
+// NETSCHED *netschedstart(int nworkers, int pin)
+// int netschedadd(NETSCHED *s, NET *sh, netschedfn fn, void *arg)
+// int netschedremove(NETSCHED *s, NET *sh)
+// int netschedmigrate(NETSCHED *s, NET *sh, int worker)
+// int netschedworkers(NETSCHED *s)
+// int netschedstats(NETSCHED *s, int worker, struct netschedstats *st)
+// void netschedstop(NETSCHED *s)
+//
+// NETMUX *netmuxstart(NET *sh, int initiator)
+// NETSTREAM *netmuxopen(NETMUX *m)
+// NETSTREAM *netmuxaccept(NETMUX *m)
+// int netmuxsend(NETSTREAM *st, char *buf, int len)
+// int netmuxrecv(NETSTREAM *st, char *buf, int maxlen)
+// int netmuxshutdown(NETSTREAM *st)
+// int netmuxclose(NETSTREAM *st)
+// int netmuxid(NETSTREAM *st)
+// int netmuxrdfdset(NETMUX *m, fd_set *rdfds, fd_set *wrfds, int *l)
+// int netmuxprocess(NETMUX *m, fd_set *rdfds, fd_set *wrfds)
+// NETSTREAM *netmuxready(NETMUX *m)
+// int netmuxstats(NETMUX *m, struct netmuxstats *st)
+// void netmuxstop(NETMUX *m)
+//
+// link with: -lssl -lcrypto -lpthread [-lzstd] [-llz4]
+//            or, for lnet-notls.a (OPEN connections only), -lpthread [-lzstd] [-llz4]
 //
 
 #ifndef _NET_DEFINED
 #define _NET_DEFINED
 
 #include <stdio.h>
+#include <time.h>
 
 #ifndef NET
 typedef struct {} NET ;
 #endif
 
+#ifndef NETSCHED
+typedef struct {} NETSCHED ;
+#endif
+
+#ifndef NETMUX
+typedef struct {} NETMUX ;
+#endif
+
+#ifndef NETSTREAM
+typedef struct {} NETSTREAM ;
+#endif
+
 enum netflags {
   OPEN = 0,           // Default (non-SSL/TLS)
   TLS = 1,            // Enables TLS
@@ -38,7 +107,9 @@ enum netflags {
   NOCERTCHAIN = 8,    // Prevents interrogation of certificate chain for SSL
   DEBUGDATADUMP = 16, // Dump traffic to stdout - requires envvar NETDUMPENABLE
   DEBUGKEYDUMP = 32,  // Enables key dump - requires envvar SSLKEYLOGFILE
-  NONBLOCK = 256      // Handles client connection as non-blocking
+  NONBLOCK = 256,     // Handles client connection as non-blocking
+  ASYNCHANDSHAKE = 512, // TLS handshake performed by a worker thread
+  BALANCE = 1024      // Spread connections over every resolved address
 } ;
 
 // errno types
@@ -58,17 +129,70 @@ enum errorcodes {
   NET_ERR_BADP,              // Invalid network port specified
   NET_ERR_BADA,              // Invalid network port specified
   NET_ERR_TIMEOUT,           // Timeout establishing connection
-  NET_ERR_UNK                // Unknown Error
+  NET_ERR_UNK,               // Unknown Error
+  NET_ERR_NOTSUP,            // Feature not compiled into this build
+  NET_ERR_INUSE,             // Option already enabled on connection
+  NET_ERR_COMPRESS,          // Compression stream error
+  NET_ERR_THROTTLED,         // Send delayed by rate limit (NONBLOCK only)
+  NET_ERR_CIRCUITOPEN,       // Destination is failing, connect not attempted
+  NET_ERR_READTIMEOUT,       // No data received within the read timeout
+  NET_ERR_WRITETIMEOUT,      // Send blocked for longer than the write timeout
+  NET_ERR_IDLETIMEOUT        // Nothing sent or received within the idle timeout
 } ;
 
+// Streaming compression algorithms
+
+enum netcompression {
+  NETCOMPRESS_NONE = 0,      // No compression
+  NETCOMPRESS_ZSTD = 1,      // zstd streaming - requires build with ZSTD=1
+  NETCOMPRESS_LZ4 = 2        // LZ4 frame streaming - requires build with LZ4=1
+} ;
+
+struct netcompressstats {
+  unsigned long long rawout ;   // Application bytes passed to netsend
+  unsigned long long wireout ;  // Compressed bytes produced
+  unsigned long long rawin ;    // Decompressed bytes produced
+  unsigned long long wirein ;   // Compressed bytes received
+  double ratioout ;             // rawout / wireout
+  double ratioin ;              // rawin / wirein
+  double cpuseconds ;           // Thread CPU time spent in the codecs
+} ;
+
+
+//
+// @brief Initialise the library ahead of the first connection.  Optional,
+//        as TLS is otherwise initialised by the first TLS connect.
+// @return true on success
+//
 
 int netinit() ;
 
 
+// Destination circuit breaker states
+
+enum netbreakerstates {
+  NETBREAKER_CLOSED = 0,     // Destination healthy, connections attempted
+  NETBREAKER_OPEN = 1,       // Destination failing, connections rejected
+  NETBREAKER_HALFOPEN = 2    // Backoff elapsed, next connection is a probe
+} ;
+
+struct netbreakerstats {
+  int state ;                    // enum netbreakerstates
+  int consecutivefailures ;      // Failures since the last success
+  long retryinms ;               // Time until an open circuit allows a probe
+  unsigned long attempts ;       // Connection attempts made
+  unsigned long successes ;      // Connections established
+  unsigned long failures ;       // Connection attempts which failed
+  unsigned long rejected ;       // Attempts refused while the circuit was open
+  unsigned long opened ;         // Number of times the circuit has opened
+} ;
+
+
 //
 // @brief Connect to server
-// @param(in) hostname Name of server to connect to
-// @param(in) port Port number on server
+// @param(in) hostname Name of server to connect to, or unix:/path/to/socket
+//                     or unix:@name for a same-host unix domain socket
+// @param(in) port Port number on server (ignored for unix: endpoints)
 // @param(in) flags Type of connection to open (OPEN|SSL2|SSL3|NONBLOCK)
 // @return Handle to SSL structure, or NULL on failure (and sets errno)
 //
@@ -76,15 +200,307 @@ int netinit() ;
 NET *netconnect(char *hostname, int port, enum netflags flags) ;
 
 
+// Source address selection
+
+#define NET_MAXSOURCES 64
+
+struct netsourcestats {
+  char address[16] ;            // Source address, empty for the total
+  unsigned long connects ;      // Connection attempts from this address
+  unsigned long addrnotavail ;  // Attempts which found no free local port
+  unsigned long bindfailures ;  // Attempts which could not bind the address
+} ;
+
+
+//
+// @brief Configure the local addresses used for new connections, which
+//        are used in turn.  Each source address has its own ephemeral
+//        ports, and a source address with no free port for a destination
+//        (EADDRNOTAVAIL) is skipped in favour of the next.
+// @param(in) addrs Local IPv4 addresses
+// @param(in) naddrs Number of addresses, up to NET_MAXSOURCES, or 0 to let
+//            the kernel choose
+// @return true on success, or false if an address is invalid
+//
+
+int netsourceaddrs(char **addrs, int naddrs) ;
+
+
+//
+// @brief Restrict the ephemeral ports used by new connections
+//        (IP_LOCAL_PORT_RANGE, Linux 6.3 and later)
+// @param(in) lo Lowest port, or 0 for the system range
+// @param(in) hi Highest port
+// @return true on success, or false if the range is invalid
+//
+
+int netsourceportrange(int lo, int hi) ;
+
+
+//
+// @brief Obtain source address statistics
+// @param(in) source Index of source address, or -1 for the total
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if the index is invalid
+//
+
+int netsourcestats(int source, struct netsourcestats *st) ;
+
+
+//
+// @brief Re-establish a connection to the same destination, waiting out
+//        the destination's backoff between attempts (this call blocks)
+// @param(in) sh Handle of connection to re-establish
+// @param(in) maxattempts Number of connection attempts before giving up
+// @return true on success, or false on error (setting errno)
+//
+
+int netreconnect(NET *sh, int maxattempts) ;
+
+
+//
+// @brief Configure destination health tracking, which is off until a
+//        threshold is set.  Only connect, handshake and timeout failures
+//        count.  The backoff defaults to 100ms initially and 30s at most.
+// @param(in) threshold Consecutive failures which open a circuit, 0 (the
+//            default) disables
+// @param(in) basems Initial backoff in milliseconds
+// @param(in) maxms Maximum backoff in milliseconds
+// @return true on success, or false if parameters are invalid
+//
+
+int netbreakerconfig(int threshold, int basems, int maxms) ;
+
+
+//
+// @brief Obtain the circuit state of a destination
+// @param(in) hostname Name of server as passed to netconnect
+// @param(in) port Port number on server
+// @param(out) st Statistics structure to populate, may be NULL
+// @return NETBREAKER_CLOSED, NETBREAKER_OPEN or NETBREAKER_HALFOPEN
+//
+
+int netbreakerstate(char *hostname, int port, struct netbreakerstats *st) ;
+
+
+//
+// @brief Forget the failure history of a destination, closing its circuit
+// @param(in) hostname Name of server as passed to netconnect
+// @param(in) port Port number on server
+// @return true if the destination was known
+//
+
+int netbreakerreset(char *hostname, int port) ;
+
+
+// Load balancing over resolved addresses (BALANCE)
+
+struct netendpointstats {
+  char address[16] ;             // IPv4 address
+  int active ;                   // Open connections
+  int ejected ;                  // True while excluded after failures
+  long ejectedms ;               // Time until an ejected address returns
+  double latencyms ;             // Moving average of connect and response latency
+  unsigned long picks ;          // Connections assigned to the address
+  unsigned long failures ;       // Connection attempts which failed
+  unsigned long ejections ;      // Number of times ejected
+  unsigned long samples ;        // Latency observations
+} ;
+
+
+//
+// @brief Configure load balancing.  An address is ejected after a run of
+//        failed connects, for a backoff which doubles each time it fails
+//        again.  Defaults are 1 failure, 1s and 30s.
+// @param(in) failures Consecutive failures which eject an address
+// @param(in) ejectms Initial ejection in milliseconds
+// @param(in) maxejectms Maximum ejection in milliseconds
+// @return true on success, or false if parameters are invalid
+//
+
+int netbalanceconfig(int failures, int ejectms, int maxejectms) ;
+
+
+//
+// @brief Obtain statistics for each address of a BALANCE destination
+// @param(in) hostname Name of server as passed to netconnect
+// @param(in) port Port number on server
+// @param(out) st Array of statistics structures to populate
+// @param(in) max Number of entries in st
+// @return Number of addresses in the latest resolution (which may exceed
+//         max), or 0 if the destination is unknown
+//
+
+int netendpointstats(char *hostname, int port, struct netendpointstats *st, int max) ;
+
+
+// Hedged connects and requests
+
+struct nethedgestats {
+  unsigned long connects ;       // Hedged connects
+  unsigned long requests ;       // Hedged requests
+  unsigned long hedges ;         // Second attempts started
+  unsigned long wins ;           // Second attempts which finished first
+  unsigned long losses ;         // Second attempts beaten by the first, and closed
+  unsigned long failures ;       // First or second attempts which failed
+  unsigned long denied ;         // Second attempts withheld by the budget
+  double connectdelayms ;        // Current delay before hedging a connect
+  double requestdelayms ;        // Current delay before hedging a request
+} ;
+
+
+//
+// @brief Connect to server, starting a second connection (to another
+//        address, if the name has more than one) should the first not
+//        complete its TLS handshake within the hedge delay.  The first to
+//        complete is returned and the other closed.  BALANCE is implied.
+// @param(in) hostname Name of server to connect to
+// @param(in) port Port number on server
+// @param(in) flags Type of connection to open
+// @return Handle to NET structure, or NULL on failure (and sets errno)
+//
+
+NET *nethedgeconnect(char *hostname, int port, enum netflags flags) ;
+
+
+//
+// @brief Send an idempotent request and read the start of its response,
+//        replaying the request on a second connection should the response
+//        not start within the hedge delay.  Whichever responds first is
+//        kept, and the other closed.
+// @param(in,out) sh Handle of open connection, replaced (and the original
+//                closed) if the second connection responds first
+// @param(in) request Request to send
+// @param(in) len Length of request
+// @param(out) response Buffer for the start of the response
+// @param(in) maxlen Size of response buffer
+// @return Number of bytes received, or -1 on error (setting errno).  The
+//         rest of the response is read from *sh with netrecv().
+//
+
+int nethedgerequest(NET **sh, char *request, int len, char *response, int maxlen) ;
+
+
+//
+// @brief Configure hedging.  The delay is the given percentile of recent
+//        latencies, clamped to the minimum and maximum (the maximum is
+//        used until enough latencies are known), and the budget caps
+//        hedges per 100 hedged operations.  Defaults are 95, 1ms, 1000ms
+//        and 10.
+// @param(in) percentile Latency percentile, 50 to 100
+// @param(in) mindelayms Smallest hedge delay in milliseconds
+// @param(in) maxdelayms Largest hedge delay in milliseconds
+// @param(in) budget Hedges per 100 operations, 0 to disable hedging
+// @return true on success, or false if parameters are invalid
+//
+
+int nethedgeconfig(int percentile, int mindelayms, int maxdelayms, int budget) ;
+
+
+//
+// @brief Obtain hedging statistics
+// @param(out) st Statistics structure to populate
+// @return true on success
+//
+
+int nethedgestats(struct nethedgestats *st) ;
+
+
+// TLS cipher suite and key exchange group profiles
+
+enum netcipherprofiles {
+  NETCIPHER_DEFAULT = 0,       // OpenSSL defaults
+  NETCIPHER_THROUGHPUT = 1,    // Bulk cipher fastest on this CPU first, TLS 1.2 allowed
+  NETCIPHER_LATENCY = 2,       // X25519 first, for a 1-RTT TLS 1.3 handshake
+  NETCIPHER_COMPATIBILITY = 3  // CPU preferred ciphers, then anything strong
+} ;
+
+
+//
+// @brief Select the cipher profile for subsequent TLS connections.  The
+//        CPU's AES-GCM acceleration is detected, and AES-GCM or
+//        ChaCha20-Poly1305 is preferred accordingly.  Profiles set what
+//        is offered first but keep fallbacks, so servers lacking the
+//        preferred cipher, X25519 or TLS 1.3 still connect.
+// @param(in) profile Cipher profile
+// @return true on success, or false if the profile is invalid
+//
+
+int netcipherprofile(enum netcipherprofiles profile) ;
+
+
+//
+// @brief Obtain the negotiated cipher suite
+// @param(in) sh Handle of open connection
+// @return Pointer to static cipher name, or NULL if not a TLS connection
+//
+
+const char *netcipher(NET *sh) ;
+
+
 // 
-// @brief Obtain SSL certificate status
+// @brief Obtain SSL certificate status, as recorded when the handshake
+//        completed
 // @param(in) Handle of open connection
-// @return Non-zero certificate status code or zero if ok
+// @return Non-zero certificate status code or zero if ok, or -1 if the
+//         peer presented no certificate
 //
 
 int netcertstatus(NET *sh) ;
 
 
+// Certificate pinning and verified chain cache
+
+struct netcertstats {
+  unsigned long verifications ; // Chains built and verified in full
+  unsigned long hits ;          // Results reused from the cache
+  unsigned long expired ;       // Cached results found to have lapsed
+  unsigned long evictions ;     // Cached results displaced by another chain
+  unsigned long pinchecks ;     // Handshakes checked against a pin set
+  unsigned long pinfailures ;   // Handshakes failed as no key was pinned
+  int entries ;                 // Results currently cached
+} ;
+
+
+//
+// @brief Pin the public keys accepted from a destination.  A TLS
+//        connection to the host fails its handshake unless its chain
+//        verifies and a certificate in the chain presented carries one
+//        of the keys.  Connections made with NOCERTCHAIN trust no roots,
+//        so for them the pins alone decide, as suits self-signed
+//        backends, and netcertstatus() still reports the chain's status.
+// @param(in) hostname Destination, as passed to netconnect
+// @param(in) pins Base64 SHA-256 digests of DER SubjectPublicKeyInfo, 
+//            optionally prefixed with "sha256//"
+// @param(in) npins Number of pins, up to 8, or 0 to remove the pin set
+// @return true on success, or false if a pin is invalid or too many
+//         destinations are pinned
+//
+
+int netpinspki(char *hostname, char **pins, int npins) ;
+
+
+//
+// @brief Set how long a verified certificate chain's result is reused by
+//        later handshakes presenting the same chain, 300 seconds by
+//        default.  Results never outlive the leaf certificate.
+// @param(in) ttlsecs Lifetime in seconds, or 0 to disable and empty the
+//            cache
+// @return true on success, or false if ttlsecs is invalid
+//
+
+int netcertcache(int ttlsecs) ;
+
+
+//
+// @brief Obtain certificate verification statistics
+// @param(out) st Statistics
+// @return true on success, or false if st is NULL
+//
+
+int netcertstats(struct netcertstats *st) ;
+
+
 // 
 // @brief Obtain SSL error status
 // @param(in) sslcertstatus Status from netcertstatus
@@ -102,6 +518,15 @@ char *netcertstatusstr(int sslcertstatus) ;
 int neterrno() ;
 
 
+// 
+// @brief Determine whether the last error was a NONBLOCK connection
+//        having to wait (EAGAIN, TLS want read/write or throttling)
+// @return True if the operation should be retried when ready
+//
+
+int netwouldblock() ;
+
+
 // 
 // @brief Obtain Network connection error status
 // @return Pointer to static string containing last error message
@@ -172,7 +597,8 @@ int netwrfdisset(NET *sh, fd_set *wrfds) ;
 //
 // @brief Obtain peer IP address
 // @param(in) sh Handle of open connection
-// @return Pointer to IP address string, or NULL if not connected
+// @return Pointer to IP address string (socket path for unix: endpoints),
+//         or NULL if not connected
 //
 
 char *netpeerip(NET *sh) ;
@@ -189,7 +615,7 @@ char *netfdsetinfo(NET *sh, fd_set *rfds, fd_set *wfds) ;
 //
 // @brief Obtain peer port number
 // @param(in) sh Handle of open connection
-// @return Peer port number, or 0 if not connected
+// @return Peer port number, or 0 if not connected or a unix: endpoint
 //
 
 int netpeerport(NET *sh) ;
@@ -198,12 +624,24 @@ int netpeerport(NET *sh) ;
 //
 // @brief Obtain local port number
 // @param(in) sh Handle of open connection
-// @return Local port number, or 0 if not connected
+// @return Local port number, or 0 if not connected or a unix: endpoint
 //
 
 int netlocalport(NET *sh) ;
 
 
+//
+// @brief Obtain the socket of a connection, for poll() and epoll loops
+//        which do not use netrdfdset().  Wait on nethandshakefd()
+//        instead while an offloaded handshake is pending, and not at
+//        all while nethaspending().
+// @param(in) sh Handle of open connection
+// @return Socket descriptor, or -1 if not connected
+//
+
+int netfd(NET *sh) ;
+
+
 //
 // @brief Send data to network interface
 // @param(in) sh Handle of open connection
@@ -221,26 +659,854 @@ int netsend(NET *sh, char *buf, int len) ;
 // @param(in) buf Buffer to store response
 // @param(in) maxlen Maximum number of bytes to read
 // @return Number of bytes received. 0 indicates peer has closed, or -1 on error
+//         With compression enabled, buffered decompressed data is returned
+//         before the network is read, and is reported by nethaspending()
 //
  
 int netrecv(NET *sh, char *buf, int maxlen) ;
 
 
 //
-// @brief Returns true if pending data
+// @brief Enable streaming compression on a connection.  Both peers must
+//        enable the same algorithm before any data is exchanged.
 // @param(in) sh Handle of open connection
-// @return true if connection open and has pending data
+// @param(in) alg Compression algorithm (NETCOMPRESS_ZSTD|NETCOMPRESS_LZ4)
+// @param(in) level Compression level, 0 for the codec default
+// @param(in) autoflush If true, every netsend() ends with a flush point,
+//            otherwise data is only guaranteed to reach the peer on netflush()
+// @return true on success, or false on error (setting errno)
 //
 
-int nethaspending(NET *sh) ;
+int netcompress(NET *sh, enum netcompression alg, int level, int autoflush) ;
+
+
+//
+// @brief Flush buffered (compressed or corked) data to the network
+// @param(in) sh Handle of open connection
+// @return Number of bytes still queued (non-blocking only, call again when
+//         netwrfdisset), or -1 on error
+//
+
+int netflush(NET *sh) ;
+
+
+// Write coalescing
+
+struct netcorkstats {
+  unsigned long writes ;        // Writes gathered into the buffer
+  unsigned long bytes ;         // Bytes gathered
+  unsigned long direct ;        // Writes at or above the threshold, sent directly
+  unsigned long flushes ;       // Sends (or TLS records) of gathered data
+  unsigned long thresholdflushes ; // Flushes because the buffer was full
+  unsigned long loopflushes ;   // Flushes at the end of a loop iteration, or
+                                // before a blocking netrecv()
+  unsigned long explicitflushes ; // netflush() calls
+  double writesperflush ;       // writes / flushes
+} ;
 
 
 //
-// @brief Close connection
+// @brief Gather small writes into one send() or TLS record.  netsend()
+//        calls smaller than threshold are buffered until the buffer
+//        fills, netflush() is called, or the event loop next calls
+//        netrdfdset().  Blocking connections also flush before
+//        netrecv(), and netclose() flushes what the socket accepts
+//        (all of it, unless NONBLOCK).  Plain TCP
+//        connections also use MSG_MORE and TCP_CORK so the kernel does
+//        not send partial segments between flushes.  Flushes of the
+//        gathered buffer are never sent with zero copy.
 // @param(in) sh Handle of open connection
+// @param(in) threshold Buffer size in bytes (typically a few kilobytes),
+//            or 0 to flush and stop gathering
 // @return true on success, or false on error (setting errno)
 //
-int netclose(NET *sh) ;
+
+int netsetcork(NET *sh, int threshold) ;
+
+
+//
+// @brief Obtain write coalescing statistics
+// @param(in) sh Handle of open connection
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if not corked
+//
+
+int netcorkstats(NET *sh, struct netcorkstats *st) ;
+
+
+// Receive read-ahead
+
+struct netreadaheadstats {
+  unsigned long recvs ;         // netrecv() calls
+  unsigned long buffered ;      // netrecv() calls made with data already buffered
+  unsigned long fills ;         // Socket reads into the ingress buffer (plain only)
+  unsigned long bytes ;         // Bytes returned
+  unsigned long pendingchecks ; // nethaspending() calls answered without a syscall
+  long pending ;                // Bytes currently buffered (plain only)
+} ;
+
+
+//
+// @brief Read ahead of netrecv().  A plain connection reads as much as
+//        the socket holds, up to bufbytes, into an ingress buffer which
+//        serves later netrecv() calls.  A TLS connection enables OpenSSL
+//        read-ahead with a read buffer of bufbytes, so several records
+//        arrive in one read.  nethaspending() then reports only buffered
+//        data, without a syscall, and netrdfdset() makes select() return
+//        while data is buffered.
+// @param(in) sh Handle of open connection
+// @param(in) bufbytes Ingress buffer size in bytes (typically 64KB), or
+//            0 to disable
+// @return true on success, or false on error (setting errno)
+//
+
+int netreadahead(NET *sh, int bufbytes) ;
+
+
+//
+// @brief Obtain read-ahead statistics
+// @param(in) sh Handle of open connection
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if read-ahead is not enabled
+//
+
+int netreadaheadstats(NET *sh, struct netreadaheadstats *st) ;
+
+
+//
+// @brief Obtain compression statistics
+// @param(in) sh Handle of open connection
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if compression not enabled
+//
+
+int netcompressstats(NET *sh, struct netcompressstats *st) ;
+
+
+// Egress pacing
+
+#define NET_MAXRATEGROUPS 16
+
+struct netratestats {
+  double rate ;                 // Measured rate over the last second, bytes/s
+  double throttledseconds ;     // Time spent waiting for the rate limit
+  unsigned long long bytes ;    // Total bytes sent
+  int kernelpacing ;            // SO_MAX_PACING_RATE accepted by the kernel
+} ;
+
+
+//
+// @brief Limit the egress rate of a connection.  Blocking connections
+//        sleep in netsend(), NONBLOCK connections fail with
+//        NET_ERR_THROTTLED and are not reported writable until the time
+//        given by netthrottleduntil()
+// @param(in) sh Handle of open connection
+// @param(in) rate Maximum rate in bytes per second, 0 for unlimited
+// @param(in) burst Bucket size in bytes, 0 for one second's worth
+// @return true on success, or false on error (setting errno)
+//
+
+int netsetrate(NET *sh, long rate, long burst) ;
+
+
+//
+// @brief Configure a shared rate limit group
+// @param(in) group Group number, 1 to NET_MAXRATEGROUPS
+// @param(in) rate Maximum rate in bytes per second, 0 for unlimited
+// @param(in) burst Bucket size in bytes, 0 for one second's worth
+// @return true on success, or false if the group is invalid
+//
+
+int netrategroup(int group, long rate, long burst) ;
+
+
+//
+// @brief Attach a connection to a shared rate limit group
+// @param(in) sh Handle of open connection
+// @param(in) group Group number, or 0 to leave any group
+// @return true on success, or false on error (setting errno)
+//
+
+int netsetrategroup(NET *sh, int group) ;
+
+
+//
+// @brief Obtain the time at which a throttled connection becomes writable
+// @param(in) sh Handle of open connection
+// @param(out) until CLOCK_MONOTONIC time when writable, may be NULL
+// @return true if the connection is currently throttled
+//
+
+int netthrottleduntil(NET *sh, struct timespec *until) ;
+
+
+//
+// @brief Obtain pacing statistics for a connection
+// @param(in) sh Handle of open connection
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if pacing not enabled
+//
+
+int netratestats(NET *sh, struct netratestats *st) ;
+
+
+//
+// @brief Obtain pacing statistics for a rate limit group
+// @param(in) group Group number
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if the group is invalid
+//
+
+int netrategroupstats(int group, struct netratestats *st) ;
+
+
+// Suggested dynamic record sizing: one record per 1500 byte packet for
+// the first 1MB, warming up again after 1 second idle
+
+#define NET_RECORD_SMALL 1369
+#define NET_RECORD_THRESHOLD 1048576
+#define NET_RECORD_IDLEMS 1000
+
+
+//
+// @brief Configure dynamic TLS record sizing.  After connect or an idle
+//        period, records are limited to smallsize bytes so the peer can
+//        decrypt the first bytes sooner, and once threshold bytes have
+//        been sent full 16KB records are used again.
+// @param(in) sh Handle of open TLS connection
+// @param(in) smallsize Record size used while warming up, 0 to disable
+// @param(in) threshold Bytes sent before switching to full size records
+// @param(in) idlems Idle time after which the connection warms up again
+// @return true on success, or false on error (setting errno)
+//
+
+int netrecordsizing(NET *sh, int smallsize, int threshold, int idlems) ;
+
+
+//
+// @brief Returns true if pending data
+// @param(in) sh Handle of open connection
+// @return true if connection open and has pending data
+//
+
+int nethaspending(NET *sh) ;
+
+
+// Receive buffer pool
+
+struct netbufpoolstats {
+  int bufsize ;                 // Size of each buffer
+  unsigned long allocated ;     // Buffers in existence
+  unsigned long free ;          // Buffers waiting in the pool
+  unsigned long borrowed ;      // Buffers held by callers
+  unsigned long maxborrowed ;   // Most buffers held at once
+  unsigned long exhausted ;     // Borrows refused by the buffer limit
+  unsigned long empty ;         // Borrows which found no data
+} ;
+
+
+//
+// @brief Configure the shared receive buffer pool used by
+//        netrecv_borrow().  Buffers are allocated on demand and kept
+//        for reuse.
+// @param(in) bufsize Size of each buffer in bytes, default 16384
+// @param(in) maxbufs Limit on buffers in existence, or 0 for no limit
+// @return true on success, or false if a parameter is invalid
+//
+
+int netbufpool(int bufsize, int maxbufs) ;
+
+
+//
+// @brief Receive data into a buffer borrowed from the shared pool, so
+//        that connections hold receive memory only while they have
+//        data.  Blocking connections wait for data before borrowing,
+//        and TLS connections for a record holding application data.
+// @param(in) sh Handle of open connection
+// @param(out) len Number of bytes received, or when NULL is returned
+//             the netrecv() result for a read which found no data, or
+//             -1 with errno ENOBUFS if the pool limit was reached
+// @return Buffer holding len bytes, which must be given back with
+//         netrecv_release(), or NULL
+//
+
+char *netrecv_borrow(NET *sh, int *len) ;
+
+
+//
+// @brief Give back a buffer obtained from netrecv_borrow().  Buffers are
+//        shared, so one may be released after its connection is closed.
+// @param(in) buf Buffer to release, or NULL
+//
+
+void netrecv_release(char *buf) ;
+
+
+//
+// @brief Obtain receive buffer pool statistics
+// @param(out) st Statistics structure to populate
+// @return true on success
+//
+
+int netbufpoolstats(struct netbufpoolstats *st) ;
+
+
+// Busy poll receive
+
+struct netbusypollstats {
+  unsigned long ready ;         // Receives which found data without spinning
+  unsigned long hits ;          // Receives which found data while spinning
+  unsigned long misses ;        // Receives which spent the budget and waited
+  double hitrate ;              // hits / (hits + misses)
+  double spinseconds ;          // Time spent spinning
+  int kernelbusypoll ;          // SO_BUSY_POLL accepted by the kernel
+} ;
+
+
+//
+// @brief Enable low latency receive.  netrecv() retries a non-blocking
+//        receive for up to spinus before blocking (or, for NONBLOCK
+//        connections, before returning to the readiness loop), trading
+//        CPU time for wake-up latency.  SO_BUSY_POLL and
+//        SO_PREFER_BUSY_POLL are also requested from the kernel.
+// @param(in) sh Handle of open connection
+// @param(in) spinus Spin budget in microseconds, 0 to disable
+// @param(in) cpu CPU to pin the calling thread to, or -1 not to pin
+// @return true on success, or false on error (setting errno)
+//
+
+int netbusypoll(NET *sh, int spinus, int cpu) ;
+
+
+//
+// @brief Obtain busy poll statistics for a connection
+// @param(in) sh Handle of open connection
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if busy polling not enabled
+//
+
+int netbusypollstats(NET *sh, struct netbusypollstats *st) ;
+
+
+// Zero copy send
+
+struct netzcstats {
+  unsigned long sends ;         // Sends transmitted without copying
+  unsigned long bytes ;         // Bytes transmitted without copying
+  unsigned long completions ;   // Sends the kernel has released
+  unsigned long copied ;        // Completions where the kernel copied anyway
+  unsigned long fallbacks ;     // Sends copied because the kernel refused (ENOBUFS)
+  unsigned long outstanding ;   // Sends whose buffers are still in use
+} ;
+
+
+//
+// @brief Enable zero copy sends (MSG_ZEROCOPY) on a plain connection.
+//        A netsend() of at least threshold bytes transmits from the
+//        caller's buffer, which must then remain untouched until
+//        netzcdone() reports its completion.  Smaller sends are copied
+//        as usual.  Not supported on TLS connections.
+// @param(in) sh Handle of open connection
+// @param(in) threshold Smallest send in bytes to transmit without copying
+//            (tens of kilobytes is typical), or 0 to disable
+// @return true on success, or false on error (setting errno)
+//
+
+int netzerocopy(NET *sh, int threshold) ;
+
+
+//
+// @brief Identify the most recent netsend() if it was zero copy
+// @param(in) sh Handle of open connection
+// @return Id to pass to netzcdone(), or -1 if the data was copied and the
+//         buffer may be reused immediately
+//
+
+long netzclastid(NET *sh) ;
+
+
+//
+// @brief Wait for a zero copy send to complete.  Completion covers every
+//        earlier send too, so waiting on the last id of a batch suffices.
+// @param(in) sh Handle of open connection
+// @param(in) id Id returned by netzclastid()
+// @param(in) ms Milliseconds to wait, 0 to poll, or -1 to wait indefinitely
+// @return 1 if the buffer may be reused, 0 if still in use, or -1 on error
+//
+
+int netzcdone(NET *sh, long id, int ms) ;
+
+
+//
+// @brief Obtain zero copy statistics for a connection
+// @param(in) sh Handle of open connection
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if zero copy never enabled
+//
+
+int netzcstats(NET *sh, struct netzcstats *st) ;
+
+
+// Memory use
+
+struct netmemory {
+  long handle ;                 // Handle, strings and optional state
+  long tls ;                    // SSL object and its buffers
+  long context ;                // Share of the (shared) SSL_CTX
+  long kernel ;                 // Socket and queued data
+  long total ;
+} ;
+
+
+//
+// @brief Reduce the memory held by idle connections.  TLS buffers are
+//        released whenever empty (SSL_MODE_RELEASE_BUFFERS), and the
+//        socket send and receive buffers are limited to bufbytes.  This
+//        disables the kernel's buffer autotuning for the socket, so the
+//        first data sent or received ends idle mode, restoring the
+//        previous buffer sizes and autotuning; call again once the
+//        connection is idle.  TLS contexts are always shared between
+//        connections with the same options.
+// @param(in) sh Handle of open connection, or NULL to set the default
+//            applied to new connections
+// @param(in) bufbytes Socket buffer size, or 0 to leave idle mode
+// @return true on success, or false on error (setting errno)
+//
+
+int netidlememory(NET *sh, int bufbytes) ;
+
+
+//
+// @brief Estimate the memory held by a connection
+// @param(in) sh Handle of open connection
+// @param(out) st Breakdown to populate, or NULL
+// @return Estimated total in bytes
+//
+
+long netmemory(NET *sh, struct netmemory *st) ;
+
+
+// Handshake offload
+
+struct nethandshakestats {
+  int threads ;                 // Worker threads running
+  unsigned long queued ;        // Handshakes waiting for a worker
+  unsigned long inflight ;      // Handshakes being performed
+  unsigned long maxqueued ;     // Most handshakes waiting at once
+  unsigned long completed ;
+  unsigned long failed ;
+  unsigned long cancelled ;     // Closed before a worker started
+  double waitseconds ;          // Total time spent waiting for a worker
+  double workseconds ;          // Total time spent in handshakes
+} ;
+
+
+//
+// @brief Set the number of worker threads performing TLS handshakes for
+//        ASYNCHANDSHAKE connections.  netconnect() then returns once the
+//        TCP connection is up.  Until the handshake completes netsend()
+//        and netrecv() fail with EAGAIN (or wait, for blocking
+//        connections), netrdfdset() waits on nethandshakefd(), and a
+//        failed handshake is reported by the next netsend() or netrecv().
+// @param(in) threads Number of workers, default 2.  The pool only grows.
+// @return true on success, or false if threads is invalid
+//
+
+int nethandshakepool(int threads) ;
+
+
+//
+// @brief Obtain the handshake notification fd, for event loops which do
+//        not use netrdfdset().  It is readable while any completed
+//        handshake has not been observed through nethandshakedone(),
+//        netrdfdset(), netsend() or netrecv().
+// @return File descriptor, or -1 on error
+//
+
+int nethandshakefd() ;
+
+
+//
+// @brief Check whether a connection's TLS handshake has completed
+// @param(in) sh Handle of connection
+// @return 1 if complete, 0 if in progress, or -1 if it failed (setting errno)
+//
+
+int nethandshakedone(NET *sh) ;
+
+
+//
+// @brief Obtain handshake offload statistics
+// @param(out) st Statistics structure to populate
+// @return true on success
+//
+
+int nethandshakestats(struct nethandshakestats *st) ;
+
+
+// Connection timeouts
+
+enum nettimeouts {
+  NETTIMEOUT_READ = 0,       // No data received
+  NETTIMEOUT_WRITE = 1,      // Waiting to send (netwrfdset or a short netsend)
+  NETTIMEOUT_IDLE = 2,       // Nothing sent or received
+  NETTIMEOUT_HANDSHAKE = 3   // Connect and TLS handshake, 2000ms by default
+} ;
+
+
+//
+// @brief Set a connection timeout, or with a NULL handle the default for
+//        subsequent connections.  Expired NONBLOCK connections are flagged
+//        by netrdfdisset() and netwrfdisset(), and their next netrecv() or
+//        netsend() fails with NET_ERR_READTIMEOUT, NET_ERR_WRITETIMEOUT or
+//        NET_ERR_IDLETIMEOUT, after which the timeout starts again.
+//        Blocking netrecv() and netsend() calls fail the same way when
+//        they wait for longer than the timeout.
+// @param(in) sh Handle of open connection, or NULL
+// @param(in) kind Timeout to set
+// @param(in) ms Timeout in milliseconds, 0 to disable
+// @return true on success, or false on error (setting errno)
+//
+
+int netsettimeout(NET *sh, enum nettimeouts kind, int ms) ;
+
+
+//
+// @brief Obtain the time until the next timeout is due, for use as the
+//        select() timeout
+// @return Milliseconds until nettimerexpire() should be called, or -1 if
+//         no timeouts are set
+//
+
+int nettimernext() ;
+
+
+//
+// @brief Fire timeouts which are due.  Call after each select().
+// @return Number of connections which have expired
+//
+
+int nettimerexpire() ;
+
+
+// Multi-threaded connection scheduler
+
+typedef void (*netschedfn)(NET *sh, void *arg) ;
+
+struct netschedstats {
+  int connections ;             // Connections owned
+  unsigned long events ;        // Callbacks run
+  unsigned long steals ;        // Callbacks taken from other workers' queues
+  unsigned long migrations ;    // Connections moved to this worker
+  double busyseconds ;          // Time spent in callbacks
+} ;
+
+
+//
+// @brief Start a scheduler with a pool of worker threads, each running
+//        its own select() loop over the connections it owns
+// @param(in) nworkers Number of worker threads, 0 for one per online CPU
+// @param(in) pin If true, pin worker n to CPU n
+// @return Handle to scheduler, or NULL on failure (and sets errno)
+//
+
+NETSCHED *netschedstart(int nworkers, int pin) ;
+
+
+//
+// @brief Add a connection to the least loaded worker.  The callback runs
+//        on a worker thread each time the connection is readable (as
+//        reported by netrdfdisset), and never on two threads at once.
+//        Idle workers steal queued callbacks from busy ones, and busy
+//        connections are migrated between workers to even out load.
+// @param(in) s Scheduler
+// @param(in) sh Handle of open connection, usually NONBLOCK
+// @param(in) fn Callback
+// @param(in) arg Argument passed to fn
+// @return true on success, or false on error (setting errno)
+//
+
+int netschedadd(NETSCHED *s, NET *sh, netschedfn fn, void *arg) ;
+
+
+//
+// @brief Remove a connection from the scheduler.  May be called from the
+//        connection's own callback, after which the handle may be closed.
+// @param(in) s Scheduler
+// @param(in) sh Handle of connection
+// @return true on success, or false if not found
+//
+
+int netschedremove(NETSCHED *s, NET *sh) ;
+
+
+//
+// @brief Move a connection to another worker between events
+// @param(in) s Scheduler
+// @param(in) sh Handle of connection
+// @param(in) worker Destination worker number
+// @return true on success, or false if the connection is busy or not found
+//
+
+int netschedmigrate(NETSCHED *s, NET *sh, int worker) ;
+
+
+//
+// @brief Obtain the number of workers
+//
+
+int netschedworkers(NETSCHED *s) ;
+
+
+//
+// @brief Obtain worker statistics
+// @param(in) s Scheduler
+// @param(in) worker Worker number, or -1 for the total of all workers
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if the worker is invalid
+//
+
+int netschedstats(NETSCHED *s, int worker, struct netschedstats *st) ;
+
+
+//
+// @brief Stop all workers and free the scheduler.  Connections are not
+//        closed, and remain owned by the caller.
+// @param(in) s Scheduler
+//
+
+void netschedstop(NETSCHED *s) ;
+
+
+// Stream multiplexing over one connection
+
+struct netmuxstats {
+  int streams ;                 // Streams open
+  unsigned long opened ;        // Streams opened locally
+  unsigned long accepted ;      // Streams opened by the peer
+  unsigned long resets ;        // Streams reset by either side
+  unsigned long framesout ;
+  unsigned long framesin ;
+  unsigned long bytesout ;      // Stream data sent
+  unsigned long bytesin ;       // Stream data received
+  unsigned long windowstalls ;  // Times a stream had data but no window
+  unsigned long writes ;        // netsend calls, each carrying many frames
+} ;
+
+
+//
+// @brief Start multiplexing logical streams over a connection.  Each
+//        stream has its own flow control window, and streams with data
+//        take turns to send a frame, so one busy stream cannot hold up
+//        the others.  The peer must run the same framing (see netmux.c).
+// @param(in) sh Handle of open NONBLOCK connection, used only through the
+//            multiplexer until netmuxstop
+// @param(in) initiator True on one side of the connection and false on
+//            the other, to keep their stream ids apart
+// @return Handle to multiplexer, or NULL on failure (and sets errno)
+//
+
+NETMUX *netmuxstart(NET *sh, int initiator) ;
+
+
+//
+// @brief Open a stream.  The peer learns of it from the first data or
+//        FIN sent.
+// @param(in) m Multiplexer
+// @return Handle to stream, or NULL on failure (and sets errno)
+//
+
+NETSTREAM *netmuxopen(NETMUX *m) ;
+
+
+//
+// @brief Obtain the next stream opened by the peer.  Streams are
+//        returned in the order the peer opened them, as found by
+//        netmuxprocess, so call it after each netmuxprocess and before
+//        netmuxready.  A stream the peer has already finished or reset
+//        is still returned, and its data read with netmuxrecv.
+// @param(in) m Multiplexer
+// @return Handle to stream, or NULL if none
+//
+
+NETSTREAM *netmuxaccept(NETMUX *m) ;
+
+
+//
+// @brief Queue data on a stream, to be sent by netmuxprocess
+// @param(in) st Stream
+// @param(in) buf Data to be sent
+// @param(in) len Amount of data to send
+// @return Number of bytes queued, or -1 on error (setting errno, EAGAIN
+//         if the stream's buffer is full)
+//
+
+int netmuxsend(NETSTREAM *st, char *buf, int len) ;
+
+
+//
+// @brief Read data received on a stream
+// @param(in) st Stream
+// @param(in) buf Buffer to store data
+// @param(in) maxlen Maximum number of bytes to read
+// @return Number of bytes read, 0 once the peer has finished sending, or
+//         -1 on error (setting errno, EAGAIN if nothing has arrived,
+//         ECONNRESET if the peer reset the stream)
+//
+
+int netmuxrecv(NETSTREAM *st, char *buf, int maxlen) ;
+
+
+//
+// @brief Finish sending on a stream, once queued data has been sent.
+//        Data can still be received.
+// @param(in) st Stream
+// @return true on success, or false on error (setting errno)
+//
+
+int netmuxshutdown(NETSTREAM *st) ;
+
+
+//
+// @brief Close a stream.  If the peer has finished sending, queued data
+//        is sent followed by FIN, otherwise queued data is discarded and
+//        the stream is reset.  The handle must not be used again.
+// @param(in) st Stream
+// @return true on success, or false on error (setting errno)
+//
+
+int netmuxclose(NETSTREAM *st) ;
+
+
+//
+// @brief Obtain a stream's id
+//
+
+int netmuxid(NETSTREAM *st) ;
+
+
+//
+// @brief Add the connection to the fd_sets, for reading and, while frames
+//        are waiting to be sent, writing.  Drain netmuxready first, as
+//        streams it returns do not make the connection readable.
+// @param(in) m Multiplexer
+// @param(in) rdfds FD Set for select()
+// @param(in) wrfds FD Set for select()
+// @param(inout) l pointer to largest fd found
+// @return number of connections added
+//
+
+int netmuxrdfdset(NETMUX *m, fd_set *rdfds, fd_set *wrfds, int *l) ;
+
+
+//
+// @brief Receive and send frames.  Call after select() (or when an event
+//        loop reports the connection ready), and after queueing data.
+// @param(in) m Multiplexer
+// @param(in) rdfds Read fd set, or NULL to read whatever is available
+// @param(in) wrfds Write fd set, or NULL
+// @return Number of streams waiting to be returned by netmuxready, or -1
+//         if the connection has failed (setting errno)
+//
+
+int netmuxprocess(NETMUX *m, fd_set *rdfds, fd_set *wrfds) ;
+
+
+//
+// @brief Obtain the next stream which has become readable, writable or
+//        closed, or has failed.  A stream is returned once per change, so
+//        read until netmuxrecv fails with EAGAIN.
+// @param(in) m Multiplexer
+// @return Handle to stream, or NULL if none
+//
+
+NETSTREAM *netmuxready(NETMUX *m) ;
+
+
+//
+// @brief Obtain multiplexer statistics
+// @param(in) m Multiplexer
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if m or st is NULL
+//
+
+int netmuxstats(NETMUX *m, struct netmuxstats *st) ;
+
+
+//
+// @brief Free the multiplexer and its streams.  The connection is not
+//        closed, and remains owned by the caller.
+// @param(in) m Multiplexer
+//
+
+void netmuxstop(NETMUX *m) ;
+
+
+//
+// @brief Close connection.  TLS connections send close_notify, without
+//        waiting for the peer's.  A NONBLOCK graceful close in progress
+//        is ended without waiting any longer.
+// @param(in) sh Handle of open connection
+// @return true on success, or false on error (setting errno).  The
+//         handle is freed either way, and must not be used again.
+//
+int netclose(NET *sh) ;
+
+
+// Connection close modes
+
+enum netclosemodes {
+  NETCLOSE_DEFAULT = 0,      // As netclose()
+  NETCLOSE_GRACEFUL = 1,     // close_notify and FIN, then wait for the peer to close
+  NETCLOSE_ABORT = 2         // Reset the connection, leaving no TIME_WAIT socket
+} ;
+
+struct netfdstats {
+  long open ;                   // Sockets currently open
+  unsigned long opened ;        // Sockets opened
+  unsigned long closed ;        // Sockets closed
+  unsigned long graceful ;      // Graceful closes completed
+  unsigned long closetimeouts ; // Graceful closes reset as the peer did not close
+  unsigned long aborted ;       // Abortive closes
+  unsigned long halfclosed ;    // Connections half-closed with netshutdown()
+} ;
+
+
+//
+// @brief Close a connection.  A NONBLOCK graceful close proceeds as the
+//        connection becomes ready: keep it in the fd_sets with netrdfdset()
+//        and call again with NETCLOSE_GRACEFUL when netrdfdisset() or
+//        netwrfdisset(), without any other use of the handle.  Any other
+//        mode, or netclose(), ends it at once.  A peer which does not
+//        close within the idle timeout (2 seconds if none is set) is reset.
+// @param(in) sh Handle of open connection
+// @param(in) mode NETCLOSE_DEFAULT, NETCLOSE_GRACEFUL or NETCLOSE_ABORT
+// @return 1 when closed, 0 if a NONBLOCK graceful close is in progress,
+//         or -1 if closed after an error (setting errno).  The handle is
+//         freed unless 0 is returned.
+//
+
+int netclosemode(NET *sh, enum netclosemodes mode) ;
+
+
+//
+// @brief Half-close a connection, sending TLS close_notify and FIN.
+//        netrecv() may be used until the peer closes, netsend() may not.
+// @param(in) sh Handle of open connection
+// @return 1 when sent, 0 if in progress (NONBLOCK, call again when
+//         netwrfdisset), or -1 on error (setting errno)
+//
+
+int netshutdown(NET *sh) ;
+
+
+//
+// @brief Obtain socket descriptor accounting, for leak checks
+// @param(out) st Statistics structure to populate
+// @return true on success
+//
+
+int netfdstats(struct netfdstats *st) ;
 
 
 #endif
@@ -10,6 +10,7 @@
 // NET *netopen(char *hostname, int port, net_flags flags)
 // int netcerterror(NET *sh)
 // char *netcerterrorstr(int certerrno)
+// int netfd(NET *sh)
 // char *netpeerip(NET *sh)
 // int netpeerport(NET *sh)
 // int netlocalport(NET *sh)
@@ -18,9 +19,43 @@
 // int netrdfdisset(INET *sh, fd_set *rfds, fd_set *wfds)
 // int netsend(INET *sh, char *buf, int len)
 // int netrecv(INET *sh, char *buf, int maxlen)
+// int netcompress(NET *sh, enum netcompression alg, int level, int autoflush)
+// int netflush(NET *sh)
+// int netsetrate(NET *sh, long rate, long burst)
+// int netrategroup(int group, long rate, long burst)
+// int netsetrategroup(NET *sh, int group)
+// int netrecordsizing(NET *sh, int smallsize, int threshold, int idlems)
+// int netsettimeout(NET *sh, enum nettimeouts kind, int ms)
+// int nettimernext()
+// int nettimerexpire()
+// int netreconnect(NET *sh, int maxattempts)
+// int netshutdown(NET *sh)
+// int netclosemode(NET *sh, enum netclosemodes mode)
+// int netfdstats(struct netfdstats *st)
+// int netsourceaddrs(char **addrs, int naddrs)
+// int netsourceportrange(int lo, int hi)
+// int netbusypoll(NET *sh, int spinus, int cpu)
+// int netzerocopy(NET *sh, int threshold)
+// int netidlememory(NET *sh, int bufbytes)
+// int nethandshakepool(int threads)
+// int netbufpool(int bufsize, int maxbufs)
+// char *netrecv_borrow(NET *sh, int *len)
+// void netrecv_release(char *buf)
+// int netsetcork(NET *sh, int threshold)
+// int netreadahead(NET *sh, int bufbytes)
+// int netcipherprofile(enum netcipherprofiles profile)
+// int netpinspki(char *hostname, char **pins, int npins)
+// int netcertcache(int ttlsecs)
+// int netbreakerstate(char *hostname, int port, struct netbreakerstats *st)
+// int netendpointstats(char *hostname, int port, struct netendpointstats *st, int max)
+// NET *nethedgeconnect(char *hostname, int port, enum netflags flags)
+// int nethedgerequest(NET **sh, char *request, int len, char *response, int maxlen)
+// int nethedgeconfig(int percentile, int mindelayms, int maxdelayms, int budget)
+// int nethedgestats(struct nethedgestats *st)
 // int netclose(NET *sh)
 //
-// link with: -lssl -lcrypto 
+// link with: -lssl -lcrypto -lpthread [-lzstd] [-llz4]
+//            or, for lnet-notls.a (OPEN connections only), -lpthread [-lzstd] [-llz4]
 //
 // NOTES
 //
@@ -39,16 +74,34 @@
 #define _GNU_SOURCE 
 
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <resolv.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <linux/sock_diag.h>
+#include <sys/eventfd.h>
+#ifdef __aarch64__
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#ifndef NET_NOTLS
 
 //#include <openssl/bio.h>
 #include <openssl/ssl.h>
@@ -57,6 +110,72 @@
 #include <openssl/x509.h>
 #include <openssl/x509_vfy.h>
 
+#else
+
+// TLS-free build (make notls): connections are never given an SSL object,
+// so the TLS paths are unreachable and compile against these stand-ins
+
+typedef struct _net_nossl SSL ;
+typedef struct _net_nossl SSL_CTX ;
+typedef struct _net_nossl SSL_METHOD ;
+typedef struct _net_nossl X509 ;
+
+#define SSL_ERROR_NONE 0
+#define SSL_ERROR_SSL 1
+#define SSL_ERROR_WANT_READ 2
+#define SSL_ERROR_WANT_WRITE 3
+#define SSL_ERROR_WANT_X509_LOOKUP 4
+#define SSL_ERROR_SYSCALL 5
+#define SSL_ERROR_ZERO_RETURN 6
+#define SSL_ERROR_WANT_CONNECT 7
+#define SSL_ERROR_WANT_ACCEPT 8
+#define SSL_ERROR_WANT_ASYNC 9
+#define SSL_ERROR_WANT_CLIENT_HELLO_CB 11
+#define SSL3_RT_MAX_PLAIN_LENGTH 16384
+#define X509_V_OK 0
+#define X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT 2
+
+// calls whose result is sometimes discarded expand to a function call rather
+// than a bare constant so -Wall stays quiet on the statement uses
+static inline int _net_nosslret(const void *s, int ret) { (void)s ; return ret ; }
+
+#define SSL_read(s,b,n) (-1)
+#define SSL_write(s,b,n) (-1)
+#define SSL_peek(s,b,n) (-1)
+#define SSL_pending(s) 0
+#define SSL_has_pending(s) 0
+#define SSL_set_read_ahead(s,y) ((void)(s))
+#define SSL_set_default_read_buffer_len(s,n) ((void)(s))
+#define SSL_free_buffers(s) _net_nosslret(s, 0)
+#define SSL_get_error(s,r) SSL_ERROR_SSL
+#define SSL_free(s) ((void)(s))
+#define SSL_CTX_free(c) ((void)(c))
+#define SSL_set_mode(s,m) _net_nosslret(s, 0)
+#define SSL_clear_mode(s,m) _net_nosslret(s, 0)
+#define SSL_MODE_RELEASE_BUFFERS 0
+#define SSL_set_max_send_fragment(s,n) _net_nosslret(s, 0)
+#define SSL_set_split_send_fragment(s,n) _net_nosslret(s, 0)
+#define SSL_get_cipher_name(s) NULL
+#define SSL_get_peer_certificate(s) NULL
+#define SSL_get_verify_result(s) X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT
+#define X509_free(x) ((void)(x))
+#define SSL_shutdown(s) _net_nosslret(s, 1)
+#define SSL_is_init_finished(s) 0
+
+#endif
+
+#ifdef NET_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef NET_WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+#define NET_ZBUFSIZE 65536     // Compression input / output buffer size
+#define NET_ZTXLIMIT 262144    // Queued compressed data before EAGAIN
+#define NET_MEM_LZ4 147456L    // LZ4 frame contexts with 64KB blocks, estimated
+
 
 typedef struct {
 
@@ -67,17 +186,78 @@ typedef struct {
   char *ipaddress ;    // Connected IP address
   int localport ;      // Local port number for connection
   int peerport ;       // Remote port number for connection
+  char *hostname ;     // Destination as passed to netconnect, for reconnect
+  int origport ;       // Port as passed to netconnect
+  int flags ;          // Flags as passed to netconnect
+  int source ;         // Index of bound source address, or -1
 
   // SSL connection management
 
   SSL *ssl;            // SSL object
   int certstatus ;     // SSL Connection status
-  SSL_CTX *ctx;        // SSL Context
+  SSL_CTX *ctx;        // SSL Context, shared through the context cache
 
   // Non-blocking data stream management
 
   int sslwantwrite ;   // Flag so SSL_read can request write in select
   int sslhaspending ;  // Flag indicating SSL read can supply more data
+  int sslfatal ;       // A fatal SSL error has occurred, so no close_notify
+
+  // Connection shutdown
+
+  int closing ;        // Close stage, enum _net_closestages
+  int closemode ;      // Close mode once shutdown is complete
+  double closedeadline ; // Time at which a blocking graceful close gives up
+
+  // Compression stream management
+
+  struct _net_zstream *z ; // Compression state, or NULL if not enabled
+
+  // Egress pacing
+
+  struct _net_pacing *pace ; // Rate limit state, or NULL if not enabled
+
+  // TLS record sizing
+
+  struct _net_records *rec ; // Record sizing state, or NULL if not enabled
+
+  // Read, write and idle deadlines
+
+  struct _net_timeouts *to ; // Timeout state, or NULL if not enabled
+
+  // Low latency receive
+
+  struct _net_busypoll *busy ; // Busy poll state, or NULL if not enabled
+
+  // Zero copy send
+
+  struct _net_zerocopy *zc ; // Zero copy state, or NULL if never enabled
+
+  // Idle memory
+
+  int idlebuf ;        // Socket buffer size while idle, 0 if not reduced
+  int busyrcvbuf ;     // Receive buffer size to restore after idle
+  int busysndbuf ;     // Send buffer size to restore after idle
+  int busylocks ;      // Buffer locks (SO_BUF_LOCK) to restore, -1 if unknown
+
+  // Handshake offload
+
+  struct _net_handshake *hs ; // Offloaded handshake, or NULL once complete
+
+  // Write coalescing
+
+  struct _net_cork *cork ; // Gathered writes, or NULL if not corked
+
+  // Receive read-ahead
+
+  struct _net_readahead *ra ; // Read-ahead state, or NULL if not enabled
+
+  // Load balancing
+
+  struct _net_dest *lbdest ; // Destination whose address was picked, or NULL
+  int lbep ;           // Index of the picked address
+  double lbstart ;     // Time the connect started
+  double lbsent ;      // Time of the first send awaiting a response, 0 if none
 
   // Debug
 
@@ -86,53 +266,556 @@ typedef struct {
 
 } INET ;
 
-//
-static int _net_errno=-1 ;
-static char _net_errcontext[64] ;
+// Error state is per thread, shared state below is guarded by _net_lock
+
+static __thread int _net_errno=-1 ;
+static __thread char _net_errcontext[64] ;
+static pthread_mutex_t _net_lock = PTHREAD_MUTEX_INITIALIZER ;
 
 #define DEVNULL "/dev/null"
+#define NET_UNIX_PREFIX "unix:"
 static int _net_devnull=-1 ;
 static int _net_numconnections=0 ;
 
+#define NET_CLOSETIMEOUT 2000  // Milliseconds to wait for the peer in a graceful close
+
+enum _net_closestages {
+  NET_CLOSE_OPEN = 0,  // Not closing
+  NET_CLOSE_NOTIFY,    // Sending TLS close_notify
+  NET_CLOSE_FIN,       // Sending FIN
+  NET_CLOSE_DRAIN,     // Discarding data until the peer closes
+  NET_CLOSE_DONE       // Shutdown complete
+} ;
+
 #define NET INET
 #include "../net.h"
 
+struct _net_zstream {
+  int alg ;            // enum netcompression
+  int level ;          // Compression level
+  int autoflush ;      // Flush after every netsend
+  int started ;        // LZ4 frame header has been written
+  void *cctx ;         // Compressor
+  void *dctx ;         // Decompressor
+  char *tx ;           // Compressed data queued for sending
+  size_t txpos, txlen, txsize ;
+  char *in ;           // Received data awaiting decompression
+  size_t inpos, inlen ;
+  char *out ;          // Decompressed data awaiting netrecv
+  size_t outpos, outlen ;
+  int more ;           // Decoder filled out, and may hold more output
+  struct netcompressstats stats ;
+} ;
+
+#define NET_MINBURST 1500      // Smallest token bucket, one packet
+#define NET_RATEWINDOW 1.0     // Seconds over which current rate is measured
+
+struct _net_bucket {
+  double rate ;        // Bytes per second, 0 if unlimited
+  double burst ;       // Bucket size in bytes
+  double tokens ;      // Bytes which may be sent now
+  double last ;        // Time of last refill
+  double winstart ;    // Start of current rate measurement window
+  unsigned long long winbytes ;
+  struct netratestats stats ;
+} ;
+
+struct _net_pacing {
+  struct _net_bucket conn ; // Per-connection bucket
+  int group ;          // Rate group number, 0 if none
+  int sslretry ;       // Length of SSL_write which must be retried
+  double throttleduntil ;   // Time at which a throttled send may proceed
+  double throttlestart ;    // Time at which a non-blocking send was throttled
+} ;
+
+static struct _net_bucket _net_rategroups[NET_MAXRATEGROUPS] ;
+
+static struct netfdstats _net_fdstats ;
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+struct _net_busypoll {
+  double budget ;      // Seconds to spin before waiting
+  struct netbusypollstats stats ;
+} ;
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+enum _net_hsstates {
+  NET_HS_QUEUED,       // Waiting for a worker
+  NET_HS_RUNNING,      // Handshake being performed by a worker
+  NET_HS_DONE,         // Handshake succeeded
+  NET_HS_FAILED        // Handshake failed or was cancelled
+} ;
+
+struct _net_handshake {
+  INET *sh ;
+  struct _net_handshake *next ; // Queue link
+  int state ;          // enum _net_hsstates
+  int acked ;          // Completion consumed from the notification fd
+  int cancelled ;      // Abandoned by a hedge, so the outcome is not reported
+  int err ;            // Error code if the handshake failed
+  int fdoptions ;      // File status flags to restore, or -1 if NONBLOCK
+  double deadline ;    // Handshake deadline, 0 if none
+  double queuedat ;    // Time queued
+  struct _net_dest *dest ;
+} ;
+
+#define NET_HSTHREADS 2        // Default number of handshake workers
+
+static struct {
+  struct _net_handshake *head, *tail ;
+  int threads ;        // Workers running
+  int want ;           // Workers requested
+  int fd ;             // Completion eventfd, -1 until first use
+  struct nethandshakestats stats ;
+} _net_hspool = { NULL, NULL, 0, NET_HSTHREADS, -1 } ;
+
+struct _net_cork {
+  char *buf ;          // Gathered writes, threshold bytes
+  int pos, len ;       // Unsent data is buf[pos..len)
+  int threshold ;      // Buffer size, and smallest write sent directly
+  int more ;           // Plain sends currently carry MSG_MORE
+  int unpushed ;       // A MSG_MORE send may have left a partial segment
+  int flushing ;       // The buffer is being sent, so must not be zero copy
+  struct netcorkstats stats ;
+} ;
+
+struct _net_readahead {
+  char *buf ;          // Ingress buffer of size bytes, plain connections only
+  int size ;           // Buffer size (TLS read buffer size for TLS)
+  int pos, len ;       // Unread data is buf[pos..len)
+  struct netreadaheadstats stats ;
+} ;
+
+#define NET_POOLBUFSIZE 16384  // Default pooled receive buffer size
+
+// Pooled buffers are preceded by this header
+
+struct _net_poolbuf {
+  struct _net_poolbuf *next ; // Free list link
+  int size ;           // Usable bytes following the header
+  int pad ;
+} ;
+
+static struct {
+  int bufsize ;        // Size of new buffers
+  int maxbufs ;        // Limit on buffers in existence, 0 if none
+  struct _net_poolbuf *free ;
+  struct netbufpoolstats stats ;
+} _net_pool = { NET_POOLBUFSIZE, 0, NULL } ;
+
+static pthread_mutex_t _net_poollock = PTHREAD_MUTEX_INITIALIZER ;
+
+static pthread_mutex_t _net_hslock = PTHREAD_MUTEX_INITIALIZER ;
+static pthread_cond_t _net_hswork = PTHREAD_COND_INITIALIZER ;
+static pthread_cond_t _net_hsdone = PTHREAD_COND_INITIALIZER ;
+
+struct _net_zerocopy {
+  int threshold ;      // Smallest send to transmit without copying, 0 if disabled
+  int lastzc ;         // True if the last netsend() was at least partly zero copy
+  uint32_t nextid ;    // Kernel id of the next zero copy send
+  uint32_t doneid ;    // All sends before this id have completed
+  struct netzcstats stats ;
+} ;
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+#ifndef IP_LOCAL_PORT_RANGE
+#define IP_LOCAL_PORT_RANGE 51
+#endif
+
+static struct {
+  int n ;              // Number of source addresses, 0 to let the kernel choose
+  int next ;           // Next source address to use
+  int portlo ;         // Per socket ephemeral port range, 0 if not set
+  int porthi ;
+  struct in_addr addr[NET_MAXSOURCES] ;
+  struct netsourcestats stats[NET_MAXSOURCES] ;
+} _net_sources ;
+
+#define NET_MINRECORD 512      // Smallest max_send_fragment OpenSSL accepts
+
+struct _net_records {
+  int smallsize ;      // Record size while warming up
+  int threshold ;      // Bytes to send before using full size records
+  double idle ;        // Idle seconds after which to warm up again
+  int current ;        // Record size currently configured
+  int retry ;          // SSL_write is waiting to be retried
+  long long sent ;     // Bytes sent since connect or idle
+  double last ;        // Time of last write
+} ;
+
+#define NET_TLS13_AES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256"
+#define NET_TLS13_CHACHA "TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384"
+#define NET_TLS12_AES "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+                      "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:" \
+                      "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305"
+#define NET_TLS12_CHACHA "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:" \
+                         "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+                         "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+
+static int _net_cipherprofile = NETCIPHER_DEFAULT ;
+static int _net_idlebufdefault = 0 ;
+
+#define NET_WHEELBITS 6
+#define NET_WHEELSLOTS (1<<NET_WHEELBITS)  // Slots per level
+#define NET_WHEELLEVELS 4                  // 1ms ticks, spanning 64ms, 4s, 4m, 4.6h
+#define NET_TIMEOUTKINDS 4                 // enum nettimeouts
+#define NET_TONEVER (~0ULL)
+
+struct _net_timer {
+  struct _net_timer *next ;    // Next timer in slot
+  struct _net_timer **pprev ;  // Link pointing at this timer, NULL if not queued
+  unsigned long long expires ; // Tick at which to fire
+  int level ;                  // Wheel level holding the timer
+} ;
+
+struct _net_timeouts {
+  struct _net_timer t ;        // Wheel entry for the earliest deadline
+  int ms[NET_TIMEOUTKINDS] ;   // Timeout for each kind, 0 if disabled
+  unsigned long long lastread ;  // Tick of last data received
+  unsigned long long lastio ;    // Tick of last data sent or received
+  unsigned long long wrblocked ; // Tick at which sends stopped progressing, 0 if not
+  int expired ;                // Kinds which have expired, awaiting netrecv/netsend
+} ;
+
+static struct {
+  unsigned long long now ;     // Current tick, advanced by nettimerexpire
+  long count ;                 // Queued timers
+  long levelcount[NET_WHEELLEVELS] ;
+  int fired ;                  // Connections expired by the current advance
+  struct _net_timer *slot[NET_WHEELLEVELS][NET_WHEELSLOTS] ;
+} _net_wheel ;
+
+static pthread_mutex_t _net_wheellock = PTHREAD_MUTEX_INITIALIZER ;
+static int _net_timeoutdefaults[NET_TIMEOUTKINDS] = { 0, 0, 0, 2000 } ;
+
+#define NET_DESTHASHSIZE 256
+#define NET_DESTMAX 4096       // Destination records kept, beyond those in use
+#define NET_LBMAXENDPOINTS 64  // Addresses tracked per destination
+#define NET_LBRETRIES 3        // Addresses tried by a BALANCE netconnect
+#define NET_LBWEIGHT 0.3       // Weight of a new latency sample
+#define NET_LBDECAY 10.0       // Seconds over which an unsampled latency halves
+
+struct _net_endpoint {
+  struct in_addr addr ;  // Resolved address
+  int present ;        // In the latest resolution
+  int active ;         // Open connections
+  int failures ;       // Consecutive failures
+  double backoff ;     // Current ejection in seconds
+  double ejecteduntil ; // Time at which an ejected address returns
+  double ewma ;        // Latency moving average in seconds, 0 until sampled
+  double sampledat ;   // Time of the last sample
+  struct netendpointstats stats ;
+} ;
+
+struct _net_dest {
+  char *hostname ;     // Destination name, as passed to netconnect
+  int port ;           // Destination port
+  int state ;          // enum netbreakerstates
+  int failures ;       // Consecutive failures
+  int probing ;        // Half-open probe in progress
+  double backoff ;     // Current backoff in seconds
+  double retryat ;     // Time at which an open circuit becomes half-open
+  struct netbreakerstats stats ;
+  struct _net_endpoint *ep ; // Resolved addresses (BALANCE), only ever grows
+  int nep ;
+  int refs ;           // Connections and attempts holding the record
+  double usedat ;      // Time of the last attempt, for eviction
+  struct _net_dest *next ;
+} ;
+
+// Outcome of a connection attempt, for the breaker and load balancing
+
+enum _net_destoutcomes {
+  NET_DEST_FAILED = 0,       // Connect, handshake or timeout failure
+  NET_DEST_OK = 1,           // Connection established
+  NET_DEST_ABANDONED = 2     // Given up for a local reason, or cancelled
+} ;
+
+static struct _net_dest *_net_desttable[NET_DESTHASHSIZE] ;
+static int _net_destcount = 0 ;
+
+static struct {
+  int threshold ;      // Consecutive failures which open a circuit
+  int basems ;         // Initial backoff
+  int maxms ;          // Maximum backoff
+} _net_breaker = { 0, 100, 30000 } ;
+
+static struct {
+  int failures ;       // Consecutive failures which eject an address
+  int ejectms ;        // Initial ejection
+  int maxejectms ;     // Maximum ejection
+} _net_balance = { 1, 1000, 30000 } ;
+
+static __thread int _net_lbavoid = -1 ; // Address a hedge is not to use
+
+#define NET_HEDGEBUCKETS 64    // Latency histogram buckets, each 2^(1/4) wider
+#define NET_HEDGEBASE 0.0001   // Upper bound of the first bucket, 100us
+#define NET_HEDGESAMPLES 20    // Samples needed before the percentile is used
+#define NET_HEDGEHALVE 1000    // Samples at which the histogram is halved
+#define NET_HEDGEBURST 10.0    // Most hedges the budget saves up
+
+struct _net_hedgehist {
+  unsigned long count[NET_HEDGEBUCKETS] ;
+  unsigned long total ;
+} ;
+
+static struct {
+  int percentile ;     // Latency percentile after which to hedge
+  int mindelayms ;     // Smallest hedge delay
+  int maxdelayms ;     // Largest hedge delay, used until there are samples
+  int budget ;         // Hedges allowed per 100 operations
+  double tokens ;      // Hedges currently allowed
+  struct _net_hedgehist connects ;
+  struct _net_hedgehist requests ;
+  struct nethedgestats stats ;
+} _net_hedge = { 95, 1, 1000, 10, NET_HEDGEBURST } ;
+
+
 int _net_seterrno(INET *sh, char *context, enum net_errno_type type, int errcode) ;
 int _net_disconnect(INET *sh) ;
+void _net_fdcount(int opened) ;
+int _net_busyspin(INET *sh, char *buf, int maxlen) ;
+int _net_zcsend(INET *sh, char *buf, int len) ;
+void _net_zcreap(INET *sh) ;
+int _net_sslconnect(INET *sh, double deadline) ;
+int _net_hsqueue(INET *sh, double deadline, int fdoptions, struct _net_dest *dest) ;
+int _net_hspoll(INET *sh, char *context, int wait) ;
+int _net_hsstate(INET *sh) ;
+void _net_hscancel(INET *sh) ;
+struct _net_poolbuf *_net_poolget() ;
+void _net_poolput(struct _net_poolbuf *b) ;
+int _net_sourcebind(INET *sh) ;
+int _net_sourceretry(INET *sh, int fdoptions, int retries) ;
 void _net_commsdump(INET *sh, char *prefix, char *buf, int buflen) ;
 
+int _net_unixaddr(INET *sh, char *path, struct sockaddr_un *addr, socklen_t *addrlen) ;
+void _net_opendevnull() ;
+int _net_xmit(INET *sh, char *buf, int len) ;
+int _net_xmitraw(INET *sh, char *buf, int len) ;
+int _net_pacedxmit(INET *sh, char *buf, int len) ;
+int _net_xmitwire(INET *sh, char *buf, int len) ;
+int _net_corkxmit(INET *sh, char *buf, int len) ;
+int _net_corkflush(INET *sh, int more) ;
+int _net_rapending(INET *sh) ;
+int _net_rarecv(INET *sh, char *buf, int maxlen) ;
+void _net_pacethrottled(INET *sh, double seconds) ;
+double _net_monotime() ;
+int _net_cpuhasaes() ;
+int _net_ssl_init() ;
+int _net_applycipherprofile(INET *sh, SSL_CTX *ctx) ;
+struct _net_pinset *_net_pinfind(char *hostname) ;
+SSL_CTX *_net_ctxget(INET *sh, int flags) ;
+void _net_ctxrelease(SSL_CTX *ctx) ;
+void _net_destevict() ;
+int _net_destadmit(char *hostname, int port, struct _net_dest **d) ;
+void _net_destresult(struct _net_dest *d, int outcome) ;
+int _net_lbpick(INET *sh, char *hostname, int port, struct hostent *host, struct in_addr *addr) ;
+void _net_lbresult(INET *sh, int outcome) ;
+void _net_lbresponse(INET *sh) ;
+void _net_lbrelease(INET *sh) ;
+int _net_lbretry(char *hostname, int port) ;
+int _net_hswait(INET **c, int n, double until) ;
+void _net_hedgesample(struct _net_hedgehist *h, double seconds) ;
+double _net_hedgedelay(struct _net_hedgehist *h) ;
+double _net_hedgestart(struct _net_hedgehist *h, unsigned long *count) ;
+int _net_hedgeadmit() ;
+INET *_net_hedgeopen(char *hostname, int port, enum netflags flags, INET *avoid) ;
+void _net_hedgeblocking(INET *sh, int blocking) ;
+int _net_hedgesend(INET *sh, char *request, int len) ;
+void _net_hedgecancel(INET *sh) ;
+INET *_net_connect(char *hostname, int port, enum netflags flags, int *timeouts) ;
+int _net_toalloc(INET *sh) ;
+void _net_toarm(struct _net_timeouts *to) ;
+void _net_tofree(INET *sh) ;
+void _net_tosockopts(INET *sh) ;
+void _net_torecvd(INET *sh, int r) ;
+void _net_idleend(INET *sh) ;
+void _net_tosent(INET *sh, int r, int len) ;
+void _net_towritewait(INET *sh) ;
+int _net_toreport(INET *sh, char *context) ;
+int _net_msremaining(double deadline) ;
+int _net_waitfd(int fd, short events, double deadline) ;
+int _net_rdbuffered(INET *sh) ;
+int _net_rcv(INET *sh, char *buf, int maxlen) ;
+int _net_zsend(INET *sh, char *buf, int len) ;
+int _net_zrecv(INET *sh, char *buf, int maxlen) ;
+int _net_zhaspending(INET *sh) ;
+void _net_zfree(INET *sh) ;
+long _net_zmemory(INET *sh) ;
+int _net_wouldblock() ;
+int _net_setrecordsize(INET *sh, int size, int grow) ;
+void _net_recordsize(INET *sh) ;
+void _net_recordsent(INET *sh, int r) ;
+
 typedef void (*SSL_CTX_keylog_cb_func)(const SSL *ssl, const char *line);
 void _net_ssl_keylog(const SSL *ssl, const char *line);
 
 
 //
-// @brief Initialise network subsystem this only needs to be called once
+// @brief Initialise network subsystem ahead of the first connection.  This
+//        is optional, as TLS is otherwise initialised by the first TLS
+//        connect, and only needs to be called once.
 // @return true on success
 //
 
+int netinit()
+{
+  _net_cpuhasaes() ;
+#ifdef NET_NOTLS
+  return 1 ;
+#else
+  if (!_net_ssl_init()) return 0 ;
+
+  // Creating a context fetches the TLS algorithms from the providers,
+  // which would otherwise be done by the first connect
+
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method()) ;
+  if (ctx) SSL_CTX_free(ctx) ;
+  return 1 ;
+#endif
+}
+
+#ifndef NET_NOTLS
+
+static pthread_once_t _net_sslonce = PTHREAD_ONCE_INIT ;
+static int _net_sslready = 0 ;
+
+//
+// @brief Initialise OpenSSL on first use
+//
+// Error strings are never looked up, so are not loaded, and algorithms
+// are fetched as contexts need them.  The configuration file is still
+// honoured.
+//
+
+void _net_ssl_doinit()
+{
+  _net_sslready = OPENSSL_init_ssl(OPENSSL_INIT_NO_LOAD_SSL_STRINGS, NULL) ;
+  _net_cpuhasaes() ;
+}
+
 int _net_ssl_init()
 {
-  static int success=0 ;
-  if (!success) {
-    OpenSSL_add_all_algorithms();
-    ERR_load_crypto_strings();
-    SSL_load_error_strings();
-    success = SSL_library_init();
+  pthread_once(&_net_sslonce, _net_ssl_doinit) ;
+  return _net_sslready ;
+}
+
+#endif
+
+//
+// @brief Open the shared /dev/null descriptor used to flag pending data
+//
+
+void _net_opendevnull()
+{
+  pthread_mutex_lock(&_net_lock) ;
+  if (_net_devnull<0) {
+    _net_devnull = open(DEVNULL, O_RDWR|O_NONBLOCK) ;
+  }
+  pthread_mutex_unlock(&_net_lock) ;
+}
+
+
+//
+// @brief Build a unix domain socket address
+// @param(in) sh Handle being connected
+// @param(in) path Filesystem path, or @name for the abstract namespace
+// @param(out) addr Address to populate
+// @param(out) addrlen Length of populated address
+// @return 0 on success, or -1 on error (and sets errno)
+//
+
+int _net_unixaddr(INET *sh, char *path, struct sockaddr_un *addr, socklen_t *addrlen)
+{
+  int len = strlen(path) ;
+
+  // Abstract names have no terminator, paths need room for one
+
+  if ( len<=0 || (path[0]=='@' && len==1) || 
+       len >= (int)sizeof(addr->sun_path) ) {
+    _net_seterrno(sh, "unixpath", NET_ERR_INT, NET_ERR_BADA) ;
+    return -1 ;
+  }
+
+  memset(addr, 0, sizeof(struct sockaddr_un)) ;
+  addr->sun_family = AF_UNIX ;
+
+  if (path[0]=='@') {
+    addr->sun_path[0]='\0' ;
+    memcpy(addr->sun_path+1, path+1, len-1) ;
+    *addrlen = offsetof(struct sockaddr_un, sun_path) + len ;
+  } else {
+    strcpy(addr->sun_path, path) ;
+    *addrlen = offsetof(struct sockaddr_un, sun_path) + len + 1 ;
+  }
+
+  // Report the socket path in place of the peer IP address
+
+  sh->ipaddress = malloc(len+1) ;
+  if (!sh->ipaddress) {
+    _net_seterrno(sh, "ipaddress", NET_ERR_ERRNO, 0) ;
+    return -1 ;
   }
-  return success ;
+  strcpy(sh->ipaddress, path) ;
+
+  return 0 ;
 }
 
 //
 // @brief Connect to server
 // @param(in) hostname Name of server to connect to - note 011 represents octal -> 9
-// @param(in) port Port number on server
+//                     or unix:/path/to/socket, or unix:@abstractname
+// @param(in) port Port number on server (ignored for unix: endpoints)
 // @param(in) flags Type of connection to open (OPEN|TLS|SSL2|SSL3|NONBLOCK)
 // @return Handle to NET structure, or NULL on failure (and sets errno)
 //
 
 INET *netconnect(char *hostname, int port, enum netflags flags)
+{
+  INET *sh = _net_connect(hostname, port, flags, _net_timeoutdefaults) ;
+
+  // A failed address has been ejected, so try the others
+
+  for (int retry=1; !sh && flags&BALANCE && retry<NET_LBRETRIES && _net_lbretry(hostname, port); retry++) {
+    sh = _net_connect(hostname, port, flags, _net_timeoutdefaults) ;
+  }
+
+  return sh ;
+}
+
+
+//
+// @brief Connect to server, applying timeouts
+// @param(in) hostname Name of server to connect to
+// @param(in) port Port number on server
+// @param(in) flags Type of connection to open
+// @param(in) timeouts Timeout for each enum nettimeouts kind, in milliseconds
+// @return Handle to NET structure, or NULL on failure (and sets errno)
+//
+
+INET *_net_connect(char *hostname, int port, enum netflags flags, int *timeouts)
 {
   struct hostent *host;
+  double deadline = 0 ;
+  struct _net_dest *dest = NULL ;
+  int destfault = 0 ;   // The failure was the destination's
 
   if (!hostname) {
     // Unable to set sh->errno
@@ -151,49 +834,124 @@ INET *netconnect(char *hostname, int port, enum netflags flags)
   sh->peerport=-1 ;
   sh->certstatus=X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT ; 
   sh->isblocking = !(flags&NONBLOCK) ;
+  sh->flags = flags ;
+  sh->origport = port ;
+  sh->source = -1 ;
 
-  // Create underlying connection
+#ifdef NET_NOTLS
+  if (flags&TLS || flags&SSL2 || flags&SSL3) {
+    _net_seterrno(sh, "netconnect", NET_ERR_INT, NET_ERR_NOTSUP) ;
+    free(sh) ;
+    errno=EPROTONOSUPPORT ;
+    return NULL ;
+  }
+#endif
 
-  host = gethostbyname(hostname) ;
-  if ( host == NULL ) {
-    _net_seterrno(sh, "gethost", NET_ERR_INT, NET_ERR_BADA) ;
-    goto fail ;
+  // Connect and handshake must complete within the handshake timeout
+
+  if (timeouts[NETTIMEOUT_HANDSHAKE]>0) {
+    deadline = _net_monotime() + timeouts[NETTIMEOUT_HANDSHAKE] / 1000.0 ;
   }
 
-  sh->fd = socket(AF_INET, SOCK_STREAM, 0);
-  if ( sh->fd <= 0 ) {
-    _net_seterrno(sh, "socket", NET_ERR_ERRNO, 0) ;
+  sh->hostname = malloc(strlen(hostname)+1) ;
+  if (!sh->hostname) {
+    _net_seterrno(sh, "hostname", NET_ERR_ERRNO, 0) ;
     goto fail ;
   }
+  strcpy(sh->hostname, hostname) ;
 
-  if (port<=0) {
-    _net_seterrno(sh, "port", NET_ERR_INT, NET_ERR_BADP) ;
-    goto fail ;
+  // Fail fast if the destination is known to be down
+
+  if (!_net_destadmit(hostname, port, &dest)) {
+    _net_seterrno(sh, "netconnect", NET_ERR_INT, NET_ERR_CIRCUITOPEN) ;
+    free(sh->hostname) ;
+    free(sh) ;
+    errno=EHOSTUNREACH ;
+    return NULL ;
   }
 
-  sh->peerport = port ;
+  // Create underlying connection
 
-  struct sockaddr_in dest_addr;
-  memset(&dest_addr, 0, sizeof(struct sockaddr_in));
-  dest_addr.sin_family=AF_INET;
-  dest_addr.sin_port=htons(sh->peerport);
-  dest_addr.sin_addr.s_addr = *(unsigned long*)(host->h_addr);
+  struct sockaddr_storage dest_addr ;
+  socklen_t dest_addr_len ;
+  memset(&dest_addr, 0, sizeof(dest_addr)) ;
 
+  if (strncmp(hostname, NET_UNIX_PREFIX, strlen(NET_UNIX_PREFIX))==0) {
 
-  // Store resolved IP address
+    // Unix domain socket: "unix:/path" or abstract "unix:@name"
 
-  char *i = inet_ntoa(dest_addr.sin_addr);
-  if (!i) {
-    _net_seterrno(sh, "ntoa", NET_ERR_INT, NET_ERR_BADA) ;
-    goto fail ;
-  }
+    if (_net_unixaddr(sh, hostname+strlen(NET_UNIX_PREFIX), 
+                      (struct sockaddr_un *)&dest_addr, &dest_addr_len)<0) {
+      goto fail ;
+    }
+
+    sh->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ( sh->fd <= 0 ) {
+      _net_seterrno(sh, "socket", NET_ERR_ERRNO, 0) ;
+      goto fail ;
+    }
+    _net_fdcount(1) ;
+
+    sh->peerport = 0 ;
+
+  } else {
+
+    host = gethostbyname(hostname) ;
+    if ( host == NULL ) {
+      _net_seterrno(sh, "gethost", NET_ERR_INT, NET_ERR_BADA) ;
+      goto fail ;
+    }
+
+    sh->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if ( sh->fd <= 0 ) {
+      _net_seterrno(sh, "socket", NET_ERR_ERRNO, 0) ;
+      goto fail ;
+    }
+    _net_fdcount(1) ;
+
+    if (_net_sourcebind(sh)<0) {
+      goto fail ;
+    }
+
+    if (port<=0) {
+      _net_seterrno(sh, "port", NET_ERR_INT, NET_ERR_BADP) ;
+      goto fail ;
+    }
+
+    sh->peerport = port ;
+
+    struct sockaddr_in *dest_in = (struct sockaddr_in *)&dest_addr ;
+    dest_in->sin_family=AF_INET;
+    dest_in->sin_port=htons(sh->peerport);
+    dest_addr_len = sizeof(struct sockaddr_in) ;
+
+    // Pick among all resolved addresses if balancing, else take the first
+
+    if (flags&BALANCE) {
+      if (!_net_lbpick(sh, hostname, port, host, &dest_in->sin_addr)) {
+        _net_seterrno(sh, "balance", NET_ERR_ERRNO, ENOMEM) ;
+        goto fail ;
+      }
+    } else {
+      dest_in->sin_addr.s_addr = *(unsigned long*)(host->h_addr);
+    }
+
+    // Store resolved IP address
+
+    char *i = inet_ntoa(dest_in->sin_addr);
+    if (!i) {
+      _net_seterrno(sh, "ntoa", NET_ERR_INT, NET_ERR_BADA) ;
+      goto fail ;
+    }
+
+    sh->ipaddress = malloc(strlen(i)+1) ;
+    if (!sh->ipaddress) {
+      _net_seterrno(sh, "ipaddress", NET_ERR_ERRNO, 0) ;
+      goto fail ;
+    }
+    strcpy(sh->ipaddress, i) ;
 
-  sh->ipaddress = malloc(strlen(i)+1) ;
-  if (!sh->ipaddress) {
-    _net_seterrno(sh, "ipaddress", NET_ERR_ERRNO, 0) ;
-    goto fail ;
   }
-  strcpy(sh->ipaddress, i) ;
 
   // Set non-blocking and connect to destination
 
@@ -205,25 +963,29 @@ INET *netconnect(char *hostname, int port, enum netflags flags)
   }
   fcntl(sh->fd, F_SETFL, fdoptions | O_NONBLOCK);
 
-  if ( connect(sh->fd, (struct sockaddr *) &dest_addr, sizeof(struct sockaddr)) < 0 ) {
+  // A source address with no free port for this destination moves on
+  // to the next source address
+
+  int cr = connect(sh->fd, (struct sockaddr *) &dest_addr, dest_addr_len) ;
+  for (int retries=1; cr<0 && errno==EADDRNOTAVAIL && _net_sourceretry(sh, fdoptions, retries); retries++) {
+    cr = connect(sh->fd, (struct sockaddr *) &dest_addr, dest_addr_len) ;
+  }
+
+  if ( cr < 0 ) {
 
     int r=0, connected=0 ;
 
     if (errno!=EINPROGRESS) {
 
+      // Running out of local ports is not the destination's fault
+
+      destfault = (errno!=EADDRNOTAVAIL) ;
       _net_seterrno(sh, "connect", NET_ERR_ERRNO, 0) ; 
       goto fail ;
 
     } else do { 
 
-      fd_set myset ;
-      struct timeval tv ;
-      tv.tv_sec = 2; 
-      tv.tv_usec = 0; 
-      FD_ZERO(&myset); 
-      FD_SET(sh->fd, &myset); 
-
-      r = select((sh->fd)+1, NULL, &myset, NULL, &tv); 
+      r = _net_waitfd(sh->fd, POLLOUT, deadline) ;
 
       if (r < 0 && errno != EINPROGRESS) {
 
@@ -233,7 +995,7 @@ INET *netconnect(char *hostname, int port, enum netflags flags)
       } else if (r > 0) { 
 
         int valopt ;
-        int lon = sizeof(int); 
+        socklen_t lon = sizeof(int) ;
         if (getsockopt(sh->fd, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) < 0) { 
    
           _net_seterrno(sh, "getsockopt", NET_ERR_ERRNO, 0) ;
@@ -243,6 +1005,7 @@ INET *netconnect(char *hostname, int port, enum netflags flags)
 
         if (valopt) { 
 
+          destfault = 1 ;
           _net_seterrno(sh, "getsockopt", NET_ERR_ERRNO, valopt) ;
           goto fail ;
  
@@ -254,6 +1017,7 @@ INET *netconnect(char *hostname, int port, enum netflags flags)
 
       } else {
 
+        destfault = 1 ;
         _net_seterrno(sh, "connect", NET_ERR_INT, NET_ERR_TIMEOUT) ;
         goto fail ;
 
@@ -263,67 +1027,45 @@ INET *netconnect(char *hostname, int port, enum netflags flags)
 
   }
 
- // Get local port
+ // Get local port (unix domain sockets have none)
+
+  if (dest_addr.ss_family == AF_INET) {
+
+    struct sockaddr_in local_addr;
+    socklen_t local_addr_len = sizeof(local_addr) ;
+    memset(&local_addr, 0, sizeof(struct sockaddr_in));
+    if (getsockname(sh->fd, (struct sockaddr *) &local_addr, &local_addr_len) < 0 ) {
+      _net_seterrno(sh, "getsockname", NET_ERR_ERRNO, 0) ; 
+       goto fail ;
+    }
+    sh->localport = ntohs(local_addr.sin_port) ;
+
+  } else {
+
+    sh->localport = 0 ;
 
-  struct sockaddr_in local_addr;
-  int local_addr_len = sizeof(local_addr) ;
-  memset(&local_addr, 0, sizeof(struct sockaddr_in));
-  if (getsockname(sh->fd, (struct sockaddr *) &local_addr, &local_addr_len) < 0 ) {
-    _net_seterrno(sh, "getsockname", NET_ERR_ERRNO, 0) ; 
-     goto fail ;
   }
-  sh->localport = ntohs(local_addr.sin_port) ;
 
 
   // Now establish SSL connection if required
 
+#ifndef NET_NOTLS
   if (flags&TLS || flags&SSL2 || flags&SSL3) {
 
     // Initialise SSL
 
     _net_ssl_init() ;
 
-    // Set client hello and announce SSLv3 & TLSv1
-
-    const SSL_METHOD *method;
-    method = SSLv23_client_method();
-    if (!method) { 
-      _net_seterrno(sh, "client_method", NET_ERR_SSL, 0) ;
-      goto fail ; 
-    }
+    // Obtain a context, shared with other connections made with the
+    // same options
 
-    sh->ctx = SSL_CTX_new(method) ;
+    sh->ctx = _net_ctxget(sh, flags) ;
     if ( !sh->ctx ) { 
-      _net_seterrno(sh, "ctx_new", NET_ERR_SSL, 0) ; 
       goto fail ; 
     }
 
-    // Enable verification of full certificate chain
-
-    if (!(flags&NOCERTCHAIN))
-      SSL_CTX_set_default_verify_paths(sh->ctx) ;
-
-    // Disable SSL if requested
-
-    if (! (flags&SSL2) ) {
-      SSL_CTX_set_options(sh->ctx, SSL_OP_NO_SSLv2);
-    }
-
-    if (! (flags&SSL3) ) {
-      SSL_CTX_set_options(sh->ctx, SSL_OP_NO_SSLv3);
-    }
-
-    // XXXXXX May not be needed ...
-
-//    if ( ! (flags&NONBLOCK) ) { 
-//      SSL_CTX_set_mode(sh->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE) ;
-//  }
-
-   // Enable key logging
-
    if (flags&DEBUGKEYDUMP) {
      sh->keydumpenable=1 ;
-     SSL_CTX_set_keylog_callback(sh->ctx, _net_ssl_keylog);
    }
 
     // Create connection state object
@@ -336,53 +1078,40 @@ INET *netconnect(char *hostname, int port, enum netflags flags)
 
     SSL_set_connect_state(sh->ssl); 
 
-    // Attach SSL server to the socket
-
-    SSL_set_fd(sh->ssl, sh->fd);
-
-
-    // Establish SSL protocol connection
-
-    int r ;
-    while ( (r=SSL_connect(sh->ssl)) < 0 ) {
-
-      fd_set fds;
-      FD_ZERO(&fds);
-      FD_SET(sh->fd, &fds);
+    // A pinned destination fails the handshake unless its key is presented
 
-      int e=SSL_get_error(sh->ssl, r) ;
+    struct _net_pinset *pins = _net_pinfind(hostname) ;
+    if (pins) {
+      SSL_set_app_data(sh->ssl, pins) ;
+      SSL_set_verify(sh->ssl, SSL_VERIFY_PEER, NULL) ;
+    }
 
-      switch (e) {
+    // Attach SSL server to the socket
 
-      case SSL_ERROR_WANT_READ:
-         select(sh->fd + 1, &fds, NULL, NULL, NULL);
-         break;
+    SSL_set_fd(sh->ssl, sh->fd);
 
-      case SSL_ERROR_WANT_WRITE:
-         select(sh->fd + 1, NULL, &fds, NULL, NULL);
-         break;
 
-      default:
-         _net_seterrno(sh, "ssl_connect", NET_ERR_SSL, r) ;
-         goto fail ;
-         break ;
-      }
+    // Establish SSL protocol connection, unless a worker is to do it
 
+    if (!(flags&ASYNCHANDSHAKE) && !_net_sslconnect(sh, deadline)) {
+      destfault = 1 ;
+      goto fail ;
     }
 
 
     // Open /dev/null, which is used for select
 
-    if ( !sh->isblocking && _net_devnull<0) {
-      _net_devnull = open(DEVNULL, O_RDWR|O_NONBLOCK) ;
+    if ( !sh->isblocking || flags&ASYNCHANDSHAKE ) {
+      _net_opendevnull() ;
     }
 
 
   }
+#endif
 
-  // Restore blocking if required
+  // Restore blocking if required, after any offloaded handshake
 
-  if ( ! (flags&NONBLOCK) ) {
+  if ( ! (flags&NONBLOCK) && !(sh->ssl && flags&ASYNCHANDSHAKE) ) {
 
     fcntl(sh->fd, F_SETFL, fdoptions);
 
@@ -391,13 +1120,41 @@ INET *netconnect(char *hostname, int port, enum netflags flags)
    if (flags&DEBUGDATADUMP && getenv("NETDUMPENABLE")) {
      sh->datadumpenable=1 ;
    }
+
+  // Apply read, write and idle timeouts
+
+  for (int kind=NETTIMEOUT_READ; kind<=NETTIMEOUT_IDLE; kind++) {
+    if (timeouts[kind]>0 && !netsettimeout(sh, kind, timeouts[kind])) goto fail ;
+  }
+  if (sh->to) sh->to->ms[NETTIMEOUT_HANDSHAKE] = timeouts[NETTIMEOUT_HANDSHAKE] ;
+
+  if (_net_idlebufdefault>0 && !netidlememory(sh, _net_idlebufdefault)) goto fail ;
+  
+  // Hand the handshake to a worker, which reports the outcome
+
+  if (sh->ssl && flags&ASYNCHANDSHAKE) {
+    if (!_net_hsqueue(sh, deadline, (flags&NONBLOCK) ? -1 : fdoptions, dest)) goto fail ;
+  } else {
+    _net_destresult(dest, NET_DEST_OK) ;
+    _net_lbresult(sh, NET_DEST_OK) ;
+  }
   
+  pthread_mutex_lock(&_net_lock) ;
   _net_numconnections++ ;
+  pthread_mutex_unlock(&_net_lock) ;
 
   return sh ;
 
 fail: 
+
+  // Only connect, handshake and timeout failures count against the
+  // destination.  Local errors (a bad port, out of memory, options which
+  // could not be applied) leave its health as it was.
+
+  _net_destresult(dest, destfault ? NET_DEST_FAILED : NET_DEST_ABANDONED) ;
+  _net_lbresult(sh, destfault ? NET_DEST_FAILED : NET_DEST_ABANDONED) ;
   _net_disconnect(sh) ;
+  free(sh) ;
   errno=EHOSTUNREACH ;
   return NULL ;
  
@@ -405,23 +1162,15 @@ fail:
 
 
 // 
-// @brief Obtain SSL certificate status
+// @brief Obtain SSL certificate status, as recorded when the handshake
+//        completed
 // @param(in) Handle of open connection
-// @return Non-zero certificate status code or zero if ok
+// @return Non-zero certificate status code or zero if ok, or -1 if the
+//         peer presented no certificate
 //
 
 int netcertstatus(INET *sh)
 {
-  // Get peer certificate
-
-  X509 *cert = SSL_get_peer_certificate(sh->ssl);
-  if (cert) {
-    sh->certstatus = SSL_get_verify_result(sh->ssl);
-    X509_free(cert) ;
-  } else {
-    sh->certstatus = -1 ;
-  }
-
   return (sh->certstatus) ;
 }
 
@@ -451,9 +1200,29 @@ int netrdfdisset(INET *sh, fd_set *rfds, fd_set *wfds)
 
     return 0 ;
 
+  } else if (sh->hs) {
+
+    // Handshake still in progress, or failed and waiting to be reported
+
+    return _net_hsstate(sh)==NET_HS_FAILED ;
+
+  } else if (sh->to && sh->to->expired) {
+
+    // A timeout is waiting to be reported by netrecv
+
+    return 1 ;
+
+  } else if (sh->z && _net_zhaspending(sh)) {
+
+    // Decompressed data is waiting to be read
+
+    return 1 ;
+
   } else if (!sh->ssl) {
 
-    return FD_ISSET(sh->fd, rfds) ;
+    // Read-ahead data is already in the ingress buffer
+
+    return ( ( sh->ra && sh->ra->pos < sh->ra->len ) || FD_ISSET(sh->fd, rfds) ) ;
 
   } else {
 
@@ -485,6 +1254,52 @@ int netrdfdset(INET *sh, fd_set *rdfds, fd_set *wrfds, int *l)
 
   if (!sh || !rdfds || !l) return 0 ;
 
+  // Zero copy completions would otherwise keep the fd readable
+
+  if (sh->zc) _net_zcreap(sh) ;
+
+  // The end of an event loop iteration flushes gathered writes, waiting
+  // for the socket to become writable if they cannot all be sent
+
+  if (sh->cork && (sh->cork->pos < sh->cork->len || sh->cork->unpushed) && !sh->hs) {
+    sh->cork->stats.loopflushes++ ;
+    if (_net_corkflush(sh, 0)>0 && wrfds && sh->fd>=0) {
+      FD_SET(sh->fd, wrfds) ;
+      if ( sh->fd > (*l) ) { (*l) = sh->fd ; }
+    }
+  }
+
+  // Wait on the notification fd while a worker performs the handshake,
+  // and report a failed handshake through DEVNULL
+
+  if (sh->hs) {
+    int h = _net_hspoll(sh, "netrdfdset", 0) ;
+    if (h==0) {
+      int hfd = nethandshakefd() ;
+      FD_SET(hfd, rdfds) ;
+      if ( hfd > (*l) ) { (*l) = hfd ; }
+      return 0 ;
+    } else if (h<0) {
+      if (wrfds && _net_devnull>=0) {
+        FD_SET(_net_devnull, wrfds) ;
+        if ( _net_devnull > (*l) ) { (*l) = _net_devnull ; }
+      }
+      return 0 ;
+    }
+  }
+
+  // Add DEVNULL if decompressed or read-ahead data, or a timeout, is
+  // waiting to be read
+
+  if ( ( (sh->z && _net_zhaspending(sh)) || (sh->to && sh->to->expired) ||
+         (sh->ra && !sh->ssl && sh->ra->pos < sh->ra->len) ) && 
+       wrfds && _net_devnull>=0 ) {
+
+    FD_SET(_net_devnull, wrfds) ;
+    if ( _net_devnull > (*l) ) { (*l) = _net_devnull ; }
+
+  }
+
   if (!sh->ssl) {
 
     // Add non-ssl fd
@@ -530,6 +1345,69 @@ int netrdfdset(INET *sh, fd_set *rdfds, fd_set *wrfds, int *l)
 
 }
 
+//
+// @brief Add connection to write fd_set if active
+// @param(in) sh Handle of network connection
+// @param(in) wrfds FD Set for select()
+// @param(inout) l pointer to largest fd found
+// @return number of connections added
+//
+
+int netwrfdset(INET *sh, fd_set *wrfds, int *l)
+{
+  if (!sh || !wrfds || !l || sh->fd<0) return 0 ;
+  if (sh->zc) _net_zcreap(sh) ;
+
+  // Handshake completion is signalled through netrdfdset(), a failure
+  // is reported by netsend
+
+  if (sh->hs) {
+    int h = _net_hspoll(sh, "netwrfdset", 0) ;
+    if (h==0) return 0 ;
+    if (h<0) {
+      if (_net_devnull<0) return 0 ;
+      FD_SET(_net_devnull, wrfds) ;
+      if ( _net_devnull > (*l) ) { (*l) = _net_devnull ; }
+      return 1 ;
+    }
+  }
+
+  // Add DEVNULL if a timeout is waiting to be reported by netsend
+
+  if (sh->to && sh->to->expired && _net_devnull>=0) {
+    FD_SET(_net_devnull, wrfds) ;
+    if ( _net_devnull > (*l) ) { (*l) = _net_devnull ; }
+    return 1 ;
+  }
+
+  // Waiting to send starts the write timeout
+
+  if (sh->to) _net_towritewait(sh) ;
+
+  if (netthrottleduntil(sh, NULL)) return 0 ;
+
+  FD_SET(sh->fd, wrfds) ;
+  if ( sh->fd > (*l) ) { (*l) = sh->fd ; }
+  return 1 ;
+}
+
+
+//
+// @brief Determine if connection is ready for writing
+// @param(in) sh Handle of network connection
+// @param(in) wrds Write fd set
+// @return True when connection becomes ready to receive data
+//
+
+int netwrfdisset(INET *sh, fd_set *wrfds)
+{
+  if (!sh || !wrfds || sh->fd<0) return 0 ;
+  if (sh->hs) return _net_hsstate(sh)==NET_HS_FAILED ;
+  if (sh->to && sh->to->expired) return 1 ;
+  if (netthrottleduntil(sh, NULL)) return 0 ;
+  return FD_ISSET(sh->fd, wrfds) ;
+}
+
 //
 // @brief Provide summary string of read and write socket fd_set info
 //
@@ -581,71 +1459,452 @@ int netlocalport(NET *sh)
   else return sh->localport ;
 }
 
+
 //
-// @brief Disconnect connection
-// @param(in) Handle of open connection
-// @return true on success, or false on error (setting errno)
+// @brief Obtain the socket of a connection
+// @param(in) sh Handle of open connection
+// @return Socket descriptor, or -1 if not connected
+//
+
+int netfd(NET *sh)
+{
+  if (!sh) return -1 ;
+  else return sh->fd ;
+}
+
+//
+// @brief Disconnect connection
+// @param(in) Handle of open connection
+// @return true on success, or false on error (setting errno)
 //
 int _net_disconnect(INET *sh)
 {
   if (!sh) return 0 ;
 
+  // A worker may still be using the connection
+
+  _net_hscancel(sh) ;
+
+  // The SSL object does not own the socket, so it is always closed here
+
   if (sh->ssl) SSL_free(sh->ssl);
-  else if (sh->fd >=0 ) close(sh->fd);
+  if (sh->fd >=0 ) {
+    close(sh->fd);
+    _net_fdcount(0) ;
+  }
   if (sh->ipaddress) free(sh->ipaddress) ;
-  if (sh->ctx) SSL_CTX_free(sh->ctx);
+  if (sh->hostname) free(sh->hostname) ;
+  if (sh->ctx) _net_ctxrelease(sh->ctx);
+  _net_zfree(sh) ;
+  if (sh->pace) free(sh->pace) ;
+  if (sh->rec) free(sh->rec) ;
+  if (sh->busy) free(sh->busy) ;
+  if (sh->zc) free(sh->zc) ;
+  if (sh->cork) {
+    free(sh->cork->buf) ;
+    free(sh->cork) ;
+  }
+  if (sh->ra) {
+    free(sh->ra->buf) ;
+    free(sh->ra) ;
+  }
+  _net_tofree(sh) ;
+  _net_lbrelease(sh) ;
 
   sh->ssl = NULL ;
   sh->fd = -1 ;
   sh->ipaddress = NULL ;
+  sh->hostname = NULL ;
   sh->ctx = NULL ;
+  sh->pace = NULL ;
+  sh->rec = NULL ;
+  sh->busy = NULL ;
+  sh->zc = NULL ;
+  sh->cork = NULL ;
+  sh->ra = NULL ;
 
   return 1 ;
 }
 
 
 //
-// @brief Close Network connection
+// @brief Close Network connection, ending any graceful close in progress
 // @param(in) Handle of open connection
-// @return true on success, or false on error (setting errno)
+// @return true on success, or false on error (setting errno).  The
+//         handle is freed either way.
 //
 int netclose(INET *sh)
 {
   if (!sh) return 0 ;
+  return netclosemode(sh, NETCLOSE_DEFAULT) >= 0 ;
+}
+
+
+//
+// Connection shutdown
+//
+// A graceful close sends TLS close_notify and FIN, then discards data
+// until the peer closes, so that neither side sees a reset and the
+// peer's TLS session stays resumable.  NONBLOCK connections do this a
+// step at a time, driven by the readiness loop, and are bounded by the
+// idle timeout (NET_CLOSETIMEOUT if none is set).  An abortive close
+// sets SO_LINGER to 0, so the kernel sends RST and keeps no TIME_WAIT
+// state for the local port.
+//
+
+//
+// @brief Count socket descriptors opened and closed
+// @param(in) opened True if a socket was opened, false if closed
+//
+
+void _net_fdcount(int opened)
+{
+  pthread_mutex_lock(&_net_lock) ;
+  if (opened) {
+    _net_fdstats.opened++ ;
+    _net_fdstats.open++ ;
+  } else {
+    _net_fdstats.closed++ ;
+    _net_fdstats.open-- ;
+  }
+  pthread_mutex_unlock(&_net_lock) ;
+}
+
+
+//
+// @brief Release a connection's resources and free the handle
+//
 
+void _net_release(INET *sh)
+{
   _net_disconnect(sh) ;
   free(sh) ;
 
+  pthread_mutex_lock(&_net_lock) ;
   _net_numconnections-- ;
   assert(_net_numconnections >= 0) ;
   if (_net_numconnections==0 && _net_devnull>=0) {
     close(_net_devnull) ;
     _net_devnull=-1 ;
   }
+  pthread_mutex_unlock(&_net_lock) ;
+}
+
+
+//
+// @brief Advance a shutdown, as far as the connection allows
+// @param(in) sh Handle of connection
+// @param(in) last Stage to stop after (NET_CLOSE_FIN or NET_CLOSE_DRAIN)
+// @return 1 if complete, 0 if waiting for the network (NONBLOCK), or -1 on error
+//
+
+int _net_closestep(INET *sh, int last)
+{
+  while (sh->closing <= last) {
+
+    switch (sh->closing) {
+
+    case NET_CLOSE_NOTIFY: {
+
+      // Gathered writes go before the close notification
+
+      if (sh->cork && sh->cork->pos < sh->cork->len) {
+        int r = _net_corkflush(sh, 0) ;
+        if (r>0) return 0 ;
+        if (r<0) {
+          if (!sh->isblocking && _net_wouldblock()) return 0 ;
+          return -1 ;
+        }
+      }
+
+      if (sh->ssl && !sh->sslfatal) {
+        int r = SSL_shutdown(sh->ssl) ;
+        if (r<0) {
+          int e = SSL_get_error(sh->ssl, r) ;
+          if (e==SSL_ERROR_WANT_WRITE) {
+            sh->sslwantwrite = 1 ;
+            return 0 ;
+          } else if (e==SSL_ERROR_WANT_READ) {
+            return 0 ;
+          }
+          _net_seterrno(sh, "netshutdown", NET_ERR_SSL, r) ;
+          return -1 ;
+        }
+        sh->sslwantwrite = 0 ;
+      }
+      sh->closing = NET_CLOSE_FIN ;
+      break ;
+
+    }
+
+    case NET_CLOSE_FIN:
+
+      if (shutdown(sh->fd, SHUT_WR)<0 && errno!=ENOTCONN) {
+        _net_seterrno(sh, "netshutdown", NET_ERR_ERRNO, 0) ;
+        return -1 ;
+      }
+      sh->closing = NET_CLOSE_DRAIN ;
+      break ;
+
+    case NET_CLOSE_DRAIN: {
+
+      char buf[4096] ;
+      int r, again=0 ;
+
+      // Blocking connections wait for the peer, up to the deadline
+
+      if ( sh->isblocking && !(sh->ssl && SSL_pending(sh->ssl)) ) {
+        if (_net_waitfd(sh->fd, POLLIN, sh->closedeadline)==0) {
+          _net_seterrno(sh, "netclose", NET_ERR_INT, NET_ERR_IDLETIMEOUT) ;
+          return -1 ;
+        }
+      }
+
+      if (sh->ssl && !sh->sslfatal) {
+        r = SSL_read(sh->ssl, buf, sizeof(buf)) ;
+        if (r<=0) {
+          int e = SSL_get_error(sh->ssl, r) ;
+          again = ( e==SSL_ERROR_WANT_READ || e==SSL_ERROR_WANT_WRITE ) ;
+        }
+      } else {
+        r = recv(sh->fd, buf, sizeof(buf), 0) ;
+        again = ( r<0 && (errno==EAGAIN || errno==EWOULDBLOCK) ) ;
+      }
+
+      if (r>0) break ;
+
+      if (again) {
+        if (!sh->isblocking) return 0 ;
+        break ;
+      }
+
+      // Peer has closed, or the connection has failed
+
+      sh->closing = NET_CLOSE_DONE ;
+      break ;
+
+    }
+
+    default:
+
+      return 1 ;
+
+    }
+
+  }
 
   return 1 ;
 }
 
 
 //
-// @brief Send data to network interface
+// @brief Reset a connection when it is closed
+//
+
+void _net_abort(INET *sh)
+{
+  struct linger lg ;
+  lg.l_onoff = 1 ;
+  lg.l_linger = 0 ;
+  if (sh->fd>=0) setsockopt(sh->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg)) ;
+}
+
+
+//
+// @brief Half-close a connection, sending TLS close_notify and FIN.
+//        Data may still be received until the peer closes.
+// @param(in) sh Handle of open connection
+// @return 1 when complete, 0 if in progress (NONBLOCK, call again when
+//         netwrfdisset), or -1 on error
+//
+
+int netshutdown(INET *sh)
+{
+  if (!sh || sh->fd<0) return -1 ;
+
+  if (sh->closing==NET_CLOSE_OPEN) {
+    sh->closing = NET_CLOSE_NOTIFY ;
+    pthread_mutex_lock(&_net_lock) ;
+    _net_fdstats.halfclosed++ ;
+    pthread_mutex_unlock(&_net_lock) ;
+  }
+
+  if (sh->closing > NET_CLOSE_FIN) return 1 ;
+  return _net_closestep(sh, NET_CLOSE_FIN) ;
+}
+
+
+//
+// @brief Close a connection using the given mode
+// @param(in) sh Handle of open connection
+// @param(in) mode NETCLOSE_DEFAULT, NETCLOSE_GRACEFUL or NETCLOSE_ABORT
+// @return 1 when closed, 0 if a NONBLOCK graceful close is in progress,
+//         or -1 if closed after an error (setting errno).  The handle is
+//         freed unless 0 is returned.
+//
+
+int netclosemode(INET *sh, enum netclosemodes mode)
+{
+  if (!sh) return -1 ;
+  _net_hscancel(sh) ;
+
+  if (sh->closemode==NETCLOSE_GRACEFUL && sh->closing!=NET_CLOSE_OPEN) {
+
+    // Graceful close already in progress.  NETCLOSE_GRACEFUL continues
+    // it, anything else ends it now, as netclose() must free the handle.
+
+  } else if (mode==NETCLOSE_GRACEFUL) {
+
+    // Wait for the peer for up to the idle timeout, or NET_CLOSETIMEOUT.
+    // NONBLOCK connections use the idle timer to become ready when the
+    // wait is over.
+
+    int ms = (sh->to && sh->to->ms[NETTIMEOUT_IDLE]>0) ? sh->to->ms[NETTIMEOUT_IDLE] : NET_CLOSETIMEOUT ;
+
+    sh->closemode = NETCLOSE_GRACEFUL ;
+    if (sh->closing==NET_CLOSE_OPEN) sh->closing = NET_CLOSE_NOTIFY ;
+    sh->closedeadline = _net_monotime() + ms / 1000.0 ;
+    if (!sh->isblocking && !netsettimeout(sh, NETTIMEOUT_IDLE, ms)) {
+      mode = NETCLOSE_ABORT ;
+    }
+
+  }
+
+  int r = 1 ;
+
+  switch (mode) {
+
+  case NETCLOSE_GRACEFUL:
+
+    // Give up on a peer which does not close in time
+
+    if ( (sh->to && sh->to->expired) || _net_monotime() > sh->closedeadline ) {
+      _net_seterrno(sh, "netclose", NET_ERR_INT, NET_ERR_IDLETIMEOUT) ;
+      r = -1 ;
+    } else {
+      r = _net_closestep(sh, NET_CLOSE_DRAIN) ;
+      if (r==0) return 0 ;
+    }
+
+    pthread_mutex_lock(&_net_lock) ;
+    if (r>0) _net_fdstats.graceful++ ;
+    else _net_fdstats.closetimeouts++ ;
+    pthread_mutex_unlock(&_net_lock) ;
+
+    if (r<0) _net_abort(sh) ;
+    break ;
+
+  case NETCLOSE_ABORT:
+
+    pthread_mutex_lock(&_net_lock) ;
+    _net_fdstats.aborted++ ;
+    pthread_mutex_unlock(&_net_lock) ;
+
+    _net_abort(sh) ;
+    break ;
+
+  default:
+
+    // Gathered writes go first, as far as the socket accepts them
+    // without waiting when NONBLOCK, unless a shutdown has sent them
+
+    if ( sh->cork && !sh->sslfatal && sh->closing<=NET_CLOSE_NOTIFY &&
+         (!sh->ssl || SSL_is_init_finished(sh->ssl)) ) {
+      _net_corkflush(sh, 0) ;
+    }
+
+    // Best effort close_notify, without waiting for the peer
+
+    if ( sh->ssl && !sh->sslfatal && sh->closing<=NET_CLOSE_NOTIFY &&
+         SSL_is_init_finished(sh->ssl) ) {
+      SSL_shutdown(sh->ssl) ;
+    }
+    break ;
+
+  }
+
+  _net_release(sh) ;
+  return r ;
+}
+
+
+//
+// @brief Obtain socket descriptor accounting
+// @param(out) st Statistics structure to populate
+// @return true on success
+//
+
+int netfdstats(struct netfdstats *st)
+{
+  if (!st) return 0 ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  *st = _net_fdstats ;
+  pthread_mutex_unlock(&_net_lock) ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Send data to the underlying plain or TLS transport
 // @param(in) sh Handle of open connection
 // @param(in) buf Data to be sent
 // @param(in) len Amount of data to send
 // @return Number of bytes sent, or -1 on error
 //
  
-int netsend(INET *sh, char *buf, int len)
+int _net_xmit(INET *sh, char *buf, int len)
+{
+  if (sh->cork) return _net_corkxmit(sh, buf, len) ;
+  else return _net_xmitwire(sh, buf, len) ;
+}
+
+
+//
+// @brief Send data to the wire, subject to pacing
+// @param(in) sh Handle of open connection
+// @param(in) buf Data to be sent
+// @param(in) len Amount of data to send
+// @return Number of bytes sent, or -1 on error
+//
+ 
+int _net_xmitwire(INET *sh, char *buf, int len)
+{
+  if (sh->pace) return _net_pacedxmit(sh, buf, len) ;
+  else return _net_xmitraw(sh, buf, len) ;
+}
+
+
+//
+// @brief Write data to the socket or SSL object
+// @param(in) sh Handle of open connection
+// @param(in) buf Data to be sent
+// @param(in) len Amount of data to send
+// @return Number of bytes sent, or -1 on error
+//
+ 
+int _net_xmitraw(INET *sh, char *buf, int len)
 {
   if (sh->ssl) {
+    if (sh->rec) _net_recordsize(sh) ;
     int r = SSL_write(sh->ssl, buf, len) ;
     _net_commsdump(sh, (r<=0)?">!":"> ", buf, len) ;
     _net_seterrno(sh, "netsend", NET_ERR_SSL, r) ;
+    if (sh->rec) _net_recordsent(sh, r) ;
     return r ;
   } else if (sh->fd) {
-    int r = send(sh->fd, buf, len, 0) ;
+    int r ;
+    if ( sh->zc && sh->zc->threshold && !sh->z && !(sh->cork && sh->cork->flushing) &&
+         len >= sh->zc->threshold ) {
+      r = _net_zcsend(sh, buf, len) ;
+    } else {
+      r = send(sh->fd, buf, len, (sh->cork && sh->cork->more) ? MSG_MORE : 0) ;
+      if (r>0 && sh->cork) sh->cork->unpushed = sh->cork->more ;
+    }
     _net_commsdump(sh, (r<=0)?">!":"> ", buf, len) ;
     _net_seterrno(sh, "netsend", NET_ERR_ERRNO, 0) ;
+    return r ;
   } else {
     errno = EBADF ;
     _net_seterrno(sh, "netsend", NET_ERR_ERRNO, 0) ;
@@ -655,7 +1914,34 @@ int netsend(INET *sh, char *buf, int len)
 
 
 //
-// @brief Receive data from network interface
+// @brief Send data to network interface
+// @param(in) sh Handle of open connection
+// @param(in) buf Data to be sent
+// @param(in) len Amount of data to send
+// @return Number of bytes sent, or -1 on error
+//
+ 
+int netsend(INET *sh, char *buf, int len)
+{
+  if (sh->hs && _net_hspoll(sh, "netsend", sh->isblocking)<=0) return -1 ;
+  if (sh->idlebuf && len>0) _net_idleend(sh) ;
+  if (sh->zc) sh->zc->lastzc = 0 ;
+  if (sh->lbdest && !sh->lbsent) sh->lbsent = _net_monotime() ;
+
+  if (!sh->to) {
+    if (sh->z) return _net_zsend(sh, buf, len) ;
+    else return _net_xmit(sh, buf, len) ;
+  }
+
+  if (sh->to->expired) return _net_toreport(sh, "netsend") ;
+  int r = sh->z ? _net_zsend(sh, buf, len) : _net_xmit(sh, buf, len) ;
+  _net_tosent(sh, r, len) ;
+  return r ;
+}
+
+
+//
+// @brief Receive data from the underlying plain or TLS transport
 // @param(in) sh Handle of open connection
 // @param(in) buf Buffer to store response
 // @param(in) maxlen Maximum number of bytes to read
@@ -667,12 +1953,31 @@ int netsend(INET *sh, char *buf, int len)
 // so you can't read 4 bytes, then n bytes.  Hence flagging the need for more
 // reads with sh->sslhaspending.
 
-int netrecv(INET *sh, char *buf, int maxlen)
+int _net_rcv(INET *sh, char *buf, int maxlen)
 {
+  if (sh->ra) {
+    sh->ra->stats.recvs++ ;
+    if (_net_rapending(sh)) sh->ra->stats.buffered++ ;
+    if (!sh->ssl && sh->ra->pos < sh->ra->len) return _net_rarecv(sh, buf, maxlen) ;
+  }
+
+  if (sh->busy) {
+    int r = _net_busyspin(sh, buf, maxlen) ;
+    if (r>0) return r ;
+  }
+
   if (sh->ssl && sh->isblocking) {
 
     int r = SSL_read(sh->ssl, buf, maxlen) ;
     _net_commsdump(sh, (r<=0)?"<!":"< ", buf, r) ;
+    if (r<=0) _net_seterrno(sh, "netrecv", NET_ERR_SSL, r) ;
+
+    // Records read ahead are not visible to select(), so are flagged
+
+    if (sh->ra) {
+      sh->sslhaspending = (r>0 && SSL_has_pending(sh->ssl)) ;
+      if (r>0) sh->ra->stats.bytes += r ;
+    }
     return r ;
 
   } else if (sh->ssl && !sh->isblocking) {
@@ -681,14 +1986,24 @@ int netrecv(INET *sh, char *buf, int maxlen)
 
     if (r > 0) {
 
-      // Data was returned.  Assert flag if even more available
+      // Data was returned.  Assert flag if even more available, which
+      // with read-ahead includes records not yet decrypted
 
-      sh->sslhaspending = nethaspending(sh) ;
+      if (sh->ra) {
+        sh->sslhaspending = SSL_has_pending(sh->ssl) ;
+        sh->ra->stats.bytes += r ;
+      } else {
+        sh->sslhaspending = nethaspending(sh) ;
+      }
       _net_commsdump(sh, (r<=0)?"<!":"< ", buf, r) ;
       return r ;
 
     } else {
 
+      // A partial record read ahead needs the socket, not DEVNULL
+
+      if (sh->ra) sh->sslhaspending = 0 ;
+
       switch(SSL_get_error(sh->ssl, r)) {
 
         case SSL_ERROR_WANT_READ:
@@ -717,6 +2032,10 @@ int netrecv(INET *sh, char *buf, int maxlen)
     }
 
 
+  } else if (sh->fd && sh->ra) {
+
+    return _net_rarecv(sh, buf, maxlen) ;
+
   } else if (sh->fd) {
 
     int r = recv(sh->fd, buf, maxlen, 0) ;
@@ -734,6 +2053,57 @@ int netrecv(INET *sh, char *buf, int maxlen)
   }
 }
 
+//
+// @brief Receive data from network interface
+// @param(in) sh Handle of open connection
+// @param(in) buf Buffer to store response
+// @param(in) maxlen Maximum number of bytes to read
+// @return Number of bytes received, or -1 on error
+//
+
+int netrecv(INET *sh, char *buf, int maxlen)
+{
+  if (sh->hs) {
+    int h = _net_hspoll(sh, "netrecv", sh->isblocking) ;
+    if (h<=0) return h ;
+  }
+
+  // A blocking caller waiting for a reply has finished writing, so
+  // gathered writes are flushed rather than left for netrdfdset()
+
+  if (sh->cork && sh->isblocking && (sh->cork->pos < sh->cork->len || sh->cork->unpushed)) {
+    sh->cork->stats.loopflushes++ ;
+    if (_net_corkflush(sh, 0)<0) return -1 ;
+  }
+
+  if (!sh->to && !sh->lbdest && !sh->idlebuf) {
+    if (sh->z) return _net_zrecv(sh, buf, maxlen) ;
+    else return _net_rcv(sh, buf, maxlen) ;
+  }
+
+  if (sh->to && sh->to->expired) return _net_toreport(sh, "netrecv") ;
+  int r = sh->z ? _net_zrecv(sh, buf, maxlen) : _net_rcv(sh, buf, maxlen) ;
+  if (sh->to) _net_torecvd(sh, r) ;
+  if (r>0 && sh->lbsent) _net_lbresponse(sh) ;
+  if (r>0 && sh->idlebuf) _net_idleend(sh) ;
+  return r ;
+}
+
+//
+// @brief Determine whether received data is buffered where the socket
+//        does not show it
+// @param(in) sh Handle of open connection
+// @return true if netrecv() can return data without the socket being readable
+//
+
+int _net_rdbuffered(INET *sh)
+{
+  if (sh->hs) return 0 ;
+  return ( (sh->z && _net_zhaspending(sh)) || (sh->to && sh->to->expired) ||
+           (sh->ra && _net_rapending(sh)) || (sh->ssl && sh->sslhaspending) ) ;
+}
+
+
 //
 // @brief Returns true if pending data
 // @param(in) sh Handle of open connection
@@ -742,7 +2112,24 @@ int netrecv(INET *sh, char *buf, int maxlen)
 
 int nethaspending(NET *sh)
 {
-  if (sh->ssl) {
+  if (sh->hs) {
+
+    // The SSL object belongs to a worker until the handshake completes
+
+    return 0 ;
+
+  } else if (sh->z && _net_zhaspending(sh)) {
+
+    return 1 ;
+
+  } else if (sh->ra) {
+
+    // Answered from what has been read ahead, without a syscall
+
+    sh->ra->stats.pendingchecks++ ;
+    return _net_rapending(sh) ;
+
+  } else if (sh->ssl) {
 
     int r = SSL_pending(sh->ssl) ;
     _net_seterrno(sh, "nethaspending", NET_ERR_SSL, r) ;
@@ -756,19 +2143,4892 @@ int nethaspending(NET *sh)
     return ( r > 0 ) ;
 
   }
- 
+
+  return 0 ;
 }
 
 
+//
+// Receive buffer pool
+//
+// Rather than every connection owning a buffer for the largest message,
+// netrecv_borrow() takes a fixed size buffer from a shared pool only for
+// as long as received data is held in it.  A buffer is taken just before
+// the read and given straight back if nothing arrives, so idle
+// connections hold no receive memory.  Blocking connections first wait
+// for the socket to become readable (MSG_PEEK, so any read timeout still
+// applies), and TLS then for a record holding application data, as the
+// bytes may be a session ticket or other record which the read consumes
+// without returning anything.  Plain sockets receive directly into the pooled buffer and
+// TLS decrypts into it, so there is no copy beyond netrecv()'s own.
+//
+
+//
+// @brief Configure the receive buffer pool
+// @param(in) bufsize Size of each buffer in bytes
+// @param(in) maxbufs Limit on buffers in use or free, or 0 for no limit
+// @return true on success, or false if bufsize is invalid
+//
 
-int neterrno()
+int netbufpool(int bufsize, int maxbufs)
 {
-  return _net_errno ;
+  if (bufsize<=0 || maxbufs<0) return 0 ;
+
+  pthread_mutex_lock(&_net_poollock) ;
+
+  // Free buffers of the old size, borrowed ones are freed on release
+
+  if (bufsize!=_net_pool.bufsize) {
+    while (_net_pool.free) {
+      struct _net_poolbuf *b = _net_pool.free ;
+      _net_pool.free = b->next ;
+      free(b) ;
+      _net_pool.stats.free-- ;
+      _net_pool.stats.allocated-- ;
+    }
+  }
+
+  _net_pool.bufsize = bufsize ;
+  _net_pool.maxbufs = maxbufs ;
+  pthread_mutex_unlock(&_net_poollock) ;
+  return 1 ;
+}
+
+
+//
+// @brief Take a buffer from the pool
+// @return Buffer header, or NULL if the pool is exhausted or out of memory
+//
+
+struct _net_poolbuf *_net_poolget()
+{
+  struct _net_poolbuf *b ;
+
+  pthread_mutex_lock(&_net_poollock) ;
+
+  if ((b = _net_pool.free)) {
+    _net_pool.free = b->next ;
+    _net_pool.stats.free-- ;
+  } else if (!_net_pool.maxbufs || _net_pool.stats.allocated < _net_pool.maxbufs) {
+    b = malloc(sizeof(struct _net_poolbuf) + _net_pool.bufsize) ;
+    if (b) {
+      b->size = _net_pool.bufsize ;
+      _net_pool.stats.allocated++ ;
+    }
+  }
+
+  if (b) {
+    _net_pool.stats.borrowed++ ;
+    if (_net_pool.stats.borrowed > _net_pool.stats.maxborrowed) {
+      _net_pool.stats.maxborrowed = _net_pool.stats.borrowed ;
+    }
+  } else {
+    _net_pool.stats.exhausted++ ;
+  }
+
+  pthread_mutex_unlock(&_net_poollock) ;
+  return b ;
+}
+
+
+//
+// @brief Return a buffer to the pool
+// @param(in) b Buffer header
+//
+
+void _net_poolput(struct _net_poolbuf *b)
+{
+  pthread_mutex_lock(&_net_poollock) ;
+  _net_pool.stats.borrowed-- ;
+  if (b->size==_net_pool.bufsize) {
+    b->next = _net_pool.free ;
+    _net_pool.free = b ;
+    _net_pool.stats.free++ ;
+  } else {
+    free(b) ;
+    _net_pool.stats.allocated-- ;
+  }
+  pthread_mutex_unlock(&_net_poollock) ;
+}
+
+
+//
+// @brief Receive data into a buffer borrowed from the pool
+// @param(in) sh Handle of open connection
+// @param(out) len Number of bytes received, or the netrecv() result (0 or
+//             -1) if no buffer is returned
+// @return Buffer holding the data, to be passed to netrecv_release(), or
+//         NULL if no data was received
+//
+
+char *netrecv_borrow(INET *sh, int *len)
+{
+  if (!sh || !len) return NULL ;
+  *len = -1 ;
+
+  // Blocking connections wait without holding a buffer
+
+  if ( sh->isblocking && sh->fd>=0 && !sh->hs &&
+       !(sh->z && _net_zhaspending(sh)) && !(sh->ra && _net_rapending(sh)) &&
+       !(sh->ssl && (sh->sslhaspending || SSL_pending(sh->ssl))) ) {
+    char ch ;
+    for (;;) {
+      int p ;
+      while ((p = recv(sh->fd, &ch, 1, MSG_PEEK))<0 && errno==EINTR) ;
+      if (p<=0 || !sh->ssl) break ;
+
+      // SSL_peek() processes records without application data, asking to
+      // read again once they are consumed, and leaves data to netrecv()
+
+      p = SSL_peek(sh->ssl, &ch, 1) ;
+      if (p>0 || SSL_has_pending(sh->ssl) || SSL_get_error(sh->ssl, p)!=SSL_ERROR_WANT_READ) break ;
+    }
+  }
+
+  struct _net_poolbuf *b = _net_poolget() ;
+  if (!b) {
+    _net_seterrno(sh, "netrecv_borrow", NET_ERR_ERRNO, ENOBUFS) ;
+    return NULL ;
+  }
+
+  char *buf = (char *)(b+1) ;
+  int r = netrecv(sh, buf, b->size) ;
+
+  if (r<=0) {
+    *len = r ;
+    _net_poolput(b) ;
+    pthread_mutex_lock(&_net_poollock) ;
+    _net_pool.stats.empty++ ;
+    pthread_mutex_unlock(&_net_poollock) ;
+    return NULL ;
+  }
+
+  *len = r ;
+  return buf ;
+}
+
+
+//
+// @brief Return a buffer obtained from netrecv_borrow()
+// @param(in) buf Buffer returned by netrecv_borrow(), or NULL
+//
+
+void netrecv_release(char *buf)
+{
+  if (!buf) return ;
+  _net_poolput((struct _net_poolbuf *)buf - 1) ;
+}
+
+
+//
+// @brief Obtain receive buffer pool statistics
+// @param(out) st Statistics structure to populate
+// @return true on success
+//
+
+int netbufpoolstats(struct netbufpoolstats *st)
+{
+  if (!st) return 0 ;
+  pthread_mutex_lock(&_net_poollock) ;
+  *st = _net_pool.stats ;
+  st->bufsize = _net_pool.bufsize ;
+  pthread_mutex_unlock(&_net_poollock) ;
+  return 1 ;
+}
+
+
+
+//
+// Streaming compression
+//
+// Compressed data is framed by the codec itself (zstd frames or LZ4F
+// frames), so both peers must call netcompress() with the same algorithm
+// before exchanging data.  netsend() compresses into sh->z->tx, which is
+// then drained to the transport.  Non-blocking connections may leave data
+// queued in sh->z->tx, which is sent by the next netsend() or netflush().
+// Decoded but unread data is held in sh->z->out, and is reported as pending
+// by nethaspending(), netrdfdset() and netrdfdisset().
+//
+
+//
+// @brief Enable streaming compression on a connection
+// @param(in) sh Handle of open connection
+// @param(in) alg Compression algorithm (NETCOMPRESS_ZSTD|NETCOMPRESS_LZ4)
+// @param(in) level Compression level, 0 for the codec default
+// @param(in) autoflush If true, every netsend() ends with a flush point
+// @return true on success, or false on error (setting errno)
+//
+
+int netcompress(INET *sh, enum netcompression alg, int level, int autoflush)
+{
+  if (!sh) return 0 ;
+
+  if (sh->z) {
+    _net_seterrno(sh, "netcompress", NET_ERR_INT, NET_ERR_INUSE) ;
+    return 0 ;
+  }
+
+  if (alg==NETCOMPRESS_NONE) return 1 ;
+
+  struct _net_zstream *z = malloc(sizeof(struct _net_zstream)) ;
+  if (!z) {
+    _net_seterrno(sh, "netcompress", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
+  memset(z, '\0', sizeof(struct _net_zstream)) ;
+  z->alg = alg ;
+  z->autoflush = autoflush ;
+
+  z->in = malloc(NET_ZBUFSIZE) ;
+  z->out = malloc(NET_ZBUFSIZE) ;
+  if (!z->in || !z->out) {
+    _net_seterrno(sh, "netcompress", NET_ERR_ERRNO, 0) ;
+    goto fail ;
+  }
+
+  switch (alg) {
+
+#ifdef NET_WITH_ZSTD
+  case NETCOMPRESS_ZSTD:
+    z->cctx = ZSTD_createCCtx() ;
+    z->dctx = ZSTD_createDCtx() ;
+    if (!z->cctx || !z->dctx) {
+      _net_seterrno(sh, "netcompress", NET_ERR_INT, NET_ERR_COMPRESS) ;
+      goto fail ;
+    }
+    if (level) ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_compressionLevel, level) ;
+    break ;
+#endif
+
+#ifdef NET_WITH_LZ4
+  case NETCOMPRESS_LZ4:
+    if ( LZ4F_isError(LZ4F_createCompressionContext((LZ4F_cctx **)&z->cctx, LZ4F_VERSION)) ||
+         LZ4F_isError(LZ4F_createDecompressionContext((LZ4F_dctx **)&z->dctx, LZ4F_VERSION)) ) {
+      _net_seterrno(sh, "netcompress", NET_ERR_INT, NET_ERR_COMPRESS) ;
+      goto fail ;
+    }
+    z->level = level ;
+    break ;
+#endif
+
+  default:
+    _net_seterrno(sh, "netcompress", NET_ERR_INT, NET_ERR_NOTSUP) ;
+    goto fail ;
+  }
+
+  // Queued compressed data may move when sh->z->tx grows
+
+  if (sh->ssl) {
+    SSL_set_mode(sh->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER) ;
+  }
+
+  // Decoded data is signalled through /dev/null, as for SSL, but
+  // blocking callers may also be using select so always open it
+
+  _net_opendevnull() ;
+
+  sh->z = z ;
+  return 1 ;
+
+fail:
+  sh->z = z ;
+  _net_zfree(sh) ;
+  return 0 ;
+}
+
+
+//
+// @brief Release compression state
+// @param(in) sh Handle of connection
+//
+
+void _net_zfree(INET *sh)
+{
+  struct _net_zstream *z = sh->z ;
+  if (!z) return ;
+
+  switch (z->alg) {
+#ifdef NET_WITH_ZSTD
+  case NETCOMPRESS_ZSTD:
+    if (z->cctx) ZSTD_freeCCtx(z->cctx) ;
+    if (z->dctx) ZSTD_freeDCtx(z->dctx) ;
+    break ;
+#endif
+#ifdef NET_WITH_LZ4
+  case NETCOMPRESS_LZ4:
+    if (z->cctx) LZ4F_freeCompressionContext(z->cctx) ;
+    if (z->dctx) LZ4F_freeDecompressionContext(z->dctx) ;
+    break ;
+#endif
+  default:
+    break ;
+  }
+
+  if (z->tx) free(z->tx) ;
+  if (z->in) free(z->in) ;
+  if (z->out) free(z->out) ;
+  free(z) ;
+  sh->z = NULL ;
+}
+
+
+//
+// @brief Estimate memory held by compression state
+// @param(in) sh Handle of connection
+// @return Estimated size in bytes
+//
+
+long _net_zmemory(INET *sh)
+{
+  struct _net_zstream *z = sh->z ;
+  if (!z) return 0 ;
+
+  long bytes = sizeof(struct _net_zstream) + 2 * NET_ZBUFSIZE + z->txsize ;
+
+  switch (z->alg) {
+#ifdef NET_WITH_ZSTD
+  case NETCOMPRESS_ZSTD:
+    bytes += ZSTD_sizeof_CCtx(z->cctx) + ZSTD_sizeof_DCtx(z->dctx) ;
+    break ;
+#endif
+#ifdef NET_WITH_LZ4
+  case NETCOMPRESS_LZ4:
+    bytes += NET_MEM_LZ4 ;
+    break ;
+#endif
+  default:
+    break ;
+  }
+
+  return bytes ;
+}
+
+
+//
+// @brief Thread CPU time in seconds, used for compression accounting
+//
+
+double _net_cputime()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) ;
+  return ts.tv_sec + ts.tv_nsec/1e9 ;
+}
+
+
+//
+// @brief Ensure the compressed transmit queue has space
+// @param(in) sh Handle of connection
+// @param(in) need Number of bytes of free space required
+// @return true on success, or false on error (setting errno)
+//
+
+int _net_ztxreserve(INET *sh, size_t need)
+{
+  struct _net_zstream *z = sh->z ;
+
+  if (z->txlen + need <= z->txsize) return 1 ;
+
+  size_t newsize = z->txsize ? z->txsize : NET_ZBUFSIZE ;
+  while (newsize < z->txlen + need) newsize *= 2 ;
+
+  char *tx = realloc(z->tx, newsize) ;
+  if (!tx) {
+    _net_seterrno(sh, "netsend", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
+  z->tx = tx ;
+  z->txsize = newsize ;
+  return 1 ;
+}
+
+
+//
+// @brief Compress data onto the transmit queue
+// @param(in) sh Handle of connection
+// @param(in) buf Data to compress
+// @param(in) len Length of data
+// @param(in) flush If true, end with a flush point so the peer can decode
+// @return true on success, or false on error (setting errno)
+//
+
+int _net_zencode(INET *sh, char *buf, int len, int flush)
+{
+  struct _net_zstream *z = sh->z ;
+
+  if (z->txpos==z->txlen) {
+    z->txpos = z->txlen = 0 ;
+  }
+
+  size_t before = z->txlen ;
+  double cpu = _net_cputime() ;
+
+  switch (z->alg) {
+
+#ifdef NET_WITH_ZSTD
+  case NETCOMPRESS_ZSTD: {
+    ZSTD_inBuffer in = { buf, len, 0 } ;
+    ZSTD_EndDirective mode = flush ? ZSTD_e_flush : ZSTD_e_continue ;
+    size_t r ;
+    do {
+      if (!_net_ztxreserve(sh, ZSTD_CStreamOutSize())) return 0 ;
+      ZSTD_outBuffer out = { z->tx+z->txlen, z->txsize-z->txlen, 0 } ;
+      r = ZSTD_compressStream2(z->cctx, &out, &in, mode) ;
+      if (ZSTD_isError(r)) {
+        _net_seterrno(sh, "netsend", NET_ERR_INT, NET_ERR_COMPRESS) ;
+        return 0 ;
+      }
+      z->txlen += out.pos ;
+    } while ( in.pos < in.size || (flush && r!=0) ) ;
+    break ; }
+#endif
+
+#ifdef NET_WITH_LZ4
+  case NETCOMPRESS_LZ4: {
+    LZ4F_preferences_t prefs ;
+    memset(&prefs, 0, sizeof(prefs)) ;
+    prefs.compressionLevel = z->level ;
+    size_t r ;
+
+    if (!z->started) {
+      if (!_net_ztxreserve(sh, LZ4F_HEADER_SIZE_MAX)) return 0 ;
+      r = LZ4F_compressBegin(z->cctx, z->tx+z->txlen, z->txsize-z->txlen, &prefs) ;
+      if (LZ4F_isError(r)) goto lz4fail ;
+      z->txlen += r ;
+      z->started = 1 ;
+    }
+
+    for (int pos=0; pos<len; pos+=NET_ZBUFSIZE) {
+      int chunk = (len-pos > NET_ZBUFSIZE) ? NET_ZBUFSIZE : len-pos ;
+      if (!_net_ztxreserve(sh, LZ4F_compressBound(chunk, &prefs))) return 0 ;
+      r = LZ4F_compressUpdate(z->cctx, z->tx+z->txlen, z->txsize-z->txlen, buf+pos, chunk, NULL) ;
+      if (LZ4F_isError(r)) goto lz4fail ;
+      z->txlen += r ;
+    }
+
+    if (flush) {
+      if (!_net_ztxreserve(sh, LZ4F_compressBound(0, &prefs))) return 0 ;
+      r = LZ4F_flush(z->cctx, z->tx+z->txlen, z->txsize-z->txlen, NULL) ;
+      if (LZ4F_isError(r)) goto lz4fail ;
+      z->txlen += r ;
+    }
+    break ;
+
+  lz4fail:
+    _net_seterrno(sh, "netsend", NET_ERR_INT, NET_ERR_COMPRESS) ;
+    return 0 ; }
+#endif
+
+  default:
+    _net_seterrno(sh, "netsend", NET_ERR_INT, NET_ERR_NOTSUP) ;
+    return 0 ;
+  }
+
+  z->stats.cpuseconds += _net_cputime() - cpu ;
+  z->stats.rawout += len ;
+  z->stats.wireout += z->txlen - before ;
+  return 1 ;
+}
+
+
+//
+// @brief Decode received compressed data into sh->z->out
+// @param(in) sh Handle of connection
+// @return true if any input was consumed or output produced, -1 on error
+//
+
+int _net_zdecode(INET *sh)
+{
+  struct _net_zstream *z = sh->z ;
+  size_t inpos = z->inpos ;
+  double cpu = _net_cputime() ;
+
+  z->outpos = z->outlen = 0 ;
+
+  switch (z->alg) {
+
+#ifdef NET_WITH_ZSTD
+  case NETCOMPRESS_ZSTD: {
+    ZSTD_inBuffer in = { z->in, z->inlen, z->inpos } ;
+    ZSTD_outBuffer out = { z->out, NET_ZBUFSIZE, 0 } ;
+    size_t r = ZSTD_decompressStream(z->dctx, &out, &in) ;
+    if (ZSTD_isError(r)) goto fail ;
+    z->inpos = in.pos ;
+    z->outlen = out.pos ;
+    break ; }
+#endif
+
+#ifdef NET_WITH_LZ4
+  case NETCOMPRESS_LZ4: {
+    size_t outlen = NET_ZBUFSIZE ;
+    size_t inlen = z->inlen - z->inpos ;
+    size_t r = LZ4F_decompress(z->dctx, z->out, &outlen, z->in+z->inpos, &inlen, NULL) ;
+    if (LZ4F_isError(r)) goto fail ;
+    z->inpos += inlen ;
+    z->outlen = outlen ;
+    break ; }
+#endif
+
+  default:
+    goto fail ;
+  }
+
+  if (z->inpos == z->inlen) z->inpos = z->inlen = 0 ;
+
+  // A full output buffer may leave decoded data inside the decoder,
+  // which must be fetched before waiting for more input
+
+  z->more = ( z->outlen == NET_ZBUFSIZE ) ;
+
+  z->stats.cpuseconds += _net_cputime() - cpu ;
+  z->stats.rawin += z->outlen ;
+  return ( z->outlen > 0 || z->inpos != inpos ) ;
+
+fail:
+  _net_seterrno(sh, "netrecv", NET_ERR_INT, NET_ERR_COMPRESS) ;
+  return -1 ;
+}
+
+
+//
+// @brief Returns true if decoded data, or undecoded input, is buffered
+//
+
+int _net_zhaspending(INET *sh)
+{
+  return ( sh->z->outpos < sh->z->outlen || sh->z->inpos < sh->z->inlen || sh->z->more ) ;
+}
+
+
+//
+// @brief Return true if the last transport error was a would-block
+//
+
+int _net_wouldblock()
+{
+  return ( _net_errno == EAGAIN || _net_errno == EWOULDBLOCK ||
+           _net_errno == NET_ERR_SSL + SSL_ERROR_WANT_READ ||
+           _net_errno == NET_ERR_SSL + SSL_ERROR_WANT_WRITE ||
+           _net_errno == NET_ERR_INT + NET_ERR_THROTTLED ) ;
+}
+
+
+//
+// @brief Send queued compressed data
+// @param(in) sh Handle of connection
+// @return Number of bytes still queued, or -1 on error
+//
+
+int _net_zdrain(INET *sh)
+{
+  struct _net_zstream *z = sh->z ;
+
+  while (z->txpos < z->txlen) {
+
+    int r = _net_xmit(sh, z->tx+z->txpos, z->txlen-z->txpos) ;
+
+    if (r<=0) {
+      if (!sh->isblocking && _net_wouldblock()) break ;
+      return -1 ;
+    }
+
+    z->txpos += r ;
+
+  }
+
+  return z->txlen - z->txpos ;
+}
+
+
+//
+// @brief Compress and send data
+// @param(in) sh Handle of open connection
+// @param(in) buf Data to be sent
+// @param(in) len Amount of data to send
+// @return Number of bytes accepted, or -1 on error
+//
+
+int _net_zsend(INET *sh, char *buf, int len)
+{
+  struct _net_zstream *z = sh->z ;
+
+  // Apply back-pressure if the peer is not keeping up
+
+  if ( z->txlen-z->txpos > NET_ZTXLIMIT && 
+       _net_zdrain(sh) > NET_ZTXLIMIT ) {
+    errno = EAGAIN ;
+    _net_seterrno(sh, "netsend", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+
+  if (!_net_zencode(sh, buf, len, z->autoflush)) return -1 ;
+  if (_net_zdrain(sh)<0) return -1 ;
+
+  return len ;
+}
+
+
+//
+// @brief Receive and decompress data
+// @param(in) sh Handle of open connection
+// @param(in) buf Buffer to store response
+// @param(in) maxlen Maximum number of bytes to read
+// @return Number of bytes received, or -1 on error
+//
+
+int _net_zrecv(INET *sh, char *buf, int maxlen)
+{
+  struct _net_zstream *z = sh->z ;
+
+  for (;;) {
+
+    if (z->outpos < z->outlen) {
+      int n = z->outlen - z->outpos ;
+      if (n > maxlen) n = maxlen ;
+      memcpy(buf, z->out+z->outpos, n) ;
+      z->outpos += n ;
+      return n ;
+    }
+
+    int r = 0 ;
+    if (z->inpos < z->inlen || z->more) {
+      r = _net_zdecode(sh) ;
+      if (r<0) return -1 ;
+    }
+
+    if (r==0) {
+
+      // Decoder needs more input
+
+      if (z->inpos>0) {
+        memmove(z->in, z->in+z->inpos, z->inlen-z->inpos) ;
+        z->inlen -= z->inpos ;
+        z->inpos = 0 ;
+      }
+
+      r = _net_rcv(sh, z->in+z->inlen, NET_ZBUFSIZE-z->inlen) ;
+      if (r<=0) return r ;
+      z->inlen += r ;
+      z->stats.wirein += r ;
+
+    }
+
+  }
+}
+
+
+//
+// @brief Flush compressed data to the network
+// @param(in) sh Handle of open connection
+// @return Number of bytes still queued (non-blocking only), or -1 on error
+//
+
+int netflush(INET *sh)
+{
+  if (!sh) return -1 ;
+
+  // Compressed data drains into the cork buffer, if there is one
+
+  int r = 0 ;
+  if (sh->z) {
+    if (!_net_zencode(sh, NULL, 0, 1)) return -1 ;
+    r = _net_zdrain(sh) ;
+    if (r<0) return -1 ;
+  }
+
+  if (sh->cork) {
+    sh->cork->stats.explicitflushes++ ;
+    int c = _net_corkflush(sh, 0) ;
+    if (c<0) return -1 ;
+    r += c ;
+  }
+
+  return r ;
+}
+
+
+//
+// @brief Obtain compression statistics
+// @param(in) sh Handle of open connection
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if compression not enabled
+//
+
+int netcompressstats(INET *sh, struct netcompressstats *st)
+{
+  if (!sh || !st) return 0 ;
+  memset(st, '\0', sizeof(struct netcompressstats)) ;
+  if (!sh->z) return 0 ;
+
+  *st = sh->z->stats ;
+  st->ratioout = st->wireout ? (double)st->rawout / st->wireout : 0 ;
+  st->ratioin = st->wirein ? (double)st->rawin / st->wirein : 0 ;
+  return 1 ;
+}
+
+
+//
+// Write coalescing
+//
+// Protocols which build a message from several netsend() calls pay for
+// a send() each, and on TLS for a record each (29 bytes of overhead and
+// a MAC).  A corked connection instead gathers writes smaller than the
+// threshold into a buffer of that size, which is sent as one send() or
+// one TLS record when it fills, on netflush(), or at the end of the event
+// loop iteration (the next netrdfdset()).  Larger writes flush the buffer
+// and are sent directly.  Plain TCP sends made before the final flush
+// carry MSG_MORE, so the kernel holds back a partial segment, and the
+// final flush pushes it out by clearing TCP_CORK.
+//
+
+//
+// @brief Enable or disable write coalescing
+// @param(in) sh Handle of open connection
+// @param(in) threshold Buffer size in bytes, or 0 to flush and disable
+// @return true on success, or false on error (setting errno).  A
+//         NONBLOCK connection which cannot flush yet stays corked and
+//         fails with EAGAIN.
+//
+
+int netsetcork(INET *sh, int threshold)
+{
+  if (!sh || threshold<0) return 0 ;
+
+  if (threshold==0) {
+    if (!sh->cork) return 1 ;
+    int r = _net_corkflush(sh, 0) ;
+    if (r!=0) {
+      if (r>0) _net_seterrno(sh, "netsetcork", NET_ERR_ERRNO, EAGAIN) ;
+      return 0 ;
+    }
+    free(sh->cork->buf) ;
+    free(sh->cork) ;
+    sh->cork = NULL ;
+    return 1 ;
+  }
+
+  // A new size needs an empty buffer
+
+  if (sh->cork && sh->cork->pos < sh->cork->len) {
+    int r = _net_corkflush(sh, 0) ;
+    if (r!=0) {
+      if (r>0) _net_seterrno(sh, "netsetcork", NET_ERR_ERRNO, EAGAIN) ;
+      return 0 ;
+    }
+  }
+
+  struct _net_cork *cork = sh->cork ;
+  if (!cork) {
+    cork = malloc(sizeof(struct _net_cork)) ;
+    if (!cork) {
+      _net_seterrno(sh, "netsetcork", NET_ERR_ERRNO, 0) ;
+      return 0 ;
+    }
+    memset(cork, '\0', sizeof(struct _net_cork)) ;
+  }
+
+  char *buf = realloc(cork->buf, threshold) ;
+  if (!buf) {
+    _net_seterrno(sh, "netsetcork", NET_ERR_ERRNO, 0) ;
+    if (!sh->cork) free(cork) ;
+    return 0 ;
+  }
+  cork->buf = buf ;
+  cork->threshold = threshold ;
+  cork->pos = cork->len = 0 ;
+
+  // A partially written record may be retried from a different place
+
+  if (sh->ssl) {
+    SSL_set_mode(sh->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER) ;
+  }
+
+  sh->cork = cork ;
+  return 1 ;
+}
+
+
+//
+// @brief Send gathered writes
+// @param(in) sh Handle of open connection
+// @param(in) more If true, more data is expected before the next flush
+// @return Number of bytes still gathered (non-blocking only), or -1 on error
+//
+
+int _net_corkflush(INET *sh, int more)
+{
+  struct _net_cork *cork = sh->cork ;
+
+  cork->more = more ;
+
+  // The buffer is reused as soon as it is sent, so the kernel must not
+  // keep referring to its pages as a zero copy send would
+
+  while (cork->pos < cork->len) {
+
+    cork->flushing = 1 ;
+    int r = _net_xmitwire(sh, cork->buf+cork->pos, cork->len-cork->pos) ;
+    cork->flushing = 0 ;
+
+    if (r<=0) {
+      cork->more = 0 ;
+      if (!sh->isblocking && _net_wouldblock()) return cork->len - cork->pos ;
+      return -1 ;
+    }
+
+    cork->pos += r ;
+    cork->stats.flushes++ ;
+
+  }
+
+  cork->pos = cork->len = 0 ;
+  cork->more = 0 ;
+
+  // Push out a segment held back by an earlier MSG_MORE
+
+  if (!more && cork->unpushed) {
+    int off = 0 ;
+    setsockopt(sh->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off)) ;
+    cork->unpushed = 0 ;
+  }
+
+  return 0 ;
+}
+
+
+//
+// @brief Gather or send a write on a corked connection
+// @param(in) sh Handle of open connection
+// @param(in) buf Data to be sent
+// @param(in) len Amount of data to send
+// @return Number of bytes accepted, or -1 on error
+//
+
+int _net_corkxmit(INET *sh, char *buf, int len)
+{
+  struct _net_cork *cork = sh->cork ;
+
+  // Make room, or clear the way for a large write
+
+  if (len >= cork->threshold || cork->len + len > cork->threshold) {
+
+    if (len < cork->threshold) cork->stats.thresholdflushes++ ;
+    int r = _net_corkflush(sh, 1) ;
+    if (r<0) return -1 ;
+    if (r>0) {
+      errno = EAGAIN ;
+      _net_seterrno(sh, "netsend", NET_ERR_ERRNO, 0) ;
+      return -1 ;
+    }
+
+  }
+
+  if (len >= cork->threshold) {
+    cork->more = 1 ;
+    int r = _net_xmitwire(sh, buf, len) ;
+    cork->more = 0 ;
+    if (r>0) cork->stats.direct++ ;
+    return r ;
+  }
+
+  memcpy(cork->buf+cork->len, buf, len) ;
+  cork->len += len ;
+  cork->stats.writes++ ;
+  cork->stats.bytes += len ;
+  return len ;
+}
+
+
+//
+// @brief Obtain write coalescing statistics
+// @param(in) sh Handle of open connection
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if not corked
+//
+
+int netcorkstats(INET *sh, struct netcorkstats *st)
+{
+  if (!sh || !st) return 0 ;
+  memset(st, '\0', sizeof(struct netcorkstats)) ;
+  if (!sh->cork) return 0 ;
+
+  *st = sh->cork->stats ;
+  if (st->flushes) st->writesperflush = (double)st->writes / st->flushes ;
+  return 1 ;
+}
+
+
+//
+// Receive read-ahead
+//
+// A plain recv() or a TLS record read costs a syscall however little it
+// returns, and SSL_read() without read-ahead reads each record's header
+// and body separately.  With read-ahead a plain connection reads as much
+// as the socket holds, up to the buffer size, into an ingress buffer
+// which then serves netrecv() calls, and a TLS connection reads into an
+// OpenSSL read buffer of that size.  The handle tracks whether data is
+// buffered, so nethaspending(), netrdfdisset() and netrdfdset() answer
+// without a MSG_PEEK recv() or FIONREAD, and data held back from the
+// socket is reported through DEVNULL as for decompressed data.
+//
+
+//
+// @brief Enable or disable read-ahead
+// @param(in) sh Handle of open connection
+// @param(in) bufbytes Ingress buffer size in bytes, or 0 to disable
+// @return true on success, or false on error (setting errno).  Buffered
+//         data must be read before the size is changed or read-ahead is
+//         disabled, failing with EAGAIN.
+//
+
+int netreadahead(INET *sh, int bufbytes)
+{
+  if (!sh || bufbytes<0 || sh->fd<0) return 0 ;
+
+  // The SSL object belongs to a worker until the handshake is done
+
+  if ( sh->hs || (sh->ra && sh->ra->pos < sh->ra->len) ) {
+    _net_seterrno(sh, "netreadahead", NET_ERR_ERRNO, EAGAIN) ;
+    return 0 ;
+  }
+
+  if (bufbytes==0) {
+    if (!sh->ra) return 1 ;
+    if (sh->ssl) {
+      SSL_set_read_ahead(sh->ssl, 0) ;
+      sh->sslhaspending = SSL_pending(sh->ssl) > 0 ;
+    }
+    free(sh->ra->buf) ;
+    free(sh->ra) ;
+    sh->ra = NULL ;
+    return 1 ;
+  }
+
+  struct _net_readahead *ra = sh->ra ;
+  if (!ra) {
+    ra = malloc(sizeof(struct _net_readahead)) ;
+    if (!ra) {
+      _net_seterrno(sh, "netreadahead", NET_ERR_ERRNO, 0) ;
+      return 0 ;
+    }
+    memset(ra, '\0', sizeof(struct _net_readahead)) ;
+  }
+
+  if (!sh->ssl) {
+    char *buf = realloc(ra->buf, bufbytes) ;
+    if (!buf) {
+      _net_seterrno(sh, "netreadahead", NET_ERR_ERRNO, 0) ;
+      if (!sh->ra) free(ra) ;
+      return 0 ;
+    }
+    ra->buf = buf ;
+  } else {
+
+    // The read buffer is sized when allocated, so an empty one is
+    // released to be allocated again at the new size
+
+    SSL_set_read_ahead(sh->ssl, 1) ;
+    SSL_set_default_read_buffer_len(sh->ssl, bufbytes) ;
+    if (!SSL_has_pending(sh->ssl)) SSL_free_buffers(sh->ssl) ;
+
+  }
+
+  ra->size = bufbytes ;
+  ra->pos = ra->len = 0 ;
+  sh->ra = ra ;
+
+  _net_opendevnull() ;
+  return 1 ;
+}
+
+
+//
+// @brief Determine whether read-ahead data is buffered
+// @param(in) sh Handle of connection with read-ahead
+// @return true if netrecv() can return data without reading the socket
+//
+
+int _net_rapending(INET *sh)
+{
+  if (sh->ssl) return sh->sslhaspending ;
+  return (sh->ra->pos < sh->ra->len) ;
+}
+
+
+//
+// @brief Receive on a plain connection through the ingress buffer
+// @param(in) sh Handle of connection with read-ahead
+// @param(in) buf Buffer to store data
+// @param(in) maxlen Maximum number of bytes to return
+// @return Number of bytes received, or -1 on error
+//
+
+int _net_rarecv(INET *sh, char *buf, int maxlen)
+{
+  struct _net_readahead *ra = sh->ra ;
+
+  if (ra->pos == ra->len) {
+
+    // A read as large as the buffer gains nothing from it
+
+    if (maxlen >= ra->size) {
+      int r = recv(sh->fd, buf, maxlen, 0) ;
+      _net_commsdump(sh, (r<=0)?"<!":"< ", buf, r) ;
+      _net_seterrno(sh, "netrecv", NET_ERR_ERRNO, 0) ;
+      if (r==0) r=-1 ;
+      if (r>0) {
+        ra->stats.fills++ ;
+        ra->stats.bytes += r ;
+      }
+      return r ;
+    }
+
+    int r = recv(sh->fd, ra->buf, ra->size, 0) ;
+    _net_seterrno(sh, "netrecv", NET_ERR_ERRNO, 0) ;
+    if (r<=0) {
+      _net_commsdump(sh, "<!", ra->buf, r) ;
+      return (r==0) ? -1 : r ;
+    }
+    ra->stats.fills++ ;
+    ra->pos = 0 ;
+    ra->len = r ;
+
+  }
+
+  int n = ra->len - ra->pos ;
+  if (n > maxlen) n = maxlen ;
+  memcpy(buf, ra->buf + ra->pos, n) ;
+  ra->pos += n ;
+  if (ra->pos == ra->len) ra->pos = ra->len = 0 ;
+  ra->stats.bytes += n ;
+
+  _net_commsdump(sh, "< ", buf, n) ;
+  return n ;
+}
+
+
+//
+// @brief Obtain read-ahead statistics
+// @param(in) sh Handle of open connection
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if read-ahead is not enabled
+//
+
+int netreadaheadstats(INET *sh, struct netreadaheadstats *st)
+{
+  if (!sh || !st) return 0 ;
+  memset(st, '\0', sizeof(struct netreadaheadstats)) ;
+  if (!sh->ra) return 0 ;
+
+  *st = sh->ra->stats ;
+  st->pending = sh->ssl ? 0 : sh->ra->len - sh->ra->pos ;
+  return 1 ;
+}
+
+
+//
+// Egress pacing
+//
+// Each paced connection has a token bucket, and may also draw on a shared
+// group bucket.  A send may go ahead once every applicable bucket holds
+// enough tokens for the send (or for a full burst, if smaller).  Blocking
+// connections sleep until then, non-blocking connections fail with
+// NET_ERR_THROTTLED and report the time at which they become writable
+// through netthrottleduntil().
+//
+
+//
+// @brief Monotonic clock in seconds
+//
+
+double _net_monotime()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return ts.tv_sec + ts.tv_nsec/1e9 ;
+}
+
+
+//
+// @brief Configure a token bucket
+//
+
+void _net_bucketset(struct _net_bucket *b, long rate, long burst)
+{
+  b->rate = rate>0 ? rate : 0 ;
+  b->burst = burst>0 ? burst : b->rate ;
+  if (b->burst < NET_MINBURST) b->burst = NET_MINBURST ;
+  b->tokens = b->burst ;
+  b->last = _net_monotime() ;
+}
+
+
+//
+// @brief Add tokens accumulated since the last refill
+//
+
+void _net_bucketrefill(struct _net_bucket *b, double now)
+{
+  if (b->rate<=0) return ;
+  b->tokens += (now - b->last) * b->rate ;
+  if (b->tokens > b->burst) b->tokens = b->burst ;
+  b->last = now ;
+}
+
+
+//
+// @brief Account for bytes sent through a bucket
+//
+
+void _net_bucketuse(struct _net_bucket *b, int n, double now)
+{
+  if (b->rate>0) b->tokens -= n ;
+
+  if (b->winstart==0) b->winstart = now ;
+  b->winbytes += n ;
+  b->stats.bytes += n ;
+
+  if (now - b->winstart >= NET_RATEWINDOW) {
+    b->stats.rate = b->winbytes / (now - b->winstart) ;
+    b->winstart = now ;
+    b->winbytes = 0 ;
+  }
+}
+
+
+//
+// @brief Determine how much may be sent now
+// @param(in) sh Paced connection
+// @param(in) len Number of bytes the caller wants to send
+// @param(in) now Current monotonic time
+// @param(out) wait Seconds until a send is possible, if none allowed now
+// @return Number of bytes which may be sent, 0 if throttled
+//
+
+int _net_paceallow(INET *sh, int len, double now, double *wait)
+{
+  struct _net_bucket *b[2] ;
+  int nb=0 ;
+  double need = len ;
+
+  if (sh->pace->conn.rate>0) b[nb++] = &sh->pace->conn ;
+  if (sh->pace->group>0) b[nb++] = &_net_rategroups[sh->pace->group-1] ;
+
+  for (int i=0; i<nb; i++) {
+    if (b[i]->rate<=0) continue ;
+    _net_bucketrefill(b[i], now) ;
+    if (b[i]->burst < need) need = b[i]->burst ;
+  }
+
+  double allowed = len ;
+  *wait = 0 ;
+
+  for (int i=0; i<nb; i++) {
+    if (b[i]->rate<=0) continue ;
+    if (b[i]->tokens < need) {
+      double w = (need - b[i]->tokens) / b[i]->rate ;
+      if (w > *wait) *wait = w ;
+    }
+    if (b[i]->tokens < allowed) allowed = b[i]->tokens ;
+  }
+
+  if (*wait > 0) return 0 ;
+  return (int)allowed ;
+}
+
+
+//
+// @brief Send data, applying the connection and group rate limits
+// @param(in) sh Handle of open connection
+// @param(in) buf Data to be sent
+// @param(in) len Amount of data to send
+// @return Number of bytes sent, or -1 on error
+//
+
+int _net_pacedxmit(INET *sh, char *buf, int len)
+{
+  struct _net_pacing *p = sh->pace ;
+  int sent=0 ;
+
+  while (sent<len) {
+
+    double now = _net_monotime() ;
+    double wait ;
+    if (p->group>0) pthread_mutex_lock(&_net_lock) ;
+    int n = _net_paceallow(sh, len-sent, now, &wait) ;
+    if (p->group>0) pthread_mutex_unlock(&_net_lock) ;
+
+    // An SSL_write which could not complete must be retried with the
+    // same length, and its data is already committed, so let it through
+
+    if (sh->ssl && p->sslretry) n = p->sslretry ;
+
+    if (n<=0) {
+
+      if (!sh->isblocking) {
+        if (sent) break ;
+        p->throttleduntil = now + wait ;
+        if (p->throttlestart==0) p->throttlestart = now ;
+        _net_seterrno(sh, "netsend", NET_ERR_INT, NET_ERR_THROTTLED) ;
+        return -1 ;
+      }
+
+      struct timespec ts ;
+      ts.tv_sec = (time_t)wait ;
+      ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9) ;
+      nanosleep(&ts, NULL) ;
+      _net_pacethrottled(sh, _net_monotime() - now) ;
+      continue ;
+
+    }
+
+    int r = _net_xmitraw(sh, buf+sent, n) ;
+
+    if (r<=0) {
+      if (sh->ssl && _net_wouldblock()) p->sslretry = n ;
+      return sent ? sent : r ;
+    }
+
+    p->sslretry = 0 ;
+    now = _net_monotime() ;
+
+    if (p->throttlestart>0) {
+      _net_pacethrottled(sh, now - p->throttlestart) ;
+      p->throttlestart = 0 ;
+    }
+    p->throttleduntil = 0 ;
+
+    _net_bucketuse(&p->conn, r, now) ;
+    if (p->group>0) {
+      pthread_mutex_lock(&_net_lock) ;
+      _net_bucketuse(&_net_rategroups[p->group-1], r, now) ;
+      pthread_mutex_unlock(&_net_lock) ;
+    }
+
+    sent += r ;
+
+    // Non-blocking sends behave like send(), and may be partial
+
+    if (!sh->isblocking) break ;
+
+  }
+
+  return sent ;
+}
+
+
+//
+// @brief Accumulate throttled time for a connection and its group
+//
+
+void _net_pacethrottled(INET *sh, double seconds)
+{
+  sh->pace->conn.stats.throttledseconds += seconds ;
+  if (sh->pace->group>0) {
+    pthread_mutex_lock(&_net_lock) ;
+    _net_rategroups[sh->pace->group-1].stats.throttledseconds += seconds ;
+    pthread_mutex_unlock(&_net_lock) ;
+  }
+}
+
+
+//
+// @brief Allocate pacing state for a connection on first use
+//
+
+int _net_pacealloc(INET *sh)
+{
+  if (sh->pace) return 1 ;
+
+  sh->pace = malloc(sizeof(struct _net_pacing)) ;
+  if (!sh->pace) {
+    _net_seterrno(sh, "netsetrate", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
+  memset(sh->pace, '\0', sizeof(struct _net_pacing)) ;
+  return 1 ;
+}
+
+
+//
+// @brief Limit the egress rate of a connection
+// @param(in) sh Handle of open connection
+// @param(in) rate Maximum rate in bytes per second, 0 for unlimited
+// @param(in) burst Bucket size in bytes, 0 for one second's worth
+// @return true on success, or false on error (setting errno)
+//
+
+int netsetrate(INET *sh, long rate, long burst)
+{
+  if (!sh) return 0 ;
+  if (!_net_pacealloc(sh)) return 0 ;
+
+  _net_bucketset(&sh->pace->conn, rate, burst) ;
+
+  // Also ask the kernel to pace at the socket level (fq qdisc)
+
+  unsigned int kernelrate = rate>0 ? (unsigned int)rate : ~0U ;
+  sh->pace->conn.stats.kernelpacing = ( setsockopt(sh->fd, SOL_SOCKET, 
+        SO_MAX_PACING_RATE, &kernelrate, sizeof(kernelrate)) == 0 && rate>0 ) ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Configure a shared rate limit group
+// @param(in) group Group number, 1 to NET_MAXRATEGROUPS
+// @param(in) rate Maximum rate in bytes per second, 0 for unlimited
+// @param(in) burst Bucket size in bytes, 0 for one second's worth
+// @return true on success, or false if the group is invalid
+//
+
+int netrategroup(int group, long rate, long burst)
+{
+  if (group<1 || group>NET_MAXRATEGROUPS) return 0 ;
+  pthread_mutex_lock(&_net_lock) ;
+  _net_bucketset(&_net_rategroups[group-1], rate, burst) ;
+  pthread_mutex_unlock(&_net_lock) ;
+  return 1 ;
+}
+
+
+//
+// @brief Attach a connection to a shared rate limit group
+// @param(in) sh Handle of open connection
+// @param(in) group Group number, or 0 to leave any group
+// @return true on success, or false on error (setting errno)
+//
+
+int netsetrategroup(INET *sh, int group)
+{
+  if (!sh) return 0 ;
+
+  if (group<0 || group>NET_MAXRATEGROUPS) {
+    _net_seterrno(sh, "netsetrategroup", NET_ERR_INT, NET_ERR_BADP) ;
+    return 0 ;
+  }
+
+  if (!_net_pacealloc(sh)) return 0 ;
+  sh->pace->group = group ;
+  return 1 ;
+}
+
+
+//
+// @brief Obtain the time at which a throttled connection becomes writable
+// @param(in) sh Handle of open connection
+// @param(out) until CLOCK_MONOTONIC time when writable, may be NULL
+// @return true if the connection is currently throttled
+//
+
+int netthrottleduntil(INET *sh, struct timespec *until)
+{
+  if (!sh || !sh->pace) return 0 ;
+
+  double t = sh->pace->throttleduntil ;
+  if (t <= _net_monotime()) return 0 ;
+
+  if (until) {
+    until->tv_sec = (time_t)t ;
+    until->tv_nsec = (long)((t - until->tv_sec) * 1e9) ;
+  }
+  return 1 ;
+}
+
+
+//
+// @brief Obtain pacing statistics for a connection
+// @param(in) sh Handle of open connection
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if pacing not enabled
+//
+
+int netratestats(INET *sh, struct netratestats *st)
+{
+  if (!st) return 0 ;
+  memset(st, '\0', sizeof(struct netratestats)) ;
+  if (!sh || !sh->pace) return 0 ;
+  *st = sh->pace->conn.stats ;
+  return 1 ;
+}
+
+
+//
+// @brief Obtain pacing statistics for a rate limit group
+// @param(in) group Group number
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if the group is invalid
+//
+
+int netrategroupstats(int group, struct netratestats *st)
+{
+  if (!st) return 0 ;
+  memset(st, '\0', sizeof(struct netratestats)) ;
+  if (group<1 || group>NET_MAXRATEGROUPS) return 0 ;
+  pthread_mutex_lock(&_net_lock) ;
+  *st = _net_rategroups[group-1].stats ;
+  pthread_mutex_unlock(&_net_lock) ;
+  return 1 ;
+}
+
+
+//
+// Cipher suite profiles
+//
+// AES-GCM is only fast where the CPU has AES and carry-less multiply
+// instructions, otherwise ChaCha20-Poly1305 is several times quicker.
+// The profiles order the offered suites so that the cheapest one for this
+// CPU is preferred, and offer X25519 first so a single key share suffices.
+//
+
+//
+// @brief Detect hardware AES support
+// @return true if AES-GCM is hardware accelerated
+//
+
+int _net_cpuhasaes()
+{
+  static int hasaes=-1 ;
+
+  if (hasaes<0) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init() ;
+    hasaes = __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") ;
+#elif defined(__aarch64__)
+    hasaes = (getauxval(AT_HWCAP) & HWCAP_AES) && (getauxval(AT_HWCAP) & HWCAP_PMULL) ;
+#else
+    hasaes = 0 ;
+#endif
+  }
+
+  return hasaes ;
+}
+
+
+//
+// @brief Select the cipher profile for subsequent TLS connections
+// @param(in) profile Cipher profile
+// @return true on success, or false if the profile is invalid
+//
+
+int netcipherprofile(enum netcipherprofiles profile)
+{
+  if (profile<NETCIPHER_DEFAULT || profile>NETCIPHER_COMPATIBILITY) return 0 ;
+  _net_cipherprofile = profile ;
+  return 1 ;
+}
+
+
+//
+// @brief Apply the selected cipher profile to an SSL context
+// @param(in) sh Handle being connected
+// @param(in) ctx SSL context
+// @return true on success, or false on error (setting errno)
+//
+
+int _net_applycipherprofile(INET *sh, SSL_CTX *ctx)
+{
+#ifdef NET_NOTLS
+  (void)sh ; (void)ctx ;
+  return 1 ;
+#else
+  const char *ciphers, *suites, *groups ;
+  int aes = _net_cpuhasaes() ;
+
+  switch (_net_cipherprofile) {
+
+  case NETCIPHER_THROUGHPUT:
+
+    // Bulk cost per byte is what matters, so the cipher fastest on this CPU
+    // leads and the other is kept only as a fallback, for servers lacking
+    // it.  TLS 1.2 is accepted.
+
+    suites = aes ? NET_TLS13_AES : NET_TLS13_CHACHA ;
+    ciphers = aes ? NET_TLS12_AES : NET_TLS12_CHACHA ;
+    groups = "X25519:P-256:P-384:P-521" ;
+    break ;
+
+  case NETCIPHER_LATENCY:
+
+    // X25519 first, as the one key share sent suits nearly every server,
+    // so the TLS 1.3 handshake takes a single round trip.  Servers lacking
+    // it ask for another group with a HelloRetryRequest, costing a round
+    // trip rather than failing, and TLS 1.2 servers are still accepted.
+
+    suites = aes ? NET_TLS13_AES : NET_TLS13_CHACHA ;
+    ciphers = aes ? NET_TLS12_AES : NET_TLS12_CHACHA ;
+    groups = "X25519:P-256:P-384:P-521" ;
+    break ;
+
+  case NETCIPHER_COMPATIBILITY:
+    suites = aes ? NET_TLS13_AES : NET_TLS13_CHACHA ;
+    ciphers = aes ? NET_TLS12_AES ":HIGH:!aNULL:!MD5" : NET_TLS12_CHACHA ":HIGH:!aNULL:!MD5" ;
+    groups = "X25519:P-256:X448:P-384:P-521" ;
+    break ;
+
+  default:
+    return 1 ;
+
+  }
+
+  if ( !SSL_CTX_set_ciphersuites(ctx, suites) ||
+       !SSL_CTX_set_cipher_list(ctx, ciphers) ||
+       !SSL_CTX_set1_groups_list(ctx, groups) ) {
+    _net_seterrno(sh, "cipherprofile", NET_ERR_SSL, 0) ;
+    return 0 ;
+  }
+
+  return 1 ;
+#endif
+}
+
+
+//
+// @brief Obtain the negotiated cipher suite
+// @param(in) sh Handle of open connection
+// @return Pointer to static cipher name, or NULL if not a TLS connection
+//
+
+const char *netcipher(INET *sh)
+{
+  if (!sh || !sh->ssl) return NULL ;
+  return SSL_get_cipher_name(sh->ssl) ;
+}
+
+
+//
+// Shared TLS contexts
+//
+// An SSL_CTX holds the trusted certificate store, which costs several
+// hundred kilobytes once the default verify paths are loaded.  Contexts
+// are therefore cached by the options that configure them (verification,
+// protocol versions, key logging and cipher profile) and shared by
+// reference count between connections.  The cache keeps one reference
+// so a context outlives its last connection, and counts the connections
+// using it so memory can be apportioned between them.
+//
+
+#define NET_CTXCACHE 16
+
+struct _net_ctxentry {
+  int key ;            // Option flags and cipher profile
+  SSL_CTX *ctx ;
+  int users ;          // Connections holding a reference
+  long bytes ;         // Estimated size of the context
+} ;
+
+static struct {
+  int n ;
+  struct _net_ctxentry e[NET_CTXCACHE] ;
+} _net_ctxcache ;
+
+// Memory estimates, measured against OpenSSL 3.0 on x86_64
+
+#define NET_MEM_CTX 12288L       // SSL_CTX without trusted certificates
+#define NET_MEM_CACERT 6144L     // Each loaded trusted certificate
+#define NET_MEM_SSL 18944L       // SSL object and session after the handshake
+#define NET_MEM_SSLBUF 16704L    // Each TLS read or write buffer
+#define NET_MEM_SOCKET 3072L     // Kernel socket, file and inode
+
+#ifndef NET_NOTLS
+
+int _net_verifycb(X509_STORE_CTX *xctx, void *arg) ;
+
+//
+// @brief Obtain a shared context for a new connection
+// @param(in) sh Handle being connected
+// @param(in) flags Connection flags
+// @return Context holding a reference for the caller, or NULL on error
+//
+
+SSL_CTX *_net_ctxget(INET *sh, int flags)
+{
+  int key = (flags & (SSL2|SSL3|NOCERTCHAIN|DEBUGKEYDUMP)) | (_net_cipherprofile << 16) ;
+  SSL_CTX *ctx = NULL ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  for (int i=0; i<_net_ctxcache.n; i++) {
+    if (_net_ctxcache.e[i].key==key) {
+      ctx = _net_ctxcache.e[i].ctx ;
+      SSL_CTX_up_ref(ctx) ;
+      _net_ctxcache.e[i].users++ ;
+      break ;
+    }
+  }
+  pthread_mutex_unlock(&_net_lock) ;
+  if (ctx) return ctx ;
+
+  // Build outside the lock, loading the verify paths is slow
+
+  const SSL_METHOD *method;
+  method = SSLv23_client_method();
+  if (!method) { 
+    _net_seterrno(sh, "client_method", NET_ERR_SSL, 0) ;
+    return NULL ; 
+  }
+
+  ctx = SSL_CTX_new(method) ;
+  if ( !ctx ) { 
+    _net_seterrno(sh, "ctx_new", NET_ERR_SSL, 0) ; 
+    return NULL ; 
+  }
+
+  // Enable verification of full certificate chain
+
+  if (!(flags&NOCERTCHAIN))
+    SSL_CTX_set_default_verify_paths(ctx) ;
+
+  // Disable SSL if requested
+
+  if (! (flags&SSL2) ) {
+    SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2);
+  }
+
+  if (! (flags&SSL3) ) {
+    SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv3);
+  }
+
+  // Order ciphers and key exchange groups for this CPU
+
+  if (!_net_applycipherprofile(sh, ctx)) {
+    SSL_CTX_free(ctx) ;
+    return NULL ;
+  }
+
+  // Enable key logging
+
+  if (flags&DEBUGKEYDUMP) {
+    SSL_CTX_set_keylog_callback(ctx, _net_ssl_keylog);
+  }
+
+  // Check pins and reuse earlier verification results, the trusted store
+  // only differs with NOCERTCHAIN
+
+  SSL_CTX_set_cert_verify_callback(ctx, _net_verifycb, (void *)(long)(flags&NOCERTCHAIN)) ;
+
+  long bytes = NET_MEM_CTX + NET_MEM_CACERT * 
+               sk_X509_OBJECT_num(X509_STORE_get0_objects(SSL_CTX_get_cert_store(ctx))) ;
+
+  // Publish, unless another thread got there first
+
+  pthread_mutex_lock(&_net_lock) ;
+  for (int i=0; i<_net_ctxcache.n; i++) {
+    if (_net_ctxcache.e[i].key==key) {
+      SSL_CTX_free(ctx) ;
+      ctx = _net_ctxcache.e[i].ctx ;
+      SSL_CTX_up_ref(ctx) ;
+      _net_ctxcache.e[i].users++ ;
+      pthread_mutex_unlock(&_net_lock) ;
+      return ctx ;
+    }
+  }
+  if (_net_ctxcache.n < NET_CTXCACHE) {
+    struct _net_ctxentry *e = &_net_ctxcache.e[_net_ctxcache.n++] ;
+    e->key = key ;
+    e->ctx = ctx ;
+    e->users = 1 ;
+    e->bytes = bytes ;
+    SSL_CTX_up_ref(ctx) ;
+  }
+  pthread_mutex_unlock(&_net_lock) ;
+
+  return ctx ;
+}
+
+#endif
+
+
+//
+// @brief Release a connection's reference to its context
+// @param(in) ctx Context
+//
+
+void _net_ctxrelease(SSL_CTX *ctx)
+{
+  pthread_mutex_lock(&_net_lock) ;
+  for (int i=0; i<_net_ctxcache.n; i++) {
+    if (_net_ctxcache.e[i].ctx==ctx) {
+      _net_ctxcache.e[i].users-- ;
+      break ;
+    }
+  }
+  pthread_mutex_unlock(&_net_lock) ;
+  SSL_CTX_free(ctx) ;
+}
+
+
+//
+// Certificate verification
+//
+// Building a peer's chain and checking it against the trusted store is
+// most of a handshake's certificate work, yet a client reconnecting to
+// the same servers is shown the same chain each time.  The shared
+// contexts verify through a callback that fingerprints the chain as
+// presented (SHA-256 over each certificate's digest), and when that
+// chain was verified against the same trusted store within the cache
+// lifetime the recorded result is reused rather than building the chain
+// again.  A reused result does not make the verified chain available
+// through SSL_get0_verified_chain().  The cache is direct mapped, so a
+// chain displaces whichever chain shares its slot.  As before a failed
+// verification does not fail the handshake, and is only reported by
+// netcertstatus().  Destinations may also be pinned to a set of public
+// keys (the SHA-256 of a SubjectPublicKeyInfo, as used by HPKP and
+// curl's --pinnedpubkey).  The pins are checked on every handshake,
+// cached or not, and are in addition to the chain verifying, so a pinned
+// destination whose chain fails (now or in a cached result) fails its
+// handshake.  Only with NOCERTCHAIN, where no roots are trusted at all,
+// do the pins alone decide.
+//
+
+#define NET_CERTCACHE 256      // Verified chain cache slots
+#define NET_PINSETS 32         // Destinations with pin sets
+#define NET_PINS 8             // Pins per destination
+
+struct _net_certentry {
+  unsigned char fp[32] ;       // Fingerprint of the chain and trusted store
+  int status ;                 // Verification result
+  double expires ;             // Time at which the result lapses, 0 if unused
+} ;
+
+struct _net_pinset {
+  char hostname[256] ;         // Destination
+  int n ;                      // Pins, 0 if the slot is unused
+  unsigned char pin[NET_PINS][32] ;
+} ;
+
+static struct {
+  int ttl ;                    // Result lifetime in seconds, 0 if disabled
+  struct _net_certentry e[NET_CERTCACHE] ;
+  struct _net_pinset pins[NET_PINSETS] ;
+  struct netcertstats stats ;
+} _net_certcache = { 300 } ;
+
+
+//
+// @brief Find a destination's pin set
+// @param(in) hostname Destination
+// @return Pin set, or NULL if the destination is not pinned
+//
+
+struct _net_pinset *_net_pinfind(char *hostname)
+{
+  struct _net_pinset *pins = NULL ;
+  if (!hostname) return NULL ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  for (int i=0; i<NET_PINSETS; i++) {
+    if (_net_certcache.pins[i].n>0 && strcmp(_net_certcache.pins[i].hostname, hostname)==0) {
+      pins = &_net_certcache.pins[i] ;
+      break ;
+    }
+  }
+  pthread_mutex_unlock(&_net_lock) ;
+  return pins ;
+}
+
+
+//
+// @brief Pin the public keys accepted from a destination
+// @param(in) hostname Destination, as passed to netconnect
+// @param(in) pins Base64 SHA-256 digests of DER SubjectPublicKeyInfo
+// @param(in) npins Number of pins, or 0 to remove the pin set
+// @return true on success, or false if a pin is invalid or too many
+//         destinations are pinned
+//
+
+int netpinspki(char *hostname, char **pins, int npins)
+{
+#ifndef NET_NOTLS
+  unsigned char pin[NET_PINS][32] ;
+
+  if (!hostname || strlen(hostname)>=sizeof(_net_certcache.pins[0].hostname) ||
+      npins<0 || npins>NET_PINS || (npins>0 && !pins)) return 0 ;
+
+  // Decode, 32 bytes encode as 44 characters with one pad
+
+  for (int i=0; i<npins; i++) {
+    unsigned char raw[36] ;
+    char *b64 = pins[i] ;
+    if (!b64) return 0 ;
+    if (strncmp(b64, "sha256//", 8)==0) b64 += 8 ;
+    if (strlen(b64)!=44 || b64[43]!='=' || b64[42]=='=' ||
+        EVP_DecodeBlock(raw, (unsigned char *)b64, 44)!=33) return 0 ;
+    memcpy(pin[i], raw, 32) ;
+  }
+
+  pthread_mutex_lock(&_net_lock) ;
+  struct _net_pinset *set = NULL ;
+  for (int i=0; i<NET_PINSETS && !set; i++) {
+    if (_net_certcache.pins[i].n>0 && strcmp(_net_certcache.pins[i].hostname, hostname)==0) {
+      set = &_net_certcache.pins[i] ;
+    }
+  }
+  for (int i=0; i<NET_PINSETS && !set && npins>0; i++) {
+    if (_net_certcache.pins[i].n==0) set = &_net_certcache.pins[i] ;
+  }
+  if (set) {
+    strcpy(set->hostname, hostname) ;
+    memcpy(set->pin, pin, sizeof(pin[0]) * npins) ;
+    set->n = npins ;
+  }
+  pthread_mutex_unlock(&_net_lock) ;
+
+  return (set || npins==0) ;
+#else
+  return 0 ;
+#endif
+}
+
+
+//
+// @brief Set the lifetime of cached verification results
+// @param(in) ttlsecs Lifetime in seconds, or 0 to disable and empty the
+//            cache
+// @return true on success, or false if ttlsecs is invalid
+//
+
+int netcertcache(int ttlsecs)
+{
+  if (ttlsecs<0) return 0 ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  _net_certcache.ttl = ttlsecs ;
+  if (ttlsecs==0) {
+    for (int i=0; i<NET_CERTCACHE; i++) _net_certcache.e[i].expires = 0 ;
+  }
+  pthread_mutex_unlock(&_net_lock) ;
+  return 1 ;
+}
+
+
+//
+// @brief Obtain certificate verification statistics
+// @param(out) st Statistics
+// @return true on success, or false if st is NULL
+//
+
+int netcertstats(struct netcertstats *st)
+{
+  if (!st) return 0 ;
+  double now = _net_monotime() ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  *st = _net_certcache.stats ;
+  st->entries = 0 ;
+  for (int i=0; i<NET_CERTCACHE; i++) {
+    if (_net_certcache.e[i].expires > now) st->entries++ ;
+  }
+  pthread_mutex_unlock(&_net_lock) ;
+  return 1 ;
+}
+
+
+#ifndef NET_NOTLS
+
+//
+// @brief Digest a certificate's SubjectPublicKeyInfo
+// @param(in) cert Certificate
+// @param(out) md SHA-256 digest
+// @return true on success, or false on error
+//
+
+int _net_spkidigest(X509 *cert, unsigned char *md)
+{
+  unsigned char *der = NULL ;
+  unsigned int mdlen ;
+  int len = i2d_X509_PUBKEY(X509_get_X509_PUBKEY(cert), &der) ;
+  int ok = len>0 && EVP_Digest(der, len, md, &mdlen, EVP_sha256(), NULL) ;
+  OPENSSL_free(der) ;
+  return ok ;
+}
+
+
+//
+// @brief Check a connection's pins against the chain presented
+// @param(in) pins Pin set
+// @param(in) leaf Peer certificate
+// @param(in) chain Chain presented, or NULL
+// @return true if a certificate carries a pinned key, or the pin set has
+//         since been removed
+//
+
+int _net_pincheck(struct _net_pinset *pins, X509 *leaf, STACK_OF(X509) *chain)
+{
+  unsigned char md[32] ;
+  int n = chain ? sk_X509_num(chain) : 0 ;
+  int matched = 0 ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  if (pins->n==0) matched = 1 ;
+  for (int i=-1; i<n && !matched; i++) {
+    X509 *cert = (i<0) ? leaf : sk_X509_value(chain, i) ;
+    if (!cert || !_net_spkidigest(cert, md)) continue ;
+    for (int p=0; p<pins->n && !matched; p++) {
+      matched = (memcmp(md, pins->pin[p], sizeof(md))==0) ;
+    }
+  }
+  _net_certcache.stats.pinchecks++ ;
+  if (!matched) _net_certcache.stats.pinfailures++ ;
+  pthread_mutex_unlock(&_net_lock) ;
+
+  return matched ;
+}
+
+
+//
+// @brief Verify a peer's certificate chain, reusing a cached result
+// @param(in) xctx Store context holding the chain presented
+// @param(in) arg Trusted store identity, NOCERTCHAIN if no roots are
+//            trusted
+// @return 1 if the chain verified, or the pins are trusted alone, else 0
+//         (which fails the handshake only of a pinned destination)
+//
+
+int _net_verifycb(X509_STORE_CTX *xctx, void *arg)
+{
+  SSL *ssl = X509_STORE_CTX_get_ex_data(xctx, SSL_get_ex_data_X509_STORE_CTX_idx()) ;
+  struct _net_pinset *pins = ssl ? SSL_get_app_data(ssl) : NULL ;
+  X509 *leaf = X509_STORE_CTX_get0_cert(xctx) ;
+  STACK_OF(X509) *chain = X509_STORE_CTX_get0_untrusted(xctx) ;
+  int n = chain ? sk_X509_num(chain) : 0 ;
+
+  if (pins && !_net_pincheck(pins, leaf, chain)) {
+    X509_STORE_CTX_set_error(xctx, X509_V_ERR_APPLICATION_VERIFICATION) ;
+    return 0 ;
+  }
+
+  // Fingerprint the chain and the store it is checked against
+
+  unsigned char fp[32], md[EVP_MAX_MD_SIZE] ;
+  unsigned int mdlen ;
+  EVP_MD_CTX *mctx = EVP_MD_CTX_new() ;
+  int ok = mctx && leaf && EVP_DigestInit_ex(mctx, EVP_sha256(), NULL) &&
+           EVP_DigestUpdate(mctx, &arg, sizeof(arg)) ;
+  for (int i=-1; i<n && ok; i++) {
+    X509 *cert = (i<0) ? leaf : sk_X509_value(chain, i) ;
+    ok = X509_digest(cert, EVP_sha256(), md, &mdlen) && EVP_DigestUpdate(mctx, md, mdlen) ;
+  }
+  ok = ok && EVP_DigestFinal_ex(mctx, fp, NULL) ;
+  EVP_MD_CTX_free(mctx) ;
+
+  struct _net_certentry *e = &_net_certcache.e[fp[0]] ;
+  double now = _net_monotime() ;
+  int status = X509_V_OK, hit = 0 ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  if (ok && _net_certcache.ttl>0 && e->expires>0 && memcmp(e->fp, fp, sizeof(fp))==0) {
+    if (e->expires > now) {
+      status = e->status ;
+      hit = 1 ;
+      _net_certcache.stats.hits++ ;
+    } else {
+      e->expires = 0 ;
+      _net_certcache.stats.expired++ ;
+    }
+  }
+  pthread_mutex_unlock(&_net_lock) ;
+
+  if (hit) {
+    X509_STORE_CTX_set_error(xctx, status) ;
+    return (status==X509_V_OK || (pins && arg)) ;
+  }
+
+  // Verify in full, and cache the result for no longer than the leaf lasts
+
+  int r = X509_verify_cert(xctx) ;
+  status = X509_STORE_CTX_get_error(xctx) ;
+
+  int days, secs ;
+  double lifetime = -1 ;
+  if (leaf && ASN1_TIME_diff(&days, &secs, NULL, X509_get0_notAfter(leaf))) {
+    lifetime = days * 86400.0 + secs ;
+  }
+
+  pthread_mutex_lock(&_net_lock) ;
+  _net_certcache.stats.verifications++ ;
+  if (lifetime > _net_certcache.ttl) lifetime = _net_certcache.ttl ;
+  if (ok && lifetime>0) {
+    if (e->expires > now && memcmp(e->fp, fp, sizeof(fp))!=0) _net_certcache.stats.evictions++ ;
+    memcpy(e->fp, fp, sizeof(fp)) ;
+    e->status = status ;
+    e->expires = now + lifetime ;
+  }
+  pthread_mutex_unlock(&_net_lock) ;
+
+  return (r==1 || (pins && arg)) ;
+}
+
+#endif
+
+
+//
+// Idle memory
+//
+// With SSL_MODE_RELEASE_BUFFERS the TLS write buffer (about 16KB) is
+// freed once its record has been sent, at the cost of an allocation per
+// record when the connection is busy.  OpenSSL 3.0 was measured to keep
+// the read buffer, so only the write buffer is assumed released when
+// estimating.  Kernel socket
+// buffers only hold memory while data is queued, but their limits bound
+// how much a peer can make an idle connection hold, so idle handles are
+// given small fixed limits.  Fixing the limits turns off the kernel's
+// buffer autotuning for the socket, so the first data sent or received
+// ends idle mode, restoring the previous sizes and, through SO_BUF_LOCK
+// (Linux 5.14), autotuning.
+//
+
+//
+// @brief Reduce the memory held by an idle connection
+// @param(in) sh Handle of open connection, or NULL to set the default
+//            for new connections
+// @param(in) bufbytes Socket buffer size while idle, or 0 to leave idle
+//            mode
+// @return true on success, or false on error (setting errno)
+//
+
+int netidlememory(INET *sh, int bufbytes)
+{
+  if (bufbytes<0) return 0 ;
+
+  if (!sh) {
+    pthread_mutex_lock(&_net_lock) ;
+    _net_idlebufdefault = bufbytes ;
+    pthread_mutex_unlock(&_net_lock) ;
+    return 1 ;
+  }
+
+  if (bufbytes==0) {
+    _net_idleend(sh) ;
+    return 1 ;
+  }
+
+  // Note the sizes and locks to restore, unless already idle
+
+  if (!sh->idlebuf) {
+    socklen_t len = sizeof(int) ;
+    if ( getsockopt(sh->fd, SOL_SOCKET, SO_RCVBUF, &sh->busyrcvbuf, &len)!=0 ||
+         getsockopt(sh->fd, SOL_SOCKET, SO_SNDBUF, &sh->busysndbuf, &len)!=0 ) {
+      _net_seterrno(sh, "netidlememory", NET_ERR_ERRNO, 0) ;
+      return 0 ;
+    }
+    sh->busylocks = -1 ;
+#ifdef SO_BUF_LOCK
+    if (getsockopt(sh->fd, SOL_SOCKET, SO_BUF_LOCK, &sh->busylocks, &len)!=0) sh->busylocks = -1 ;
+#endif
+  }
+
+  int capped = ( setsockopt(sh->fd, SOL_SOCKET, SO_RCVBUF, &bufbytes, sizeof(bufbytes))==0 &&
+                 setsockopt(sh->fd, SOL_SOCKET, SO_SNDBUF, &bufbytes, sizeof(bufbytes))==0 ) ;
+  sh->idlebuf = bufbytes ;
+  if (!capped) {
+    _net_seterrno(sh, "netidlememory", NET_ERR_ERRNO, 0) ;
+    _net_idleend(sh) ;
+    return 0 ;
+  }
+
+  if (sh->ssl) SSL_set_mode(sh->ssl, SSL_MODE_RELEASE_BUFFERS) ;
+  return 1 ;
+}
+
+
+//
+// @brief Leave idle mode, restoring the socket buffers
+// @param(in) sh Handle of open connection
+//
+
+void _net_idleend(INET *sh)
+{
+  if (!sh->idlebuf) return ;
+  sh->idlebuf = 0 ;
+
+  if (sh->ssl && !sh->hs) SSL_clear_mode(sh->ssl, SSL_MODE_RELEASE_BUFFERS) ;
+
+  // getsockopt() reports twice the size set, the kernel's bookkeeping
+  // allowance included
+
+  int rcvbuf = sh->busyrcvbuf / 2, sndbuf = sh->busysndbuf / 2 ;
+  setsockopt(sh->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) ;
+  setsockopt(sh->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) ;
+#ifdef SO_BUF_LOCK
+  if (sh->busylocks>=0) setsockopt(sh->fd, SOL_SOCKET, SO_BUF_LOCK, &sh->busylocks, sizeof(sh->busylocks)) ;
+#endif
+}
+
+
+//
+// @brief Estimate the memory held by a connection
+// @param(in) sh Handle of open connection
+// @param(out) st Breakdown to populate, or NULL
+// @return Estimated total in bytes
+//
+
+long netmemory(INET *sh, struct netmemory *st)
+{
+  struct netmemory m ;
+  memset(&m, '\0', sizeof(m)) ;
+  if (!sh) {
+    if (st) *st = m ;
+    return 0 ;
+  }
+
+  // Handle and optional state
+
+  m.handle = sizeof(INET) ;
+  if (sh->hostname) m.handle += strlen(sh->hostname) + 1 ;
+  if (sh->ipaddress) m.handle += strlen(sh->ipaddress) + 1 ;
+  if (sh->pace) m.handle += sizeof(struct _net_pacing) ;
+  if (sh->rec) m.handle += sizeof(struct _net_records) ;
+  if (sh->to) m.handle += sizeof(struct _net_timeouts) ;
+  if (sh->busy) m.handle += sizeof(struct _net_busypoll) ;
+  if (sh->zc) m.handle += sizeof(struct _net_zerocopy) ;
+  if (sh->ra) m.handle += sizeof(struct _net_readahead) + (sh->ssl ? 0 : sh->ra->size) ;
+  if (sh->z) m.handle += _net_zmemory(sh) ;
+
+  // TLS state, with the write buffer released while empty in idle mode
+
+  if (sh->ssl) {
+    m.tls = NET_MEM_SSL + NET_MEM_SSLBUF ;
+    if (!sh->idlebuf || sh->sslwantwrite) m.tls += NET_MEM_SSLBUF ;
+    if (sh->ra && sh->ra->size > NET_MEM_SSLBUF) m.tls += sh->ra->size - NET_MEM_SSLBUF ;
+  }
+
+  // This connection's share of its context
+
+  if (sh->ctx) {
+    pthread_mutex_lock(&_net_lock) ;
+    for (int i=0; i<_net_ctxcache.n; i++) {
+      if (_net_ctxcache.e[i].ctx==sh->ctx && _net_ctxcache.e[i].users>0) {
+        m.context = _net_ctxcache.e[i].bytes / _net_ctxcache.e[i].users ;
+        break ;
+      }
+    }
+    pthread_mutex_unlock(&_net_lock) ;
+  }
+
+  // Kernel socket and queued data
+
+  if (sh->fd>=0) {
+    unsigned int mem[SK_MEMINFO_VARS] ;
+    socklen_t len = sizeof(mem) ;
+    m.kernel = NET_MEM_SOCKET ;
+    if (getsockopt(sh->fd, SOL_SOCKET, SO_MEMINFO, mem, &len)==0 && 
+        len >= sizeof(unsigned int) * (SK_MEMINFO_WMEM_QUEUED+1)) {
+      m.kernel += mem[SK_MEMINFO_RMEM_ALLOC] + mem[SK_MEMINFO_WMEM_QUEUED] + 
+                  mem[SK_MEMINFO_FWD_ALLOC] ;
+    }
+  }
+
+  m.total = m.handle + m.tls + m.context + m.kernel ;
+  if (st) *st = m ;
+  return m.total ;
+}
+
+
+//
+// Dynamic TLS record sizing
+//
+// A TLS record can only be decrypted once all of it has arrived, so a
+// 16KB record sent on a cold connection may need several round trips
+// before the peer sees the first byte.  While a connection is warming up
+// (after connect, or after being idle) records are limited to one that
+// fits in a single packet, and once enough data has been sent they return
+// to the maximum size for throughput.
+//
+
+//
+// @brief Configure dynamic TLS record sizing
+// @param(in) sh Handle of open TLS connection
+// @param(in) smallsize Record size used while warming up, 0 to disable
+// @param(in) threshold Bytes sent before switching to full size records
+// @param(in) idlems Idle time after which the connection warms up again
+// @return true on success, or false on error (setting errno)
+//
+
+int netrecordsizing(INET *sh, int smallsize, int threshold, int idlems)
+{
+  if (!sh) return 0 ;
+
+  if (!sh->ssl) {
+    _net_seterrno(sh, "netrecordsizing", NET_ERR_INT, NET_ERR_NOTSUP) ;
+    return 0 ;
+  }
+
+  if (smallsize<=0) {
+    if (sh->rec) {
+
+      // Records are only resized once the handshake is complete, so
+      // until then there is nothing to restore.  Should data be buffered
+      // the split is left, and records stay at the small size.
+
+      if (!sh->hs && sh->rec->current && sh->rec->current < SSL3_RT_MAX_PLAIN_LENGTH &&
+          !_net_setrecordsize(sh, SSL3_RT_MAX_PLAIN_LENGTH, 1)) {
+        SSL_set_max_send_fragment(sh->ssl, SSL3_RT_MAX_PLAIN_LENGTH) ;
+      }
+      free(sh->rec) ;
+      sh->rec = NULL ;
+    }
+    return 1 ;
+  }
+
+  if (smallsize<NET_MINRECORD) smallsize = NET_MINRECORD ;
+  if (smallsize>SSL3_RT_MAX_PLAIN_LENGTH) smallsize = SSL3_RT_MAX_PLAIN_LENGTH ;
+
+  if (!sh->rec) {
+    sh->rec = malloc(sizeof(struct _net_records)) ;
+    if (!sh->rec) {
+      _net_seterrno(sh, "netrecordsizing", NET_ERR_ERRNO, 0) ;
+      return 0 ;
+    }
+    memset(sh->rec, '\0', sizeof(struct _net_records)) ;
+  }
+
+  sh->rec->smallsize = smallsize ;
+  sh->rec->threshold = threshold ;
+  sh->rec->idle = idlems / 1000.0 ;
+  sh->rec->sent = 0 ;
+  sh->rec->current = 0 ;
+  return 1 ;
+}
+
+
+//
+// @brief Set the largest record an SSL_write may send
+// @param(in) sh Handle of open TLS connection
+// @param(in) size Record size
+// @param(in) grow True if size is larger than the current size
+// @return true if set, or false if it must wait for buffered data
+//
+// Lowering the maximum fragment also lowers the split fragment, which is
+// what SSL_write actually cuts records at, and raising it again leaves
+// the split where it was, so both are set.  The write buffer keeps the
+// size it was given for smaller records, so before growing it is freed
+// to be reallocated by the next write, which OpenSSL refuses while data
+// is buffered.
+//
+
+int _net_setrecordsize(INET *sh, int size, int grow)
+{
+  if (grow && !SSL_free_buffers(sh->ssl)) return 0 ;
+  SSL_set_max_send_fragment(sh->ssl, size) ;
+  SSL_set_split_send_fragment(sh->ssl, size) ;
+  return 1 ;
+}
+
+
+//
+// @brief Choose the record size before an SSL_write
+// @param(in) sh Handle of open TLS connection
+//
+
+void _net_recordsize(INET *sh)
+{
+  struct _net_records *rec = sh->rec ;
+  double now = _net_monotime() ;
+
+  // The size cannot change while a write is waiting to be retried
+
+  if (rec->retry) return ;
+
+  if (rec->last>0 && now - rec->last > rec->idle) rec->sent = 0 ;
+
+  int size = (rec->sent < rec->threshold) ? rec->smallsize : SSL3_RT_MAX_PLAIN_LENGTH ;
+  if (size != rec->current && _net_setrecordsize(sh, size, size > rec->current)) {
+    rec->current = size ;
+  }
+}
+
+
+//
+// @brief Account for an SSL_write when choosing later record sizes
+// @param(in) sh Handle of open TLS connection
+// @param(in) r Result of SSL_write
+//
+
+void _net_recordsent(INET *sh, int r)
+{
+  struct _net_records *rec = sh->rec ;
+
+  rec->retry = (r<=0 && _net_wouldblock()) ;
+  if (r>0) {
+    rec->sent += r ;
+    rec->last = _net_monotime() ;
+  }
+}
+
+
+//
+// Handshake offload
+//
+// The key exchange and certificate checks in a TLS handshake cost about
+// a millisecond of CPU, so a burst of connects, such as every connection
+// reconnecting at once, stalls the thread running the event loop.  With
+// ASYNCHANDSHAKE netconnect() returns once the TCP connection is up and
+// queues the TLS handshake for a pool of worker threads.  Until it
+// completes netsend() and netrecv() would block, netrdfdset() adds the
+// shared notification fd (an eventfd counting unconsumed completions)
+// in place of the socket, and a failure is reported by the next
+// netsend() or netrecv().  Blocking connections wait for the handshake
+// in netsend() and netrecv().  SSL_MODE_ASYNC was not used, as it only
+// helps with an asynchronous crypto engine.
+//
+
+//
+// @brief Set the number of handshake worker threads
+// @param(in) threads Number of workers, started on first use.  The pool
+//            only grows.
+// @return true on success, or false if threads is invalid
+//
+
+int nethandshakepool(int threads)
+{
+  if (threads<1) return 0 ;
+  pthread_mutex_lock(&_net_hslock) ;
+  _net_hspool.want = threads ;
+  pthread_mutex_unlock(&_net_hslock) ;
+  return 1 ;
+}
+
+
+//
+// @brief Obtain the handshake notification fd
+// @return File descriptor, readable while a handshake completion has not
+//         been consumed, or -1 on error
+//
+
+int nethandshakefd()
+{
+  pthread_mutex_lock(&_net_hslock) ;
+  if (_net_hspool.fd<0) {
+    _net_hspool.fd = eventfd(0, EFD_NONBLOCK|EFD_SEMAPHORE|EFD_CLOEXEC) ;
+  }
+  int fd = _net_hspool.fd ;
+  pthread_mutex_unlock(&_net_hslock) ;
+  return fd ;
+}
+
+
+//
+// @brief Perform the TLS handshake on a connected socket
+// @param(in) sh Handle being connected
+// @param(in) deadline Time by which the handshake must complete, 0 if none
+// @return true on success, or false on error (setting errno)
+//
+
+#ifndef NET_NOTLS
+
+int _net_sslconnect(INET *sh, double deadline)
+{
+  int r ;
+  while ( (r=SSL_connect(sh->ssl)) < 0 ) {
+
+    int e=SSL_get_error(sh->ssl, r) ;
+
+    switch (e) {
+
+    case SSL_ERROR_WANT_READ:
+       r = _net_waitfd(sh->fd, POLLIN, deadline) ;
+       break;
+
+    case SSL_ERROR_WANT_WRITE:
+       r = _net_waitfd(sh->fd, POLLOUT, deadline) ;
+       break;
+
+    default:
+       _net_seterrno(sh, "ssl_connect", NET_ERR_SSL, r) ;
+       return 0 ;
+       break ;
+    }
+
+    if (r==0) {
+       _net_seterrno(sh, "ssl_connect", NET_ERR_INT, NET_ERR_TIMEOUT) ;
+       return 0 ;
+    }
+
+  }
+
+  if (r==0) {
+    _net_seterrno(sh, "ssl_connect", NET_ERR_SSL, r) ;
+    return 0 ;
+  }
+
+  // Record the verification result for netcertstatus
+
+  sh->certstatus = SSL_get0_peer_certificate(sh->ssl) ? SSL_get_verify_result(sh->ssl) : -1 ;
+
+  return 1 ;
+}
+
+#else
+
+int _net_sslconnect(INET *sh, double deadline)
+{
+  _net_seterrno(sh, "ssl_connect", NET_ERR_INT, NET_ERR_NOTSUP) ;
+  return 0 ;
+}
+
+#endif
+
+
+//
+// @brief Consume a completed handshake's notification, with _net_hslock held
+// @param(in) hs Handshake
+//
+
+void _net_hsack(struct _net_handshake *hs)
+{
+  uint64_t v ;
+  if (hs->acked || hs->state<NET_HS_DONE) return ;
+  if (read(_net_hspool.fd, &v, sizeof(v))<0) { /* Already consumed */ }
+  hs->acked = 1 ;
+}
+
+
+//
+// @brief Handshake worker thread
+// @param(in) arg Unused
+//
+
+void *_net_hsworker(void *arg)
+{
+  uint64_t one = 1 ;
+
+  pthread_mutex_lock(&_net_hslock) ;
+
+  for (;;) {
+
+    while (!_net_hspool.head) pthread_cond_wait(&_net_hswork, &_net_hslock) ;
+
+    struct _net_handshake *hs = _net_hspool.head ;
+    _net_hspool.head = hs->next ;
+    if (!_net_hspool.head) _net_hspool.tail = NULL ;
+
+    double start = _net_monotime() ;
+    hs->state = NET_HS_RUNNING ;
+    _net_hspool.stats.queued-- ;
+    _net_hspool.stats.inflight++ ;
+    _net_hspool.stats.waitseconds += start - hs->queuedat ;
+    pthread_mutex_unlock(&_net_hslock) ;
+
+    INET *sh = hs->sh ;
+    int ok = _net_sslconnect(sh, hs->deadline) ;
+    int err = ok ? 0 : _net_errno ;
+    if (hs->fdoptions>=0) fcntl(sh->fd, F_SETFL, hs->fdoptions) ;
+
+    // A cancelled handshake (a losing hedge) says nothing about the
+    // destination, but must still end a half-open probe
+
+    pthread_mutex_lock(&_net_hslock) ;
+    int outcome = hs->cancelled ? NET_DEST_ABANDONED : ok ? NET_DEST_OK : NET_DEST_FAILED ;
+    pthread_mutex_unlock(&_net_hslock) ;
+    _net_destresult(hs->dest, outcome) ;
+    _net_lbresult(sh, outcome) ;
+
+    // Publish the outcome and notify under the lock, so the notification
+    // is never consumed before it is written
+
+    pthread_mutex_lock(&_net_hslock) ;
+    hs->err = err ;
+    hs->state = ok ? NET_HS_DONE : NET_HS_FAILED ;
+    _net_hspool.stats.inflight-- ;
+    if (ok) _net_hspool.stats.completed++ ;
+    else _net_hspool.stats.failed++ ;
+    _net_hspool.stats.workseconds += _net_monotime() - start ;
+    if (write(_net_hspool.fd, &one, sizeof(one))<0) { /* Counter cannot overflow */ }
+    pthread_cond_broadcast(&_net_hsdone) ;
+
+  }
+
+  return NULL ;
+}
+
+
+//
+// @brief Queue a connection's handshake for the worker pool
+// @param(in) sh Handle being connected
+// @param(in) deadline Time by which the handshake must complete, 0 if none
+// @param(in) fdoptions File status flags to restore, or -1
+// @param(in) dest Destination to report the outcome to
+// @return true on success, or false on error (setting errno)
+//
+
+int _net_hsqueue(INET *sh, double deadline, int fdoptions, struct _net_dest *dest)
+{
+  if (nethandshakefd()<0) {
+    _net_seterrno(sh, "nethandshake", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
+
+  struct _net_handshake *hs = malloc(sizeof(struct _net_handshake)) ;
+  if (!hs) {
+    _net_seterrno(sh, "nethandshake", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
+  memset(hs, '\0', sizeof(struct _net_handshake)) ;
+  hs->sh = sh ;
+  hs->state = NET_HS_QUEUED ;
+  hs->fdoptions = fdoptions ;
+  hs->deadline = deadline ;
+  hs->dest = dest ;
+  hs->queuedat = _net_monotime() ;
+
+  pthread_mutex_lock(&_net_hslock) ;
+
+  while (_net_hspool.threads < _net_hspool.want) {
+    pthread_t tid ;
+    if (pthread_create(&tid, NULL, _net_hsworker, NULL)!=0) break ;
+    pthread_detach(tid) ;
+    _net_hspool.threads++ ;
+  }
+
+  if (_net_hspool.threads==0) {
+    pthread_mutex_unlock(&_net_hslock) ;
+    free(hs) ;
+    _net_seterrno(sh, "nethandshake", NET_ERR_ERRNO, EAGAIN) ;
+    return 0 ;
+  }
+
+  if (_net_hspool.tail) _net_hspool.tail->next = hs ;
+  else _net_hspool.head = hs ;
+  _net_hspool.tail = hs ;
+  _net_hspool.stats.queued++ ;
+  if (_net_hspool.stats.queued > _net_hspool.stats.maxqueued) {
+    _net_hspool.stats.maxqueued = _net_hspool.stats.queued ;
+  }
+  sh->hs = hs ;
+
+  pthread_cond_signal(&_net_hswork) ;
+  pthread_mutex_unlock(&_net_hslock) ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Check, or wait for, an offloaded handshake
+// @param(in) sh Handle of connection
+// @param(in) context Error context
+// @param(in) wait If true, wait for the handshake to complete
+// @return 1 if complete, 0 if in progress (errno EAGAIN), or -1 if the
+//         handshake failed (setting errno)
+//
+
+int _net_hspoll(INET *sh, char *context, int wait)
+{
+  struct _net_handshake *hs = sh->hs ;
+
+  pthread_mutex_lock(&_net_hslock) ;
+  while (wait && hs->state<NET_HS_DONE) pthread_cond_wait(&_net_hsdone, &_net_hslock) ;
+  int state = hs->state ;
+  _net_hsack(hs) ;
+  pthread_mutex_unlock(&_net_hslock) ;
+
+  switch (state) {
+
+  case NET_HS_DONE:
+    free(hs) ;
+    sh->hs = NULL ;
+    return 1 ;
+
+  case NET_HS_FAILED:
+    _net_seterrno(sh, context, NET_ERR_ERRNO, hs->err ? hs->err : ECANCELED) ;
+    return -1 ;
+
+  default:
+    _net_seterrno(sh, context, NET_ERR_ERRNO, EAGAIN) ;
+    return 0 ;
+
+  }
+}
+
+
+//
+// @brief Read the state of an offloaded handshake
+// @param(in) sh Handle of connection
+// @return enum _net_hsstates
+//
+
+int _net_hsstate(INET *sh)
+{
+  pthread_mutex_lock(&_net_hslock) ;
+  int state = sh->hs->state ;
+  pthread_mutex_unlock(&_net_hslock) ;
+  return state ;
+}
+
+
+//
+// @brief Withdraw a queued handshake, or wait for a running one
+// @param(in) sh Handle of connection
+//
+
+void _net_hscancel(INET *sh)
+{
+  struct _net_handshake *hs = sh->hs ;
+  int dequeued = 0 ;
+  if (!hs) return ;
+
+  pthread_mutex_lock(&_net_hslock) ;
+
+  if (hs->state==NET_HS_QUEUED) {
+    struct _net_handshake **p = &_net_hspool.head, *prev = NULL ;
+    while (*p && *p!=hs) { prev = *p ; p = &(*p)->next ; }
+    if (*p) *p = hs->next ;
+    if (_net_hspool.tail==hs) _net_hspool.tail = prev ;
+    _net_hspool.stats.queued-- ;
+    _net_hspool.stats.cancelled++ ;
+    hs->state = NET_HS_FAILED ;
+    hs->acked = 1 ;
+    dequeued = 1 ;
+  }
+
+  while (hs->state==NET_HS_RUNNING) pthread_cond_wait(&_net_hsdone, &_net_hslock) ;
+  _net_hsack(hs) ;
+
+  pthread_mutex_unlock(&_net_hslock) ;
+
+  // No worker will report a handshake that never ran, so the destination
+  // is told it was abandoned, ending a half-open probe without counting a
+  // failure, and the endpoint is given back
+
+  if (dequeued) {
+    _net_destresult(hs->dest, NET_DEST_ABANDONED) ;
+    _net_lbrelease(sh) ;
+  }
+
+  free(hs) ;
+  sh->hs = NULL ;
+}
+
+
+//
+// @brief Wait for one of several offloaded handshakes to finish
+// @param(in) c Handles of connections, NULL entries are skipped
+// @param(in) n Number of entries in c
+// @param(in) until Time to stop waiting, 0 to wait indefinitely
+// @return Index of a finished (or failed) handshake, or -1 on timeout
+//
+
+int _net_hswait(INET **c, int n, double until)
+{
+  struct timespec ts ;
+  int w = -1 ;
+
+  // Condition variables time out against the real time clock
+
+  if (until>0) {
+    clock_gettime(CLOCK_REALTIME, &ts) ;
+    double t = ts.tv_sec + ts.tv_nsec / 1e9 + (until - _net_monotime()) ;
+    ts.tv_sec = (time_t)t ;
+    ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9) ;
+  }
+
+  pthread_mutex_lock(&_net_hslock) ;
+
+  for (;;) {
+    for (int i=0; i<n && w<0; i++) {
+      if (c[i] && c[i]->hs && c[i]->hs->state>=NET_HS_DONE) w = i ;
+    }
+    if (w>=0) break ;
+    if (until<=0) pthread_cond_wait(&_net_hsdone, &_net_hslock) ;
+    else if (pthread_cond_timedwait(&_net_hsdone, &_net_hslock, &ts)==ETIMEDOUT) break ;
+  }
+
+  pthread_mutex_unlock(&_net_hslock) ;
+  return w ;
+}
+
+
+//
+// @brief Check whether a connection's handshake has completed
+// @param(in) sh Handle of connection
+// @return 1 if complete (or not offloaded), 0 if in progress, or -1 if
+//         it failed (setting errno)
+//
+
+int nethandshakedone(INET *sh)
+{
+  if (!sh) return -1 ;
+  if (!sh->hs) return 1 ;
+  return _net_hspoll(sh, "nethandshakedone", 0) ;
+}
+
+
+//
+// @brief Obtain handshake offload statistics
+// @param(out) st Statistics structure to populate
+// @return true on success
+//
+
+int nethandshakestats(struct nethandshakestats *st)
+{
+  if (!st) return 0 ;
+  pthread_mutex_lock(&_net_hslock) ;
+  *st = _net_hspool.stats ;
+  st->threads = _net_hspool.threads ;
+  pthread_mutex_unlock(&_net_hslock) ;
+  return 1 ;
+}
+
+
+//
+// Busy poll receive
+//
+// Waking a thread blocked in select() or recv() costs several
+// microseconds.  A busy polling connection instead retries a
+// non-blocking receive for up to its spin budget before falling back
+// to the blocking read (blocking connections) or returning EAGAIN to the
+// readiness loop (NONBLOCK connections).  Plain sockets receive directly
+// while spinning.  TLS connections peek at the socket, and then read
+// through SSL_read.  SO_BUSY_POLL additionally lets the kernel poll the
+// device queue, where the driver supports it and the caller has
+// CAP_NET_ADMIN or the value is within net.core.busy_read.
+//
+
+//
+// @brief Enable busy polling for a connection
+// @param(in) sh Handle of open connection
+// @param(in) spinus Microseconds to spin in netrecv() before waiting,
+//            0 to disable
+// @param(in) cpu CPU to pin the calling (polling) thread to, or -1
+// @return true on success, or false on error (setting errno)
+//
+
+int netbusypoll(INET *sh, int spinus, int cpu)
+{
+  if (!sh || spinus<0) return 0 ;
+
+  if (spinus==0) {
+    if (sh->busy) {
+      int zero = 0 ;
+      setsockopt(sh->fd, SOL_SOCKET, SO_BUSY_POLL, &zero, sizeof(zero)) ;
+      setsockopt(sh->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &zero, sizeof(zero)) ;
+      free(sh->busy) ;
+      sh->busy = NULL ;
+    }
+    return 1 ;
+  }
+
+  if (!sh->busy) {
+    sh->busy = malloc(sizeof(struct _net_busypoll)) ;
+    if (!sh->busy) {
+      _net_seterrno(sh, "netbusypoll", NET_ERR_ERRNO, 0) ;
+      return 0 ;
+    }
+    memset(sh->busy, '\0', sizeof(struct _net_busypoll)) ;
+  }
+  sh->busy->budget = spinus / 1e6 ;
+
+  // Kernel busy polling is best effort
+
+  int one = 1 ;
+  sh->busy->stats.kernelbusypoll = 
+    ( setsockopt(sh->fd, SOL_SOCKET, SO_BUSY_POLL, &spinus, sizeof(spinus))==0 ) ;
+  setsockopt(sh->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) ;
+
+  if (cpu>=0) {
+    cpu_set_t cpus ;
+    CPU_ZERO(&cpus) ;
+    CPU_SET(cpu % CPU_SETSIZE, &cpus) ;
+    int e = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) ;
+    if (e) {
+      _net_seterrno(sh, "netbusypoll", NET_ERR_ERRNO, e) ;
+      return 0 ;
+    }
+  }
+
+  return 1 ;
+}
+
+
+//
+// @brief Spin until data arrives or the budget is spent
+// @param(in) sh Handle of connection
+// @param(in) buf Buffer to store received data (plain sockets)
+// @param(in) maxlen Maximum number of bytes to read
+// @return Number of bytes received, or 0 to continue with a normal read
+//
+
+int _net_busyspin(INET *sh, char *buf, int maxlen)
+{
+  struct _net_busypoll *bp = sh->busy ;
+  double start = 0, now = 0 ;
+  int spins = 0, r ;
+  char ch ;
+
+  // Nothing to wait for if SSL has already buffered data
+
+  if (sh->ssl && (sh->sslhaspending || SSL_pending(sh->ssl))) return 0 ;
+
+  for (;;) {
+
+    if (sh->ssl) r = recv(sh->fd, &ch, 1, MSG_PEEK|MSG_DONTWAIT) ;
+    else r = recv(sh->fd, buf, maxlen, MSG_DONTWAIT) ;
+
+    // Data, end of stream or an error is left to the normal read
+
+    if (r>=0 || (errno!=EAGAIN && errno!=EWOULDBLOCK)) break ;
+
+    now = _net_monotime() ;
+    if (spins==0) start = now ;
+    else if (now - start >= bp->budget) break ;
+    spins++ ;
+
+  }
+
+  if (spins==0) {
+    bp->stats.ready++ ;
+  } else {
+    if (r>=0) bp->stats.hits++ ;
+    else bp->stats.misses++ ;
+    bp->stats.spinseconds += _net_monotime() - start ;
+  }
+
+  if (!sh->ssl && r>0) {
+    _net_commsdump(sh, "< ", buf, r) ;
+    _net_seterrno(sh, "netrecv", NET_ERR_ERRNO, 0) ;
+    return r ;
+  }
+
+  return 0 ;
+}
+
+
+//
+// @brief Obtain busy poll statistics for a connection
+// @param(in) sh Handle of open connection
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if busy polling not enabled
+//
+
+int netbusypollstats(INET *sh, struct netbusypollstats *st)
+{
+  if (!sh || !st) return 0 ;
+  memset(st, '\0', sizeof(struct netbusypollstats)) ;
+  if (!sh->busy) return 0 ;
+
+  *st = sh->busy->stats ;
+  if (st->hits + st->misses) st->hitrate = (double)st->hits / (st->hits + st->misses) ;
+  return 1 ;
+}
+
+
+//
+// Zero copy send
+//
+// MSG_ZEROCOPY pins the caller's pages instead of copying them into the
+// socket buffer, which saves CPU on large sends but leaves the buffer in
+// use until the kernel reports completion on the socket error queue.
+// Completions for TCP arrive in order as id ranges, so the handle only
+// tracks the first id not yet known to be complete.  Sends below the
+// threshold, compressed sends and TLS connections are always copied,
+// and so is a send the kernel refuses with ENOBUFS (optmem exhausted).
+//
+
+//
+// @brief Enable zero copy sends on a plain connection
+// @param(in) sh Handle of open connection
+// @param(in) threshold Smallest send, in bytes, to transmit without
+//            copying, or 0 to disable
+// @return true on success, or false on error (setting errno)
+//
+
+int netzerocopy(INET *sh, int threshold)
+{
+  if (!sh || threshold<0) return 0 ;
+
+  if (sh->ssl) {
+    _net_seterrno(sh, "netzerocopy", NET_ERR_INT, NET_ERR_NOTSUP) ;
+    return 0 ;
+  }
+
+  // Disabling keeps the state so outstanding sends can still complete
+
+  if (threshold==0) {
+    if (sh->zc) sh->zc->threshold = 0 ;
+    return 1 ;
+  }
+
+  if (!sh->zc) {
+
+    int one = 1 ;
+    if (setsockopt(sh->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one))!=0) {
+      _net_seterrno(sh, "netzerocopy", NET_ERR_ERRNO, 0) ;
+      return 0 ;
+    }
+
+    sh->zc = malloc(sizeof(struct _net_zerocopy)) ;
+    if (!sh->zc) {
+      _net_seterrno(sh, "netzerocopy", NET_ERR_ERRNO, 0) ;
+      return 0 ;
+    }
+    memset(sh->zc, '\0', sizeof(struct _net_zerocopy)) ;
+
+  }
+
+  sh->zc->threshold = threshold ;
+  return 1 ;
+}
+
+
+//
+// @brief Send without copying, falling back to a copy if refused
+// @param(in) sh Handle of open connection
+// @param(in) buf Data to be sent
+// @param(in) len Amount of data to send
+// @return Number of bytes sent, or -1 on error
+//
+
+int _net_zcsend(INET *sh, char *buf, int len)
+{
+  struct _net_zerocopy *zc = sh->zc ;
+
+  // Collect completions first so the kernel can release pinned pages
+
+  _net_zcreap(sh) ;
+
+  int r = send(sh->fd, buf, len, MSG_ZEROCOPY) ;
+
+  if (r<0 && errno==ENOBUFS) {
+    zc->stats.fallbacks++ ;
+    return send(sh->fd, buf, len, 0) ;
+  }
+
+  if (r>0) {
+    zc->lastzc = 1 ;
+    zc->nextid++ ;
+    zc->stats.sends++ ;
+    zc->stats.bytes += r ;
+  }
+
+  return r ;
+}
+
+
+//
+// @brief Read zero copy completions from the socket error queue
+// @param(in) sh Handle of open connection
+//
+
+void _net_zcreap(INET *sh)
+{
+  struct _net_zerocopy *zc = sh->zc ;
+  char control[256] ;
+  struct msghdr msg ;
+  struct cmsghdr *cm ;
+  int saved = errno ;
+
+  while (zc->doneid != zc->nextid) {
+
+    memset(&msg, '\0', sizeof(msg)) ;
+    msg.msg_control = control ;
+    msg.msg_controllen = sizeof(control) ;
+
+    if (recvmsg(sh->fd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) < 0) break ;
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+
+      if ( !(cm->cmsg_level==SOL_IP && cm->cmsg_type==IP_RECVERR) &&
+           !(cm->cmsg_level==SOL_IPV6 && cm->cmsg_type==IPV6_RECVERR) ) continue ;
+
+      struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm) ;
+      if (ee->ee_origin!=SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno!=0) continue ;
+
+      uint32_t n = ee->ee_data - ee->ee_info + 1 ;
+      zc->stats.completions += n ;
+      if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) zc->stats.copied += n ;
+      if ((int32_t)(ee->ee_data + 1 - zc->doneid) > 0) zc->doneid = ee->ee_data + 1 ;
+
+    }
+
+  }
+
+  errno = saved ;
+}
+
+
+//
+// @brief Identify the most recent zero copy send
+// @param(in) sh Handle of open connection
+// @return Id to pass to netzcdone(), or -1 if the last send was copied
+//         and its buffer may be reused immediately
+//
+
+long netzclastid(INET *sh)
+{
+  if (!sh || !sh->zc || !sh->zc->lastzc) return -1 ;
+  return (long)(uint32_t)(sh->zc->nextid - 1) ;
+}
+
+
+//
+// @brief Wait for a zero copy send to complete
+// @param(in) sh Handle of open connection
+// @param(in) id Id returned by netzclastid()
+// @param(in) ms Milliseconds to wait, 0 to poll, or -1 to wait indefinitely
+// @return 1 if the send, and all those before it, completed, 0 if still
+//         in progress, or -1 on error (setting errno)
+//
+
+int netzcdone(INET *sh, long id, int ms)
+{
+  if (!sh || id<0) return 1 ;
+  if (!sh->zc) return 1 ;
+
+  double deadline = _net_monotime() + ms / 1000.0 ;
+
+  for (;;) {
+
+    _net_zcreap(sh) ;
+    if ((int32_t)((uint32_t)id - sh->zc->doneid) < 0) return 1 ;
+
+    int wait = -1 ;
+    if (ms>=0) {
+      wait = (int)((deadline - _net_monotime()) * 1000.0 + 0.5) ;
+      if (wait<=0) return 0 ;
+    }
+
+    // The error queue raises POLLERR, no events need requesting
+
+    struct pollfd p ;
+    p.fd = sh->fd ;
+    p.events = 0 ;
+    p.revents = 0 ;
+    int r = poll(&p, 1, wait) ;
+
+    if (r<0 && errno!=EINTR) {
+      _net_seterrno(sh, "netzcdone", NET_ERR_ERRNO, 0) ;
+      return -1 ;
+    }
+
+    if (r>0 && !(p.revents & POLLERR)) {
+      errno = (p.revents & POLLNVAL) ? EBADF : EPIPE ;
+      _net_seterrno(sh, "netzcdone", NET_ERR_ERRNO, 0) ;
+      return -1 ;
+    }
+
+  }
+}
+
+
+//
+// @brief Obtain zero copy statistics for a connection
+// @param(in) sh Handle of open connection
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if zero copy never enabled
+//
+
+int netzcstats(INET *sh, struct netzcstats *st)
+{
+  if (!sh || !st) return 0 ;
+  memset(st, '\0', sizeof(struct netzcstats)) ;
+  if (!sh->zc) return 0 ;
+
+  _net_zcreap(sh) ;
+  *st = sh->zc->stats ;
+  st->outstanding = (uint32_t)(sh->zc->nextid - sh->zc->doneid) ;
+  return 1 ;
+}
+
+
+//
+// Source address selection
+//
+// By default the kernel picks the source address, and a free ephemeral
+// port for it when connect() is called, so one host can only hold about
+// 28k connections to a destination.  With several source addresses each
+// has its own ports.  IP_BIND_ADDRESS_NO_PORT lets bind() choose the
+// address only, so the port is picked at connect() time and may be
+// reused for different destinations.  IP_LOCAL_PORT_RANGE narrows the
+// range per socket (Linux 6.3 and later, silently ignored before).
+//
+
+//
+// @brief Configure the source addresses for new connections
+// @param(in) addrs Local IPv4 addresses, used in turn
+// @param(in) naddrs Number of addresses, 0 to let the kernel choose
+// @return true on success, or false if an address is invalid
+//
+
+int netsourceaddrs(char **addrs, int naddrs)
+{
+  struct in_addr addr[NET_MAXSOURCES] ;
+
+  if (naddrs<0 || naddrs>NET_MAXSOURCES || (naddrs>0 && !addrs)) return 0 ;
+
+  for (int i=0; i<naddrs; i++) {
+    if (!addrs[i] || inet_pton(AF_INET, addrs[i], &addr[i])!=1) return 0 ;
+  }
+
+  pthread_mutex_lock(&_net_lock) ;
+  memset(_net_sources.stats, '\0', sizeof(_net_sources.stats)) ;
+  for (int i=0; i<naddrs; i++) {
+    _net_sources.addr[i] = addr[i] ;
+    inet_ntop(AF_INET, &addr[i], _net_sources.stats[i].address, sizeof(_net_sources.stats[i].address)) ;
+  }
+  _net_sources.n = naddrs ;
+  _net_sources.next = 0 ;
+  pthread_mutex_unlock(&_net_lock) ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Configure the ephemeral port range for new connections
+// @param(in) lo Lowest port, or 0 for the system range
+// @param(in) hi Highest port
+// @return true on success, or false if the range is invalid
+//
+
+int netsourceportrange(int lo, int hi)
+{
+  if (lo<0 || hi>65535 || (lo>0 && hi<lo)) return 0 ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  _net_sources.portlo = lo ;
+  _net_sources.porthi = lo>0 ? hi : 0 ;
+  pthread_mutex_unlock(&_net_lock) ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Bind a new socket to the next source address
+// @param(in) sh Handle being connected
+// @return 0 on success, or -1 on error (and sets errno)
+//
+
+int _net_sourcebind(INET *sh)
+{
+  struct sockaddr_in src ;
+  int one = 1 ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  int n = _net_sources.n ;
+  unsigned int range = (_net_sources.porthi << 16) | _net_sources.portlo ;
+  if (n>0) {
+    sh->source = _net_sources.next ;
+    _net_sources.next = (_net_sources.next + 1) % n ;
+    _net_sources.stats[sh->source].connects++ ;
+    memset(&src, 0, sizeof(src)) ;
+    src.sin_family = AF_INET ;
+    src.sin_addr = _net_sources.addr[sh->source] ;
+  }
+  pthread_mutex_unlock(&_net_lock) ;
+
+  if (range) {
+    setsockopt(sh->fd, IPPROTO_IP, IP_LOCAL_PORT_RANGE, &range, sizeof(range)) ;
+  }
+
+  if (n>0) {
+
+    // Leave the port to connect(), so it is only unique per destination
+
+    setsockopt(sh->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one)) ;
+
+    if (bind(sh->fd, (struct sockaddr *)&src, sizeof(src))<0) {
+      _net_seterrno(sh, "bind", NET_ERR_ERRNO, 0) ;
+      pthread_mutex_lock(&_net_lock) ;
+      _net_sources.stats[sh->source].bindfailures++ ;
+      pthread_mutex_unlock(&_net_lock) ;
+      return -1 ;
+    }
+
+  }
+
+  return 0 ;
+}
+
+
+//
+// @brief Account for a source address with no free port, and move on
+//        to another one
+// @param(in) sh Handle being connected
+// @param(in) fdoptions Socket file status flags
+// @param(in) retries Number of source addresses already tried
+// @return true to retry with a new socket, or false (errno is EADDRNOTAVAIL)
+//
+
+int _net_sourceretry(INET *sh, int fdoptions, int retries)
+{
+  if (sh->source<0) return 0 ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  _net_sources.stats[sh->source].addrnotavail++ ;
+  int n = _net_sources.n ;
+  pthread_mutex_unlock(&_net_lock) ;
+
+  if (retries>=n) {
+    errno = EADDRNOTAVAIL ;
+    return 0 ;
+  }
+
+  close(sh->fd) ;
+  _net_fdcount(0) ;
+
+  sh->fd = socket(AF_INET, SOCK_STREAM, 0) ;
+  if (sh->fd<0) return 0 ;
+  _net_fdcount(1) ;
+  fcntl(sh->fd, F_SETFL, fdoptions | O_NONBLOCK) ;
+
+  if (_net_sourcebind(sh)<0) {
+    errno = EADDRNOTAVAIL ;
+    return 0 ;
+  }
+
+  return 1 ;
+}
+
+
+//
+// @brief Obtain source address statistics
+// @param(in) source Index of source address, or -1 for the total
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if the index is invalid
+//
+
+int netsourcestats(int source, struct netsourcestats *st)
+{
+  if (!st) return 0 ;
+  memset(st, '\0', sizeof(struct netsourcestats)) ;
+
+  pthread_mutex_lock(&_net_lock) ;
+
+  if (source>=_net_sources.n) {
+    pthread_mutex_unlock(&_net_lock) ;
+    return 0 ;
+  }
+
+  if (source>=0) {
+    *st = _net_sources.stats[source] ;
+  } else {
+    for (int i=0; i<_net_sources.n; i++) {
+      st->connects += _net_sources.stats[i].connects ;
+      st->addrnotavail += _net_sources.stats[i].addrnotavail ;
+      st->bindfailures += _net_sources.stats[i].bindfailures ;
+    }
+  }
+
+  pthread_mutex_unlock(&_net_lock) ;
+  return 1 ;
+}
+
+
+//
+// Timeouts
+//
+// Each connection with read, write or idle timeouts has one timer, queued
+// on a hierarchical timing wheel for its earliest deadline.  Level 0 has
+// a slot per 1ms tick, and each higher level has a slot per turn of the
+// level below, so queueing and removing a timer is O(1) and a turn of
+// level 0 cascades at most one slot of each higher level back down.
+// The write timeout runs from a send which could not complete, or from
+// netwrfdset(), until a send completes.
+// Sending and receiving only records the time; a timer that fires before
+// its (moved) deadline is simply queued again, so busy connections do not
+// touch the wheel.  An expired connection is reported readable and
+// writable, and its next netrecv() or netsend() fails with
+// NET_ERR_READTIMEOUT, NET_ERR_WRITETIMEOUT or NET_ERR_IDLETIMEOUT.
+// Blocking connections additionally bound each netrecv() and netsend()
+// with SO_RCVTIMEO and SO_SNDTIMEO.
+//
+
+//
+// @brief Current wheel tick, in milliseconds
+//
+
+unsigned long long _net_ticks()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return (unsigned long long)ts.tv_sec*1000 + ts.tv_nsec/1000000 ;
+}
+
+
+//
+// @brief Convert a deadline into a poll() timeout
+// @param(in) deadline _net_monotime() deadline, or 0 for none
+// @return Milliseconds, rounded up, or -1 to wait indefinitely
+//
+
+int _net_msremaining(double deadline)
+{
+  if (deadline<=0) return -1 ;
+
+  double remaining = deadline - _net_monotime() ;
+  if (remaining<0) remaining = 0 ;
+  return (int)(remaining * 1000 + 0.999) ;
+}
+
+
+//
+// @brief Wait for a descriptor to become ready.  poll() is used, not
+//        select(), as descriptors may be beyond FD_SETSIZE.
+// @param(in) fd Descriptor
+// @param(in) events POLLIN or POLLOUT
+// @param(in) deadline _net_monotime() deadline, or 0 for none
+// @return 1 if ready, 0 on timeout, or -1 on error (setting errno)
+//
+
+int _net_waitfd(int fd, short events, double deadline)
+{
+  struct pollfd pfd = { .fd = fd, .events = events } ;
+  return poll(&pfd, 1, _net_msremaining(deadline)) ;
+}
+
+
+//
+// @brief Queue a timer on the wheel (_net_wheellock held)
+//
+
+void _net_wheeladd(struct _net_timer *t)
+{
+  unsigned long long now = _net_wheel.now ;
+  unsigned long long at = t->expires ;
+  unsigned long long delta = at > now ? at - now : 0 ;
+  int level = 0 ;
+
+  while ( level < NET_WHEELLEVELS-1 && 
+          delta >= 1ULL << (NET_WHEELBITS*(level+1)) ) level++ ;
+
+  // Beyond the wheel, park in the furthest slot and cascade again later
+
+  if (delta >= 1ULL << (NET_WHEELBITS*NET_WHEELLEVELS)) {
+    at = now + (1ULL << (NET_WHEELBITS*NET_WHEELLEVELS)) - 1 ;
+  }
+
+  int slot = (at >> (NET_WHEELBITS*level)) & (NET_WHEELSLOTS-1) ;
+  struct _net_timer **head = &_net_wheel.slot[level][slot] ;
+
+  t->level = level ;
+  t->next = *head ;
+  if (t->next) t->next->pprev = &t->next ;
+  t->pprev = head ;
+  *head = t ;
+
+  _net_wheel.count++ ;
+  _net_wheel.levelcount[level]++ ;
+}
+
+
+//
+// @brief Remove a timer from the wheel (_net_wheellock held)
+//
+
+void _net_wheeldel(struct _net_timer *t)
+{
+  if (!t->pprev) return ;
+
+  *t->pprev = t->next ;
+  if (t->next) t->next->pprev = t->pprev ;
+  t->next = NULL ;
+  t->pprev = NULL ;
+
+  _net_wheel.count-- ;
+  _net_wheel.levelcount[t->level]-- ;
+}
+
+
+//
+// @brief Find a connection's next deadline
+// @param(in) to Timeout state
+// @param(in) now Current tick
+// @param(out) due Kinds whose deadline has passed
+// @return Tick of the earliest deadline still to come, or NET_TONEVER
+//
+
+unsigned long long _net_tonext(struct _net_timeouts *to, unsigned long long now, int *due)
+{
+  unsigned long long next = NET_TONEVER ;
+  unsigned long long at[NET_TIMEOUTKINDS] = { NET_TONEVER, NET_TONEVER, NET_TONEVER, NET_TONEVER } ;
+
+  if (to->ms[NETTIMEOUT_READ]>0) at[NETTIMEOUT_READ] = to->lastread + to->ms[NETTIMEOUT_READ] ;
+  if (to->ms[NETTIMEOUT_WRITE]>0 && to->wrblocked) at[NETTIMEOUT_WRITE] = to->wrblocked + to->ms[NETTIMEOUT_WRITE] ;
+  if (to->ms[NETTIMEOUT_IDLE]>0) at[NETTIMEOUT_IDLE] = to->lastio + to->ms[NETTIMEOUT_IDLE] ;
+
+  *due = 0 ;
+  for (int kind=NETTIMEOUT_READ; kind<=NETTIMEOUT_IDLE; kind++) {
+    if (to->expired & (1<<kind) || at[kind]==NET_TONEVER) continue ;
+    if (at[kind] <= now) *due |= 1<<kind ;
+    else if (at[kind] < next) next = at[kind] ;
+  }
+
+  return next ;
+}
+
+
+//
+// @brief Queue a connection's timer for its earliest deadline (_net_wheellock held)
+//
+
+void _net_toarm(struct _net_timeouts *to)
+{
+  unsigned long long now = _net_ticks() ;
+  int due ;
+
+  unsigned long long next = _net_tonext(to, now, &due) ;
+  if (due) next = now ;
+
+  if (next==NET_TONEVER) {
+    _net_wheeldel(&to->t) ;
+    return ;
+  }
+
+  // A timer which fires early is re-queued when it fires
+
+  if (to->t.pprev && to->t.expires <= next) return ;
+
+  _net_wheeldel(&to->t) ;
+  if (_net_wheel.count==0 || _net_wheel.now==0) _net_wheel.now = now ;
+  to->t.expires = next > _net_wheel.now ? next : _net_wheel.now+1 ;
+  _net_wheeladd(&to->t) ;
+}
+
+
+//
+// @brief Expire, or re-queue, a timer which has reached its slot (_net_wheellock held)
+//
+
+void _net_tofire(struct _net_timer *t)
+{
+  struct _net_timeouts *to = (struct _net_timeouts *)t ;
+  int due ;
+
+  unsigned long long next = _net_tonext(to, _net_wheel.now, &due) ;
+
+  if (due) {
+    if (!to->expired) _net_wheel.fired++ ;
+    to->expired |= due ;
+  }
+
+  if (next!=NET_TONEVER) {
+    to->t.expires = next ;
+    _net_wheeladd(&to->t) ;
+  }
+}
+
+
+//
+// @brief Move a higher level slot's timers down the wheel (_net_wheellock held)
+//
+
+void _net_wheelcascade(int level, int slot)
+{
+  struct _net_timer *t = _net_wheel.slot[level][slot] ;
+  _net_wheel.slot[level][slot] = NULL ;
+
+  while (t) {
+    struct _net_timer *next = t->next ;
+    t->pprev = NULL ;
+    _net_wheel.count-- ;
+    _net_wheel.levelcount[level]-- ;
+    _net_wheeladd(t) ;
+    t = next ;
+  }
+}
+
+
+//
+// @brief Advance the wheel, firing timers (_net_wheellock held)
+//
+
+void _net_wheeladvance(unsigned long long to)
+{
+  while (_net_wheel.now < to) {
+
+    if (_net_wheel.count==0) {
+      _net_wheel.now = to ;
+      break ;
+    }
+
+    // Skip to the end of this turn if level 0 is empty
+
+    if (_net_wheel.levelcount[0]==0) {
+      unsigned long long end = _net_wheel.now | (NET_WHEELSLOTS-1) ;
+      _net_wheel.now = end < to ? end : to-1 ;
+    }
+
+    unsigned long long now = ++_net_wheel.now ;
+
+    // Cascade each level whose slot turns over at this tick
+
+    for (int level=1; level<NET_WHEELLEVELS; level++) {
+      if (now & ((1ULL << (NET_WHEELBITS*level)) - 1)) break ;
+      _net_wheelcascade(level, (now >> (NET_WHEELBITS*level)) & (NET_WHEELSLOTS-1)) ;
+    }
+
+    int slot = now & (NET_WHEELSLOTS-1) ;
+    struct _net_timer *t = _net_wheel.slot[0][slot] ;
+    _net_wheel.slot[0][slot] = NULL ;
+
+    while (t) {
+      struct _net_timer *next = t->next ;
+      t->pprev = NULL ;
+      _net_wheel.count-- ;
+      _net_wheel.levelcount[0]-- ;
+      _net_tofire(t) ;
+      t = next ;
+    }
+
+  }
+}
+
+
+//
+// @brief Allocate timeout state for a connection on first use
+//
+
+int _net_toalloc(INET *sh)
+{
+  if (sh->to) return 1 ;
+
+  sh->to = malloc(sizeof(struct _net_timeouts)) ;
+  if (!sh->to) {
+    _net_seterrno(sh, "netsettimeout", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
+  memset(sh->to, '\0', sizeof(struct _net_timeouts)) ;
+  sh->to->lastread = sh->to->lastio = _net_ticks() ;
+
+  // Expired connections are flagged readable through /dev/null
+
+  _net_opendevnull() ;
+  return 1 ;
+}
+
+
+//
+// @brief Remove a connection's timer and release its timeout state
+//
+
+void _net_tofree(INET *sh)
+{
+  if (!sh->to) return ;
+
+  pthread_mutex_lock(&_net_wheellock) ;
+  _net_wheeldel(&sh->to->t) ;
+  pthread_mutex_unlock(&_net_wheellock) ;
+
+  free(sh->to) ;
+  sh->to = NULL ;
+}
+
+
+//
+// @brief Bound blocking socket calls by the read, write and idle timeouts
+//
+
+void _net_tosockopts(INET *sh)
+{
+  if (!sh->isblocking || sh->fd<0) return ;
+
+  int *ms = sh->to->ms ;
+  int rd = ms[NETTIMEOUT_READ] ;
+  int wr = ms[NETTIMEOUT_WRITE] ;
+  if ( ms[NETTIMEOUT_IDLE]>0 && (rd==0 || ms[NETTIMEOUT_IDLE]<rd) ) rd = ms[NETTIMEOUT_IDLE] ;
+  if ( ms[NETTIMEOUT_IDLE]>0 && (wr==0 || ms[NETTIMEOUT_IDLE]<wr) ) wr = ms[NETTIMEOUT_IDLE] ;
+
+  struct timeval tv ;
+  tv.tv_sec = rd / 1000 ;
+  tv.tv_usec = (rd % 1000) * 1000 ;
+  setsockopt(sh->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ;
+  tv.tv_sec = wr / 1000 ;
+  tv.tv_usec = (wr % 1000) * 1000 ;
+  setsockopt(sh->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) ;
+}
+
+
+//
+// @brief Account for a netrecv on a connection with timeouts
+// @param(in) sh Handle of connection
+// @param(in) r Result of the receive
+//
+
+void _net_torecvd(INET *sh, int r)
+{
+  struct _net_timeouts *to = sh->to ;
+
+  if (r>0) {
+    to->lastread = to->lastio = _net_ticks() ;
+  } else if (r<0 && sh->isblocking && _net_wouldblock()) {
+    _net_seterrno(sh, "netrecv", NET_ERR_INT, 
+                  to->ms[NETTIMEOUT_READ]>0 ? NET_ERR_READTIMEOUT : NET_ERR_IDLETIMEOUT) ;
+  }
+}
+
+
+//
+// @brief Account for a netsend on a connection with timeouts
+// @param(in) sh Handle of connection
+// @param(in) r Result of the send
+// @param(in) len Length of data passed to netsend
+//
+
+void _net_tosent(INET *sh, int r, int len)
+{
+  struct _net_timeouts *to = sh->to ;
+  int blocked = r<len || (sh->z && sh->z->txpos < sh->z->txlen) ;
+
+  if (r<0 && sh->isblocking && _net_wouldblock()) {
+    _net_seterrno(sh, "netsend", NET_ERR_INT, 
+                  to->ms[NETTIMEOUT_WRITE]>0 ? NET_ERR_WRITETIMEOUT : NET_ERR_IDLETIMEOUT) ;
+  }
+
+  if (r>0 || !blocked) to->lastio = _net_ticks() ;
+  if (!blocked) to->wrblocked = 0 ;
+  else _net_towritewait(sh) ;
+}
+
+
+//
+// @brief Start the write deadline, unless already started
+// @param(in) sh Handle of connection waiting to send
+//
+
+void _net_towritewait(INET *sh)
+{
+  struct _net_timeouts *to = sh->to ;
+  if (to->wrblocked || to->ms[NETTIMEOUT_WRITE]<=0) return ;
+
+  // The write deadline may be sooner than the queued timer
+
+  pthread_mutex_lock(&_net_wheellock) ;
+  to->wrblocked = _net_ticks() ;
+  _net_toarm(to) ;
+  pthread_mutex_unlock(&_net_wheellock) ;
+}
+
+
+//
+// @brief Report an expired timeout, restarting its deadline
+// @param(in) sh Handle of connection
+// @param(in) context Calling function
+// @return -1, with the timeout's net errno set
+//
+
+int _net_toreport(INET *sh, char *context)
+{
+  struct _net_timeouts *to = sh->to ;
+  int err = NET_ERR_IDLETIMEOUT ;
+
+  pthread_mutex_lock(&_net_wheellock) ;
+  unsigned long long now = _net_ticks() ;
+  if (to->expired & (1<<NETTIMEOUT_READ)) {
+    to->expired &= ~(1<<NETTIMEOUT_READ) ;
+    to->lastread = now ;
+    err = NET_ERR_READTIMEOUT ;
+  } else if (to->expired & (1<<NETTIMEOUT_WRITE)) {
+    to->expired &= ~(1<<NETTIMEOUT_WRITE) ;
+    to->wrblocked = 0 ;
+    err = NET_ERR_WRITETIMEOUT ;
+  } else {
+    to->expired &= ~(1<<NETTIMEOUT_IDLE) ;
+    to->lastio = now ;
+  }
+  _net_toarm(to) ;
+  pthread_mutex_unlock(&_net_wheellock) ;
+
+  _net_seterrno(sh, context, NET_ERR_INT, err) ;
+  return -1 ;
+}
+
+
+//
+// @brief Set a connection timeout, or the default for new connections
+// @param(in) sh Handle of open connection, or NULL to set the default
+// @param(in) kind Timeout to set
+// @param(in) ms Timeout in milliseconds, 0 to disable
+// @return true on success, or false on error (setting errno)
+//
+
+int netsettimeout(INET *sh, enum nettimeouts kind, int ms)
+{
+  if (kind<NETTIMEOUT_READ || kind>NETTIMEOUT_HANDSHAKE || ms<0) return 0 ;
+
+  if (!sh) {
+    _net_timeoutdefaults[kind] = ms ;
+    return 1 ;
+  }
+
+  if (!_net_toalloc(sh)) return 0 ;
+
+  // A timeout being enabled runs from now, not from the last I/O
+
+  pthread_mutex_lock(&_net_wheellock) ;
+  if (sh->to->ms[kind]<=0 && kind==NETTIMEOUT_READ) sh->to->lastread = _net_ticks() ;
+  if (sh->to->ms[kind]<=0 && kind==NETTIMEOUT_IDLE) sh->to->lastio = _net_ticks() ;
+  sh->to->ms[kind] = ms ;
+  _net_toarm(sh->to) ;
+  pthread_mutex_unlock(&_net_wheellock) ;
+
+  _net_tosockopts(sh) ;
+  return 1 ;
+}
+
+
+//
+// @brief Obtain the time until the next timer is due
+// @return Milliseconds until nettimerexpire() should be called, 
+//         or -1 if no timers are queued
+//
+
+int nettimernext()
+{
+  pthread_mutex_lock(&_net_wheellock) ;
+
+  if (_net_wheel.count==0) {
+    pthread_mutex_unlock(&_net_wheellock) ;
+    return -1 ;
+  }
+
+  // The first occupied slot at each level is due, or cascades, at the
+  // start of its tick
+
+  unsigned long long now = _net_wheel.now ;
+  unsigned long long due = NET_TONEVER ;
+
+  for (int level=0; level<NET_WHEELLEVELS; level++) {
+    if (_net_wheel.levelcount[level]==0) continue ;
+    int shift = NET_WHEELBITS*level ;
+    for (int i=1; i<=NET_WHEELSLOTS; i++) {
+      unsigned long long tick = (now >> shift) + i ;
+      if (_net_wheel.slot[level][tick & (NET_WHEELSLOTS-1)]) {
+        if ((tick << shift) < due) due = tick << shift ;
+        break ;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&_net_wheellock) ;
+
+  unsigned long long current = _net_ticks() ;
+  if (due <= current) return 0 ;
+  if (due - current > 0x7fffffff) return 0x7fffffff ;
+  return (int)(due - current) ;
+}
+
+
+//
+// @brief Fire timers which are due, flagging their connections readable
+// @return Number of connections which have expired
+//
+
+int nettimerexpire()
+{
+  pthread_mutex_lock(&_net_wheellock) ;
+  _net_wheel.fired = 0 ;
+  _net_wheeladvance(_net_ticks()) ;
+  int fired = _net_wheel.fired ;
+  pthread_mutex_unlock(&_net_wheellock) ;
+
+  return fired ;
+}
+
+
+//
+// Destination health
+//
+// Connection outcomes are tracked per hostname:port.  After a run of
+// consecutive failures the destination's circuit opens, and netconnect()
+// fails immediately with NET_ERR_CIRCUITOPEN until a jittered, exponentially
+// increasing backoff has elapsed.  The circuit then becomes half-open and a
+// single probe connection is let through: success closes the circuit, and
+// failure re-opens it with a longer backoff.  Tracking is off until
+// netbreakerconfig() sets a threshold.
+//
+// Each attempt holds a reference to its destination's record until its
+// outcome is reported, as does each BALANCE connection until it closes.
+// Beyond NET_DESTMAX records, the least recently used one not referenced
+// is evicted to make room for a new destination.
+//
+
+//
+// @brief Cheap pseudo random number for backoff jitter
+//
+
+unsigned int _net_random()
+{
+  static __thread unsigned int seed=0 ;
+  if (!seed) seed = (unsigned int)(_net_monotime()*1e6) | 1 ;
+  seed ^= seed << 13 ;
+  seed ^= seed >> 17 ;
+  seed ^= seed << 5 ;
+  return seed ;
+}
+
+
+//
+// @brief Free the least recently used destination record which is not in
+//        use (_net_lock held)
+//
+
+void _net_destevict()
+{
+  struct _net_dest **victim = NULL ;
+
+  for (int i=0; i<NET_DESTHASHSIZE; i++) {
+    for (struct _net_dest **p=&_net_desttable[i]; *p; p=&(*p)->next) {
+      if ((*p)->refs==0 && (!victim || (*p)->usedat < (*victim)->usedat)) victim = p ;
+    }
+  }
+  if (!victim) return ;
+
+  struct _net_dest *d = *victim ;
+  *victim = d->next ;
+  _net_destcount-- ;
+  free(d->hostname) ;
+  free(d->ep) ;
+  free(d) ;
+}
+
+
+//
+// @brief Find, or create, the health record for a destination (_net_lock held)
+// @param(in) hostname Name of server as passed to netconnect
+// @param(in) port Port number on server
+// @param(in) create If true, create a record if none exists
+// @return Pointer to destination record, or NULL
+//
+
+struct _net_dest *_net_destfind(char *hostname, int port, int create)
+{
+  unsigned int hash = port ;
+  for (char *p=hostname; *p; p++) hash = hash*31 + (unsigned char)*p ;
+  hash %= NET_DESTHASHSIZE ;
+
+  for (struct _net_dest *d=_net_desttable[hash]; d; d=d->next) {
+    if (d->port==port && strcmp(d->hostname, hostname)==0) return d ;
+  }
+
+  if (!create) return NULL ;
+
+  if (_net_destcount >= NET_DESTMAX) _net_destevict() ;
+
+  struct _net_dest *d = malloc(sizeof(struct _net_dest)) ;
+  if (!d) return NULL ;
+  memset(d, '\0', sizeof(struct _net_dest)) ;
+
+  d->hostname = malloc(strlen(hostname)+1) ;
+  if (!d->hostname) {
+    free(d) ;
+    return NULL ;
+  }
+  strcpy(d->hostname, hostname) ;
+  d->port = port ;
+
+  d->next = _net_desttable[hash] ;
+  _net_desttable[hash] = d ;
+  _net_destcount++ ;
+  return d ;
+}
+
+
+//
+// @brief Decide whether a connection attempt may proceed
+// @param(in) hostname Name of server
+// @param(in) port Port number on server
+// @param(out) d Destination record, held until _net_destresult, or NULL if
+//             health tracking is disabled or the attempt is refused
+// @return true if the attempt may proceed, false if the circuit is open
+//
+
+int _net_destadmit(char *hostname, int port, struct _net_dest **d)
+{
+  *d = NULL ;
+  if (_net_breaker.threshold<=0) return 1 ;
+
+  pthread_mutex_lock(&_net_lock) ;
+
+  *d = _net_destfind(hostname, port, 1) ;
+  if (!*d) {
+    pthread_mutex_unlock(&_net_lock) ;
+    return 1 ;
+  }
+
+  struct _net_dest *dp = *d ;
+  double now = _net_monotime() ;
+  int admit = 1 ;
+
+  if (dp->state == NETBREAKER_OPEN && now >= dp->retryat) {
+    dp->state = NETBREAKER_HALFOPEN ;
+    dp->probing = 0 ;
+  }
+
+  if ( dp->state == NETBREAKER_OPEN || 
+       (dp->state == NETBREAKER_HALFOPEN && dp->probing) ) {
+    dp->stats.rejected++ ;
+    *d = NULL ;
+    admit = 0 ;
+  } else {
+    if (dp->state == NETBREAKER_HALFOPEN) dp->probing = 1 ;
+    dp->stats.attempts++ ;
+    dp->refs++ ;
+    dp->usedat = now ;
+  }
+
+  pthread_mutex_unlock(&_net_lock) ;
+  return admit ;
+}
+
+
+//
+// @brief Record the outcome of a connection attempt, releasing the record
+// @param(in) d Destination record
+// @param(in) outcome enum _net_destoutcomes.  An abandoned attempt only
+//            ends a half-open probe, so the next attempt probes instead.
+//
+
+void _net_destresult(struct _net_dest *d, int outcome)
+{
+  if (!d) return ;
+
+  pthread_mutex_lock(&_net_lock) ;
+
+  d->probing = 0 ;
+  d->refs-- ;
+
+  if (outcome == NET_DEST_ABANDONED) {
+
+    pthread_mutex_unlock(&_net_lock) ;
+    return ;
+
+  } else if (outcome == NET_DEST_OK) {
+
+    d->stats.successes++ ;
+    d->failures = 0 ;
+    d->backoff = 0 ;
+    d->state = NETBREAKER_CLOSED ;
+    pthread_mutex_unlock(&_net_lock) ;
+    return ;
+
+  }
+
+  d->stats.failures++ ;
+  d->failures++ ;
+
+  if (d->state == NETBREAKER_HALFOPEN || d->failures >= _net_breaker.threshold) {
+
+    // Double the backoff, and pick a point in its upper half
+
+    if (d->backoff <= 0) d->backoff = _net_breaker.basems / 1000.0 ;
+    else d->backoff *= 2 ;
+    if (d->backoff > _net_breaker.maxms / 1000.0) d->backoff = _net_breaker.maxms / 1000.0 ;
+
+    double jitter = (_net_random() % 1000) / 1000.0 ;
+    d->retryat = _net_monotime() + d->backoff * (0.5 + 0.5*jitter) ;
+
+    if (d->state != NETBREAKER_OPEN) d->stats.opened++ ;
+    d->state = NETBREAKER_OPEN ;
+
+  }
+
+  pthread_mutex_unlock(&_net_lock) ;
+}
+
+
+//
+// @brief Configure destination health tracking
+// @param(in) threshold Consecutive failures which open a circuit, 0 (the default) disables
+// @param(in) basems Initial backoff in milliseconds
+// @param(in) maxms Maximum backoff in milliseconds
+// @return true on success, or false if parameters are invalid
+//
+
+int netbreakerconfig(int threshold, int basems, int maxms)
+{
+  if (threshold<0 || basems<=0 || maxms<basems) return 0 ;
+  _net_breaker.threshold = threshold ;
+  _net_breaker.basems = basems ;
+  _net_breaker.maxms = maxms ;
+  return 1 ;
+}
+
+
+//
+// @brief Obtain the circuit state of a destination
+// @param(in) hostname Name of server as passed to netconnect
+// @param(in) port Port number on server
+// @param(out) st Statistics structure to populate, may be NULL
+// @return NETBREAKER_CLOSED, NETBREAKER_OPEN or NETBREAKER_HALFOPEN
+//
+
+int netbreakerstate(char *hostname, int port, struct netbreakerstats *st)
+{
+  if (st) memset(st, '\0', sizeof(struct netbreakerstats)) ;
+  if (!hostname) return NETBREAKER_CLOSED ;
+
+  pthread_mutex_lock(&_net_lock) ;
+
+  struct _net_dest *d = _net_destfind(hostname, port, 0) ;
+  if (!d) {
+    pthread_mutex_unlock(&_net_lock) ;
+    return NETBREAKER_CLOSED ;
+  }
+
+  double now = _net_monotime() ;
+  int state = d->state ;
+  if (state == NETBREAKER_OPEN && now >= d->retryat) state = NETBREAKER_HALFOPEN ;
+
+  if (st) {
+    *st = d->stats ;
+    st->state = state ;
+    st->consecutivefailures = d->failures ;
+    st->retryinms = (state == NETBREAKER_OPEN) ? (long)((d->retryat - now)*1000) : 0 ;
+  }
+
+  pthread_mutex_unlock(&_net_lock) ;
+  return state ;
+}
+
+
+//
+// @brief Forget the failure history of a destination, closing its circuit
+// @param(in) hostname Name of server as passed to netconnect
+// @param(in) port Port number on server
+// @return true if the destination was known
+//
+
+int netbreakerreset(char *hostname, int port)
+{
+  if (!hostname) return 0 ;
+
+  pthread_mutex_lock(&_net_lock) ;
+
+  struct _net_dest *d = _net_destfind(hostname, port, 0) ;
+  if (d) {
+    d->state = NETBREAKER_CLOSED ;
+    d->failures = 0 ;
+    d->backoff = 0 ;
+    d->probing = 0 ;
+  }
+
+  pthread_mutex_unlock(&_net_lock) ;
+  return (d!=NULL) ;
+}
+
+
+//
+// Load balancing
+//
+// netconnect() normally connects to the first address a name resolves
+// to.  With BALANCE every resolved address is kept with the destination's
+// health record, and each connect picks two candidates at random and
+// takes the one with the lower latency moving average (of connect plus
+// handshake time, and of the time from a send to the next data received)
+// scaled by its open connections.  An address's average decays towards
+// zero while it goes unsampled, so a recovered address is tried again.
+// A failed connect ejects its address for a backoff which doubles each
+// time it fails again, and netconnect() then tries another address.
+//
+
+//
+// @brief Score an address for selection (_net_lock held)
+// @param(in) ep Address
+// @param(in) now Current time
+// @return Score, lower is better
+//
+
+double _net_lbscore(struct _net_endpoint *ep, double now)
+{
+  double age = now - ep->sampledat ;
+  return ep->ewma * NET_LBDECAY / (NET_LBDECAY + age) * (ep->active + 1) ;
+}
+
+
+//
+// @brief Record a latency sample (_net_lock held)
+// @param(in) ep Address
+// @param(in) seconds Observed latency
+// @param(in) now Current time
+//
+
+void _net_lbsample(struct _net_endpoint *ep, double seconds, double now)
+{
+  if (ep->stats.samples==0) ep->ewma = seconds ;
+  else ep->ewma += NET_LBWEIGHT * (seconds - ep->ewma) ;
+  ep->sampledat = now ;
+  ep->stats.samples++ ;
+}
+
+
+//
+// @brief Choose the address for a BALANCE connection
+// @param(in) sh Handle being connected
+// @param(in) hostname Name of server as passed to netconnect
+// @param(in) port Port number on server
+// @param(in) host Resolved addresses
+// @param(out) addr Chosen address
+// @return true on success, or false if out of memory
+//
+
+int _net_lbpick(INET *sh, char *hostname, int port, struct hostent *host, struct in_addr *addr)
+{
+  double now = _net_monotime() ;
+
+  pthread_mutex_lock(&_net_lock) ;
+
+  struct _net_dest *d = _net_destfind(hostname, port, 1) ;
+  if (!d) {
+    pthread_mutex_unlock(&_net_lock) ;
+    return 0 ;
+  }
+
+  // Follow the latest resolution, keeping the history of known addresses
+
+  for (int i=0; i<d->nep; i++) d->ep[i].present = 0 ;
+
+  for (char **a=host->h_addr_list; *a; a++) {
+    struct in_addr in ;
+    memcpy(&in, *a, sizeof(in)) ;
+    int i = 0 ;
+    while (i<d->nep && d->ep[i].addr.s_addr!=in.s_addr) i++ ;
+    if (i==d->nep) {
+      if (d->nep>=NET_LBMAXENDPOINTS) continue ;
+      struct _net_endpoint *ep = realloc(d->ep, (d->nep+1) * sizeof(struct _net_endpoint)) ;
+      if (!ep) continue ;
+      d->ep = ep ;
+      memset(&ep[i], '\0', sizeof(struct _net_endpoint)) ;
+      ep[i].addr = in ;
+      inet_ntop(AF_INET, &in, ep[i].stats.address, sizeof(ep[i].stats.address)) ;
+      d->nep++ ;
+    }
+    d->ep[i].present = 1 ;
+  }
+
+  // Candidates are the addresses not ejected, or if all are, the one
+  // returning first
+
+  int cand[NET_LBMAXENDPOINTS], n = 0, soonest = -1 ;
+  for (int i=0; i<d->nep; i++) {
+    struct _net_endpoint *ep = &d->ep[i] ;
+    if (!ep->present) continue ;
+    if (ep->ejecteduntil <= now) cand[n++] = i ;
+    else if (soonest<0 || ep->ejecteduntil < d->ep[soonest].ejecteduntil) soonest = i ;
+  }
+  if (n==0 && soonest>=0) cand[n++] = soonest ;
+
+  // A hedge goes elsewhere than the attempt it races, if it can
+
+  for (int i=0; i<n && n>1; i++) {
+    if (cand[i]==_net_lbavoid) cand[i] = cand[--n] ;
+  }
+  if (n==0) {
+    pthread_mutex_unlock(&_net_lock) ;
+    return 0 ;
+  }
+
+  // Power of two choices
+
+  int a = _net_random() % n ;
+  int pick = cand[a] ;
+  if (n>1) {
+    int b = _net_random() % (n-1) ;
+    if (b>=a) b++ ;
+    if (_net_lbscore(&d->ep[cand[b]], now) < _net_lbscore(&d->ep[pick], now)) pick = cand[b] ;
+  }
+
+  struct _net_endpoint *ep = &d->ep[pick] ;
+  ep->active++ ;
+  ep->stats.picks++ ;
+  *addr = ep->addr ;
+
+  sh->lbdest = d ;
+  sh->lbep = pick ;
+  sh->lbstart = now ;
+  d->refs++ ;
+  d->usedat = now ;
+
+  pthread_mutex_unlock(&_net_lock) ;
+  return 1 ;
+}
+
+
+//
+// @brief Record the outcome of a BALANCE connect, ejecting a failed address
+// @param(in) sh Handle connected
+// @param(in) outcome enum _net_destoutcomes, abandoned attempts recording
+//            nothing
+//
+
+void _net_lbresult(INET *sh, int outcome)
+{
+  if (!sh->lbdest || outcome == NET_DEST_ABANDONED) return ;
+  double now = _net_monotime() ;
+
+  pthread_mutex_lock(&_net_lock) ;
+
+  struct _net_endpoint *ep = &sh->lbdest->ep[sh->lbep] ;
+
+  if (outcome == NET_DEST_OK) {
+
+    ep->failures = 0 ;
+    ep->backoff = 0 ;
+    _net_lbsample(ep, now - sh->lbstart, now) ;
+
+  } else {
+
+    ep->failures++ ;
+    ep->stats.failures++ ;
+
+    if (ep->failures >= _net_balance.failures) {
+      if (ep->backoff <= 0) ep->backoff = _net_balance.ejectms / 1000.0 ;
+      else ep->backoff *= 2 ;
+      if (ep->backoff > _net_balance.maxejectms / 1000.0) ep->backoff = _net_balance.maxejectms / 1000.0 ;
+
+      double jitter = (_net_random() % 1000) / 1000.0 ;
+      ep->ejecteduntil = now + ep->backoff * (0.5 + 0.5*jitter) ;
+      ep->stats.ejections++ ;
+    }
+
+  }
+
+  pthread_mutex_unlock(&_net_lock) ;
+}
+
+
+//
+// @brief Record the time from a send to the data which followed
+// @param(in) sh Handle of BALANCE connection
+//
+
+void _net_lbresponse(INET *sh)
+{
+  double now = _net_monotime() ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  _net_lbsample(&sh->lbdest->ep[sh->lbep], now - sh->lbsent, now) ;
+  pthread_mutex_unlock(&_net_lock) ;
+
+  sh->lbsent = 0 ;
+}
+
+
+//
+// @brief Release a connection's claim on its address
+// @param(in) sh Handle being disconnected
+//
+
+void _net_lbrelease(INET *sh)
+{
+  if (!sh->lbdest) return ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  sh->lbdest->ep[sh->lbep].active-- ;
+  sh->lbdest->refs-- ;
+  pthread_mutex_unlock(&_net_lock) ;
+
+  sh->lbdest = NULL ;
+  sh->lbsent = 0 ;
+}
+
+
+//
+// @brief Decide whether a failed BALANCE connect should try again
+// @param(in) hostname Name of server as passed to netconnect
+// @param(in) port Port number on server
+// @return true if the failure was an address's, and another is available
+//
+
+int _net_lbretry(char *hostname, int port)
+{
+  if (_net_errno == NET_ERR_INT + NET_ERR_CIRCUITOPEN ||
+      _net_errno == NET_ERR_INT + NET_ERR_BADA ||
+      _net_errno == NET_ERR_INT + NET_ERR_BADP) return 0 ;
+
+  double now = _net_monotime() ;
+  int available = 0 ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  struct _net_dest *d = _net_destfind(hostname, port, 0) ;
+  for (int i=0; d && i<d->nep && !available; i++) {
+    available = (d->ep[i].present && d->ep[i].ejecteduntil <= now) ;
+  }
+  pthread_mutex_unlock(&_net_lock) ;
+
+  return available ;
+}
+
+
+//
+// @brief Configure load balancing
+// @param(in) failures Consecutive failures which eject an address
+// @param(in) ejectms Initial ejection in milliseconds
+// @param(in) maxejectms Maximum ejection in milliseconds
+// @return true on success, or false if parameters are invalid
+//
+
+int netbalanceconfig(int failures, int ejectms, int maxejectms)
+{
+  if (failures<=0 || ejectms<=0 || maxejectms<ejectms) return 0 ;
+  pthread_mutex_lock(&_net_lock) ;
+  _net_balance.failures = failures ;
+  _net_balance.ejectms = ejectms ;
+  _net_balance.maxejectms = maxejectms ;
+  pthread_mutex_unlock(&_net_lock) ;
+  return 1 ;
+}
+
+
+//
+// @brief Obtain statistics for each address of a BALANCE destination
+// @param(in) hostname Name of server as passed to netconnect
+// @param(in) port Port number on server
+// @param(out) st Array of statistics structures to populate
+// @param(in) max Number of entries in st
+// @return Number of addresses in the latest resolution
+//
+
+int netendpointstats(char *hostname, int port, struct netendpointstats *st, int max)
+{
+  if (!hostname || (!st && max>0)) return 0 ;
+  double now = _net_monotime() ;
+  int n = 0 ;
+
+  pthread_mutex_lock(&_net_lock) ;
+
+  struct _net_dest *d = _net_destfind(hostname, port, 0) ;
+  for (int i=0; d && i<d->nep; i++) {
+    struct _net_endpoint *ep = &d->ep[i] ;
+    if (!ep->present) continue ;
+    if (n<max) {
+      st[n] = ep->stats ;
+      st[n].active = ep->active ;
+      st[n].ejected = (ep->ejecteduntil > now) ;
+      st[n].ejectedms = st[n].ejected ? (long)((ep->ejecteduntil - now) * 1000) : 0 ;
+      st[n].latencyms = ep->ewma * 1000 ;
+    }
+    n++ ;
+  }
+
+  pthread_mutex_unlock(&_net_lock) ;
+  return n ;
+}
+
+
+//
+// Hedging
+//
+// A backend which accepts the connection but is slow to complete the
+// handshake, or to answer, sets the tail latency.  A hedged connect or
+// request that has not finished within a delay taken from a percentile
+// of recent latencies starts a second attempt, to another address where
+// the name resolves to more than one, and whichever finishes first is
+// used.  The other is closed, and its address is charged the time it
+// had taken so far, but is not counted as failed.  A budget of hedges
+// per 100 operations stops hedging from multiplying the load on a
+// destination which is slow for everyone.
+//
+
+//
+// @brief Record the latency of an operation (_net_lock held)
+// @param(in) h Histogram
+// @param(in) seconds Observed latency
+//
+
+void _net_hedgesample(struct _net_hedgehist *h, double seconds)
+{
+  int i = 0 ;
+  for (double bound = NET_HEDGEBASE; i<NET_HEDGEBUCKETS-1 && seconds>bound; i++) bound *= 1.189207 ;
+  h->count[i]++ ;
+  h->total++ ;
+
+  // Halving keeps the histogram following recent behaviour
+
+  if (h->total >= NET_HEDGEHALVE) {
+    h->total = 0 ;
+    for (i=0; i<NET_HEDGEBUCKETS; i++) {
+      h->count[i] /= 2 ;
+      h->total += h->count[i] ;
+    }
+  }
+}
+
+
+//
+// @brief Derive the hedge delay from a latency histogram (_net_lock held)
+// @param(in) h Histogram of the operation's latency
+// @return Time to wait before hedging, in seconds
+//
+
+double _net_hedgedelay(struct _net_hedgehist *h)
+{
+  double delay = _net_hedge.maxdelayms / 1000.0 ;
+
+  if (h->total >= NET_HEDGESAMPLES) {
+    unsigned long want = (h->total * _net_hedge.percentile + 99) / 100, seen = 0 ;
+    double bound = NET_HEDGEBASE ;
+    for (int i=0; i<NET_HEDGEBUCKETS-1 && (seen += h->count[i]) < want; i++) bound *= 1.189207 ;
+    if (bound < delay) delay = bound ;
+  }
+
+  if (delay < _net_hedge.mindelayms / 1000.0) delay = _net_hedge.mindelayms / 1000.0 ;
+  return delay ;
+}
+
+
+//
+// @brief Start an operation, adding to the hedge budget (_net_lock held)
+// @param(in) h Histogram of the operation's latency
+// @param(in) count Operation counter to increment
+// @return Time to wait before hedging, in seconds
+//
+
+double _net_hedgestart(struct _net_hedgehist *h, unsigned long *count)
+{
+  (*count)++ ;
+  _net_hedge.tokens += _net_hedge.budget / 100.0 ;
+  if (_net_hedge.tokens > NET_HEDGEBURST) _net_hedge.tokens = NET_HEDGEBURST ;
+  return _net_hedgedelay(h) ;
+}
+
+
+//
+// @brief Take a hedge from the budget
+// @return true if a hedge may be started
+//
+
+int _net_hedgeadmit()
+{
+  pthread_mutex_lock(&_net_lock) ;
+  int ok = (_net_hedge.tokens >= 1.0) ;
+  if (ok) {
+    _net_hedge.tokens -= 1.0 ;
+    _net_hedge.stats.hedges++ ;
+  } else {
+    _net_hedge.stats.denied++ ;
+  }
+  pthread_mutex_unlock(&_net_lock) ;
+  return ok ;
+}
+
+
+//
+// @brief Start the second attempt of a hedge
+// @param(in) hostname Name of server
+// @param(in) port Port number on server
+// @param(in) flags Type of connection to open
+// @param(in) avoid Connection being raced, whose address is not to be used
+// @return Handle to NET structure, or NULL on failure (and sets errno)
+//
+
+INET *_net_hedgeopen(char *hostname, int port, enum netflags flags, INET *avoid)
+{
+  _net_lbavoid = (avoid && avoid->lbdest) ? avoid->lbep : -1 ;
+  INET *sh = _net_connect(hostname, port, flags, _net_timeoutdefaults) ;
+  _net_lbavoid = -1 ;
+
+  if (!sh) {
+    pthread_mutex_lock(&_net_lock) ;
+    _net_hedge.stats.failures++ ;
+    pthread_mutex_unlock(&_net_lock) ;
+  }
+  return sh ;
+}
+
+
+//
+// @brief Switch a raced connection between blocking and NONBLOCK
+// @param(in) sh Handle of connection
+// @param(in) blocking True to make the connection blocking
+//
+
+void _net_hedgeblocking(INET *sh, int blocking)
+{
+  int fdoptions = fcntl(sh->fd, F_GETFL, 0) ;
+  if (fdoptions>=0) {
+    fcntl(sh->fd, F_SETFL, blocking ? (fdoptions & ~O_NONBLOCK) : (fdoptions | O_NONBLOCK)) ;
+  }
+  sh->isblocking = blocking ;
+}
+
+
+//
+// @brief Send a hedged request in full, leaving the connection NONBLOCK
+// @param(in) sh Handle of connection
+// @param(in) request Request to send
+// @param(in) len Length of request
+// @return true if sent
+//
+
+int _net_hedgesend(INET *sh, char *request, int len)
+{
+  _net_hedgeblocking(sh, 1) ;
+  int r = netsend(sh, request, len) ;
+
+  // Gathered writes go now, as the race waits with poll() rather than
+  // netrdfdset()
+
+  if (r==len && sh->cork && _net_corkflush(sh, 0)<0) r = -1 ;
+  _net_hedgeblocking(sh, 0) ;
+  return (r==len) ;
+}
+
+
+//
+// @brief Close the losing attempt of a hedge
+// @param(in) sh Handle of connection, which is freed
+//
+
+void _net_hedgecancel(INET *sh)
+{
+  double now = _net_monotime() ;
+  double since = sh->hs ? sh->lbstart : sh->lbsent ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  if (sh->lbdest && since>0) _net_lbsample(&sh->lbdest->ep[sh->lbep], now - since, now) ;
+  pthread_mutex_unlock(&_net_lock) ;
+
+  // Shutting the socket down ends a handshake a worker is waiting on,
+  // which the worker reports as abandoned, and closing gives the endpoint
+  // back
+
+  if (sh->hs) {
+    pthread_mutex_lock(&_net_hslock) ;
+    sh->hs->cancelled = 1 ;
+    pthread_mutex_unlock(&_net_hslock) ;
+    shutdown(sh->fd, SHUT_RD) ;
+  }
+
+  netclose(sh) ;
+}
+
+
+//
+// @brief Connect to server, racing a second connection if the first is slow
+// @param(in) hostname Name of server to connect to
+// @param(in) port Port number on server
+// @param(in) flags Type of connection to open, BALANCE is implied
+// @return Handle to NET structure, or NULL on failure (and sets errno)
+//
+// The handshakes are performed by the handshake workers, but this call
+// blocks until one has completed.  Plain connections have no handshake
+// to race, and are made as netconnect().
+//
+
+INET *nethedgeconnect(char *hostname, int port, enum netflags flags)
+{
+  if (!hostname) return NULL ;
+
+  double start = _net_monotime() ;
+  flags |= BALANCE ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  double hedgeat = start + _net_hedgestart(&_net_hedge.connects, &_net_hedge.stats.connects) ;
+  pthread_mutex_unlock(&_net_lock) ;
+
+  if (!(flags&TLS || flags&SSL2 || flags&SSL3)) return netconnect(hostname, port, flags) ;
+
+  INET *c[2] = { NULL, NULL } ;
+  int hedged = 0, w = -1 ;
+
+  c[0] = _net_connect(hostname, port, flags|ASYNCHANDSHAKE, _net_timeoutdefaults) ;
+  if (!c[0]) {
+    pthread_mutex_lock(&_net_lock) ;
+    _net_hedge.stats.failures++ ;
+    pthread_mutex_unlock(&_net_lock) ;
+  }
+
+  while (w<0) {
+
+    // Hedge once the delay has passed, or at once if the first has failed
+
+    if ( !hedged && (!c[0] || _net_monotime() >= hedgeat) ) {
+      hedged = 1 ;
+      if (_net_hedgeadmit()) c[1] = _net_hedgeopen(hostname, port, flags|ASYNCHANDSHAKE, c[0]) ;
+    }
+    if (!c[0] && !c[1]) break ;
+
+    int i = _net_hswait(c, 2, hedged ? 0 : hedgeat) ;
+    if (i<0) continue ;
+
+    if (_net_hspoll(c[i], "nethedgeconnect", 0) > 0) {
+      w = i ;
+    } else {
+      netclose(c[i]) ;
+      c[i] = NULL ;
+      pthread_mutex_lock(&_net_lock) ;
+      _net_hedge.stats.failures++ ;
+      pthread_mutex_unlock(&_net_lock) ;
+    }
+
+  }
+
+  if (w<0) {
+    errno = EHOSTUNREACH ;
+    return NULL ;
+  }
+
+  pthread_mutex_lock(&_net_lock) ;
+  _net_hedgesample(&_net_hedge.connects, _net_monotime() - start) ;
+  if (w==1) _net_hedge.stats.wins++ ;
+  else if (c[1]) _net_hedge.stats.losses++ ;
+  pthread_mutex_unlock(&_net_lock) ;
+
+  if (c[1-w]) _net_hedgecancel(c[1-w]) ;
+  c[w]->flags = flags ;
+
+  return c[w] ;
+}
+
+
+//
+// @brief Send an idempotent request, replaying it on a second connection
+//        if the response is slow to start
+// @param(in,out) sh Handle of open connection, replaced by the hedge's
+//                connection if that responds first (the original is then
+//                closed)
+// @param(in) request Request to send, in one netsend()
+// @param(in) len Length of request
+// @param(out) response Buffer for the start of the response
+// @param(in) maxlen Size of response buffer
+// @return Number of bytes received, or -1 on error (setting errno).  The
+//         rest of the response is read from *sh with netrecv().
+//
+
+int nethedgerequest(INET **sh, char *request, int len, char *response, int maxlen)
+{
+  if (!sh || !*sh || !request || len<=0 || !response || maxlen<=0) {
+    errno = EINVAL ;
+    return -1 ;
+  }
+
+  double start = _net_monotime() ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  double hedgeat = start + _net_hedgestart(&_net_hedge.requests, &_net_hedge.stats.requests) ;
+  pthread_mutex_unlock(&_net_lock) ;
+
+  // Both connections are raced as NONBLOCK, so that a TLS record which
+  // is not application data cannot stall the other
+
+  INET *c[2] = { *sh, NULL } ;
+  int live[2] = { 1, 0 }, sent[2] = { 1, 0 }, hedged = 0, failed = 0, w = -1, r = -1 ;
+  enum netflags flags = c[0]->flags | BALANCE ;
+  int blocking = c[0]->isblocking ;
+
+  _net_opendevnull() ;
+
+  if (!_net_hedgesend(c[0], request, len)) {
+    live[0] = 0 ;
+    failed++ ;
+  }
+
+  while (w<0) {
+
+    // Hedge once the delay has passed, or at once if the first has failed
+
+    if ( !hedged && (!live[0] || _net_monotime() >= hedgeat) ) {
+      hedged = 1 ;
+      if (_net_hedgeadmit()) {
+        c[1] = _net_hedgeopen(c[0]->hostname, c[0]->origport, flags|NONBLOCK|ASYNCHANDSHAKE, c[0]) ;
+        live[1] = (c[1]!=NULL) ;
+      }
+    }
+
+    // The hedge's request goes once its handshake completes
+
+    for (int i=0; i<2; i++) {
+      if (!live[i] || sent[i]) continue ;
+      int h = nethandshakedone(c[i]) ;
+      if (h>0) sent[i] = 1 ;
+      if ( (h>0 && !_net_hedgesend(c[i], request, len)) || h<0 ) {
+        live[i] = 0 ;
+        failed++ ;
+      }
+    }
+    if (!live[0] && !live[1]) break ;
+
+    // poll(), as the caller's descriptors may be beyond FD_SETSIZE
+
+    struct pollfd pfd[2] ;
+    int n = 0, at[2] = { -1, -1 } ;
+    int timeout = hedged ? -1 : _net_msremaining(hedgeat) ;
+    for (int i=0; i<2; i++) {
+      if (!live[i]) continue ;
+      if (_net_rdbuffered(c[i])) timeout = 0 ;
+      pfd[n].fd = c[i]->hs ? nethandshakefd() : c[i]->fd ;
+      pfd[n].events = POLLIN | (c[i]->sslwantwrite ? POLLOUT : 0) ;
+      pfd[n].revents = 0 ;
+      at[i] = n++ ;
+    }
+
+    if (poll(pfd, n, timeout)<0 && errno!=EINTR) break ;
+
+    for (int i=0; i<2 && w<0; i++) {
+
+      if (!live[i]) continue ;
+
+      if (!sent[i]) continue ;
+      if (!pfd[at[i]].revents && !_net_rdbuffered(c[i])) continue ;
+      errno = 0 ;
+      int n = netrecv(c[i], response, maxlen) ;
+      if (n>0) {
+        w = i ;
+        r = n ;
+      } else if (n<0 && !_net_wouldblock()) {
+        live[i] = 0 ;
+        failed++ ;
+      }
+
+    }
+
+  }
+
+  pthread_mutex_lock(&_net_lock) ;
+  if (w>=0) _net_hedgesample(&_net_hedge.requests, _net_monotime() - start) ;
+  if (w==1) _net_hedge.stats.wins++ ;
+  else if (w==0 && live[1]) _net_hedge.stats.losses++ ;
+  _net_hedge.stats.failures += failed ;
+  pthread_mutex_unlock(&_net_lock) ;
+
+  // The loser is closed, the first connection only if it was replaced
+
+  if (w==1) {
+    c[1]->flags = flags ;
+    _net_hedgecancel(c[0]) ;
+    *sh = c[1] ;
+  } else if (c[1]) {
+    _net_hedgecancel(c[1]) ;
+  }
+  if (blocking) _net_hedgeblocking(*sh, 1) ;
+
+  if (w<0 && !errno) errno = EHOSTUNREACH ;
+  return r ;
+}
+
+
+//
+// @brief Configure hedging
+// @param(in) percentile Latency percentile after which to hedge, 50 to 100
+// @param(in) mindelayms Smallest hedge delay in milliseconds
+// @param(in) maxdelayms Largest hedge delay in milliseconds
+// @param(in) budget Hedges allowed per 100 operations, 0 disables hedging
+// @return true on success, or false if parameters are invalid
+//
+
+int nethedgeconfig(int percentile, int mindelayms, int maxdelayms, int budget)
+{
+  if (percentile<50 || percentile>100 || mindelayms<0 || maxdelayms<mindelayms || 
+      budget<0 || budget>100) return 0 ;
+  pthread_mutex_lock(&_net_lock) ;
+  _net_hedge.percentile = percentile ;
+  _net_hedge.mindelayms = mindelayms ;
+  _net_hedge.maxdelayms = maxdelayms ;
+  _net_hedge.budget = budget ;
+  if (budget==0) _net_hedge.tokens = 0 ;
+  pthread_mutex_unlock(&_net_lock) ;
+  return 1 ;
+}
+
+
+//
+// @brief Obtain hedging statistics
+// @param(out) st Statistics structure to populate
+// @return true on success
+//
+
+int nethedgestats(struct nethedgestats *st)
+{
+  if (!st) return 0 ;
+
+  pthread_mutex_lock(&_net_lock) ;
+  *st = _net_hedge.stats ;
+  st->connectdelayms = _net_hedgedelay(&_net_hedge.connects) * 1000 ;
+  st->requestdelayms = _net_hedgedelay(&_net_hedge.requests) * 1000 ;
+  pthread_mutex_unlock(&_net_lock) ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Re-establish a connection to the same destination
+// @param(in) sh Handle of connection to re-establish
+// @param(in) maxattempts Number of connection attempts before giving up
+// @return true on success, or false on error (setting errno)
+//
+// Attempts are separated by the destination's backoff, so this call
+// blocks.  Rate limits and timeouts are retained, compression, busy
+// polling, zero copy, idle memory, corking and read-ahead must be re-enabled.
+// The handshake is performed here even with ASYNCHANDSHAKE.
+//
+
+int netreconnect(INET *sh, int maxattempts)
+{
+  if (!sh || !sh->hostname) return 0 ;
+
+  for (int attempt=0; attempt<maxattempts; attempt++) {
+
+    if (attempt>0) {
+
+      // Wait for the circuit to allow a probe, or for a short backoff
+
+      struct netbreakerstats st ;
+      double wait = _net_breaker.basems / 1000.0 ;
+      if (netbreakerstate(sh->hostname, sh->peerport, &st) == NETBREAKER_OPEN) {
+        wait = st.retryinms / 1000.0 ;
+      }
+      wait *= 0.5 + 0.5 * (_net_random() % 1000) / 1000.0 ;
+
+      struct timespec ts ;
+      ts.tv_sec = (time_t)wait ;
+      ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9) ;
+      nanosleep(&ts, NULL) ;
+
+    }
+
+    // The handshake is performed here, as a worker would hold the
+    // temporary handle
+
+    INET *nsh = _net_connect(sh->hostname, sh->origport, sh->flags & ~ASYNCHANDSHAKE, 
+                             sh->to ? sh->to->ms : _net_timeoutdefaults) ;
+    if (!nsh) continue ;
+    nsh->flags = sh->flags ;
+
+    // Move the new connection into the caller's handle
+
+    struct _net_pacing *pace = sh->pace ;
+    sh->pace = NULL ;
+    _net_disconnect(sh) ;
+    *sh = *nsh ;
+    free(nsh) ;
+    pthread_mutex_lock(&_net_lock) ;
+    _net_numconnections-- ;
+    pthread_mutex_unlock(&_net_lock) ;
+
+    if (pace) {
+      sh->pace = pace ;
+      if (pace->conn.rate>0) netsetrate(sh, pace->conn.rate, pace->conn.burst) ;
+    }
+
+    return 1 ;
+
+  }
+
+  return 0 ;
+}
+
+
+int neterrno()
+{
+  return _net_errno ;
+}
+
+
+int netwouldblock()
+{
+  return _net_wouldblock() ;
 }
 
 
 char *netcertstatusstr(int statusno)
 {
+#ifdef NET_NOTLS
+  if (statusno==-1) return "unable to get peer certificate" ;
+  return "TLS not supported by this build" ;
+#else
   switch(statusno) {
   case X509_V_OK: return "certificate ok" ;
   case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT: return "unable to get issuer certificate" ;
@@ -777,7 +7037,7 @@ char *netcertstatusstr(int statusno)
   case X509_V_ERR_UNABLE_TO_DECRYPT_CRL_SIGNATURE: return "unable to decrypt CRL's signature" ;
   case X509_V_ERR_UNABLE_TO_DECODE_ISSUER_PUBLIC_KEY: return "unable to decode issuer public key" ;
   case X509_V_ERR_CERT_SIGNATURE_FAILURE: return "certificate signature failure" ;
-  case X509_V_ERR_CRL_SIGNATURE_FAILURE: "CRL signature failure" ;
+  case X509_V_ERR_CRL_SIGNATURE_FAILURE: return "CRL signature failure" ;
   case X509_V_ERR_CERT_NOT_YET_VALID: return "certificate is not yet valid" ;
   case X509_V_ERR_CERT_HAS_EXPIRED: return "certificate has expired" ;
   case X509_V_ERR_CRL_NOT_YET_VALID: return "CRL is not yet valid" ;
@@ -805,6 +7065,7 @@ char *netcertstatusstr(int statusno)
   case -1: return "unable to get peer certificate" ;
   default: return "unknown error" ;
   }
+#endif
 }
 
 char *netstrerrorcontext() 
@@ -828,6 +7089,14 @@ char *netstrerror()
     case NET_ERR_BADP: return "invalid port number" ;
     case NET_ERR_BADA: return "invalid address" ;
     case NET_ERR_TIMEOUT: return "timeout establishing connection" ;
+    case NET_ERR_NOTSUP: return "not supported by this build" ;
+    case NET_ERR_INUSE: return "option already enabled" ;
+    case NET_ERR_COMPRESS: return "compression stream error" ;
+    case NET_ERR_THROTTLED: return "rate limited, not writable until netthrottleduntil()" ;
+    case NET_ERR_CIRCUITOPEN: return "destination circuit open, failing fast" ;
+    case NET_ERR_READTIMEOUT: return "read timeout, no data received" ;
+    case NET_ERR_WRITETIMEOUT: return "write timeout, peer not accepting data" ;
+    case NET_ERR_IDLETIMEOUT: return "idle timeout, no data sent or received" ;
     default: return "unknown error" ;
     }
 
@@ -884,6 +7153,8 @@ int _net_seterrno(INET *sh, char *context, enum net_errno_type type, int errcode
   } else if (type == NET_ERR_SSL) { 
 
     _net_errno = NET_ERR_SSL + SSL_get_error(sh->ssl, errcode) ;
+    if ( _net_errno == NET_ERR_SSL + SSL_ERROR_SSL ||
+         _net_errno == NET_ERR_SSL + SSL_ERROR_SYSCALL ) sh->sslfatal = 1 ;
     if (_net_errno == NET_ERR_SSL) _net_errno=errno ;
 
   } else {
@@ -0,0 +1,872 @@
+//
+// netmux.c
+//
+// Stream multiplexing over a single NET connection
+//
+// NETMUX *netmuxstart(NET *sh, int initiator)
+// NETSTREAM *netmuxopen(NETMUX *m)
+// NETSTREAM *netmuxaccept(NETMUX *m)
+// int netmuxsend(NETSTREAM *st, char *buf, int len)
+// int netmuxrecv(NETSTREAM *st, char *buf, int maxlen)
+// int netmuxshutdown(NETSTREAM *st)
+// int netmuxclose(NETSTREAM *st)
+// int netmuxid(NETSTREAM *st)
+// int netmuxrdfdset(NETMUX *m, fd_set *rdfds, fd_set *wrfds, int *l)
+// int netmuxprocess(NETMUX *m, fd_set *rdfds, fd_set *wrfds)
+// NETSTREAM *netmuxready(NETMUX *m)
+// int netmuxstats(NETMUX *m, struct netmuxstats *st)
+// void netmuxstop(NETMUX *m)
+//
+// link with: -lssl -lcrypto -lpthread
+//
+// NOTES
+//
+// Every frame starts with a 9 byte header: a type byte, then the stream
+// id and a length, both 32 bit big endian.  Only DATA frames carry a
+// payload (of up to NETMUX_MAXFRAME bytes), for the others the length
+// field is the value:
+//
+//   DATA    Stream data, opening the stream if the id is new
+//   WINDOW  The receiver has consumed data, length is the window increment
+//   FIN     The sender has finished sending on the stream
+//   RESET   The sender has abandoned the stream, and will read no more
+//
+// The side passing initiator to netmuxstart() numbers its streams 1, 3,
+// 5 ..., the other 2, 4, 6 ..., and a stream is opened by the first frame
+// sent on it.  Each direction of each stream starts with a window of
+// NETMUX_WINDOW bytes, and the receiver grants more as the application
+// reads, in steps of half a window, so a slow reader stops only its own
+// stream.  Frames are gathered into one output buffer and written with a
+// single netsend(): window updates, FIN and RESET first, then one DATA
+// frame per stream with data and window in turn, so a stream sending
+// large amounts cannot starve the others.
+//
+// A multiplexer is driven by one thread, from a select() loop or an
+// event loop watching the connection.  netmuxsend() and netmuxrecv()
+// only ever copy to and from the stream's buffers, and return -1 with
+// errno EAGAIN when they cannot progress.  netmuxprocess() performs the
+// network I/O, after which netmuxaccept() returns streams opened by the
+// peer and netmuxready() streams which have become readable, writable or
+// closed since last returned.  The NET connection must be NONBLOCK.
+//
+
+#define _GNU_SOURCE
+
+#include <sys/select.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+typedef struct _net_mux MUX ;
+typedef struct _mux_stream STREAM ;
+
+#define NETMUX MUX
+#define NETSTREAM STREAM
+#include "../net.h"
+
+#define NETMUX_HDR 9                // Frame header size
+#define NETMUX_MAXFRAME 16384       // Largest DATA payload
+#define NETMUX_WINDOW 65536         // Initial window, each direction
+#define NETMUX_SENDBUF 65536        // Data queued by netmuxsend per stream
+#define NETMUX_MINBUF 4096          // Initial stream buffer size
+#define NETMUX_OUTBUF 65536         // Frames waiting for netsend
+#define NETMUX_INBUF 65536          // Received frames being decoded
+#define NETMUX_MAXSTREAMS 1024      // Open streams, above which the peer's are reset
+#define NETMUX_MAPSIZE 1024         // Stream lookup table size
+
+enum _mux_frames {
+  FRAME_DATA = 0,
+  FRAME_WINDOW = 1,
+  FRAME_FIN = 2,
+  FRAME_RESET = 3
+} ;
+
+enum _mux_queues {
+  Q_ACTIVE = 0,       // Data or FIN to send
+  Q_CONTROL,          // Window update or RESET to send
+  Q_READY,            // Events for netmuxready
+  Q_ACCEPT,           // Opened by the peer, for netmuxaccept
+  NETMUX_QUEUES
+} ;
+
+struct _mux_stream {
+  MUX *m ;             // Owning multiplexer
+  unsigned int id ;    // Stream id
+  char *rbuf ;         // Data received and not yet read
+  int rpos, rlen, rsize ;
+  char *sbuf ;         // Data queued by netmuxsend and not yet framed
+  int spos, slen, ssize ;
+  long sendwindow ;    // Bytes the peer will accept
+  long recvwindow ;    // Bytes the peer may send
+  long consumed ;      // Bytes read since the last window update
+  long windowupdate ;  // Window increment waiting to be sent
+  int finqueued ;      // netmuxshutdown called
+  int finsent ;
+  int finrecvd ;
+  int resetqueued ;    // Closed while the peer was sending
+  int resetsent ;
+  int resetrecvd ;
+  int closed ;         // netmuxclose called, free once frames are sent
+  int wantwrite ;      // netmuxsend was refused, report when there is space
+  int queued[NETMUX_QUEUES] ;
+  STREAM *next[NETMUX_QUEUES] ;
+  STREAM *mapnext ;    // Stream lookup chain
+} ;
+
+struct _mux_queue {
+  STREAM *head, *tail ;
+  int count ;
+} ;
+
+struct _net_mux {
+  NET *sh ;            // Connection carrying the streams
+  unsigned int nextid ;     // Id for the next stream opened locally
+  unsigned int lastpeerid ; // Highest id opened by the peer
+  int nstreams ;
+  int failed ;         // errno once the connection has failed, else 0
+  int retry ;          // Output must be resent from the same address
+  struct _mux_queue q[NETMUX_QUEUES] ;
+  STREAM *map[NETMUX_MAPSIZE] ;
+  struct netmuxstats stats ;
+  int outpos, outlen ;
+  int inlen ;
+  char out[NETMUX_OUTBUF] ;
+  char in[NETMUX_INBUF] ;
+} ;
+
+
+//
+// @brief Append a stream to a queue, unless already queued
+//
+
+void _mux_push(MUX *m, int q, STREAM *st)
+{
+  if (st->queued[q]) return ;
+  st->queued[q] = 1 ;
+  st->next[q] = NULL ;
+  if (m->q[q].tail) m->q[q].tail->next[q] = st ;
+  else m->q[q].head = st ;
+  m->q[q].tail = st ;
+  m->q[q].count++ ;
+}
+
+
+//
+// @brief Take the stream at the head of a queue
+//
+
+STREAM *_mux_pop(MUX *m, int q)
+{
+  STREAM *st = m->q[q].head ;
+  if (!st) return NULL ;
+  m->q[q].head = st->next[q] ;
+  if (!m->q[q].head) m->q[q].tail = NULL ;
+  m->q[q].count-- ;
+  st->queued[q] = 0 ;
+  return st ;
+}
+
+
+//
+// @brief Find a stream, and optionally unlink it from the map
+//
+
+STREAM *_mux_find(MUX *m, unsigned int id, int unlink)
+{
+  STREAM **pst = &m->map[id % NETMUX_MAPSIZE] ;
+
+  while (*pst && (*pst)->id != id) pst = &(*pst)->mapnext ;
+
+  STREAM *st = *pst ;
+  if (st && unlink) *pst = st->mapnext ;
+  return st ;
+}
+
+
+//
+// @brief Create a stream
+//
+
+STREAM *_mux_new(MUX *m, unsigned int id)
+{
+  STREAM *st = malloc(sizeof(STREAM)) ;
+  if (!st) return NULL ;
+  memset(st, '\0', sizeof(STREAM)) ;
+  st->m = m ;
+  st->id = id ;
+  st->sendwindow = NETMUX_WINDOW ;
+  st->recvwindow = NETMUX_WINDOW ;
+
+  unsigned int h = id % NETMUX_MAPSIZE ;
+  st->mapnext = m->map[h] ;
+  m->map[h] = st ;
+  m->nstreams++ ;
+  return st ;
+}
+
+
+//
+// @brief Free a closed stream once it has nothing left to send and is
+//        no longer queued
+//
+
+void _mux_release(STREAM *st)
+{
+  MUX *m = st->m ;
+
+  if (!st->closed) return ;
+  for (int q=0; q<NETMUX_QUEUES; q++) {
+    if (st->queued[q]) return ;
+  }
+  if (!st->finsent && !st->resetsent && !st->resetrecvd && !m->failed) return ;
+
+  _mux_find(m, st->id, 1) ;
+  m->nstreams-- ;
+  free(st->rbuf) ;
+  free(st->sbuf) ;
+  free(st) ;
+}
+
+
+//
+// @brief Report an event on a stream to netmuxready
+//
+
+void _mux_ready(STREAM *st)
+{
+  if (!st->closed) _mux_push(st->m, Q_READY, st) ;
+}
+
+
+//
+// @brief Grow a stream buffer to hold len bytes, moving data to the front
+// @return true on success, or false if out of memory
+//
+
+int _mux_reserve(char **buf, int *pos, int *used, int *size, int len)
+{
+  if (*pos>0) {
+    memmove(*buf, *buf + *pos, *used - *pos) ;
+    *used -= *pos ;
+    *pos = 0 ;
+  }
+  if (*used + len <= *size) return 1 ;
+
+  int newsize = *size ? *size : NETMUX_MINBUF ;
+  while (newsize < *used + len) newsize *= 2 ;
+  char *b = realloc(*buf, newsize) ;
+  if (!b) return 0 ;
+  *buf = b ;
+  *size = newsize ;
+  return 1 ;
+}
+
+
+//
+// @brief Mark the connection failed, waking every stream
+//
+
+void _mux_fail(MUX *m, int e)
+{
+  if (!m->failed) m->failed = e ? e : ECONNRESET ;
+  for (int h=0; h<NETMUX_MAPSIZE; h++) {
+    for (STREAM *st=m->map[h]; st; st=st->mapnext) _mux_ready(st) ;
+  }
+}
+
+
+//
+// @brief Append a frame header to the output buffer
+//
+
+void _mux_header(MUX *m, int type, unsigned int id, unsigned int len)
+{
+  unsigned char *p = (unsigned char *)m->out + m->outlen ;
+  p[0] = type ;
+  p[1] = id >> 24 ; p[2] = id >> 16 ; p[3] = id >> 8 ; p[4] = id ;
+  p[5] = len >> 24 ; p[6] = len >> 16 ; p[7] = len >> 8 ; p[8] = len ;
+  m->outlen += NETMUX_HDR ;
+  m->stats.framesout++ ;
+}
+
+
+//
+// @brief Encode queued frames into the output buffer
+//
+
+void _mux_fill(MUX *m)
+{
+  STREAM *st ;
+
+  // A TLS write waiting to be retried must be repeated from the same
+  // address, so the buffer is only compacted after a completed write
+
+  if (!m->retry && m->outpos>0) {
+    memmove(m->out, m->out + m->outpos, m->outlen - m->outpos) ;
+    m->outlen -= m->outpos ;
+    m->outpos = 0 ;
+  }
+
+  // Control frames first, they are small and unblock the peer
+
+  while (NETMUX_OUTBUF - m->outlen >= NETMUX_HDR && (st = _mux_pop(m, Q_CONTROL))) {
+    if (st->resetqueued && !st->resetsent) {
+      _mux_header(m, FRAME_RESET, st->id, 0) ;
+      st->resetsent = 1 ;
+    } else if (st->windowupdate>0 && !st->resetsent) {
+      _mux_header(m, FRAME_WINDOW, st->id, st->windowupdate) ;
+      st->windowupdate = 0 ;
+    }
+    _mux_release(st) ;
+  }
+
+  // Then a frame from each stream in turn
+
+  while (NETMUX_OUTBUF - m->outlen > NETMUX_HDR && (st = _mux_pop(m, Q_ACTIVE))) {
+
+    if (st->resetsent || st->resetrecvd) {
+      _mux_release(st) ;
+      continue ;
+    }
+
+    long n = st->slen - st->spos ;
+    if (n > st->sendwindow) n = st->sendwindow ;
+    if (n > NETMUX_MAXFRAME) n = NETMUX_MAXFRAME ;
+    if (n > NETMUX_OUTBUF - m->outlen - NETMUX_HDR) n = NETMUX_OUTBUF - m->outlen - NETMUX_HDR ;
+
+    if (n>0) {
+      _mux_header(m, FRAME_DATA, st->id, n) ;
+      memcpy(m->out + m->outlen, st->sbuf + st->spos, n) ;
+      m->outlen += n ;
+      st->spos += n ;
+      st->sendwindow -= n ;
+      m->stats.bytesout += n ;
+      if (st->spos==st->slen) st->spos = st->slen = 0 ;
+      if (st->wantwrite) {
+        st->wantwrite = 0 ;
+        _mux_ready(st) ;
+      }
+    }
+
+    if (st->slen > st->spos) {
+      if (st->sendwindow>0) _mux_push(m, Q_ACTIVE, st) ;
+      else m->stats.windowstalls++ ;
+    } else if (st->finqueued && !st->finsent) {
+      if (NETMUX_OUTBUF - m->outlen >= NETMUX_HDR) {
+        _mux_header(m, FRAME_FIN, st->id, 0) ;
+        st->finsent = 1 ;
+      } else {
+        _mux_push(m, Q_ACTIVE, st) ;
+      }
+    }
+
+    _mux_release(st) ;
+  }
+}
+
+
+//
+// @brief Encode and send queued frames
+// @return true on success, or false if the connection has failed
+//
+
+int _mux_flush(MUX *m)
+{
+  for (;;) {
+
+    _mux_fill(m) ;
+    if (m->outpos==m->outlen) return 1 ;
+
+    int r = netsend(m->sh, m->out + m->outpos, m->outlen - m->outpos) ;
+    if (r<=0) {
+      if (netwouldblock()) {
+        m->retry = 1 ;
+        return 1 ;
+      }
+      _mux_fail(m, EPIPE) ;
+      return 0 ;
+    }
+
+    m->retry = 0 ;
+    m->outpos += r ;
+    m->stats.writes++ ;
+
+    // Stop once everything queued has been written
+
+    if (m->outpos==m->outlen && !m->q[Q_CONTROL].count && !m->q[Q_ACTIVE].count) {
+      m->outpos = m->outlen = 0 ;
+      return 1 ;
+    }
+  }
+}
+
+
+//
+// @brief Apply a received frame
+// @return true on success, or false on a protocol error (setting errno)
+//
+
+int _mux_frame(MUX *m, int type, unsigned int id, unsigned int len, char *payload)
+{
+  STREAM *st = _mux_find(m, id, 0) ;
+
+  if (!st) {
+
+    // Frames for streams which have since closed are dropped
+
+    if ((id&1)==(m->nextid&1) || id<=m->lastpeerid || type==FRAME_RESET) return 1 ;
+
+    m->lastpeerid = id ;
+    st = _mux_new(m, id) ;
+    if (!st) return 0 ;
+
+    if (m->nstreams > NETMUX_MAXSTREAMS) {
+      st->closed = 1 ;
+      st->resetqueued = 1 ;
+      m->stats.resets++ ;
+      _mux_push(m, Q_CONTROL, st) ;
+    } else {
+      m->stats.accepted++ ;
+      _mux_push(m, Q_ACCEPT, st) ;
+    }
+  }
+
+  switch (type) {
+
+  case FRAME_DATA:
+    if (len > st->recvwindow) {
+      errno = EPROTO ;
+      return 0 ;
+    }
+    st->recvwindow -= len ;
+    m->stats.bytesin += len ;
+    if (st->closed || st->finrecvd) break ;
+    if (!_mux_reserve(&st->rbuf, &st->rpos, &st->rlen, &st->rsize, len)) return 0 ;
+    memcpy(st->rbuf + st->rlen, payload, len) ;
+    st->rlen += len ;
+    _mux_ready(st) ;
+    break ;
+
+  case FRAME_WINDOW:
+    st->sendwindow += len ;
+    if (st->slen > st->spos || (st->finqueued && !st->finsent)) _mux_push(m, Q_ACTIVE, st) ;
+    break ;
+
+  case FRAME_FIN:
+    st->finrecvd = 1 ;
+    _mux_ready(st) ;
+    break ;
+
+  case FRAME_RESET:
+    st->resetrecvd = 1 ;
+    st->spos = st->slen = 0 ;
+    m->stats.resets++ ;
+    _mux_ready(st) ;
+    break ;
+
+  default:
+    errno = EPROTO ;
+    return 0 ;
+  }
+
+  _mux_release(st) ;
+  return 1 ;
+}
+
+
+//
+// @brief Decode the complete frames in the input buffer
+// @return true on success, or false on a protocol error (setting errno)
+//
+
+int _mux_input(MUX *m)
+{
+  int pos = 0 ;
+
+  while (m->inlen - pos >= NETMUX_HDR) {
+
+    unsigned char *p = (unsigned char *)m->in + pos ;
+    unsigned int id = (p[1]<<24) | (p[2]<<16) | (p[3]<<8) | p[4] ;
+    unsigned int len = (p[5]<<24) | (p[6]<<16) | (p[7]<<8) | p[8] ;
+    unsigned int plen = (p[0]==FRAME_DATA) ? len : 0 ;
+
+    if (plen > NETMUX_MAXFRAME) {
+      errno = EPROTO ;
+      return 0 ;
+    }
+    if (m->inlen - pos < NETMUX_HDR + plen) break ;
+
+    m->stats.framesin++ ;
+    if (!_mux_frame(m, p[0], id, len, m->in + pos + NETMUX_HDR)) return 0 ;
+    pos += NETMUX_HDR + plen ;
+  }
+
+  memmove(m->in, m->in + pos, m->inlen - pos) ;
+  m->inlen -= pos ;
+  return 1 ;
+}
+
+
+//
+// @brief Start multiplexing streams over a connection
+// @param(in) sh Handle of open NONBLOCK connection, used only through the
+//            multiplexer until netmuxstop
+// @param(in) initiator True on one side of the connection and false on
+//            the other, to keep their stream ids apart
+// @return Handle to multiplexer, or NULL on failure (and sets errno)
+//
+
+MUX *netmuxstart(NET *sh, int initiator)
+{
+  if (!sh) {
+    errno = EINVAL ;
+    return NULL ;
+  }
+
+  MUX *m = malloc(sizeof(MUX)) ;
+  if (!m) return NULL ;
+  memset(m, '\0', offsetof(MUX, out)) ;
+  m->sh = sh ;
+  m->nextid = initiator ? 1 : 2 ;
+  return m ;
+}
+
+
+//
+// @brief Open a stream
+// @param(in) m Multiplexer
+// @return Handle to stream, or NULL on failure (and sets errno)
+//
+
+STREAM *netmuxopen(MUX *m)
+{
+  if (!m) {
+    errno = EINVAL ;
+    return NULL ;
+  }
+  if (m->failed) {
+    errno = m->failed ;
+    return NULL ;
+  }
+  if (m->nstreams >= NETMUX_MAXSTREAMS) {
+    errno = EMFILE ;
+    return NULL ;
+  }
+
+  STREAM *st = _mux_new(m, m->nextid) ;
+  if (!st) return NULL ;
+  m->nextid += 2 ;
+  m->stats.opened++ ;
+  return st ;
+}
+
+
+//
+// @brief Obtain the next stream opened by the peer
+// @param(in) m Multiplexer
+// @return Handle to stream, or NULL if none
+//
+
+STREAM *netmuxaccept(MUX *m)
+{
+  STREAM *st ;
+  if (!m) return NULL ;
+
+  while ((st = _mux_pop(m, Q_ACCEPT))) {
+    if (!st->closed) return st ;
+    _mux_release(st) ;
+  }
+  return NULL ;
+}
+
+
+//
+// @brief Queue data on a stream
+// @param(in) st Stream
+// @param(in) buf Data to be sent
+// @param(in) len Amount of data to send
+// @return Number of bytes queued, or -1 on error (setting errno, EAGAIN
+//         if the stream's buffer is full)
+//
+
+int netmuxsend(STREAM *st, char *buf, int len)
+{
+  if (!st || !buf || len<0 || st->closed) {
+    errno = EINVAL ;
+    return -1 ;
+  }
+
+  MUX *m = st->m ;
+  if (m->failed) {
+    errno = m->failed ;
+    return -1 ;
+  }
+  if (st->resetrecvd) {
+    errno = ECONNRESET ;
+    return -1 ;
+  }
+  if (st->finqueued) {
+    errno = EPIPE ;
+    return -1 ;
+  }
+
+  int n = NETMUX_SENDBUF - (st->slen - st->spos) ;
+  if (n > len) n = len ;
+  if (n<=0) {
+    st->wantwrite = 1 ;
+    errno = EAGAIN ;
+    return -1 ;
+  }
+
+  if (!_mux_reserve(&st->sbuf, &st->spos, &st->slen, &st->ssize, n)) return -1 ;
+  memcpy(st->sbuf + st->slen, buf, n) ;
+  st->slen += n ;
+  if (n<len) st->wantwrite = 1 ;
+
+  if (st->sendwindow>0) _mux_push(m, Q_ACTIVE, st) ;
+  return n ;
+}
+
+
+//
+// @brief Read data received on a stream
+// @param(in) st Stream
+// @param(in) buf Buffer to store data
+// @param(in) maxlen Maximum number of bytes to read
+// @return Number of bytes read, 0 once the peer has finished sending, or
+//         -1 on error (setting errno, EAGAIN if nothing has arrived)
+//
+
+int netmuxrecv(STREAM *st, char *buf, int maxlen)
+{
+  if (!st || !buf || maxlen<0 || st->closed) {
+    errno = EINVAL ;
+    return -1 ;
+  }
+
+  MUX *m = st->m ;
+  int n = st->rlen - st->rpos ;
+
+  if (n>0) {
+
+    if (n > maxlen) n = maxlen ;
+    memcpy(buf, st->rbuf + st->rpos, n) ;
+    st->rpos += n ;
+    if (st->rpos==st->rlen) st->rpos = st->rlen = 0 ;
+
+    // Grant the peer more window once half has been consumed
+
+    st->consumed += n ;
+    if (!st->finrecvd && !st->resetrecvd && st->consumed >= NETMUX_WINDOW/2) {
+      st->windowupdate += st->consumed ;
+      st->recvwindow += st->consumed ;
+      st->consumed = 0 ;
+      _mux_push(m, Q_CONTROL, st) ;
+    }
+    return n ;
+  }
+
+  if (st->finrecvd) return 0 ;
+
+  errno = st->resetrecvd ? ECONNRESET : (m->failed ? m->failed : EAGAIN) ;
+  return -1 ;
+}
+
+
+//
+// @brief Finish sending on a stream, once queued data has been sent.
+//        Data can still be received.
+// @param(in) st Stream
+// @return true on success, or false on error (setting errno)
+//
+
+int netmuxshutdown(STREAM *st)
+{
+  if (!st || st->closed) {
+    errno = EINVAL ;
+    return 0 ;
+  }
+
+  if (!st->finqueued) {
+    st->finqueued = 1 ;
+    if (st->slen==st->spos || st->sendwindow>0) _mux_push(st->m, Q_ACTIVE, st) ;
+  }
+  return 1 ;
+}
+
+
+//
+// @brief Close a stream.  If the peer has finished sending, queued data
+//        is sent followed by FIN, otherwise queued data is discarded and
+//        the stream is reset.  The handle must not be used again.
+// @param(in) st Stream
+// @return true on success, or false on error (setting errno)
+//
+
+int netmuxclose(STREAM *st)
+{
+  if (!st || st->closed) {
+    errno = EINVAL ;
+    return 0 ;
+  }
+
+  MUX *m = st->m ;
+
+  if (!st->finrecvd && !st->resetrecvd && !m->failed) {
+    st->spos = st->slen = 0 ;
+    st->resetqueued = 1 ;
+    m->stats.resets++ ;
+    _mux_push(m, Q_CONTROL, st) ;
+  } else {
+    netmuxshutdown(st) ;
+  }
+
+  st->closed = 1 ;
+  _mux_release(st) ;
+  return 1 ;
+}
+
+
+//
+// @brief Obtain a stream's id
+//
+
+int netmuxid(STREAM *st)
+{
+  return st ? (int)st->id : -1 ;
+}
+
+
+//
+// @brief Add the connection to the fd_sets, for reading and, while frames
+//        are waiting to be sent, writing
+// @param(in) m Multiplexer
+// @param(in) rdfds FD Set for select()
+// @param(in) wrfds FD Set for select()
+// @param(inout) l pointer to largest fd found
+// @return number of connections added
+//
+
+int netmuxrdfdset(MUX *m, fd_set *rdfds, fd_set *wrfds, int *l)
+{
+  if (!m || m->failed) return 0 ;
+
+  int n = netrdfdset(m->sh, rdfds, wrfds, l) ;
+  if (m->outpos < m->outlen || m->q[Q_CONTROL].count || m->q[Q_ACTIVE].count) {
+    netwrfdset(m->sh, wrfds, l) ;
+  }
+  return n ;
+}
+
+
+//
+// @brief Receive and send frames.  Call after select() (or when the
+//        connection is reported ready by an event loop), and after
+//        queueing data.
+// @param(in) m Multiplexer
+// @param(in) rdfds Read fd set, or NULL to read whatever is available
+// @param(in) wrfds Write fd set, or NULL
+// @return Number of streams waiting to be returned by netmuxready, or -1
+//         if the connection has failed (setting errno)
+//
+
+int netmuxprocess(MUX *m, fd_set *rdfds, fd_set *wrfds)
+{
+  if (!m) {
+    errno = EINVAL ;
+    return -1 ;
+  }
+
+  if (!m->failed && (!rdfds || netrdfdisset(m->sh, rdfds, wrfds))) {
+
+    int r ;
+    do {
+
+      // A plain connection closing returns -1 without setting errno
+
+      errno = 0 ;
+      r = netrecv(m->sh, m->in + m->inlen, NETMUX_INBUF - m->inlen) ;
+      if (r>0) {
+        m->inlen += r ;
+        if (!_mux_input(m)) {
+          _mux_fail(m, errno) ;
+          break ;
+        }
+      } else if (r<0 && !netwouldblock()) {
+        _mux_fail(m, ECONNRESET) ;
+      }
+
+    } while (r>0 && nethaspending(m->sh)) ;
+
+  }
+
+  if (!m->failed) _mux_flush(m) ;
+
+  if (m->failed) {
+    errno = m->failed ;
+    return -1 ;
+  }
+  return m->q[Q_READY].count ;
+}
+
+
+//
+// @brief Obtain the next stream which has become readable, writable or
+//        closed, or has failed.  A stream is returned once per change, so
+//        read until netmuxrecv fails with EAGAIN.
+// @param(in) m Multiplexer
+// @return Handle to stream, or NULL if none
+//
+
+STREAM *netmuxready(MUX *m)
+{
+  STREAM *st ;
+  if (!m) return NULL ;
+
+  while ((st = _mux_pop(m, Q_READY))) {
+    if (!st->closed) return st ;
+    _mux_release(st) ;
+  }
+  return NULL ;
+}
+
+
+//
+// @brief Obtain multiplexer statistics
+// @param(in) m Multiplexer
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if m or st is NULL
+//
+
+int netmuxstats(MUX *m, struct netmuxstats *st)
+{
+  if (!m || !st) return 0 ;
+  *st = m->stats ;
+  st->streams = m->nstreams ;
+  return 1 ;
+}
+
+
+//
+// @brief Free the multiplexer and its streams.  The connection is not
+//        closed, and remains owned by the caller.
+// @param(in) m Multiplexer
+//
+
+void netmuxstop(MUX *m)
+{
+  if (!m) return ;
+
+  for (int h=0; h<NETMUX_MAPSIZE; h++) {
+    STREAM *st = m->map[h] ;
+    while (st) {
+      STREAM *next = st->mapnext ;
+      free(st->rbuf) ;
+      free(st->sbuf) ;
+      free(st) ;
+      st = next ;
+    }
+  }
+  free(m) ;
+}
@@ -0,0 +1,736 @@
+//
+// netsched.c
+//
+// Multi-threaded scheduler for NET connections
+//
+// NETSCHED *netschedstart(int nworkers, int pin)
+// int netschedadd(NETSCHED *s, NET *sh, netschedfn fn, void *arg)
+// int netschedremove(NETSCHED *s, NET *sh)
+// int netschedmigrate(NETSCHED *s, NET *sh, int worker)
+// int netschedworkers(NETSCHED *s)
+// int netschedstats(NETSCHED *s, int worker, struct netschedstats *st)
+// void netschedstop(NETSCHED *s)
+//
+// link with: -lssl -lcrypto -lpthread
+//
+// NOTES
+//
+// Each worker thread owns a set of connections and runs a select() loop
+// over them using the netrdfdset / netrdfdisset helpers, so SSL pending
+// data is handled exactly as for a single threaded caller.  Connections
+// which become readable are queued on their owner's ready queue, and the
+// callback is run by the owner or, if the owner is busy, stolen and run
+// by an idle worker.  A connection is never in an fd_set while it is
+// queued or running, so its callback is only ever run by one thread at a
+// time, and it only moves between workers while idle.
+//
+// Every NETSCHED_BALANCE seconds a worker whose recent event load is well
+// above the least loaded worker hands its busiest idle connection over.
+// The NET handle carries all of the connection's state, including its SSL
+// object, so a migration is just a change of owner.
+//
+// Workers also drive the shared timer wheel, so connection timeouts set
+// with netsettimeout() are reported to the callback as a failed netrecv().
+//
+
+#define _GNU_SOURCE
+
+#include <sys/select.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+typedef struct _net_sched SCHED ;
+
+#define NETSCHED SCHED
+#include "../net.h"
+
+#define NETSCHED_TIMEOUT 50000      // Select timeout in microseconds
+#define NETSCHED_BALANCE 0.1        // Seconds between load balancing checks
+#define NETSCHED_MAPSIZE 4096       // Handle lookup table size
+
+enum _sched_state {
+  CONN_IDLE = 0,      // In the owner's fd_set
+  CONN_QUEUED,        // Ready, waiting on the owner's ready queue
+  CONN_RUNNING        // Callback in progress
+} ;
+
+struct _sched_conn {
+  NET *sh ;            // Connection
+  netschedfn fn ;      // Callback when readable
+  void *arg ;          // Callback argument
+  int owner ;          // Index of owning worker
+  int state ;          // enum _sched_state
+  int removed ;        // Removed while running, free when callback returns
+  unsigned long recent ; // Events since last balancing check
+  struct _sched_conn *prev, *next ;  // Owner's connection list
+  struct _sched_conn *mapnext ;      // Handle lookup chain
+} ;
+
+struct _sched_worker {
+  SCHED *s ;           // Owning scheduler
+  int index ;          // Worker number
+  pthread_t thread ;
+  pthread_mutex_t lock ;  // Guards conns, ready and connection states
+  int wakefd[2] ;      // Pipe used to interrupt select
+  struct _sched_conn *conns ;   // Owned connections
+  struct _sched_conn **ready ;  // Ready queue, a ring buffer
+  int rhead, rcount, rsize ;
+  unsigned long recent ;        // Events since last balancing check
+  double lastbalance ;
+  struct netschedstats stats ;
+} ;
+
+struct _net_sched {
+  int nworkers ;
+  int stop ;
+  struct _sched_worker *workers ;
+  pthread_mutex_t maplock ;     // Guards map
+  struct _sched_conn *map[NETSCHED_MAPSIZE] ;
+} ;
+
+
+double _sched_now()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return ts.tv_sec + ts.tv_nsec/1e9 ;
+}
+
+unsigned int _sched_hash(NET *sh)
+{
+  return ((unsigned long)sh >> 4) % NETSCHED_MAPSIZE ;
+}
+
+
+//
+// @brief Obtain the number of workers started.  Workers run while later
+//        ones are still being started, so read it with acquire ordering.
+//
+
+int _sched_nworkers(SCHED *s)
+{
+  return __atomic_load_n(&s->nworkers, __ATOMIC_ACQUIRE) ;
+}
+
+
+//
+// @brief Obtain a worker's load, under its lock
+// @param(in) w Worker
+// @param(in) conns True to add its number of connections
+// @return Recent events, plus connections if asked for
+//
+
+unsigned long _sched_load(struct _sched_worker *w, int conns)
+{
+  pthread_mutex_lock(&w->lock) ;
+  unsigned long load = w->recent + (conns ? w->stats.connections : 0) ;
+  pthread_mutex_unlock(&w->lock) ;
+  return load ;
+}
+
+
+//
+// @brief Interrupt a worker's select so it rebuilds its fd_set
+//
+
+void _sched_wake(struct _sched_worker *w)
+{
+  char ch=0 ;
+  if (write(w->wakefd[1], &ch, 1) < 0) {
+    // Pipe full, so a wake is already pending
+  }
+}
+
+
+//
+// @brief Find a connection's record, and optionally unlink it from the map
+//
+
+struct _sched_conn *_sched_find(SCHED *s, NET *sh, int unlink)
+{
+  unsigned int h = _sched_hash(sh) ;
+  struct _sched_conn **pc = &s->map[h] ;
+
+  while (*pc && (*pc)->sh != sh) pc = &(*pc)->mapnext ;
+
+  struct _sched_conn *c = *pc ;
+  if (c && unlink) *pc = c->mapnext ;
+  return c ;
+}
+
+
+//
+// @brief Link / unlink a connection on a worker's list (worker locked)
+//
+
+void _sched_link(struct _sched_worker *w, struct _sched_conn *c)
+{
+  c->owner = w->index ;
+  c->prev = NULL ;
+  c->next = w->conns ;
+  if (w->conns) w->conns->prev = c ;
+  w->conns = c ;
+  w->stats.connections++ ;
+}
+
+void _sched_unlink(struct _sched_worker *w, struct _sched_conn *c)
+{
+  if (c->prev) c->prev->next = c->next ;
+  else w->conns = c->next ;
+  if (c->next) c->next->prev = c->prev ;
+  c->prev = c->next = NULL ;
+  w->stats.connections-- ;
+}
+
+
+//
+// @brief Ready queue operations (worker locked)
+//
+
+int _sched_push(struct _sched_worker *w, struct _sched_conn *c)
+{
+  if (w->rcount == w->rsize) {
+    int newsize = w->rsize ? w->rsize*2 : 64 ;
+    struct _sched_conn **r = malloc(newsize * sizeof(struct _sched_conn *)) ;
+    if (!r) return 0 ;
+    for (int i=0; i<w->rcount; i++) r[i] = w->ready[(w->rhead+i) % w->rsize] ;
+    free(w->ready) ;
+    w->ready = r ;
+    w->rhead = 0 ;
+    w->rsize = newsize ;
+  }
+  w->ready[(w->rhead + w->rcount) % w->rsize] = c ;
+  w->rcount++ ;
+  c->state = CONN_QUEUED ;
+  return 1 ;
+}
+
+struct _sched_conn *_sched_pophead(struct _sched_worker *w)
+{
+  if (!w->rcount) return NULL ;
+  struct _sched_conn *c = w->ready[w->rhead] ;
+  w->rhead = (w->rhead+1) % w->rsize ;
+  w->rcount-- ;
+  return c ;
+}
+
+struct _sched_conn *_sched_poptail(struct _sched_worker *w)
+{
+  if (!w->rcount) return NULL ;
+  w->rcount-- ;
+  return w->ready[(w->rhead + w->rcount) % w->rsize] ;
+}
+
+void _sched_dequeue(struct _sched_worker *w, struct _sched_conn *c)
+{
+  int n = w->rcount ;
+  int j = 0 ;
+  for (int i=0; i<n; i++) {
+    struct _sched_conn *q = w->ready[(w->rhead+i) % w->rsize] ;
+    if (q != c) w->ready[(w->rhead+j++) % w->rsize] = q ;
+  }
+  w->rcount = j ;
+}
+
+
+//
+// @brief Run a connection's callback, then return it to its owner's fd_set
+// @param(in) self Worker running the callback
+// @param(in) c Connection, in CONN_RUNNING state
+//
+
+void _sched_run(struct _sched_worker *self, struct _sched_conn *c)
+{
+  SCHED *s = self->s ;
+
+  c->fn(c->sh, c->arg) ;
+
+  // The owner cannot change while running, as migration needs CONN_IDLE
+
+  struct _sched_worker *owner = &s->workers[c->owner] ;
+
+  pthread_mutex_lock(&owner->lock) ;
+  owner->recent++ ;
+  c->recent++ ;
+  if (c->removed) {
+    pthread_mutex_unlock(&owner->lock) ;
+    free(c) ;
+    return ;
+  }
+  c->state = CONN_IDLE ;
+  pthread_mutex_unlock(&owner->lock) ;
+
+  if (owner != self) _sched_wake(owner) ;
+}
+
+
+//
+// @brief Take a queued connection from another worker
+// @param(in) self Idle worker
+// @return Connection now in CONN_RUNNING state, or NULL
+//
+
+struct _sched_conn *_sched_steal(struct _sched_worker *self)
+{
+  SCHED *s = self->s ;
+  int n = _sched_nworkers(s) ;
+
+  for (int i=1; i<n; i++) {
+
+    struct _sched_worker *victim = &s->workers[(self->index+i) % n] ;
+
+    pthread_mutex_lock(&victim->lock) ;
+    struct _sched_conn *c = _sched_poptail(victim) ;
+    if (c) c->state = CONN_RUNNING ;
+    pthread_mutex_unlock(&victim->lock) ;
+
+    if (c) {
+      pthread_mutex_lock(&self->lock) ;
+      self->stats.steals++ ;
+      pthread_mutex_unlock(&self->lock) ;
+      return c ;
+    }
+
+  }
+
+  return NULL ;
+}
+
+
+//
+// @brief Move an idle connection between workers (both workers unlocked)
+// @return true if moved, false if the connection is busy
+//
+
+int _sched_move(SCHED *s, struct _sched_conn *c, int from, int to)
+{
+  if (from==to) return 1 ;
+
+  struct _sched_worker *a = &s->workers[from<to ? from : to] ;
+  struct _sched_worker *b = &s->workers[from<to ? to : from] ;
+
+  pthread_mutex_lock(&a->lock) ;
+  pthread_mutex_lock(&b->lock) ;
+
+  int moved = ( c->owner == from && c->state == CONN_IDLE && !c->removed ) ;
+  if (moved) {
+    _sched_unlink(&s->workers[from], c) ;
+    _sched_link(&s->workers[to], c) ;
+    s->workers[to].stats.migrations++ ;
+  }
+
+  pthread_mutex_unlock(&b->lock) ;
+  pthread_mutex_unlock(&a->lock) ;
+
+  if (moved) {
+    _sched_wake(&s->workers[from]) ;
+    _sched_wake(&s->workers[to]) ;
+  }
+
+  return moved ;
+}
+
+
+//
+// @brief Hand the busiest idle connection to the least loaded worker
+//        if this worker is carrying much more than its share
+//
+
+void _sched_balance(struct _sched_worker *w)
+{
+  SCHED *s = w->s ;
+  double now = _sched_now() ;
+
+  if (now - w->lastbalance < NETSCHED_BALANCE) return ;
+  w->lastbalance = now ;
+
+  struct _sched_worker *least = NULL ;
+  unsigned long leastload = 0 ;
+  int n = _sched_nworkers(s) ;
+  for (int i=0; i<n; i++) {
+    struct _sched_worker *o = &s->workers[i] ;
+    if (o==w) continue ;
+    unsigned long load = _sched_load(o, 0) ;
+    if (!least || load < leastload) {
+      least = o ;
+      leastload = load ;
+    }
+  }
+
+  struct _sched_conn *hot = NULL ;
+  unsigned long hotload = 0 ;
+
+  pthread_mutex_lock(&w->lock) ;
+
+  if ( least && w->stats.connections > 1 &&
+       w->recent > 2 * leastload + 2 ) {
+    for (struct _sched_conn *c=w->conns; c; c=c->next) {
+      if (c->state==CONN_IDLE && c->recent > hotload) {
+        hot = c ;
+        hotload = c->recent ;
+      }
+    }
+  }
+
+  // Only move if it evens out the load, rather than moving the hotspot
+
+  if (hot && leastload + hotload >= w->recent) hot = NULL ;
+
+  // Decay load so that it reflects recent activity
+
+  for (struct _sched_conn *c=w->conns; c; c=c->next) c->recent /= 2 ;
+  w->recent /= 2 ;
+
+  pthread_mutex_unlock(&w->lock) ;
+
+  if (hot) _sched_move(s, hot, w->index, least->index) ;
+}
+
+
+//
+// @brief Worker thread event loop
+//
+
+void *_sched_loop(void *arg)
+{
+  struct _sched_worker *w = arg ;
+  SCHED *s = w->s ;
+
+  while (!__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)) {
+
+    fd_set rd, wr ;
+    int l = w->wakefd[0] ;
+    FD_ZERO(&rd) ;
+    FD_ZERO(&wr) ;
+    FD_SET(w->wakefd[0], &rd) ;
+
+    pthread_mutex_lock(&w->lock) ;
+    int pending = w->rcount ;
+    for (struct _sched_conn *c=w->conns; c; c=c->next) {
+      if (c->state==CONN_IDLE) netrdfdset(c->sh, &rd, &wr, &l) ;
+    }
+    pthread_mutex_unlock(&w->lock) ;
+
+    // Don't sleep if there is queued work, or past the next timeout
+
+    struct timeval tv ;
+    int next = nettimernext() ;
+    tv.tv_sec = 0 ;
+    tv.tv_usec = pending ? 0 : NETSCHED_TIMEOUT ;
+    if (next>=0 && next*1000 < tv.tv_usec) tv.tv_usec = next*1000 ;
+
+    int r = select(l+1, &rd, &wr, NULL, &tv) ;
+
+    // Any worker may fire the timers, so expired connections are looked
+    // for on every pass
+
+    nettimerexpire() ;
+
+    if (r>0 && FD_ISSET(w->wakefd[0], &rd)) {
+      char buf[64] ;
+      while (read(w->wakefd[0], buf, sizeof(buf)) > 0) ;
+    }
+
+    if (r>=0) {
+      pthread_mutex_lock(&w->lock) ;
+      for (struct _sched_conn *c=w->conns; c; c=c->next) {
+        if (c->state==CONN_IDLE && netrdfdisset(c->sh, &rd, &wr)) {
+          _sched_push(w, c) ;
+        }
+      }
+      pthread_mutex_unlock(&w->lock) ;
+    }
+
+    // Run own work first, then help other workers
+
+    for (;;) {
+
+      pthread_mutex_lock(&w->lock) ;
+      struct _sched_conn *c = _sched_pophead(w) ;
+      if (c) c->state = CONN_RUNNING ;
+      pthread_mutex_unlock(&w->lock) ;
+
+      if (!c) c = _sched_steal(w) ;
+      if (!c) break ;
+
+      double start = _sched_now() ;
+      _sched_run(w, c) ;
+      double busy = _sched_now() - start ;
+
+      pthread_mutex_lock(&w->lock) ;
+      w->stats.events++ ;
+      w->stats.busyseconds += busy ;
+      pthread_mutex_unlock(&w->lock) ;
+
+      if (__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)) break ;
+
+    }
+
+    _sched_balance(w) ;
+
+  }
+
+  return NULL ;
+}
+
+
+//
+// @brief Start a scheduler
+// @param(in) nworkers Number of worker threads, 0 for one per online CPU
+// @param(in) pin If true, pin worker n to CPU n
+// @return Handle to scheduler, or NULL on failure (and sets errno)
+//
+
+SCHED *netschedstart(int nworkers, int pin)
+{
+  if (nworkers<=0) nworkers = sysconf(_SC_NPROCESSORS_ONLN) ;
+  if (nworkers<=0) nworkers = 1 ;
+
+  SCHED *s = malloc(sizeof(SCHED)) ;
+  if (!s) return NULL ;
+  memset(s, '\0', sizeof(SCHED)) ;
+  pthread_mutex_init(&s->maplock, NULL) ;
+
+  s->workers = malloc(nworkers * sizeof(struct _sched_worker)) ;
+  if (!s->workers) {
+    free(s) ;
+    return NULL ;
+  }
+  memset(s->workers, '\0', nworkers * sizeof(struct _sched_worker)) ;
+
+  for (int i=0; i<nworkers; i++) {
+
+    struct _sched_worker *w = &s->workers[i] ;
+    w->s = s ;
+    w->index = i ;
+    pthread_mutex_init(&w->lock, NULL) ;
+
+    // A worker that fails to start is not counted in nworkers, so its pipe
+    // and lock are released here rather than by netschedstop
+
+    int e = 0 ;
+    if (pipe2(w->wakefd, O_NONBLOCK)<0) {
+      e = errno ;
+    } else if ((e = pthread_create(&w->thread, NULL, _sched_loop, w))!=0) {
+      close(w->wakefd[0]) ;
+      close(w->wakefd[1]) ;
+    }
+    if (e) {
+      pthread_mutex_destroy(&w->lock) ;
+      __atomic_store_n(&s->nworkers, i, __ATOMIC_RELEASE) ;
+      netschedstop(s) ;
+      errno = e ;
+      return NULL ;
+    }
+    __atomic_store_n(&s->nworkers, i+1, __ATOMIC_RELEASE) ;
+
+    if (pin) {
+      cpu_set_t cpus ;
+      CPU_ZERO(&cpus) ;
+      CPU_SET(i % CPU_SETSIZE, &cpus) ;
+      pthread_setaffinity_np(w->thread, sizeof(cpus), &cpus) ;
+    }
+
+  }
+
+  return s ;
+}
+
+
+//
+// @brief Add a connection to the least loaded worker
+// @param(in) s Scheduler
+// @param(in) sh Handle of open connection, usually NONBLOCK
+// @param(in) fn Callback, run on a worker thread when sh is readable
+// @param(in) arg Argument passed to fn
+// @return true on success, or false on error (setting errno)
+//
+
+int netschedadd(SCHED *s, NET *sh, netschedfn fn, void *arg)
+{
+  if (!s || !sh || !fn) {
+    errno = EINVAL ;
+    return 0 ;
+  }
+
+  struct _sched_conn *c = malloc(sizeof(struct _sched_conn)) ;
+  if (!c) return 0 ;
+  memset(c, '\0', sizeof(struct _sched_conn)) ;
+  c->sh = sh ;
+  c->fn = fn ;
+  c->arg = arg ;
+
+  pthread_mutex_lock(&s->maplock) ;
+
+  if (_sched_find(s, sh, 0)) {
+    pthread_mutex_unlock(&s->maplock) ;
+    free(c) ;
+    errno = EEXIST ;
+    return 0 ;
+  }
+
+  unsigned int h = _sched_hash(sh) ;
+  c->mapnext = s->map[h] ;
+  s->map[h] = c ;
+
+  // Least loaded is fewest recent events, then fewest connections
+
+  struct _sched_worker *best = &s->workers[0] ;
+  unsigned long bestload = _sched_load(best, 1) ;
+  for (int i=1; i<s->nworkers; i++) {
+    unsigned long load = _sched_load(&s->workers[i], 1) ;
+    if (load < bestload) {
+      best = &s->workers[i] ;
+      bestload = load ;
+    }
+  }
+
+  pthread_mutex_lock(&best->lock) ;
+  _sched_link(best, c) ;
+  pthread_mutex_unlock(&best->lock) ;
+
+  pthread_mutex_unlock(&s->maplock) ;
+
+  _sched_wake(best) ;
+  return 1 ;
+}
+
+
+//
+// @brief Remove a connection from the scheduler.  May be called from the
+//        connection's own callback, after which the handle may be closed.
+// @param(in) s Scheduler
+// @param(in) sh Handle of connection
+// @return true on success, or false if not found
+//
+
+int netschedremove(SCHED *s, NET *sh)
+{
+  if (!s || !sh) return 0 ;
+
+  pthread_mutex_lock(&s->maplock) ;
+  struct _sched_conn *c = _sched_find(s, sh, 1) ;
+  if (!c) {
+    pthread_mutex_unlock(&s->maplock) ;
+    return 0 ;
+  }
+
+  struct _sched_worker *w = &s->workers[c->owner] ;
+  pthread_mutex_lock(&w->lock) ;
+
+  _sched_unlink(w, c) ;
+  int running = (c->state == CONN_RUNNING) ;
+  if (c->state == CONN_QUEUED) _sched_dequeue(w, c) ;
+  if (running) c->removed = 1 ;
+
+  pthread_mutex_unlock(&w->lock) ;
+  pthread_mutex_unlock(&s->maplock) ;
+
+  if (!running) free(c) ;
+  _sched_wake(w) ;
+  return 1 ;
+}
+
+
+//
+// @brief Move a connection to another worker between events
+// @param(in) s Scheduler
+// @param(in) sh Handle of connection
+// @param(in) worker Destination worker number
+// @return true on success, or false if the connection is busy or not found
+//
+
+int netschedmigrate(SCHED *s, NET *sh, int worker)
+{
+  if (!s || !sh || worker<0 || worker>=s->nworkers) return 0 ;
+
+  pthread_mutex_lock(&s->maplock) ;
+  struct _sched_conn *c = _sched_find(s, sh, 0) ;
+  int moved = c ? _sched_move(s, c, c->owner, worker) : 0 ;
+  pthread_mutex_unlock(&s->maplock) ;
+
+  return moved ;
+}
+
+
+//
+// @brief Obtain the number of workers
+//
+
+int netschedworkers(SCHED *s)
+{
+  return s ? s->nworkers : 0 ;
+}
+
+
+//
+// @brief Obtain worker statistics
+// @param(in) s Scheduler
+// @param(in) worker Worker number, or -1 for the total of all workers
+// @param(out) st Statistics structure to populate
+// @return true on success, or false if the worker is invalid
+//
+
+int netschedstats(SCHED *s, int worker, struct netschedstats *st)
+{
+  if (!st) return 0 ;
+  memset(st, '\0', sizeof(struct netschedstats)) ;
+  if (!s || worker<-1 || worker>=s->nworkers) return 0 ;
+
+  for (int i=0; i<s->nworkers; i++) {
+    if (worker>=0 && i!=worker) continue ;
+    struct _sched_worker *w = &s->workers[i] ;
+    pthread_mutex_lock(&w->lock) ;
+    st->connections += w->stats.connections ;
+    st->events += w->stats.events ;
+    st->steals += w->stats.steals ;
+    st->migrations += w->stats.migrations ;
+    st->busyseconds += w->stats.busyseconds ;
+    pthread_mutex_unlock(&w->lock) ;
+  }
+
+  return 1 ;
+}
+
+
+//
+// @brief Stop all workers and free the scheduler.  Connections are not
+//        closed, and remain owned by the caller.
+// @param(in) s Scheduler
+//
+
+void netschedstop(SCHED *s)
+{
+  if (!s) return ;
+
+  __atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE) ;
+  for (int i=0; i<s->nworkers; i++) _sched_wake(&s->workers[i]) ;
+
+  // Running workers may still steal from any other, so all are stopped
+  // before any is freed
+
+  for (int i=0; i<s->nworkers; i++) pthread_join(s->workers[i].thread, NULL) ;
+
+  for (int i=0; i<s->nworkers; i++) {
+    struct _sched_worker *w = &s->workers[i] ;
+    close(w->wakefd[0]) ;
+    close(w->wakefd[1]) ;
+    while (w->conns) {
+      struct _sched_conn *c = w->conns ;
+      w->conns = c->next ;
+      free(c) ;
+    }
+    free(w->ready) ;
+    pthread_mutex_destroy(&w->lock) ;
+  }
+
+  pthread_mutex_destroy(&s->maplock) ;
+  free(s->workers) ;
+  free(s) ;
+}
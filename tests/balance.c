@@ -0,0 +1,136 @@
+//
+// balance.c
+//
+// BALANCE connections over every address "lbtest" resolves to, with echo
+// peers answering after 1, 5 and 20ms on all but the last address, where
+// nothing listens.  The dead address must be ejected without the caller
+// seeing a failure, and the fastest picked most.  Then the first address
+// slows to 30ms and must lose its share.  Prints the time per request,
+// balanced and pinned to the first address.
+//
+// Linked with gethostbyname() wrapped (see the Makefile), so "lbtest"
+// resolves to 127.0.0.1 to 127.0.0.4 without touching /etc/hosts.
+//
+
+#include <netdb.h>
+
+#include "testsrv.h"
+
+#define LBTEST "lbtest"
+#define MAXADDRS 8
+#define REQS 300
+
+static int delays[] = { 1, 5, 20 } ;
+
+struct hostent *__real_gethostbyname(const char *name) ;
+
+
+//
+// @brief Resolve LBTEST to four loopback addresses, anything else as usual
+//
+
+struct hostent *__wrap_gethostbyname(const char *name)
+{
+  static struct in_addr addrs[4] ;
+  static char *list[5] ;
+  static struct hostent host = { .h_addrtype = AF_INET, .h_length = sizeof(struct in_addr), .h_addr_list = list } ;
+
+  if (strcmp(name, LBTEST)) return __real_gethostbyname(name) ;
+  for (int i=0; i<4; i++) {
+    addrs[i].s_addr = htonl(INADDR_LOOPBACK + i) ;
+    list[i] = (char *)&addrs[i] ;
+  }
+  host.h_name = LBTEST ;
+  return &host ;
+}
+
+
+//
+// @brief Make REQS sequential requests: connect, 4 byte echo and close
+// @return Milliseconds per request, or -1 if any failed
+//
+
+static double requests(int port, enum netflags flags)
+{
+  char buf[4] = "ping" ;
+  int i ;
+
+  double start = testnow() ;
+  for (i=0; i<REQS; i++) {
+    NET *sh = netconnect(LBTEST, port, flags) ;
+    int got = 0, r ;
+    if (!sh) break ;
+    if (netsend(sh, buf, sizeof(buf))==sizeof(buf)) {
+      while (got<(int)sizeof(buf) && (r = netrecv(sh, buf+got, sizeof(buf)-got))>0) got += r ;
+    }
+    netclose(sh) ;
+    if (got!=sizeof(buf)) break ;
+  }
+  return i==REQS ? (testnow() - start) * 1e3 / REQS : -1 ;
+}
+
+
+int main()
+{
+  struct testpeer peers[MAXADDRS] ;
+  struct netendpointstats st[MAXADDRS], before[MAXADDRS] ;
+  char addrs[MAXADDRS][INET_ADDRSTRLEN] ;
+  int i, n = 0, port = 0 ;
+
+  struct hostent *host = gethostbyname(LBTEST) ;
+  while (host && host->h_addrtype==AF_INET && host->h_addr_list[n] && n<MAXADDRS) {
+    inet_ntop(AF_INET, host->h_addr_list[n], addrs[n], sizeof(addrs[n])) ;
+    n++ ;
+  }
+  TESTCHECK(n==4, "%s resolves to %d addresses", LBTEST, n) ;
+  if (n!=4) return testresult("balance") ;
+
+  // A peer on every address but the last, all on the same port
+
+  memset(peers, 0, sizeof(peers)) ;
+  for (i=0; i<n-1; i++) {
+    peers[i].mode = TESTPEER_ECHO ;
+    peers[i].addr = addrs[i] ;
+    peers[i].port = port ;
+    peers[i].delayms = delays[i] ;
+    TESTCHECK(testpeerstart(&peers[i]), "peer on %s failed to start", addrs[i]) ;
+    port = peers[0].port ;
+  }
+
+  TESTCHECK(!netbalanceconfig(0, 1000, 30000) && !netbalanceconfig(1, 2000, 1000),
+            "invalid balance settings accepted") ;
+  TESTCHECK(netbalanceconfig(1, 1000, 30000), "netbalanceconfig failed") ;
+  TESTCHECK(netendpointstats(LBTEST, port, st, MAXADDRS)==0, "stats before the first connect") ;
+
+  double balanced = requests(port, BALANCE) ;
+  TESTCHECK(balanced>0, "a balanced request failed") ;
+
+  TESTCHECK(netendpointstats(LBTEST, port, st, MAXADDRS)==n, "stats for the wrong number of addresses") ;
+  for (i=0; i<n; i++) {
+    printf("balance: %-10s %3lu picks, %lu failures, %.1fms\n",
+           st[i].address, st[i].picks, st[i].failures, st[i].latencyms) ;
+    TESTCHECK(!strcmp(st[i].address, addrs[i]), "address %d is %s", i, st[i].address) ;
+    TESTCHECK(st[i].active==0, "%s has %d open connections", st[i].address, st[i].active) ;
+  }
+  TESTCHECK(st[n-1].ejections>=1 && st[n-1].failures>=1, "the dead address was never ejected") ;
+  TESTCHECK(st[n-1].picks<REQS/10, "the dead address was picked %lu times", st[n-1].picks) ;
+  TESTCHECK(st[0].picks>st[n-2].picks, "the 1ms address picked %lu times, the %dms %lu",
+            st[0].picks, delays[n-2], st[n-2].picks) ;
+
+  // The first address slows down
+
+  memcpy(before, st, sizeof(before)) ;
+  peers[0].delayms = 30 ;
+  double slowed = requests(port, BALANCE) ;
+  TESTCHECK(slowed>0, "a balanced request failed after slowing") ;
+  netendpointstats(LBTEST, port, st, MAXADDRS) ;
+  unsigned long picks = st[0].picks - before[0].picks ;
+  TESTCHECK(picks<REQS/(n-1), "the slowed address kept %lu of %d picks", picks, REQS) ;
+
+  double pinned = requests(port, OPEN) ;
+  TESTCHECK(pinned>0, "a request pinned to the first address failed") ;
+  printf("balance: %.1fms per request balanced, %.1fms after %s slowed (%lu picks), %.1fms pinned to it\n",
+         balanced, slowed, addrs[0], picks, pinned) ;
+
+  return testresult("balance") ;
+}
@@ -0,0 +1,141 @@
+//
+// breaker.c
+//
+// Destination circuit breaker: off by default, then a circuit opening
+// after a run of refused connects, failing fast, letting one probe
+// through once half-open, re-opening with a longer backoff, and closing
+// when the destination recovers.  Local errors must not count, and
+// destination records beyond the table's limit are evicted unless in use.
+//
+
+#include "testsrv.h"
+
+#define THRESHOLD 3
+#define BASEMS 200
+#define MAXMS 800
+#define DESTMAX 4096      // NET_DESTMAX in net.c
+
+
+//
+// @brief Find a loopback port nothing listens on
+//
+
+static int deadport()
+{
+  struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) } ;
+  socklen_t len = sizeof(sa) ;
+  int fd = socket(AF_INET, SOCK_STREAM, 0) ;
+  bind(fd, (struct sockaddr *)&sa, sizeof(sa)) ;
+  getsockname(fd, (struct sockaddr *)&sa, &len) ;
+  close(fd) ;
+  return ntohs(sa.sin_port) ;
+}
+
+
+//
+// @brief Connect, closing at once if connected
+// @return true if connected
+//
+
+static int attempt(int port)
+{
+  NET *sh = netconnect("127.0.0.1", port, OPEN) ;
+  if (sh) netclose(sh) ;
+  return sh!=NULL ;
+}
+
+
+//
+// @brief Wait until an open circuit lets a probe through
+//
+
+static void waithalfopen(int port)
+{
+  double end = testnow() + 5 ;
+  while (netbreakerstate("127.0.0.1", port, NULL)==NETBREAKER_OPEN && testnow()<end) usleep(10000) ;
+}
+
+
+int main()
+{
+  struct netbreakerstats st ;
+  int i, circuitopen = 0 ;
+  int port = deadport() ;
+
+  // Off by default, so every attempt is made
+
+  for (i=0; i<2*THRESHOLD; i++) {
+    attempt(port) ;
+    if (neterrno()==NET_ERR_INT+NET_ERR_CIRCUITOPEN) circuitopen++ ;
+  }
+  TESTCHECK(!circuitopen, "%d connects failed fast with the breaker off", circuitopen) ;
+  TESTCHECK(netbreakerstate("127.0.0.1", port, &st)==NETBREAKER_CLOSED && st.attempts==0,
+            "tracked %lu attempts with the breaker off", st.attempts) ;
+
+  TESTCHECK(!netbreakerconfig(-1, BASEMS, MAXMS) && !netbreakerconfig(1, 0, MAXMS) &&
+            !netbreakerconfig(1, MAXMS, BASEMS), "invalid breaker settings accepted") ;
+  TESTCHECK(netbreakerconfig(THRESHOLD, BASEMS, MAXMS), "netbreakerconfig failed") ;
+
+  // Local errors say nothing about the destination
+
+  for (i=0; i<2*THRESHOLD; i++) attempt(0) ;
+  TESTCHECK(netbreakerstate("127.0.0.1", 0, &st)==NETBREAKER_CLOSED && st.failures==0 && st.attempts==2*THRESHOLD,
+            "a bad port counted %lu failures in %lu attempts", st.failures, st.attempts) ;
+
+  // Refused connects open the circuit, after which connects fail fast
+
+  for (i=0; i<THRESHOLD; i++) {
+    TESTCHECK(netbreakerstate("127.0.0.1", port, NULL)==NETBREAKER_CLOSED, "opened after %d failures", i) ;
+    attempt(port) ;
+  }
+  TESTCHECK(netbreakerstate("127.0.0.1", port, &st)==NETBREAKER_OPEN, "circuit state %d", st.state) ;
+  TESTCHECK(st.opened==1 && st.consecutivefailures==THRESHOLD && st.failures==THRESHOLD,
+            "opened %lu times after %d failures", st.opened, st.consecutivefailures) ;
+  TESTCHECK(st.retryinms>0 && st.retryinms<=BASEMS, "retry in %ldms", st.retryinms) ;
+
+  double start = testnow() ;
+  TESTCHECK(!attempt(port) && neterrno()==NET_ERR_INT+NET_ERR_CIRCUITOPEN, "open circuit gave error %d", neterrno()) ;
+  TESTCHECK(testnow()-start<0.01, "failing fast took %.1fms", (testnow()-start)*1e3) ;
+  TESTCHECK(netbreakerstate("127.0.0.1", port, &st)==NETBREAKER_OPEN && st.rejected==1, "%lu rejected", st.rejected) ;
+
+  // A failed probe re-opens it for longer
+
+  waithalfopen(port) ;
+  TESTCHECK(netbreakerstate("127.0.0.1", port, NULL)==NETBREAKER_HALFOPEN, "never became half-open") ;
+  TESTCHECK(!attempt(port) && neterrno()!=NET_ERR_INT+NET_ERR_CIRCUITOPEN, "the probe was not let through") ;
+  TESTCHECK(netbreakerstate("127.0.0.1", port, &st)==NETBREAKER_OPEN && st.opened==2,
+            "after a failed probe state %d, opened %lu times", st.state, st.opened) ;
+  TESTCHECK(st.retryinms>BASEMS/2 && st.retryinms<=2*BASEMS, "backoff %ldms after a failed probe", st.retryinms) ;
+
+  // A successful probe closes it
+
+  struct testpeer echo = { .mode = TESTPEER_ECHO, .port = port } ;
+  testpeerstart(&echo) ;
+  waithalfopen(port) ;
+  TESTCHECK(attempt(port), "the probe failed with the destination back") ;
+  TESTCHECK(netbreakerstate("127.0.0.1", port, &st)==NETBREAKER_CLOSED && st.successes==1 && st.consecutivefailures==0,
+            "after a good probe state %d, %lu successes", st.state, st.successes) ;
+  TESTCHECK(attempt(port) && attempt(port), "connects failed with the circuit closed") ;
+
+  TESTCHECK(netbreakerreset("127.0.0.1", port) && !netbreakerreset("127.0.0.1", 1),
+            "netbreakerreset of a known and an unknown destination") ;
+
+  // Past DESTMAX destinations the oldest records go, unless a connection
+  // is using them
+
+  int dead = deadport() ;
+  for (i=0; i<THRESHOLD; i++) attempt(dead) ;
+  TESTCHECK(netbreakerstate("127.0.0.1", dead, NULL)==NETBREAKER_OPEN, "second circuit did not open") ;
+  NET *held = netconnect("127.0.0.1", port, BALANCE) ;
+  TESTCHECK(held!=NULL, "BALANCE connect failed") ;
+
+  for (i=1; i<=DESTMAX; i++) attempt(-i) ;
+  TESTCHECK(netbreakerstate("127.0.0.1", dead, &st)==NETBREAKER_CLOSED && st.attempts==0,
+            "an unused record survived %d newer destinations", DESTMAX) ;
+  TESTCHECK(netbreakerstate("127.0.0.1", port, &st)==NETBREAKER_CLOSED && st.successes>0,
+            "a record in use was evicted") ;
+  if (held) netclose(held) ;
+
+  netbreakerconfig(0, BASEMS, MAXMS) ;
+  return testresult("breaker") ;
+}
@@ -0,0 +1,173 @@
+//
+// bufpool.c
+//
+// Shared receive buffer pool against echo peers: a borrow which finds no
+// data holding nothing, an echo landing in a borrowed buffer, buffers
+// going back to the pool to be reused, even after their connection has
+// closed, the buffer limit refusing a borrow with ENOBUFS, idle
+// connections holding no buffers, and a blocking TLS connection waiting
+// through the peer's session tickets without a buffer.  Prints the
+// buffers used against the connections served.
+//
+
+#include "testsrv.h"
+
+#define CONNS 100
+#define BUFSIZE 4096
+#define MSG 64
+#define SLOWMS 200
+
+static long heldwhilewaiting = -1 ;
+
+
+//
+// @brief Sample the buffers borrowed halfway through a slow echo
+//
+
+static void *sample(void *arg)
+{
+  struct netbufpoolstats st ;
+  (void)arg ;
+  usleep(SLOWMS*1000/2) ;
+  netbufpoolstats(&st) ;
+  heldwhilewaiting = st.borrowed ;
+  return NULL ;
+}
+
+
+//
+// @brief Borrow from a NONBLOCK connection until data arrives, up to 1s
+//
+
+static char *borrowed(NET *sh, int *len)
+{
+  double end = testnow() + 1 ;
+  char *buf ;
+  while (!(buf = netrecv_borrow(sh, len)) && *len==-1 && netwouldblock() && testnow()<end) {
+    usleep(1000) ;
+  }
+  return buf ;
+}
+
+
+int main()
+{
+  struct testpeer echo = { .mode = TESTPEER_ECHO } ;
+  struct testpeer slow = { .mode = TESTPEER_ECHO, .tls = 1, .delayms = SLOWMS } ;
+  struct netbufpoolstats st, before ;
+  static NET *conns[CONNS] ;
+  char msg[MSG], *buf, *held ;
+  int len, got, i ;
+  pthread_t t ;
+
+  testpeerstart(&echo) ;
+  testpeerstart(&slow) ;
+  memset(msg, 'p', sizeof(msg)) ;
+
+  TESTCHECK(!netbufpool(0, 0) && !netbufpool(BUFSIZE, -1), "invalid pool accepted") ;
+  TESTCHECK(netbufpool(BUFSIZE, 0), "netbufpool failed") ;
+  TESTCHECK(!netrecv_borrow(NULL, &len), "borrow from no connection") ;
+
+  // A borrow which finds nothing holds nothing
+
+  NET *sh = netconnect("127.0.0.1", echo.port, NONBLOCK) ;
+  TESTCHECK(sh!=NULL, "connect failed") ;
+  if (!sh) return testresult("bufpool") ;
+  netbufpoolstats(&before) ;
+  buf = netrecv_borrow(sh, &len) ;
+  netbufpoolstats(&st) ;
+  TESTCHECK(!buf && len==-1 && netwouldblock(), "borrow with no data gave %d", len) ;
+  TESTCHECK(st.borrowed==0 && st.empty==before.empty+1, "%lu borrowed, %lu empty after an empty borrow",
+            st.borrowed, st.empty-before.empty) ;
+
+  // An echo lands in a borrowed buffer, which goes back to be reused
+
+  netsend(sh, msg, MSG) ;
+  buf = borrowed(sh, &len) ;
+  netbufpoolstats(&st) ;
+  TESTCHECK(buf && len==MSG && !memcmp(buf, msg, MSG), "echo not borrowed, %d bytes", len) ;
+  TESTCHECK(st.borrowed==1 && st.bufsize==BUFSIZE, "%lu borrowed of size %d", st.borrowed, st.bufsize) ;
+  netrecv_release(buf) ;
+  netrecv_release(NULL) ;
+  netbufpoolstats(&st) ;
+  TESTCHECK(st.borrowed==0 && st.free==st.allocated, "%lu borrowed, %lu of %lu free after release",
+            st.borrowed, st.free, st.allocated) ;
+
+  unsigned long allocated = st.allocated ;
+  netsend(sh, msg, MSG) ;
+  buf = borrowed(sh, &len) ;
+  netclose(sh) ;
+  netrecv_release(buf) ;
+  netbufpoolstats(&st) ;
+  TESTCHECK(buf && st.allocated==allocated && st.borrowed==0, "buffer not reused, %lu allocated, %lu borrowed",
+            st.allocated, st.borrowed) ;
+
+  // The limit refuses a borrow once reached, until a buffer comes back
+
+  TESTCHECK(netbufpool(BUFSIZE, 1), "netbufpool limit failed") ;
+  NET *a = netconnect("127.0.0.1", echo.port, NONBLOCK) ;
+  NET *b = netconnect("127.0.0.1", echo.port, NONBLOCK) ;
+  TESTCHECK(a && b, "limit connects failed") ;
+  if (!a || !b) return testresult("bufpool") ;
+  netsend(a, msg, MSG) ;
+  netsend(b, msg, MSG) ;
+  held = borrowed(a, &len) ;
+  usleep(20000) ;
+  netbufpoolstats(&before) ;
+  buf = netrecv_borrow(b, &len) ;
+  netbufpoolstats(&st) ;
+  TESTCHECK(held && !buf && len==-1 && neterrno()==ENOBUFS, "borrow past the limit gave %d, error %d",
+            len, neterrno()) ;
+  TESTCHECK(st.exhausted==before.exhausted+1, "%lu exhausted", st.exhausted-before.exhausted) ;
+  netrecv_release(held) ;
+  buf = netrecv_borrow(b, &len) ;
+  TESTCHECK(buf && len==MSG, "data lost to a refused borrow, %d bytes", len) ;
+  netrecv_release(buf) ;
+  netclose(a) ;
+  netclose(b) ;
+  netbufpool(BUFSIZE, 0) ;
+
+  // Idle connections hold no buffers, and busy ones share them
+
+  for (i=0; i<CONNS; i++) {
+    conns[i] = netconnect("127.0.0.1", echo.port, NONBLOCK) ;
+    TESTCHECK(conns[i]!=NULL, "connect %d failed", i) ;
+    if (!conns[i]) return testresult("bufpool") ;
+  }
+  netbufpoolstats(&before) ;
+  for (got=0, i=0; i<CONNS; i++) {
+    if ((buf = netrecv_borrow(conns[i], &len))) got++ ;
+    netrecv_release(buf) ;
+  }
+  netbufpoolstats(&st) ;
+  TESTCHECK(got==0 && st.borrowed==0 && st.allocated==before.allocated && st.empty==before.empty+CONNS,
+            "%d idle connections borrowed, %lu allocated", got, st.allocated-before.allocated) ;
+
+  for (i=0; i<CONNS; i++) netsend(conns[i], msg, MSG) ;
+  for (got=0, i=0; i<CONNS; i++) {
+    if ((buf = borrowed(conns[i], &len)) && len==MSG && !memcmp(buf, msg, MSG)) got++ ;
+    netrecv_release(buf) ;
+  }
+  netbufpoolstats(&st) ;
+  TESTCHECK(got==CONNS && st.allocated==before.allocated && st.borrowed==0,
+            "%d of %d echoes borrowed, %lu buffers allocated", got, CONNS, st.allocated) ;
+  printf("bufpool: %d connections served by %lu buffers of %d bytes, %lu held at most\n",
+         CONNS, st.allocated, BUFSIZE, st.maxborrowed) ;
+  for (i=0; i<CONNS; i++) netclose(conns[i]) ;
+
+  // A blocking TLS connection waits through the session tickets which
+  // arrive after the handshake without taking a buffer
+
+  sh = netconnect("127.0.0.1", slow.port, TLS|NOCERTCHAIN) ;
+  TESTCHECK(sh && netsend(sh, msg, MSG)==MSG, "TLS connect failed") ;
+  if (!sh) return testresult("bufpool") ;
+  pthread_create(&t, NULL, sample, NULL) ;
+  buf = netrecv_borrow(sh, &len) ;
+  pthread_join(t, NULL) ;
+  TESTCHECK(buf && len==MSG && !memcmp(buf, msg, MSG), "TLS echo not borrowed, %d bytes", len) ;
+  TESTCHECK(heldwhilewaiting==0, "%ld buffers held waiting for TLS data", heldwhilewaiting) ;
+  netrecv_release(buf) ;
+  netclose(sh) ;
+
+  return testresult("bufpool") ;
+}
@@ -0,0 +1,137 @@
+//
+// busypoll.c
+//
+// Busy poll receive against echo peers: data already waiting counted as
+// ready, echoes slower than the spin budget counted as misses having
+// spun the whole budget, every receive counted exactly once over plain
+// and TLS round trips, the calling thread pinned, and the mode turned
+// off again.  Prints round-trip times with and without spinning.
+//
+
+#include "testsrv.h"
+
+#define ROUNDS 200
+#define SPINUS 100
+#define SLOWMS 2
+#define MSG 64
+
+
+//
+// @brief Send a message and read its echo
+// @return Seconds taken, or -1 if the echo was wrong
+//
+
+static double roundtrip(NET *sh)
+{
+  char msg[MSG], buf[MSG] ;
+  int got = 0, r = 0 ;
+  memset(msg, 'b', sizeof(msg)) ;
+  double start = testnow() ;
+  if (netsend(sh, msg, MSG)!=MSG) return -1 ;
+  while (got<MSG && (r = netrecv(sh, buf+got, MSG-got))>0) got += r ;
+  return (got==MSG && !memcmp(buf, msg, MSG)) ? testnow() - start : -1 ;
+}
+
+
+//
+// @brief Run ROUNDS round trips
+// @return Median round trip in seconds, or -1 if one failed
+//
+
+static double rounds(NET *sh)
+{
+  static double t[ROUNDS] ;
+  int i, j ;
+  for (i=0; i<ROUNDS; i++) {
+    double secs = roundtrip(sh) ;
+    if (secs<0) return -1 ;
+    for (j=i; j>0 && t[j-1]>secs; j--) t[j] = t[j-1] ;
+    t[j] = secs ;
+  }
+  return t[ROUNDS/2] ;
+}
+
+
+int main()
+{
+  struct testpeer echo = { .mode = TESTPEER_ECHO } ;
+  struct testpeer slow = { .mode = TESTPEER_ECHO, .delayms = SLOWMS } ;
+  struct testpeer tls = { .mode = TESTPEER_ECHO, .tls = 1 } ;
+  struct netbusypollstats st ;
+  char buf[MSG] ;
+  int i ;
+
+  testpeerstart(&echo) ;
+  testpeerstart(&slow) ;
+  testpeerstart(&tls) ;
+
+  NET *sh = netconnect("127.0.0.1", echo.port, OPEN) ;
+  TESTCHECK(sh!=NULL, "connect failed") ;
+  if (!sh) return testresult("busypoll") ;
+  TESTCHECK(!netbusypoll(sh, -1, -1), "negative spin budget accepted") ;
+  TESTCHECK(!netbusypollstats(sh, &st), "stats with busy polling off") ;
+
+  double plain = rounds(sh) ;
+  TESTCHECK(plain>0, "echoes failed without busy polling") ;
+
+  // Data already waiting needs no spin
+
+  TESTCHECK(netbusypoll(sh, SPINUS, -1), "netbusypoll failed") ;
+  for (i=0; i<10; i++) {
+    memset(buf, 'r', sizeof(buf)) ;
+    netsend(sh, buf, MSG) ;
+    usleep(5000) ;
+    netrecv(sh, buf, sizeof(buf)) ;
+  }
+  TESTCHECK(netbusypollstats(sh, &st) && st.ready==10 && st.hits+st.misses==0,
+            "%lu ready, %lu hits, %lu misses with data waiting", st.ready, st.hits, st.misses) ;
+
+  // Every receive of a round trip counts once
+
+  netbusypoll(sh, 0, -1) ;
+  netbusypoll(sh, SPINUS, -1) ;
+  double spun = rounds(sh) ;
+  TESTCHECK(spun>0, "echoes failed while busy polling") ;
+  TESTCHECK(netbusypollstats(sh, &st) && st.ready+st.hits+st.misses>=ROUNDS,
+            "%lu receives counted in %d round trips", st.ready+st.hits+st.misses, ROUNDS) ;
+  TESTCHECK(st.hitrate>=0 && st.hitrate<=1, "hit rate %.2f", st.hitrate) ;
+  printf("busypoll: median round trip %.1fus, %.1fus spinning %dus (%lu ready, %lu hits, %lu misses), kernel %s\n",
+         plain*1e6, spun*1e6, SPINUS, st.ready, st.hits, st.misses, st.kernelbusypoll ? "on" : "off") ;
+
+  // Turned off, counting stops
+
+  TESTCHECK(netbusypoll(sh, 0, -1) && !netbusypollstats(sh, &st), "busy polling not turned off") ;
+  TESTCHECK(roundtrip(sh)>0, "echo failed after turning busy polling off") ;
+  netclose(sh) ;
+
+  // Echoes slower than the budget spin all of it, then wait
+
+  sh = netconnect("127.0.0.1", slow.port, OPEN) ;
+  TESTCHECK(sh && netbusypoll(sh, SPINUS, -1), "slow netbusypoll failed") ;
+  for (i=0; sh && i<20; i++) TESTCHECK(roundtrip(sh)>=SLOWMS/1000.0, "slow echo %d failed", i) ;
+  TESTCHECK(sh && netbusypollstats(sh, &st) && st.misses>=20 && st.hits==0 && st.hitrate==0,
+            "%lu hits, %lu misses on slow echoes", st.hits, st.misses) ;
+  TESTCHECK(st.spinseconds>=st.misses*SPINUS/1e6*0.9 && st.spinseconds<st.misses*(SPINUS/1e6+0.001),
+            "spun %.2fms for %lu misses", st.spinseconds*1e3, st.misses) ;
+  if (sh) netclose(sh) ;
+
+  // TLS peeks at the socket while spinning, then reads through SSL
+
+  sh = netconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN) ;
+  TESTCHECK(sh && netbusypoll(sh, SPINUS, -1), "TLS netbusypoll failed") ;
+  TESTCHECK(sh && rounds(sh)>0, "TLS echoes failed while busy polling") ;
+  TESTCHECK(sh && netbusypollstats(sh, &st) && st.ready+st.hits+st.misses>=ROUNDS,
+            "%lu TLS receives counted in %d round trips", st.ready+st.hits+st.misses, ROUNDS) ;
+
+  // Pinning the polling thread
+
+  cpu_set_t all, cpus ;
+  sched_getaffinity(0, sizeof(all), &all) ;
+  TESTCHECK(sh && netbusypoll(sh, SPINUS, 0), "netbusypoll failed pinning to CPU 0") ;
+  sched_getaffinity(0, sizeof(cpus), &cpus) ;
+  TESTCHECK(CPU_COUNT(&cpus)==1 && CPU_ISSET(0, &cpus), "pinned to %d CPUs", CPU_COUNT(&cpus)) ;
+  sched_setaffinity(0, sizeof(all), &all) ;
+  if (sh) netclose(sh) ;
+
+  return testresult("busypoll") ;
+}
@@ -0,0 +1,187 @@
+//
+// churn.c
+//
+// Connection churn through every close mode, checking that no
+// descriptor outlives its handle (each TLS close used to leak one) and
+// that the close modes behave as documented in net.h.
+//
+
+#include "testsrv.h"
+
+
+//
+// @brief Wait for the peer threads to close their side
+// @param(in) fds Descriptor count to wait for
+// @return Descriptor count reached
+//
+
+static int settle(int fds)
+{
+  double end = testnow() + 2 ;
+  while (testfds()!=fds && testnow()<end) usleep(10000) ;
+  return testfds() ;
+}
+
+
+//
+// @brief Drive a NONBLOCK close to completion
+// @param(in) sh Handle of open connection
+// @param(in) mode Close mode
+// @return Result of the final netclosemode()
+//
+
+static int drive(NET *sh, enum netclosemodes mode)
+{
+  int r ;
+  while ((r = netclosemode(sh, mode))==0) {
+    fd_set rd, wr ;
+    int l = 0 ;
+    FD_ZERO(&rd) ;
+    FD_ZERO(&wr) ;
+    netrdfdset(sh, &rd, &wr, &l) ;
+    int next = nettimernext() ;
+    struct timeval tv = { 0, (next<0 || next>100 ? 100 : next) * 1000 } ;
+    select(l+1, &rd, &wr, NULL, &tv) ;
+    nettimerexpire() ;
+  }
+  return r ;
+}
+
+
+static void roundtrip(NET *sh)
+{
+  char buf[8] ;
+  netsend(sh, "x", 1) ;
+  netrecv(sh, buf, 1) ;
+}
+
+
+int main()
+{
+  struct testpeer echo = { .mode = TESTPEER_ECHO } ;
+  struct testpeer tls = { .mode = TESTPEER_ECHO, .tls = 1 } ;
+  struct testpeer aborts = { .mode = TESTPEER_ECHO } ;
+  struct testpeer defaults = { .mode = TESTPEER_ECHO } ;
+  struct testpeer silent = { .mode = TESTPEER_SILENT } ;
+  struct netfdstats st ;
+  NET *sh ;
+  int i, r, bad ;
+
+  testpeerstart(&echo) ;
+  testpeerstart(&tls) ;
+  testpeerstart(&aborts) ;
+  testpeerstart(&defaults) ;
+  testpeerstart(&silent) ;
+  netinit() ;
+
+  int base = testfds() ;
+
+  for (i=0, bad=0; i<500; i++) {
+    if (!(sh = netconnect("127.0.0.1", echo.port, OPEN))) bad++ ;
+    else netclose(sh) ;
+  }
+  TESTCHECK(!bad, "plain connects failed: %d", bad) ;
+  TESTCHECK(settle(base)==base, "plain closes leaked %d fds", testfds()-base) ;
+
+  for (i=0, bad=0; i<100; i++) {
+    if (!(sh = netconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN))) bad++ ;
+    else netclose(sh) ;
+  }
+  TESTCHECK(!bad, "TLS connects failed: %d", bad) ;
+  TESTCHECK(settle(base)==base, "TLS closes leaked %d fds", testfds()-base) ;
+
+  for (i=0, bad=0; i<30; i++) {
+    sh = netconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN|NONBLOCK) ;
+    if (!sh || drive(sh, NETCLOSE_GRACEFUL)!=1) bad++ ;
+  }
+  TESTCHECK(!bad, "NONBLOCK TLS graceful closes failed: %d", bad) ;
+
+  for (i=0, bad=0; i<30; i++) {
+    sh = netconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN) ;
+    if (!sh || netclosemode(sh, NETCLOSE_GRACEFUL)!=1) bad++ ;
+  }
+  TESTCHECK(!bad, "blocking TLS graceful closes failed: %d", bad) ;
+
+  for (i=0, bad=0; i<30; i++) {
+    sh = netconnect("127.0.0.1", echo.port, NONBLOCK) ;
+    if (!sh || drive(sh, NETCLOSE_GRACEFUL)!=1) bad++ ;
+  }
+  TESTCHECK(!bad, "NONBLOCK plain graceful closes failed: %d", bad) ;
+  TESTCHECK(settle(base)==base, "graceful closes leaked %d fds", testfds()-base) ;
+
+  // An abortive close resets, so leaves no TIME_WAIT socket behind, where
+  // the client closing first normally does
+
+  for (i=0; i<200; i++) {
+    if ((sh = netconnect("127.0.0.1", aborts.port, OPEN))) {
+      roundtrip(sh) ;
+      netclosemode(sh, NETCLOSE_ABORT) ;
+    }
+  }
+  for (i=0; i<200; i++) {
+    if ((sh = netconnect("127.0.0.1", defaults.port, OPEN))) {
+      roundtrip(sh) ;
+      netclose(sh) ;
+    }
+  }
+  settle(base) ;
+  TESTCHECK(testtimewait(aborts.port)==0, "abortive closes left %d TIME_WAIT sockets",
+            testtimewait(aborts.port)) ;
+  TESTCHECK(testtimewait(defaults.port)>0, "default closes left no TIME_WAIT sockets") ;
+
+  // netshutdown() half-closes, and the echo still arrives
+
+  char buf[8] ;
+  sh = netconnect("127.0.0.1", echo.port, OPEN) ;
+  netsend(sh, "abc", 3) ;
+  TESTCHECK(netshutdown(sh)==1, "netshutdown failed") ;
+  r = netrecv(sh, buf, sizeof(buf)) ;
+  TESTCHECK(r==3, "netrecv after half close returned %d", r) ;
+  TESTCHECK(netrecv(sh, buf, sizeof(buf))<=0, "peer close not seen after half close") ;
+  netclose(sh) ;
+
+  // A graceful close to a peer which never closes gives up after 2s
+
+  double start = testnow() ;
+  sh = netconnect("127.0.0.1", silent.port, NONBLOCK) ;
+  r = drive(sh, NETCLOSE_GRACEFUL) ;
+  double nonblocking = testnow() - start ;
+  TESTCHECK(r==-1, "NONBLOCK graceful close to silent peer returned %d", r) ;
+  start = testnow() ;
+  sh = netconnect("127.0.0.1", silent.port, OPEN) ;
+  r = netclosemode(sh, NETCLOSE_GRACEFUL) ;
+  double blocking = testnow() - start ;
+  TESTCHECK(r==-1, "blocking graceful close to silent peer returned %d", r) ;
+  TESTCHECK(nonblocking>1.9 && nonblocking<3, "NONBLOCK graceful close to silent peer took %.2fs", nonblocking) ;
+  TESTCHECK(blocking>1.9 && blocking<3, "blocking graceful close to silent peer took %.2fs", blocking) ;
+
+  // A graceful close in progress is ended by netclose() or an abortive
+  // close, which must free the handle
+
+  struct netfdstats before ;
+  netfdstats(&before) ;
+  sh = netconnect("127.0.0.1", silent.port, NONBLOCK) ;
+  TESTCHECK(sh && netclosemode(sh, NETCLOSE_GRACEFUL)==0, "graceful close to silent peer not in progress") ;
+  TESTCHECK(sh && netclose(sh), "netclose of a graceful close in progress failed") ;
+  sh = netconnect("127.0.0.1", silent.port, NONBLOCK) ;
+  TESTCHECK(sh && netclosemode(sh, NETCLOSE_GRACEFUL)==0, "graceful close to silent peer not in progress") ;
+  TESTCHECK(sh && netclosemode(sh, NETCLOSE_ABORT)==1, "abortive close of a graceful close in progress failed") ;
+  netfdstats(&st) ;
+  TESTCHECK(st.open==before.open && st.aborted==before.aborted+1, "%ld left open, %lu aborted",
+            st.open-before.open, st.aborted-before.aborted) ;
+  TESTCHECK(nettimernext()==-1, "a close timer is due after closing") ;
+
+  netfdstats(&st) ;
+  TESTCHECK(st.open==0, "netfdstats reports %ld open", st.open) ;
+  TESTCHECK(st.opened==st.closed, "netfdstats opened %lu closed %lu", st.opened, st.closed) ;
+  TESTCHECK(st.graceful==90, "netfdstats graceful %lu", st.graceful) ;
+  TESTCHECK(st.closetimeouts==2, "netfdstats closetimeouts %lu", st.closetimeouts) ;
+  TESTCHECK(st.aborted==201, "netfdstats aborted %lu", st.aborted) ;
+  TESTCHECK(st.halfclosed==1, "netfdstats halfclosed %lu", st.halfclosed) ;
+
+  // The silent peer still holds its four connections
+
+  TESTCHECK(settle(base+4)==base+4, "%d fds open, expected %d", testfds(), base+4) ;
+
+  return testresult("churn") ;
+}
@@ -0,0 +1,167 @@
+//
+// cipher.c
+//
+// netcipherprofile() against peers restricted to TLS 1.2, to ChaCha20,
+// and to P-256, checking that every profile connects and what it
+// negotiates.  Then the handshake time of each profile, with and without
+// X25519 on the peer, and the bulk rate through a TLS echo of each
+// profile and of each TLS 1.3 cipher suite.
+//
+
+#include "testsrv.h"
+
+#define BULK (8<<20)
+#define HANDSHAKES 50
+
+static char *names[] = { "default", "throughput", "latency", "compatibility" } ;
+static char *suites[] = { "TLS_AES_128_GCM_SHA256", "TLS_AES_256_GCM_SHA384", "TLS_CHACHA20_POLY1305_SHA256" } ;
+
+
+//
+// @brief Connect with a profile
+// @param(in) profile Cipher profile
+// @param(in) port Peer port
+// @param(out) cipher Negotiated cipher, if connected
+// @return true if connected
+//
+
+static int connects(int profile, int port, char *cipher, int len)
+{
+  netcipherprofile(profile) ;
+  NET *sh = netconnect("127.0.0.1", port, TLS|NOCERTCHAIN) ;
+  if (!sh) return 0 ;
+  snprintf(cipher, len, "%s", netcipher(sh) ? netcipher(sh) : "") ;
+  netclose(sh) ;
+  return 1 ;
+}
+
+
+//
+// @brief Time connects with a profile
+// @return Milliseconds per connect, or -1 on failure
+//
+
+static double handshake(int profile, int port)
+{
+  netcipherprofile(profile) ;
+  double start = testnow() ;
+  for (int i=0; i<HANDSHAKES; i++) {
+    NET *sh = netconnect("127.0.0.1", port, TLS|NOCERTCHAIN) ;
+    if (!sh) return -1 ;
+    netclose(sh) ;
+  }
+  return (testnow() - start) * 1e3 / HANDSHAKES ;
+}
+
+
+//
+// @brief Echo BULK bytes through a connection
+// @return MB/s, or -1 on failure
+//
+
+static double bulk(int profile, int port)
+{
+  static char buf[65536] ;
+  long sent = 0, got = 0 ;
+
+  netcipherprofile(profile) ;
+  NET *sh = netconnect("127.0.0.1", port, TLS|NOCERTCHAIN) ;
+  if (!sh) return -1 ;
+  memset(buf, 'b', sizeof(buf)) ;
+
+  double start = testnow() ;
+  while (got<BULK) {
+    if (sent<BULK) {
+      int r = netsend(sh, buf, 16384) ;
+      if (r<=0) break ;
+      sent += r ;
+    }
+    while (got<sent) {
+      int r = netrecv(sh, buf, sizeof(buf)) ;
+      if (r<=0) break ;
+      got += r ;
+    }
+    if (got<sent) break ;
+  }
+  double secs = testnow() - start ;
+  netclose(sh) ;
+  return got==BULK ? BULK/secs/1e6 : -1 ;
+}
+
+
+int main()
+{
+  struct testpeer any = { .mode = TESTPEER_ECHO, .tls = 1 } ;
+  struct testpeer tls12 = { .mode = TESTPEER_ECHO, .tls = 1, .tls12 = 1 } ;
+  struct testpeer chacha = { .mode = TESTPEER_ECHO, .tls = 1, .tls13 = 1,
+                             .suites = "TLS_CHACHA20_POLY1305_SHA256" } ;
+  struct testpeer p256 = { .mode = TESTPEER_ECHO, .tls = 1, .tls13 = 1, .groups = "P-256" } ;
+  static struct testpeer one[3] ;
+  char cipher[64] ;
+  int p ;
+
+  testpeerstart(&any) ;
+  testpeerstart(&tls12) ;
+  testpeerstart(&chacha) ;
+  testpeerstart(&p256) ;
+
+  TESTCHECK(!netcipherprofile(-1) && !netcipherprofile(NETCIPHER_COMPATIBILITY+1),
+            "invalid profiles accepted") ;
+
+  // The peer follows the client's order, so the profile's first choice
+  // shows whether AES-GCM was found to be accelerated
+
+  TESTCHECK(connects(NETCIPHER_THROUGHPUT, any.port, cipher, sizeof(cipher)), "throughput failed") ;
+  int aes = !strcmp(cipher, "TLS_AES_128_GCM_SHA256") ;
+  TESTCHECK(aes || !strcmp(cipher, "TLS_CHACHA20_POLY1305_SHA256"), "throughput negotiated %s", cipher) ;
+  printf("cipher: AES-GCM %s\n", aes ? "accelerated" : "not accelerated") ;
+
+  for (p=NETCIPHER_DEFAULT; p<=NETCIPHER_COMPATIBILITY; p++) {
+    TESTCHECK(connects(p, any.port, cipher, sizeof(cipher)), "%s: failed", names[p]) ;
+    if (p!=NETCIPHER_DEFAULT) {
+      TESTCHECK(!strcmp(cipher, aes ? "TLS_AES_128_GCM_SHA256" : "TLS_CHACHA20_POLY1305_SHA256"),
+                "%s: negotiated %s", names[p], cipher) ;
+    }
+  }
+
+  // Every profile falls back to what the peer has
+
+  for (p=NETCIPHER_DEFAULT; p<=NETCIPHER_COMPATIBILITY; p++) {
+    TESTCHECK(connects(p, tls12.port, cipher, sizeof(cipher)), "%s: TLS 1.2 peer refused", names[p]) ;
+    TESTCHECK(connects(p, p256.port, cipher, sizeof(cipher)), "%s: P-256 only peer refused", names[p]) ;
+    TESTCHECK(connects(p, chacha.port, cipher, sizeof(cipher)) && !strcmp(cipher, suites[2]),
+              "%s: ChaCha20 only peer gave %s", names[p], cipher) ;
+  }
+
+  // Without X25519 on the peer the key share sent is of no use, and the
+  // HelloRetryRequest costs a round trip
+
+  for (p=NETCIPHER_DEFAULT; p<=NETCIPHER_COMPATIBILITY; p++) {
+    double any_ms = handshake(p, any.port), p256_ms = handshake(p, p256.port) ;
+    TESTCHECK(any_ms>0 && p256_ms>0, "%s: handshakes failed", names[p]) ;
+    printf("cipher: %-13s %.2fms per handshake, %.2fms with a P-256 only peer\n", names[p], any_ms, p256_ms) ;
+  }
+
+  for (p=NETCIPHER_DEFAULT; p<=NETCIPHER_COMPATIBILITY; p++) {
+    connects(p, any.port, cipher, sizeof(cipher)) ;
+    double rate = bulk(p, any.port) ;
+    TESTCHECK(rate>0, "%s: bulk echo failed", names[p]) ;
+    printf("cipher: %-13s %-28s %.0f MB/s echoed\n", names[p], cipher, rate) ;
+  }
+
+  // Each suite on its own, so the choice the CPU detection made can be
+  // checked against the alternatives
+
+  for (int i=0; i<3; i++) {
+    one[i] = (struct testpeer){ .mode = TESTPEER_ECHO, .tls = 1, .tls13 = 1, .suites = suites[i] } ;
+    testpeerstart(&one[i]) ;
+    TESTCHECK(connects(NETCIPHER_DEFAULT, one[i].port, cipher, sizeof(cipher)) && !strcmp(cipher, suites[i]),
+              "%s peer gave %s", suites[i], cipher) ;
+    double rate = bulk(NETCIPHER_DEFAULT, one[i].port) ;
+    TESTCHECK(rate>0, "%s: bulk echo failed", suites[i]) ;
+    printf("cipher: suite %-28s %.0f MB/s echoed\n", suites[i], rate) ;
+  }
+
+  netcipherprofile(NETCIPHER_DEFAULT) ;
+  return testresult("cipher") ;
+}
@@ -0,0 +1,187 @@
+//
+// compress.c
+//
+// Streaming compression between two handles paired through a relay peer,
+// for each algorithm this build has (make ZSTD=1 LZ4=1): a stream of log
+// lines must arrive intact and smaller on the wire, without autoflush a
+// short message must wait for netflush(), with it must not, and a second
+// netcompress() must be refused.  Algorithms not built in must be
+// refused with NET_ERR_NOTSUP.  Prints each algorithm's ratio and rate
+// against no compression.
+//
+
+#include "testsrv.h"
+
+#define TOTAL (4<<20)
+#define CHUNK 16384
+#define SHORT 100
+
+static char *names[] = { "none", "zstd", "lz4" } ;
+static char *data ;
+
+
+//
+// @brief Pair two NONBLOCK handles through the relay
+//
+
+static int pair(int port, NET **a, NET **b)
+{
+  *a = netconnect("127.0.0.1", port, NONBLOCK) ;
+  *b = *a ? netconnect("127.0.0.1", port, NONBLOCK) : NULL ;
+  return *a && *b ;
+}
+
+
+//
+// @brief Wait until a can send or b has data, for up to 10ms
+//
+
+static void waitboth(NET *a, NET *b)
+{
+  fd_set rd, wr ;
+  int l = 0 ;
+  struct timeval tv = { 0, 10000 } ;
+  FD_ZERO(&rd) ;
+  FD_ZERO(&wr) ;
+  netwrfdset(a, &wr, &l) ;
+  netrdfdset(b, &rd, &wr, &l) ;
+  select(l+1, &rd, &wr, NULL, &tv) ;
+}
+
+
+//
+// @brief Stream TOTAL bytes of data from a to b, flushing at the end
+// @return Seconds taken, or -1 if the stream failed or was corrupted
+//
+
+static double stream(NET *a, NET *b)
+{
+  static char buf[65536] ;
+  long sent = 0, got = 0 ;
+  double start = testnow(), end = start + 30 ;
+  int r ;
+
+  while (got<TOTAL && testnow()<end) {
+    int progress = 0 ;
+    if (sent<TOTAL) {
+      r = netsend(a, data+sent, TOTAL-sent>CHUNK ? CHUNK : TOTAL-sent) ;
+      if (r>0) {
+        sent += r ;
+        progress = 1 ;
+      } else if (!netwouldblock()) {
+        return -1 ;
+      }
+    } else if (netflush(a)<0) {
+      return -1 ;
+    }
+    while ((r = netrecv(b, buf, sizeof(buf)))>0) {
+      if (got+r>TOTAL || memcmp(buf, data+got, r)) return -1 ;
+      got += r ;
+      progress = 1 ;
+    }
+    if (r<0 && !netwouldblock()) return -1 ;
+    if (!progress) waitboth(a, b) ;
+  }
+  return got==TOTAL ? testnow() - start : -1 ;
+}
+
+
+//
+// @brief Wait up to 50ms for a short message
+// @return Bytes received
+//
+
+static int shortrecv(NET *b)
+{
+  char buf[SHORT] ;
+  int got = 0, r ;
+  double end = testnow() + 0.05 ;
+  while (got<SHORT && testnow()<end) {
+    if ((r = netrecv(b, buf, sizeof(buf)))>0) got += r ;
+    else usleep(1000) ;
+  }
+  return got ;
+}
+
+
+int main()
+{
+  struct testpeer relay = { .mode = TESTPEER_RELAY } ;
+  struct netcompressstats sta, stb ;
+  double rate[3], ratio[3] ;
+  int alg, i ;
+  NET *a, *b ;
+
+  testpeerstart(&relay) ;
+
+  // Log lines, compressible but not trivially so
+
+  data = malloc(TOTAL+128) ;
+  for (i=0; i<TOTAL; ) {
+    unsigned int h = i * 2654435761u ;
+    i += sprintf(data+i, "%08u GET /api/v1/items/%u HTTP/1.1 status=%d bytes=%u\n",
+                 (unsigned)i, h%10000, (h>>16)%5 ? 200 : 404, h%65536) ;
+  }
+
+  for (alg=NETCOMPRESS_NONE; alg<=NETCOMPRESS_LZ4; alg++) {
+
+    rate[alg] = ratio[alg] = 0 ;
+    TESTCHECK(pair(relay.port, &a, &b), "%s: relay connects failed", names[alg]) ;
+    if (!a || !b) return testresult("compress") ;
+
+    if (alg!=NETCOMPRESS_NONE) {
+      int oka = netcompress(a, alg, 0, 0), okb = netcompress(b, alg, 0, 0) ;
+      if (!oka && !okb && neterrno()==NET_ERR_INT+NET_ERR_NOTSUP) {
+        printf("compress: %s not built in, skipped\n", names[alg]) ;
+        netclose(a) ;
+        netclose(b) ;
+        continue ;
+      }
+      TESTCHECK(oka && okb, "%s: netcompress failed with %d", names[alg], neterrno()) ;
+      TESTCHECK(!netcompress(a, alg, 0, 0) && neterrno()==NET_ERR_INT+NET_ERR_INUSE,
+                "%s: compression enabled twice", names[alg]) ;
+    }
+
+    double secs = stream(a, b) ;
+    TESTCHECK(secs>0, "%s: stream lost or corrupted", names[alg]) ;
+    if (secs>0) rate[alg] = TOTAL/secs/1e6 ;
+
+    if (alg!=NETCOMPRESS_NONE) {
+      TESTCHECK(netcompressstats(a, &sta) && netcompressstats(b, &stb), "%s: no stats", names[alg]) ;
+      TESTCHECK(sta.rawout==TOTAL && stb.rawin==TOTAL, "%s: %llu bytes out, %llu in",
+                names[alg], sta.rawout, stb.rawin) ;
+      TESTCHECK(sta.wireout==stb.wirein && sta.wireout<TOTAL/2, "%s: %llu bytes on the wire, %llu received",
+                names[alg], sta.wireout, stb.wirein) ;
+      ratio[alg] = sta.ratioout ;
+
+      // Without autoflush a short message waits for netflush()
+
+      char msg[SHORT] ;
+      memset(msg, 's', sizeof(msg)) ;
+      TESTCHECK(netsend(a, msg, SHORT)==SHORT, "%s: short send failed", names[alg]) ;
+      TESTCHECK(shortrecv(b)==0, "%s: short message arrived unflushed", names[alg]) ;
+      TESTCHECK(netflush(a)==0 && shortrecv(b)==SHORT, "%s: flushed message lost", names[alg]) ;
+    }
+    netclose(a) ;
+    netclose(b) ;
+
+    // With autoflush every send arrives by itself
+
+    if (alg!=NETCOMPRESS_NONE && pair(relay.port, &a, &b)) {
+      char msg[SHORT] ;
+      memset(msg, 'f', sizeof(msg)) ;
+      netcompress(a, alg, 0, 1) ;
+      netcompress(b, alg, 0, 1) ;
+      TESTCHECK(netsend(a, msg, SHORT)==SHORT && shortrecv(b)==SHORT, "%s: autoflushed message lost", names[alg]) ;
+      netclose(a) ;
+      netclose(b) ;
+    }
+
+    if (rate[alg]>0) {
+      printf("compress: %-5s %.0f MB/s, ratio %.1f\n", names[alg], rate[alg], alg ? ratio[alg] : 1.0) ;
+    }
+  }
+
+  free(data) ;
+  return testresult("compress") ;
+}
@@ -0,0 +1,169 @@
+//
+// cork.c
+//
+// Write coalescing between two handles paired through a relay peer, and
+// against TLS and sink peers: small writes held back until netflush(),
+// a full buffer flushing by itself, a large write going directly after
+// what was gathered, netrdfdset() flushing at the end of a loop
+// iteration, a blocking TLS connection sending its gathered writes as
+// one record before netrecv(), and turning coalescing off or closing
+// sending what was left.  Prints the writes per send and per record.
+//
+
+#include "testsrv.h"
+
+#define THRESHOLD 1024
+#define PIECE 100
+#define PIECES 5
+#define BIG 4000
+
+static int records ;
+
+
+//
+// @brief Count TLS records received by the peer
+//
+
+static void onrecord(struct testpeer *p, int len)
+{
+  (void)p ; (void)len ;
+  __sync_fetch_and_add(&records, 1) ;
+}
+
+
+//
+// @brief Read whatever arrives within 50ms, up to len bytes
+// @return Bytes received
+//
+
+static int arrived(NET *b, char *buf, int len)
+{
+  int got = 0, r ;
+  double end = testnow() + 0.05 ;
+  while (got<len && testnow()<end) {
+    if ((r = netrecv(b, buf+got, len-got))>0) got += r ;
+    else usleep(1000) ;
+  }
+  return got ;
+}
+
+
+//
+// @brief Send n PIECE sized writes
+// @return true if every write was accepted
+//
+
+static int pieces(NET *a, char *msg, int n)
+{
+  for (int i=0; i<n; i++) if (netsend(a, msg + i*PIECE, PIECE)!=PIECE) return 0 ;
+  return 1 ;
+}
+
+
+int main()
+{
+  struct testpeer relay = { .mode = TESTPEER_RELAY } ;
+  struct testpeer tls = { .mode = TESTPEER_ECHO, .tls = 1, .onrecord = onrecord } ;
+  struct testpeer sink = { .mode = TESTPEER_SINK } ;
+  struct netcorkstats st ;
+  static char msg[BIG], buf[2*BIG] ;
+  int i, got ;
+
+  testpeerstart(&relay) ;
+  testpeerstart(&tls) ;
+  testpeerstart(&sink) ;
+  for (i=0; i<BIG; i++) msg[i] = 'a' + i%26 ;
+
+  NET *a = netconnect("127.0.0.1", relay.port, NONBLOCK) ;
+  NET *b = a ? netconnect("127.0.0.1", relay.port, NONBLOCK) : NULL ;
+  TESTCHECK(a && b, "relay connects failed") ;
+  if (!a || !b) return testresult("cork") ;
+  TESTCHECK(!netsetcork(a, -1) && !netcorkstats(a, &st), "negative threshold accepted") ;
+  TESTCHECK(netsetcork(a, THRESHOLD), "netsetcork failed") ;
+
+  // Small writes wait for netflush(), then arrive together
+
+  TESTCHECK(pieces(a, msg, PIECES), "gathered sends failed") ;
+  TESTCHECK(arrived(b, buf, sizeof(buf))==0, "gathered writes sent before a flush") ;
+  TESTCHECK(netflush(a)==0, "netflush failed") ;
+  got = arrived(b, buf, PIECES*PIECE) ;
+  TESTCHECK(got==PIECES*PIECE && !memcmp(buf, msg, got), "flushed writes gave %d bytes", got) ;
+  TESTCHECK(netcorkstats(a, &st) && st.writes==PIECES && st.bytes==PIECES*PIECE && st.flushes==1 &&
+            st.explicitflushes==1 && st.writesperflush==PIECES,
+            "%lu writes, %lu bytes, %lu flushes, %lu explicit", st.writes, st.bytes, st.flushes, st.explicitflushes) ;
+
+  // A full buffer goes to the socket by itself, with MSG_MORE as the
+  // rest is still gathered, so the kernel may hold it until the flush
+
+  int fill = THRESHOLD/PIECE + 1 ;
+  TESTCHECK(pieces(a, msg, fill), "filling sends failed") ;
+  TESTCHECK(netcorkstats(a, &st) && st.thresholdflushes==1 && st.flushes==2,
+            "%lu threshold flushes, %lu flushes", st.thresholdflushes, st.flushes) ;
+  TESTCHECK(netflush(a)==0, "netflush after filling failed") ;
+  got = arrived(b, buf, fill*PIECE) ;
+  TESTCHECK(got==fill*PIECE && !memcmp(buf, msg, got), "full buffer gave %d bytes", got) ;
+
+  // A large write goes directly, after what was gathered
+
+  TESTCHECK(pieces(a, msg, 1) && netsend(a, msg, BIG)==BIG && netflush(a)==0, "large send failed") ;
+  got = arrived(b, buf, PIECE+BIG) ;
+  TESTCHECK(got==PIECE+BIG && !memcmp(buf, msg, PIECE) && !memcmp(buf+PIECE, msg, BIG),
+            "large write out of order, %d bytes", got) ;
+  TESTCHECK(netcorkstats(a, &st) && st.direct==1, "%lu direct writes", st.direct) ;
+
+  // The event loop's netrdfdset() flushes
+
+  fd_set rd, wr ;
+  int l = 0 ;
+  FD_ZERO(&rd) ;
+  FD_ZERO(&wr) ;
+  TESTCHECK(pieces(a, msg, PIECES), "loop sends failed") ;
+  netrdfdset(a, &rd, &wr, &l) ;
+  got = arrived(b, buf, PIECES*PIECE) ;
+  TESTCHECK(got==PIECES*PIECE && netcorkstats(a, &st) && st.loopflushes==1,
+            "loop flush gave %d bytes, %lu loop flushes", got, st.loopflushes) ;
+  printf("cork: plain %lu writes in %lu sends, %.1f per send\n", st.writes + st.direct, st.flushes + st.direct,
+         (double)(st.writes + st.direct) / (st.flushes + st.direct)) ;
+
+  // Turning coalescing off sends what is gathered
+
+  TESTCHECK(pieces(a, msg, PIECES) && netsetcork(a, 0), "netsetcork off failed") ;
+  TESTCHECK(arrived(b, buf, PIECES*PIECE)==PIECES*PIECE, "gathered writes lost turning off") ;
+  TESTCHECK(!netcorkstats(a, &st), "stats after turning off") ;
+  TESTCHECK(netsend(a, msg, PIECE)==PIECE && arrived(b, buf, PIECE)==PIECE, "uncorked write held back") ;
+  netclose(a) ;
+  netclose(b) ;
+
+  // A blocking TLS connection sends its gathered writes as one record
+  // before waiting for the reply
+
+  NET *sh = netconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN) ;
+  TESTCHECK(sh!=NULL, "TLS connect failed") ;
+  if (!sh) return testresult("cork") ;
+  TESTCHECK(netsend(sh, msg, PIECE)==PIECE && netrecv(sh, buf, PIECE)==PIECE, "TLS echo failed") ;
+  TESTCHECK(netsetcork(sh, THRESHOLD), "TLS netsetcork failed") ;
+  int before = __sync_fetch_and_add(&records, 0) ;
+  TESTCHECK(pieces(sh, msg, PIECES), "TLS gathered sends failed") ;
+  for (got=0; got<PIECES*PIECE; ) {
+    int r = netrecv(sh, buf+got, sizeof(buf)-got) ;
+    if (r<=0) break ;
+    got += r ;
+  }
+  int sent = __sync_fetch_and_add(&records, 0) - before ;
+  TESTCHECK(got==PIECES*PIECE && !memcmp(buf, msg, got), "TLS echo of gathered writes gave %d bytes", got) ;
+  TESTCHECK(sent==1 && netcorkstats(sh, &st) && st.loopflushes==1, "%d records, %lu loop flushes",
+            sent, st.loopflushes) ;
+  printf("cork: TLS %d writes in %d record\n", PIECES, sent) ;
+  netclose(sh) ;
+
+  // Closing sends what is gathered
+
+  sh = netconnect("127.0.0.1", sink.port, OPEN) ;
+  TESTCHECK(sh && netsetcork(sh, THRESHOLD) && pieces(sh, msg, PIECES), "sink sends failed") ;
+  if (sh) netclose(sh) ;
+  double end = testnow() + 1 ;
+  while (__sync_fetch_and_add(&sink.bytes, 0)<PIECES*PIECE && testnow()<end) usleep(1000) ;
+  TESTCHECK(sink.bytes==PIECES*PIECE, "%ld of %d bytes sent on close", sink.bytes, PIECES*PIECE) ;
+
+  return testresult("cork") ;
+}
@@ -0,0 +1,299 @@
+//
+// handshake.c
+//
+// Offloaded TLS handshakes: a storm of thousands of NONBLOCK
+// ASYNCHANDSHAKE connects opened in batches from a poll() loop (select()
+// cannot take descriptors past 1024), each echoing once its handshake
+// completes, while pending handles refuse I/O and report nothing
+// pending.  The longest the loop goes without polling is compared with
+// inline handshakes.  Then handles closed mid-handshake, a blocking
+// handle, and a half-open circuit's probe closed while still queued.
+//
+
+#include <poll.h>
+#include <sys/resource.h>
+
+#include "testsrv.h"
+
+#define STORM 2000
+#define BATCH 20              // Connects per loop iteration
+#define CANCEL 50
+#define MSG 64
+
+struct conn {
+  NET *sh ;
+  int sent ;            // Echo request sent
+  int got ;             // Bytes of the echo received
+  int done ;            // Echoed or failed
+} ;
+
+struct storm {
+  int connected ;
+  int echoed ;
+  int pending ;         // Handshakes pending when first checked
+  int refused ;         // ... whose send was refused
+  int finished ;        // ... which finished before the send
+  int haspending ;      // ... which reported data pending
+  double longest ;      // Longest netconnect() call
+  double stall ;        // Longest the loop went without polling
+  double secs ;         // Until every connection echoed
+} ;
+
+static struct conn conns[STORM] ;
+static struct pollfd pfds[STORM+1] ;
+static int polled[STORM+1] ;
+static int nconns ;
+static char msg[MSG] ;
+
+
+//
+// @brief Open nconns connections, BATCH per iteration of a poll() loop
+//        which drives every connection through its echo.  Handles still
+//        handshaking are waited for on nethandshakefd().
+// @param(out) st Outcome of the storm
+//
+
+static void storm(int port, enum netflags flags, struct storm *st)
+{
+  char buf[MSG] ;
+  int i, opened = 0, done = 0 ;
+  double start = testnow(), end = start + 60 ;
+
+  memset(st, 0, sizeof(*st)) ;
+
+  while (done<nconns && testnow()<end) {
+    double busy = testnow() ;
+
+    // Open the next batch, trying to send on handles caught mid-handshake
+
+    for (i=0; i<BATCH && opened<nconns; i++, opened++) {
+      struct conn *c = &conns[opened] ;
+      memset(c, 0, sizeof(*c)) ;
+      double t = testnow() ;
+      c->sh = netconnect("127.0.0.1", port, flags) ;
+      t = testnow() - t ;
+      if (t>st->longest) st->longest = t ;
+      if (!c->sh) {
+        c->done = 1 ;
+        done++ ;
+        continue ;
+      }
+      st->connected++ ;
+      if (!(flags&ASYNCHANDSHAKE) || nethandshakedone(c->sh)!=0) continue ;
+      st->pending++ ;
+      if (nethaspending(c->sh)) st->haspending++ ;
+      int r = netsend(c->sh, msg, MSG) ;
+      if (r==MSG) {
+        c->sent = 1 ;
+        st->finished++ ;
+      } else if (r==-1 && netwouldblock()) {
+        st->refused++ ;
+      }
+    }
+
+    // Send once the handshake is done, and poll for the echoes
+
+    int n = 0, waiting = 0 ;
+    for (i=0; i<opened; i++) {
+      struct conn *c = &conns[i] ;
+      if (c->done) continue ;
+      int hs = nethandshakedone(c->sh) ;
+      if (hs==0) {
+        waiting++ ;
+        continue ;
+      }
+      if (hs<0 || (!c->sent && netsend(c->sh, msg, MSG)!=MSG)) {
+        c->done = 1 ;
+        done++ ;
+        continue ;
+      }
+      c->sent = 1 ;
+      pfds[n].fd = netfd(c->sh) ;
+      pfds[n].events = POLLIN ;
+      polled[n++] = i ;
+    }
+    if (waiting) {
+      pfds[n].fd = nethandshakefd() ;
+      pfds[n].events = POLLIN ;
+      polled[n++] = -1 ;
+    }
+    busy = testnow() - busy ;
+
+    poll(pfds, n, opened<nconns ? 0 : 100) ;
+
+    double t = testnow() ;
+    for (i=0; i<n; i++) {
+      if (polled[i]<0 || !pfds[i].revents) continue ;
+      struct conn *c = &conns[polled[i]] ;
+      int r ;
+      do {
+        if ((r = netrecv(c->sh, buf, sizeof(buf)))>0) c->got += r ;
+      } while (r>0 && c->got<MSG && nethaspending(c->sh)) ;
+      if (c->got>=MSG) {
+        st->echoed++ ;
+        c->done = 1 ;
+        done++ ;
+      } else if (r<0 && !netwouldblock()) {
+        c->done = 1 ;
+        done++ ;
+      }
+    }
+    busy += testnow() - t ;
+    if (busy>st->stall) st->stall = busy ;
+  }
+  st->secs = testnow() - start ;
+}
+
+
+//
+// @brief Find a loopback port nothing listens on
+//
+
+static int deadport()
+{
+  struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) } ;
+  socklen_t len = sizeof(sa) ;
+  int fd = socket(AF_INET, SOCK_STREAM, 0) ;
+  bind(fd, (struct sockaddr *)&sa, sizeof(sa)) ;
+  getsockname(fd, (struct sockaddr *)&sa, &len) ;
+  close(fd) ;
+  return ntohs(sa.sin_port) ;
+}
+
+
+static void closeall()
+{
+  for (int i=0; i<nconns; i++) if (conns[i].sh) netclose(conns[i].sh) ;
+}
+
+
+int main()
+{
+  struct testpeer tls = { .mode = TESTPEER_ECHO, .tls = 1 } ;
+  struct nethandshakestats st, before ;
+  struct storm inl, off ;
+  struct rlimit rl ;
+  int i ;
+
+  testpeerstart(&tls) ;
+  memset(msg, 'h', sizeof(msg)) ;
+
+  // Each connection takes a descriptor here and one in the peer
+
+  getrlimit(RLIMIT_NOFILE, &rl) ;
+  rl.rlim_cur = rl.rlim_max ;
+  setrlimit(RLIMIT_NOFILE, &rl) ;
+  getrlimit(RLIMIT_NOFILE, &rl) ;
+  nconns = rl.rlim_cur>2*STORM+64 ? STORM : (int)(rl.rlim_cur-64)/2 ;
+
+  TESTCHECK(!nethandshakepool(-1), "negative pool size accepted") ;
+  TESTCHECK(nethandshakepool(2), "nethandshakepool failed") ;
+  int fds = testfds() ;
+
+  // The last of thousands queued on two workers waits longer than the
+  // default handshake timeout, which counts from the connect
+
+  netsettimeout(NULL, NETTIMEOUT_HANDSHAKE, 60000) ;
+
+  // Inline handshakes, for comparison
+
+  storm(tls.port, TLS|NOCERTCHAIN|NONBLOCK, &inl) ;
+  TESTCHECK(inl.connected==nconns && inl.echoed==nconns, "%d connected, %d of %d echoed inline",
+            inl.connected, inl.echoed, nconns) ;
+  closeall() ;
+
+  // The same storm offloaded.  Handles caught mid-handshake must neither
+  // send nor touch the worker's SSL object, unless the handshake finished
+  // in the meantime.
+
+  nethandshakestats(&before) ;
+  storm(tls.port, TLS|NOCERTCHAIN|NONBLOCK|ASYNCHANDSHAKE, &off) ;
+  TESTCHECK(off.connected==nconns && off.echoed==nconns, "%d connected, %d of %d echoed offloaded",
+            off.connected, off.echoed, nconns) ;
+  TESTCHECK(off.pending>0, "no handshake was still pending") ;
+  TESTCHECK(!off.haspending, "%d pending handshakes reported data", off.haspending) ;
+  TESTCHECK(off.refused>0 && off.refused+off.finished==off.pending, "%d of %d pending handshakes failed a send",
+            off.pending-off.refused-off.finished, off.pending) ;
+  closeall() ;
+
+  TESTCHECK(nethandshakestats(&st), "nethandshakestats failed") ;
+  TESTCHECK(st.completed-before.completed==(unsigned long)nconns && st.failed==before.failed,
+            "%lu completed, %lu failed", st.completed-before.completed, st.failed-before.failed) ;
+  TESTCHECK(st.threads==2 && st.queued==0 && st.inflight==0,
+            "%d threads, %lu queued, %lu in flight", st.threads, st.queued, st.inflight) ;
+
+  netsettimeout(NULL, NETTIMEOUT_HANDSHAKE, 2000) ;
+
+  printf("handshake: %d connects, %d per loop, loop stalled up to %.1fms inline, %.1fms offloaded\n",
+         nconns, BATCH, inl.stall*1e3, off.stall*1e3) ;
+  printf("handshake: longest netconnect() %.2fms inline, %.2fms offloaded, all echoed after %.2fs and %.2fs, "
+         "%lu most queued\n", inl.longest*1e3, off.longest*1e3, inl.secs, off.secs, st.maxqueued) ;
+
+  // Handles closed mid-handshake are cancelled or waited for
+
+  nethandshakestats(&before) ;
+  for (i=0; i<CANCEL; i++) {
+    NET *sh = netconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN|NONBLOCK|ASYNCHANDSHAKE) ;
+    if (sh) netclose(sh) ;
+  }
+  nethandshakestats(&st) ;
+  unsigned long closed = (st.completed - before.completed) + (st.failed - before.failed) +
+                           (st.cancelled - before.cancelled) ;
+  TESTCHECK(closed==CANCEL && st.queued==0 && st.inflight==0,
+            "%lu of %d closed handshakes accounted for, %lu queued, %lu in flight",
+            closed, CANCEL, st.queued, st.inflight) ;
+
+  // A blocking handle waits for its handshake
+
+  NET *sh = netconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN|ASYNCHANDSHAKE) ;
+  TESTCHECK(sh!=NULL, "blocking connect failed") ;
+  if (sh) {
+    char buf[MSG] ;
+    int got = 0, r = 0 ;
+    TESTCHECK(netsend(sh, msg, MSG)==MSG, "blocking send failed") ;
+    while (got<MSG && (r = netrecv(sh, buf, sizeof(buf)))>0) got += r ;
+    TESTCHECK(got==MSG, "blocking echo returned %d bytes", got) ;
+    netclose(sh) ;
+  }
+
+  // Only the notification fd and the shared DEVNULL stay open, once the
+  // peer has closed its side of every connection
+
+  double end = testnow() + 2 ;
+  while (testfds()>fds+2 && testnow()<end) usleep(10000) ;
+  TESTCHECK(testfds()<=fds+2, "handshakes leaked %d fds", testfds()-fds) ;
+
+  // A half-open circuit's probe closed while queued behind busy workers
+  // must end the probe, or the destination is refused for good
+
+  struct testpeer silent = { .mode = TESTPEER_SILENT } ;
+  struct netendpointstats ep ;
+  NET *busy[2], *probe ;
+  int port = deadport() ;
+
+  testpeerstart(&silent) ;
+  netbreakerconfig(1, 50, 50) ;
+  NET *failed = netconnect("127.0.0.1", port, OPEN) ;
+  TESTCHECK(!failed && netbreakerstate("127.0.0.1", port, NULL)==NETBREAKER_OPEN, "circuit did not open") ;
+  struct testpeer back = { .mode = TESTPEER_ECHO, .tls = 1, .port = port } ;
+  testpeerstart(&back) ;
+  end = testnow() + 2 ;
+  while (netbreakerstate("127.0.0.1", port, NULL)==NETBREAKER_OPEN && testnow()<end) usleep(5000) ;
+
+  for (i=0; i<2; i++) busy[i] = netconnect("127.0.0.1", silent.port, TLS|NOCERTCHAIN|NONBLOCK|ASYNCHANDSHAKE) ;
+  usleep(20000) ;
+  probe = netconnect("127.0.0.1", port, TLS|NOCERTCHAIN|NONBLOCK|ASYNCHANDSHAKE|BALANCE) ;
+  nethandshakestats(&st) ;
+  TESTCHECK(probe && st.queued==1, "probe %p with %lu queued", (void *)probe, st.queued) ;
+  if (probe) netclose(probe) ;
+
+  NET *after = netconnect("127.0.0.1", port, TLS|NOCERTCHAIN) ;
+  TESTCHECK(after!=NULL, "connect after the cancelled probe failed with %d", neterrno()) ;
+  if (after) netclose(after) ;
+  TESTCHECK(netendpointstats("127.0.0.1", port, &ep, 1)==1 && ep.active==0,
+            "cancelled probe left %d connections active", ep.active) ;
+  for (i=0; i<2; i++) if (busy[i]) netclose(busy[i]) ;
+  netbreakerconfig(0, 50, 50) ;
+
+  return testresult("handshake") ;
+}
@@ -0,0 +1,118 @@
+//
+// hedge.c
+//
+// Hedged connects and requests against a TLS echo peer whose handshakes
+// or echoes are slowed, so every operation hedges: each must succeed and
+// be counted as a win or a loss.  Then a hedge opened as a half-open
+// circuit's probe, and cancelled mid-handshake when the first connection
+// responds, must end the probe rather than leave the destination refused.
+//
+
+#include "testsrv.h"
+
+#define CONNECTS 20
+#define REQUESTS 20
+#define MSG 32
+
+
+//
+// @brief Hedge a request and read the rest of its echo
+// @return true if the whole echo came back
+//
+
+static int request(NET **sh)
+{
+  char msg[MSG], buf[MSG] ;
+  memset(msg, 'q', sizeof(msg)) ;
+  int got = nethedgerequest(sh, msg, MSG, buf, sizeof(buf)), r = 0 ;
+  while (got>0 && got<MSG && (r = netrecv(*sh, buf+got, sizeof(buf)-got))>0) got += r ;
+  return got==MSG && !memcmp(buf, msg, MSG) ;
+}
+
+
+int main()
+{
+  struct testpeer tls = { .mode = TESTPEER_ECHO, .tls = 1 } ;
+  struct nethedgestats st, before ;
+  struct netbreakerstats bst ;
+  struct netendpointstats ep ;
+  int i, ok = 0 ;
+
+  testpeerstart(&tls) ;
+
+  TESTCHECK(!nethedgeconfig(49, 1, 10, 10) && !nethedgeconfig(95, 10, 1, 10) &&
+            !nethedgeconfig(95, 1, 10, -1), "invalid hedge settings accepted") ;
+
+  // Handshakes slower than the hedge delay, so every connect hedges
+
+  TESTCHECK(nethedgeconfig(95, 2, 2, 100), "nethedgeconfig failed") ;
+  tls.hsdelayms = 20 ;
+  nethedgestats(&before) ;
+  double start = testnow() ;
+  for (i=0; i<CONNECTS; i++) {
+    NET *sh = nethedgeconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN) ;
+    if (sh && nethandshakedone(sh)==1) ok++ ;
+    if (sh) netclose(sh) ;
+  }
+  double connectms = (testnow() - start) * 1e3 / CONNECTS ;
+  TESTCHECK(ok==CONNECTS, "%d of %d hedged connects failed", CONNECTS-ok, CONNECTS) ;
+  nethedgestats(&st) ;
+  TESTCHECK(st.connects-before.connects==CONNECTS, "%lu connects counted", st.connects-before.connects) ;
+  TESTCHECK(st.hedges-before.hedges==CONNECTS, "%lu of %d connects hedged", st.hedges-before.hedges, CONNECTS) ;
+  TESTCHECK((st.wins-before.wins) + (st.losses-before.losses)==CONNECTS && st.failures==before.failures,
+            "%lu wins, %lu losses, %lu failures", st.wins-before.wins, st.losses-before.losses,
+            st.failures-before.failures) ;
+
+  // Echoes slower than the hedge delay, so every request hedges and the
+  // first connection, with a head start, wins
+
+  tls.hsdelayms = 0 ;
+  tls.delayms = 20 ;
+  NET *sh = netconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN|BALANCE) ;
+  TESTCHECK(sh!=NULL, "connect for hedged requests failed") ;
+  nethedgestats(&before) ;
+  start = testnow() ;
+  for (i=0, ok=0; sh && i<REQUESTS; i++) ok += request(&sh) ;
+  double requestms = (testnow() - start) * 1e3 / REQUESTS ;
+  TESTCHECK(ok==REQUESTS, "%d of %d hedged requests failed", REQUESTS-ok, REQUESTS) ;
+  nethedgestats(&st) ;
+  TESTCHECK(st.requests-before.requests==REQUESTS && st.hedges-before.hedges==REQUESTS,
+            "%lu requests, %lu hedged", st.requests-before.requests, st.hedges-before.hedges) ;
+  TESTCHECK(st.losses-before.losses>=REQUESTS/2, "only %lu hedges lost to the first connection",
+            st.losses-before.losses) ;
+
+  printf("hedge: %.1fms per connect with 20ms handshakes, %.1fms per request with 20ms echoes\n",
+         connectms, requestms) ;
+
+  // A hedge which is a half-open circuit's probe, losing while its
+  // handshake is running, ends the probe without counting a failure
+
+  netsettimeout(NULL, NETTIMEOUT_HANDSHAKE, 200) ;
+  netbreakerconfig(1, 50, 50) ;
+  tls.hsdelayms = 400 ;
+  TESTCHECK(!netconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN) &&
+            netbreakerstate("127.0.0.1", tls.port, NULL)==NETBREAKER_OPEN, "a slow handshake did not open the circuit") ;
+  double end = testnow() + 2 ;
+  while (netbreakerstate("127.0.0.1", tls.port, NULL)==NETBREAKER_OPEN && testnow()<end) usleep(5000) ;
+
+  nethedgestats(&before) ;
+  TESTCHECK(sh && request(&sh), "hedged request with a probing hedge failed") ;
+  nethedgestats(&st) ;
+  TESTCHECK(st.hedges-before.hedges==1 && st.losses-before.losses==1, "%lu hedges, %lu losses",
+            st.hedges-before.hedges, st.losses-before.losses) ;
+
+  tls.hsdelayms = 0 ;
+  NET *after = netconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN) ;
+  TESTCHECK(after!=NULL, "connect after the cancelled probe failed with %d", neterrno()) ;
+  if (after) netclose(after) ;
+  TESTCHECK(netbreakerstate("127.0.0.1", tls.port, &bst)==NETBREAKER_CLOSED && bst.failures==1,
+            "state %d with %lu failures", bst.state, bst.failures) ;
+  TESTCHECK(netendpointstats("127.0.0.1", tls.port, &ep, 1)==1 && ep.active==1,
+            "%d connections active with one open", ep.active) ;
+
+  if (sh) netclose(sh) ;
+  netbreakerconfig(0, 50, 50) ;
+  netsettimeout(NULL, NETTIMEOUT_HANDSHAKE, 2000) ;
+
+  return testresult("hedge") ;
+}
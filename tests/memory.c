@@ -0,0 +1,157 @@
+//
+// memory.c
+//
+// Per-connection memory: netmemory() breaking down plain and TLS
+// connections, netidlememory() capping the socket buffers and releasing
+// TLS buffers, and the previous sizes and autotuning coming back when
+// idle mode is turned off, when data is sent, when data is received,
+// but not while merely waiting for it.  Also the default for new
+// connections.  Prints the estimates with and without idle mode.
+//
+
+#include "testsrv.h"
+
+#define IDLEBUF 4096
+#define MSG 64
+
+struct bufs {
+  int rcv, snd, locks ;
+} ;
+
+
+//
+// @brief Find a connection's socket by its local port
+//
+
+static int sockfd(NET *sh)
+{
+  int port = netlocalport(sh) ;
+  for (int fd=3; fd<1024; fd++) {
+    struct sockaddr_in sa ;
+    socklen_t len = sizeof(sa) ;
+    if (getsockname(fd, (struct sockaddr *)&sa, &len)==0 && sa.sin_family==AF_INET &&
+        ntohs(sa.sin_port)==port) return fd ;
+  }
+  return -1 ;
+}
+
+
+//
+// @brief Read a connection's socket buffer sizes and locks
+//
+
+static struct bufs bufs(NET *sh)
+{
+  struct bufs b = { 0, 0, -1 } ;
+  socklen_t len = sizeof(int) ;
+  int fd = sockfd(sh) ;
+  getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &b.rcv, &len) ;
+  getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &b.snd, &len) ;
+#ifdef SO_BUF_LOCK
+  getsockopt(fd, SOL_SOCKET, SO_BUF_LOCK, &b.locks, &len) ;
+#endif
+  return b ;
+}
+
+
+//
+// @brief Check buffers are capped to IDLEBUF (reported doubled) and locked
+//
+
+static int capped(NET *sh)
+{
+  struct bufs b = bufs(sh) ;
+  return b.rcv==2*IDLEBUF && b.snd==2*IDLEBUF && b.locks!=0 ;
+}
+
+
+//
+// @brief Check buffers are back to what they were
+//
+
+static int restored(NET *sh, struct bufs was)
+{
+  struct bufs b = bufs(sh) ;
+  return b.rcv==was.rcv && b.snd==was.snd && b.locks==was.locks ;
+}
+
+
+int main()
+{
+  struct testpeer echo = { .mode = TESTPEER_ECHO } ;
+  struct testpeer tls = { .mode = TESTPEER_ECHO, .tls = 1 } ;
+  struct netmemory st, idle ;
+  char msg[MSG], buf[MSG] ;
+  int got, r ;
+
+  testpeerstart(&echo) ;
+  testpeerstart(&tls) ;
+  memset(msg, 'm', sizeof(msg)) ;
+
+  TESTCHECK(netmemory(NULL, &st)==0 && st.total==0, "memory of no connection") ;
+
+  // A plain connection holds its handle and socket
+
+  NET *sh = netconnect("127.0.0.1", echo.port, NONBLOCK) ;
+  TESTCHECK(sh!=NULL, "connect failed") ;
+  if (!sh) return testresult("memory") ;
+  long total = netmemory(sh, &st) ;
+  TESTCHECK(total==st.total && st.total==st.handle+st.tls+st.context+st.kernel, "breakdown does not add up") ;
+  TESTCHECK(st.handle>0 && st.kernel>0 && st.tls==0 && st.context==0, "plain breakdown %ld %ld %ld %ld",
+            st.handle, st.tls, st.context, st.kernel) ;
+
+  // Idle mode caps the buffers, and turning it off restores them
+
+  struct bufs was = bufs(sh) ;
+  TESTCHECK(!netidlememory(sh, -1), "negative buffer size accepted") ;
+  TESTCHECK(netidlememory(sh, IDLEBUF) && capped(sh), "idle buffers not capped") ;
+  TESTCHECK(netidlememory(sh, IDLEBUF*2) && netidlememory(sh, IDLEBUF), "idle size not changed") ;
+  TESTCHECK(netidlememory(sh, 0) && restored(sh, was), "buffers not restored leaving idle mode") ;
+  TESTCHECK(was.locks<=0, "autotuning was off to start with, locks %d", was.locks) ;
+
+  // Waiting for data keeps idle mode, data sent or received ends it
+
+  netidlememory(sh, IDLEBUF) ;
+  TESTCHECK(netrecv(sh, buf, sizeof(buf))==-1 && netwouldblock() && capped(sh), "waiting for data ended idle mode") ;
+  TESTCHECK(netsend(sh, msg, MSG)==MSG && restored(sh, was), "buffers not restored by a send") ;
+  usleep(20000) ;
+  netidlememory(sh, IDLEBUF) ;
+  TESTCHECK(netrecv(sh, buf, sizeof(buf))==MSG && restored(sh, was), "buffers not restored by a receive") ;
+  netclose(sh) ;
+
+  // The default applies to new connections
+
+  netidlememory(NULL, IDLEBUF) ;
+  sh = netconnect("127.0.0.1", echo.port, OPEN) ;
+  netidlememory(NULL, 0) ;
+  TESTCHECK(sh && capped(sh), "default idle mode not applied") ;
+  TESTCHECK(sh && netsend(sh, msg, MSG)==MSG && restored(sh, was), "default idle mode not ended by a send") ;
+  if (sh) netclose(sh) ;
+  sh = netconnect("127.0.0.1", echo.port, OPEN) ;
+  TESTCHECK(sh && restored(sh, was), "default idle mode not turned off") ;
+  if (sh) netclose(sh) ;
+
+  // TLS connections share a context, and release their write buffer
+  // while idle
+
+  sh = netconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN) ;
+  TESTCHECK(sh!=NULL, "TLS connect failed") ;
+  if (!sh) return testresult("memory") ;
+  netmemory(sh, &st) ;
+  TESTCHECK(st.tls>0 && st.context>0, "TLS breakdown %ld %ld", st.tls, st.context) ;
+  netidlememory(sh, IDLEBUF) ;
+  netmemory(sh, &idle) ;
+  TESTCHECK(idle.tls<st.tls && capped(sh), "idle TLS %ld bytes, %ld active", idle.tls, st.tls) ;
+  got = 0 ;
+  if (netsend(sh, msg, MSG)==MSG) {
+    while (got<MSG && (r = netrecv(sh, buf+got, sizeof(buf)-got))>0) got += r ;
+  }
+  TESTCHECK(got==MSG && !memcmp(buf, msg, MSG), "TLS echo failed after idle mode") ;
+  struct netmemory after ;
+  netmemory(sh, &after) ;
+  TESTCHECK(after.tls==st.tls && !capped(sh), "TLS idle mode not ended, %ld TLS bytes", after.tls) ;
+  printf("memory: TLS connection %ld bytes, %ld idle (tls %ld, %ld)\n", st.total, idle.total, st.tls, idle.tls) ;
+  netclose(sh) ;
+
+  return testresult("memory") ;
+}
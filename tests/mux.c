@@ -0,0 +1,275 @@
+//
+// mux.c
+//
+// Stream multiplexing: two handles paired through a relay peer, one
+// opening a hundred streams and the other echoing each back.  Every echo
+// must arrive intact, streams must be accepted in the order opened, and a
+// bulk stream must not hold up the small ones.  Then a reset stream, and
+// the time for a hundred small requests as streams over one connection
+// against new connections.
+//
+
+#include "testsrv.h"
+
+#define STREAMS 100
+#define SMALL 4096
+#define BIG (1<<20)
+#define CHUNK 16384
+#define REQUEST 256
+
+struct client {
+  NETSTREAM *st ;
+  long size ;
+  long sent ;
+  long got ;
+  int shut ;
+  int done ;            // Order finished, from 1
+  int bad ;             // Echo differed from what was sent
+} ;
+
+struct server {
+  NETSTREAM *st ;
+  char buf[CHUNK] ;
+  int pos ;
+  int len ;
+  int fin ;
+} ;
+
+static struct client clients[STREAMS] ;
+static struct server servers[STREAMS] ;
+static int lastid = 0 ;
+static int misordered = 0 ;
+static int events = 0 ;
+
+
+static char pattern(int stream, long offset)
+{
+  return (char)(stream*7 + offset) ;
+}
+
+
+//
+// @brief Send what the stream's window allows and check what has come back
+//
+
+static void clientstep(int i, int *finished)
+{
+  struct client *c = &clients[i] ;
+  char buf[CHUNK] ;
+  int r ;
+
+  while (c->sent<c->size) {
+    int n = c->size-c->sent>CHUNK ? CHUNK : c->size-c->sent ;
+    for (int k=0; k<n; k++) buf[k] = pattern(i, c->sent+k) ;
+    if ((r = netmuxsend(c->st, buf, n))<=0) break ;
+    c->sent += r ;
+  }
+  if (c->sent==c->size && !c->shut) c->shut = netmuxshutdown(c->st) ;
+
+  while ((r = netmuxrecv(c->st, buf, sizeof(buf)))>0) {
+    for (int k=0; k<r; k++) if (buf[k]!=pattern(i, c->got+k)) c->bad = 1 ;
+    c->got += r ;
+  }
+  if (r==0) {
+    c->done = ++(*finished) ;
+    netmuxclose(c->st) ;
+  } else if (errno!=EAGAIN) {
+    c->bad = 1 ;
+    c->done = ++(*finished) ;
+  }
+}
+
+
+//
+// @brief Echo whatever has arrived, finishing once the peer has
+//
+
+static void serverstep(struct server *s)
+{
+  int r ;
+
+  for (;;) {
+    if (s->pos<s->len) {
+      if ((r = netmuxsend(s->st, s->buf+s->pos, s->len-s->pos))<=0) return ;
+      s->pos += r ;
+      continue ;
+    }
+    if ((r = netmuxrecv(s->st, s->buf, sizeof(s->buf)))>0) {
+      s->pos = 0 ;
+      s->len = r ;
+    } else {
+      if (r==0) {
+        netmuxclose(s->st) ;
+        s->st = NULL ;
+      }
+      return ;
+    }
+  }
+}
+
+
+//
+// @brief Open n streams on a and echo them from b, until all have
+//        finished or 30 seconds have passed
+// @return Number of streams finished
+//
+
+static int exchange(NETMUX *a, NETMUX *b, int n, long *sizes)
+{
+  fd_set rd, wr ;
+  fd_set *rdp = NULL, *wrp = NULL ;
+  int i, finished = 0, accepted = 0 ;
+  double end = testnow() + 30 ;
+
+  memset(clients, 0, sizeof(clients)) ;
+  memset(servers, 0, sizeof(servers)) ;
+  for (i=0; i<n; i++) {
+    clients[i].st = netmuxopen(a) ;
+    clients[i].size = sizes[i] ;
+    if (!clients[i].st) return 0 ;
+  }
+
+  while (finished<n && testnow()<end) {
+    struct timeval tv = { 0, 100000 } ;
+    int l = 0 ;
+    NETSTREAM *st ;
+
+    if (netmuxprocess(a, rdp, wrp)<0 || netmuxprocess(b, rdp, wrp)<0) break ;
+
+    // The peer's streams first, then readiness, and only then wait, as
+    // data already taken in does not make the connection readable
+
+    while (accepted<n && (st = netmuxaccept(b))) {
+      if (netmuxid(st)<=lastid || netmuxid(st)%2!=1) misordered++ ;
+      lastid = netmuxid(st) ;
+      servers[accepted++].st = st ;
+    }
+    while (netmuxready(a) || netmuxready(b)) events++ ;
+
+    for (i=0; i<n; i++) if (!clients[i].done) clientstep(i, &finished) ;
+    for (i=0; i<accepted; i++) if (servers[i].st) serverstep(&servers[i]) ;
+    if (finished==n) break ;
+
+    FD_ZERO(&rd) ;
+    FD_ZERO(&wr) ;
+    netmuxrdfdset(a, &rd, &wr, &l) ;
+    netmuxrdfdset(b, &rd, &wr, &l) ;
+    if (select(l+1, &rd, &wr, NULL, &tv)<0) break ;
+    rdp = &rd ;
+    wrp = &wr ;
+  }
+
+  return finished ;
+}
+
+
+int main()
+{
+  struct testpeer relay = { .mode = TESTPEER_RELAY } ;
+  struct testpeer echo = { .mode = TESTPEER_ECHO } ;
+  struct testpeer tls = { .mode = TESTPEER_ECHO, .tls = 1 } ;
+  struct netmuxstats sta, stb ;
+  static long sizes[STREAMS] ;
+  int i, bad = 0, short_ = 0, late = 0 ;
+
+  testpeerstart(&relay) ;
+  testpeerstart(&echo) ;
+  testpeerstart(&tls) ;
+
+  NET *sha = netconnect("127.0.0.1", relay.port, NONBLOCK) ;
+  NET *shb = netconnect("127.0.0.1", relay.port, NONBLOCK) ;
+  TESTCHECK(sha && shb, "relay connects failed") ;
+  if (!sha || !shb) return testresult("mux") ;
+
+  TESTCHECK(!netmuxstart(NULL, 1), "started on a NULL handle") ;
+  NETMUX *a = netmuxstart(sha, 1) ;
+  NETMUX *b = netmuxstart(shb, 0) ;
+  TESTCHECK(a && b, "netmuxstart failed") ;
+  if (!a || !b) return testresult("mux") ;
+
+  // The first stream is bulk, far beyond its window, the rest small
+
+  long total = 0 ;
+  for (i=0; i<STREAMS; i++) total += sizes[i] = i ? SMALL : BIG ;
+  int finished = exchange(a, b, STREAMS, sizes) ;
+  TESTCHECK(finished==STREAMS, "only %d of %d streams finished", finished, STREAMS) ;
+
+  for (i=0; i<STREAMS; i++) {
+    if (clients[i].bad) bad++ ;
+    if (clients[i].got!=clients[i].size) short_++ ;
+    if (i && clients[i].done>clients[0].done) late++ ;
+  }
+  TESTCHECK(!bad, "%d echoes corrupt", bad) ;
+  TESTCHECK(!short_, "%d echoes short", short_) ;
+  TESTCHECK(!late, "%d small streams finished after the bulk one", late) ;
+  TESTCHECK(!misordered, "%d streams accepted out of order", misordered) ;
+  TESTCHECK(events>0, "netmuxready never returned a stream") ;
+
+  TESTCHECK(netmuxstats(a, &sta) && netmuxstats(b, &stb), "netmuxstats failed") ;
+  TESTCHECK(sta.opened==STREAMS && stb.accepted==STREAMS,
+            "%lu opened, %lu accepted", sta.opened, stb.accepted) ;
+  TESTCHECK(sta.bytesout==(unsigned long)total && sta.bytesin==(unsigned long)total &&
+            stb.bytesin==(unsigned long)total && stb.bytesout==(unsigned long)total,
+            "bytes %lu/%lu out, %lu/%lu in, expected %ld",
+            sta.bytesout, stb.bytesout, sta.bytesin, stb.bytesin, total) ;
+  TESTCHECK(sta.windowstalls+stb.windowstalls>0, "the bulk stream never ran out of window") ;
+  TESTCHECK(sta.writes<sta.framesout, "%lu writes for %lu frames", sta.writes, sta.framesout) ;
+
+  // Closing a stream the peer is still sending on resets it
+
+  NETSTREAM *st = netmuxopen(a) ;
+  NETSTREAM *peer = NULL ;
+  char buf[REQUEST] = { 0 } ;
+  int r = -1 ;
+  TESTCHECK(st && netmuxsend(st, buf, sizeof(buf))==sizeof(buf), "reset stream send failed") ;
+  netmuxprocess(a, NULL, NULL) ;
+  TESTCHECK(netmuxclose(st), "netmuxclose failed") ;
+  double end = testnow() + 5 ;
+  while (testnow()<end) {
+    netmuxprocess(a, NULL, NULL) ;
+    netmuxprocess(b, NULL, NULL) ;
+    if (!peer) peer = netmuxaccept(b) ;
+    while (netmuxready(a) || netmuxready(b)) ;
+    if (peer) while ((r = netmuxrecv(peer, buf, sizeof(buf)))>0) ;
+    if (peer && r<0 && errno==ECONNRESET) break ;
+    usleep(1000) ;
+  }
+  TESTCHECK(peer && r<0 && errno==ECONNRESET, "peer never saw the reset") ;
+  if (peer) netmuxclose(peer) ;
+  TESTCHECK(netmuxstats(b, &stb) && stb.resets>=1, "%lu resets", stb.resets) ;
+
+  // A hundred small requests as streams, against a new connection each
+
+  for (i=0; i<STREAMS; i++) sizes[i] = REQUEST ;
+  double start = testnow() ;
+  finished = exchange(a, b, STREAMS, sizes) ;
+  double muxsecs = testnow() - start ;
+  TESTCHECK(finished==STREAMS, "only %d of %d requests finished", finished, STREAMS) ;
+
+  double conn[2] ;
+  for (int secure=0; secure<2; secure++) {
+    start = testnow() ;
+    for (i=0; i<STREAMS; i++) {
+      NET *sh = secure ? netconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN)
+                       : netconnect("127.0.0.1", echo.port, OPEN) ;
+      int got = 0 ;
+      if (!sh) break ;
+      if (netsend(sh, buf, REQUEST)==REQUEST) {
+        while (got<REQUEST && (r = netrecv(sh, buf, sizeof(buf)))>0) got += r ;
+      }
+      netclose(sh) ;
+      if (got!=REQUEST) break ;
+    }
+    conn[secure] = testnow() - start ;
+    TESTCHECK(i==STREAMS, "request %d on a new %s connection failed", i, secure ? "TLS" : "plain") ;
+  }
+  printf("mux: %d requests in %.2fms as streams, %.2fms on new connections, %.2fms on new TLS connections\n",
+         STREAMS, muxsecs*1e3, conn[0]*1e3, conn[1]*1e3) ;
+
+  netmuxstop(a) ;
+  netmuxstop(b) ;
+  netclose(sha) ;
+  netclose(shb) ;
+
+  return testresult("mux") ;
+}
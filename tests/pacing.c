@@ -0,0 +1,180 @@
+//
+// pacing.c
+//
+// Egress pacing against a sink peer: a blocking connection sleeping in
+// netsend() to hold its rate, a NONBLOCK connection failing with
+// NET_ERR_THROTTLED, left out of select() until netthrottleduntil(), and
+// holding the same rate from a select() loop, two connections sharing a
+// group's budget, and a connection leaving its limits going at full
+// speed.  Prints the rates measured against the limit.
+//
+
+#include "testsrv.h"
+
+#define RATE 2000000      // Bytes per second
+#define BURST 65536
+#define TOTAL 1000000
+#define CHUNK 16384
+#define SLACK 0.15        // Seconds a paced send may overrun on a loaded host
+
+static char buf[CHUNK] ;
+
+
+//
+// @brief Check a paced transfer of TOTAL bytes took as long as the limit
+//
+
+static int ontime(double secs)
+{
+  double expect = (double)(TOTAL-BURST) / RATE ;
+  return secs>=expect*0.9 && secs<=expect+SLACK ;
+}
+
+
+//
+// @brief Send TOTAL bytes from a select() loop, sleeping only until the
+//        first throttled connection may send again.  Connections take
+//        turns to go first, since whichever does takes a shared budget.
+// @param(out) sent Bytes sent by each connection
+// @return Seconds taken, or -1 on a failed send or after 10 seconds
+//
+
+static double pump(NET **sh, int n, long *sent)
+{
+  double start = testnow() ;
+  long all = 0 ;
+  int i, first = 0 ;
+
+  for (i=0; i<n; i++) sent[i] = 0 ;
+
+  while (all<TOTAL) {
+    struct timespec until ;
+    double now = testnow(), wait = 0.1 ;
+    fd_set wr ;
+    int l = 0 ;
+
+    if (now-start>10) return -1 ;
+    FD_ZERO(&wr) ;
+    for (i=0; i<n; i++) {
+      if (netthrottleduntil(sh[i], &until)) {
+        double w = until.tv_sec + until.tv_nsec/1e9 - now ;
+        if (w<wait) wait = w>0 ? w : 0 ;
+      }
+      netwrfdset(sh[i], &wr, &l) ;
+    }
+    struct timeval tv = { 0, (long)(wait*1e6) } ;
+    select(l+1, NULL, &wr, NULL, &tv) ;
+
+    for (i=0; i<n && all<TOTAL; i++) {
+      int c = (first+i) % n ;
+      if (!netwrfdisset(sh[c], &wr)) continue ;
+      int r = netsend(sh[c], buf, TOTAL-all>CHUNK ? CHUNK : TOTAL-all) ;
+      if (r>0) {
+        sent[c] += r ;
+        all += r ;
+      } else if (!netwouldblock()) {
+        return -1 ;
+      }
+    }
+    first++ ;
+  }
+  return testnow() - start ;
+}
+
+
+int main()
+{
+  struct testpeer sink = { .mode = TESTPEER_SINK } ;
+  struct netratestats st ;
+  struct timespec until ;
+  long sent[2] ;
+  double secs ;
+  int r ;
+
+  testpeerstart(&sink) ;
+  memset(buf, 'p', sizeof(buf)) ;
+
+  TESTCHECK(!netrategroup(0, RATE, BURST) && !netrategroup(NET_MAXRATEGROUPS+1, RATE, BURST),
+            "invalid groups accepted") ;
+
+  // A blocking connection sleeps in netsend()
+
+  NET *sh = netconnect("127.0.0.1", sink.port, OPEN) ;
+  TESTCHECK(sh && !netratestats(sh, &st), "stats for an unpaced connection") ;
+  TESTCHECK(!netsetrategroup(sh, NET_MAXRATEGROUPS+1) && neterrno()==NET_ERR_INT+NET_ERR_BADP,
+            "invalid group joined") ;
+  TESTCHECK(netsetrate(sh, RATE, BURST), "netsetrate failed") ;
+  double start = testnow() ;
+  long total = 0 ;
+  while (total<TOTAL && (r = netsend(sh, buf, CHUNK))>0) total += r ;
+  secs = testnow() - start ;
+  TESTCHECK(total>=TOTAL && ontime(secs), "blocking send of %ld bytes took %.0fms", total, secs*1e3) ;
+  TESTCHECK(netratestats(sh, &st) && st.bytes==(unsigned long long)total, "%llu bytes counted", st.bytes) ;
+  TESTCHECK(st.throttledseconds>=secs*0.8 && st.throttledseconds<=secs, "throttled %.0fms of %.0fms",
+            st.throttledseconds*1e3, secs*1e3) ;
+  printf("pacing: blocking %.2f MB/s against %.2f MB/s, kernel pacing %s\n", total/secs/1e6, RATE/1e6,
+         st.kernelpacing ? "on" : "off") ;
+  netclose(sh) ;
+
+  // A NONBLOCK connection is refused, not reported writable, once its
+  // burst is spent
+
+  sh = netconnect("127.0.0.1", sink.port, NONBLOCK) ;
+  TESTCHECK(sh && netsetrate(sh, RATE, BURST), "NONBLOCK netsetrate failed") ;
+  for (total=0; total<BURST && (r = netsend(sh, buf, CHUNK))>0; total += r) ;
+  r = netsend(sh, buf, CHUNK) ;
+  TESTCHECK(r==-1 && neterrno()==NET_ERR_INT+NET_ERR_THROTTLED && netwouldblock(),
+            "send past the burst gave %d, error %d", r, neterrno()) ;
+  TESTCHECK(netthrottleduntil(sh, &until), "throttled connection reported writable") ;
+  double wait = until.tv_sec + until.tv_nsec/1e9 - testnow() ;
+  TESTCHECK(wait>0 && wait<=(double)CHUNK/RATE+0.001, "writable in %.2fms", wait*1e3) ;
+
+  fd_set wr ;
+  int l = 0 ;
+  FD_ZERO(&wr) ;
+  TESTCHECK(!netwrfdset(sh, &wr, &l) && !netwrfdisset(sh, &wr), "throttled connection in the write set") ;
+
+  usleep((useconds_t)(wait*1e6) + 1000) ;
+  TESTCHECK(!netthrottleduntil(sh, NULL) && netsend(sh, buf, CHUNK)>0, "still throttled once due") ;
+
+  // ... and holds the rate from a select() loop
+
+  usleep(BURST*1000000LL/RATE) ;
+  secs = pump(&sh, 1, sent) ;
+  TESTCHECK(ontime(secs), "NONBLOCK send of %d bytes took %.0fms", TOTAL, secs*1e3) ;
+  TESTCHECK(netratestats(sh, &st) && st.throttledseconds>0, "no throttled time counted") ;
+  if (secs>0) printf("pacing: NONBLOCK %.2f MB/s\n", TOTAL/secs/1e6) ;
+
+  // Leaving every limit, it goes at full speed
+
+  netsetrate(sh, 0, 0) ;
+  secs = pump(&sh, 1, sent) ;
+  TESTCHECK(secs>=0 && secs<(double)TOTAL/RATE/2, "unlimited send took %.0fms", secs*1e3) ;
+  netclose(sh) ;
+
+  // Two connections share a group's budget
+
+  NET *pair[2] ;
+  pair[0] = netconnect("127.0.0.1", sink.port, NONBLOCK) ;
+  pair[1] = netconnect("127.0.0.1", sink.port, NONBLOCK) ;
+  TESTCHECK(pair[0] && pair[1], "group connects failed") ;
+  if (!pair[0] || !pair[1]) return testresult("pacing") ;
+  TESTCHECK(netrategroup(1, RATE, BURST), "netrategroup failed") ;
+  TESTCHECK(netsetrategroup(pair[0], 1) && netsetrategroup(pair[1], 1), "netsetrategroup failed") ;
+  secs = pump(pair, 2, sent) ;
+  TESTCHECK(ontime(secs), "group send of %d bytes took %.0fms", TOTAL, secs*1e3) ;
+  TESTCHECK(sent[0]>TOTAL/4 && sent[1]>TOTAL/4, "group shared %ld and %ld bytes", sent[0], sent[1]) ;
+  TESTCHECK(netrategroupstats(1, &st) && st.bytes==TOTAL && st.throttledseconds>0,
+            "group counted %llu bytes, throttled %.0fms", st.bytes, st.throttledseconds*1e3) ;
+  if (secs>0) printf("pacing: group of 2 %.2f MB/s (%ld and %ld bytes)\n", TOTAL/secs/1e6, sent[0], sent[1]) ;
+
+  netsetrategroup(pair[0], 0) ;
+  secs = pump(pair, 1, sent) ;
+  TESTCHECK(secs>=0 && secs<(double)TOTAL/RATE/2, "send after leaving the group took %.0fms", secs*1e3) ;
+
+  netclose(pair[0]) ;
+  netclose(pair[1]) ;
+  netrategroup(1, 0, 0) ;
+
+  return testresult("pacing") ;
+}
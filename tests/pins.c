@@ -0,0 +1,144 @@
+//
+// pins.c
+//
+// Public key pinning and the verified chain cache against a TLS echo
+// peer whose certificate is self-signed: invalid pins refused, a pinned
+// key trusted alone only with NOCERTCHAIN, a matching pin not rescuing a
+// chain which fails to verify, whether verified in full or taken from
+// the cache, and once the certificate is made a trusted root, pinned
+// connections verifying, repeats reusing the cached result and a wrong
+// pin still refused.  Prints the verifications and cache hits.
+//
+
+#include <openssl/pem.h>
+
+#include "testsrv.h"
+
+#define HOST "127.0.0.1"
+#define NOPIN "sha256//AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA="
+
+
+//
+// @brief Encode a certificate's pin, the base64 SHA-256 of its
+//        SubjectPublicKeyInfo
+//
+
+static void pinof(X509 *cert, char *b64)
+{
+  unsigned char *der = NULL, md[32] ;
+  unsigned int mdlen ;
+  int len = i2d_X509_PUBKEY(X509_get_X509_PUBKEY(cert), &der) ;
+  EVP_Digest(der, len, md, &mdlen, EVP_sha256(), NULL) ;
+  OPENSSL_free(der) ;
+  EVP_EncodeBlock((unsigned char *)b64, md, sizeof(md)) ;
+}
+
+
+//
+// @brief Connect and echo a message
+// @param(out) status netcertstatus() of the connection
+// @return true if the handshake was accepted and the echo returned
+//
+
+static int echoes(int port, enum netflags flags, int *status)
+{
+  char buf[8] ;
+  NET *sh = netconnect(HOST, port, flags) ;
+  if (!sh) return 0 ;
+  int ok = netsend(sh, "pin", 3)==3 && netrecv(sh, buf, sizeof(buf))==3 ;
+  *status = netcertstatus(sh) ;
+  netclose(sh) ;
+  return ok ;
+}
+
+
+int main()
+{
+  struct testpeer tls = { .mode = TESTPEER_ECHO, .tls = 1 } ;
+  struct netcertstats st, before ;
+  char pin[64], path[64], *pins[9] ;
+  char *nopin = NOPIN ;
+  int status, i ;
+
+  testpeerstart(&tls) ;
+  X509 *cert = SSL_CTX_get0_certificate(tls.ctx) ;
+  pinof(cert, pin) ;
+  char *mine = pin ;
+
+  for (i=0; i<9; i++) pins[i] = pin ;
+  char *bad = "not a pin" ;
+  TESTCHECK(!netpinspki(NULL, &mine, 1) && !netpinspki(HOST, &bad, 1) && !netpinspki(HOST, NULL, 1),
+            "invalid pin accepted") ;
+  TESTCHECK(!netpinspki(HOST, pins, 9), "more than 8 pins accepted") ;
+  TESTCHECK(!netcertcache(-1), "negative cache lifetime accepted") ;
+
+  // Unpinned, a chain which fails to verify is only reported
+
+  TESTCHECK(echoes(tls.port, TLS|NOCERTCHAIN, &status) && status!=0, "unpinned NOCERTCHAIN status %d", status) ;
+  TESTCHECK(echoes(tls.port, TLS, &status) && status!=0, "unpinned status %d", status) ;
+
+  // With NOCERTCHAIN no roots are trusted, and the pins alone decide
+
+  TESTCHECK(netpinspki(HOST, &mine, 1), "netpinspki failed") ;
+  netcertstats(&before) ;
+  TESTCHECK(echoes(tls.port, TLS|NOCERTCHAIN, &status) && status!=0,
+            "pinned key refused with NOCERTCHAIN, status %d", status) ;
+  TESTCHECK(netpinspki(HOST, &nopin, 1), "netpinspki replacing the pin failed") ;
+  TESTCHECK(!echoes(tls.port, TLS|NOCERTCHAIN, &status), "unpinned key accepted") ;
+  netcertstats(&st) ;
+  TESTCHECK(st.pinchecks==before.pinchecks+2 && st.pinfailures==before.pinfailures+1,
+            "%lu pin checks, %lu failures", st.pinchecks-before.pinchecks, st.pinfailures-before.pinfailures) ;
+
+  // Otherwise a pinned key does not make up for a chain which fails,
+  // verified in full or cached
+
+  TESTCHECK(netpinspki(HOST, &mine, 1), "netpinspki restoring the pin failed") ;
+  netcertstats(&before) ;
+  TESTCHECK(!echoes(tls.port, TLS, &status), "pinned key accepted for an unverified chain") ;
+  TESTCHECK(!echoes(tls.port, TLS, &status), "pinned key accepted for a cached unverified chain") ;
+  netcertstats(&st) ;
+  TESTCHECK(st.hits>before.hits && st.pinfailures==before.pinfailures,
+            "%lu cache hits, %lu pin failures", st.hits-before.hits, st.pinfailures-before.pinfailures) ;
+
+  // Trust the certificate as a root.  A new cipher profile makes a new
+  // context, which loads SSL_CERT_FILE, and the cache is emptied as it
+  // takes the default roots not to change.
+
+  snprintf(path, sizeof(path), "/tmp/pins-%d.pem", (int)getpid()) ;
+  FILE *f = fopen(path, "w") ;
+  TESTCHECK(f && PEM_write_X509(f, cert), "cannot write %s", path) ;
+  if (f) fclose(f) ;
+  setenv("SSL_CERT_FILE", path, 1) ;
+  netcipherprofile(NETCIPHER_LATENCY) ;
+  netcertcache(0) ;
+  TESTCHECK(netcertstats(&st) && st.entries==0, "%d results cached after emptying", st.entries) ;
+  netcertcache(300) ;
+
+  netcertstats(&before) ;
+  TESTCHECK(echoes(tls.port, TLS, &status) && status==0, "pinned verified chain refused, status %d", status) ;
+  TESTCHECK(echoes(tls.port, TLS, &status) && status==0, "pinned cached chain refused, status %d", status) ;
+  netcertstats(&st) ;
+  TESTCHECK(st.verifications==before.verifications+1 && st.hits==before.hits+1 && st.entries==1,
+            "%lu verifications, %lu hits, %d cached", st.verifications-before.verifications,
+            st.hits-before.hits, st.entries) ;
+  printf("pins: %lu chains verified, %lu cached results reused, %lu pin checks\n",
+         st.verifications, st.hits, st.pinchecks) ;
+
+  TESTCHECK(netpinspki(HOST, &nopin, 1), "netpinspki replacing the pin failed") ;
+  TESTCHECK(!echoes(tls.port, TLS, &status), "verified chain accepted without its pinned key") ;
+
+  // Removing the pins, an emptied cache verifies in full again
+
+  TESTCHECK(netpinspki(HOST, NULL, 0), "removing the pins failed") ;
+  netcertcache(0) ;
+  netcertcache(300) ;
+  netcertstats(&before) ;
+  TESTCHECK(echoes(tls.port, TLS, &status) && status==0, "unpinned verified chain status %d", status) ;
+  netcertstats(&st) ;
+  TESTCHECK(st.verifications==before.verifications+1 && st.pinchecks==before.pinchecks,
+            "%lu verifications, %lu pin checks unpinned", st.verifications-before.verifications,
+            st.pinchecks-before.pinchecks) ;
+
+  unlink(path) ;
+  return testresult("pins") ;
+}
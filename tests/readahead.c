@@ -0,0 +1,131 @@
+//
+// readahead.c
+//
+// Receive read-ahead against echo peers: a plain echo waiting in the
+// socket read in one fill and served to small netrecv() calls from the
+// buffer, buffered data reported by nethaspending() and select() without
+// touching the socket, large reads bypassing the buffer, the size kept
+// while data is buffered, and TLS records read ahead in bulk.  Prints
+// the socket reads saved.
+//
+
+#include "testsrv.h"
+
+#define ECHO 4000
+#define PIECE 100
+#define RECORDS 20
+#define BUFBYTES 65536
+
+
+//
+// @brief Send len bytes and wait for their echo to arrive
+//
+
+static void echoed(NET *sh, char *msg, int len, int records)
+{
+  for (int i=0; i<records; i++) netsend(sh, msg + i*(len/records), len/records) ;
+  usleep(50000) ;
+}
+
+
+//
+// @brief Read len bytes in PIECE sized netrecv() calls
+// @return true if they match msg
+//
+
+static int pieces(NET *sh, char *msg, int len)
+{
+  char buf[PIECE] ;
+  int got = 0, r = 0 ;
+  while (got<len && (r = netrecv(sh, buf, PIECE))>0) {
+    if (got+r>len || memcmp(buf, msg+got, r)) return 0 ;
+    got += r ;
+  }
+  return got==len ;
+}
+
+
+//
+// @brief Check select() reports the connection readable at once
+//
+
+static int readable(NET *sh)
+{
+  fd_set rd, wr ;
+  int l = 0 ;
+  struct timeval tv = { 0, 0 } ;
+  FD_ZERO(&rd) ;
+  FD_ZERO(&wr) ;
+  netrdfdset(sh, &rd, &wr, &l) ;
+  return select(l+1, &rd, &wr, NULL, &tv)>0 && netrdfdisset(sh, &rd, &wr) ;
+}
+
+
+int main()
+{
+  struct testpeer echo = { .mode = TESTPEER_ECHO } ;
+  struct testpeer tls = { .mode = TESTPEER_ECHO, .tls = 1 } ;
+  struct netreadaheadstats st ;
+  static char msg[ECHO], big[BUFBYTES] ;
+  int i ;
+
+  testpeerstart(&echo) ;
+  testpeerstart(&tls) ;
+  for (i=0; i<ECHO; i++) msg[i] = 'a' + i%26 ;
+
+  NET *sh = netconnect("127.0.0.1", echo.port, OPEN) ;
+  TESTCHECK(sh!=NULL, "connect failed") ;
+  if (!sh) return testresult("readahead") ;
+  TESTCHECK(!netreadahead(sh, -1) && !netreadaheadstats(sh, &st), "negative size accepted") ;
+  TESTCHECK(netreadahead(sh, BUFBYTES), "netreadahead failed") ;
+
+  // One fill serves every small read, and buffered data is reported
+  // without a syscall
+
+  echoed(sh, msg, ECHO, 1) ;
+  char buf[PIECE] ;
+  TESTCHECK(netrecv(sh, buf, PIECE)==PIECE && !memcmp(buf, msg, PIECE), "first piece wrong") ;
+  TESTCHECK(nethaspending(sh) && readable(sh), "buffered data not reported") ;
+  TESTCHECK(netreadaheadstats(sh, &st) && st.fills==1 && st.pending==ECHO-PIECE && st.pendingchecks>0,
+            "%lu fills, %ld bytes pending, %lu pending checks", st.fills, st.pending, st.pendingchecks) ;
+  TESTCHECK(!netreadahead(sh, BUFBYTES/2) && neterrno()==EAGAIN, "resized with data buffered") ;
+
+  TESTCHECK(pieces(sh, msg+PIECE, ECHO-PIECE), "buffered pieces wrong") ;
+  TESTCHECK(!nethaspending(sh), "drained buffer reported pending") ;
+  TESTCHECK(netreadaheadstats(sh, &st) && st.fills==1 && st.bytes==ECHO && st.pending==0,
+            "%lu fills, %lu bytes after draining", st.fills, st.bytes) ;
+  TESTCHECK(st.recvs==ECHO/PIECE && st.buffered==ECHO/PIECE-1, "%lu receives, %lu from the buffer",
+            st.recvs, st.buffered) ;
+  printf("readahead: plain %lu netrecv() calls, %lu socket reads\n", st.recvs, st.fills) ;
+
+  // A read as large as the buffer goes straight to the socket
+
+  echoed(sh, msg, ECHO, 1) ;
+  int got = 0, r ;
+  while (got<ECHO && (r = netrecv(sh, big, sizeof(big)))>0) got += r ;
+  TESTCHECK(got==ECHO && !memcmp(big, msg, ECHO), "large read returned %d bytes", got) ;
+  TESTCHECK(netreadaheadstats(sh, &st) && st.pending==0, "%ld bytes buffered by a large read", st.pending) ;
+
+  TESTCHECK(netreadahead(sh, 0) && !netreadaheadstats(sh, &st), "read-ahead not turned off") ;
+  echoed(sh, msg, ECHO, 1) ;
+  TESTCHECK(pieces(sh, msg, ECHO), "pieces wrong with read-ahead off") ;
+  netclose(sh) ;
+
+  // TLS reads several records at once
+
+  sh = netconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN) ;
+  TESTCHECK(sh && netreadahead(sh, BUFBYTES), "TLS netreadahead failed") ;
+  if (sh) {
+    echoed(sh, msg, ECHO, RECORDS) ;
+    TESTCHECK(netrecv(sh, buf, PIECE)==PIECE && !memcmp(buf, msg, PIECE), "first TLS piece wrong") ;
+    TESTCHECK(nethaspending(sh) && readable(sh), "buffered TLS records not reported") ;
+    TESTCHECK(pieces(sh, msg+PIECE, ECHO-PIECE), "TLS pieces wrong") ;
+    TESTCHECK(!nethaspending(sh), "drained TLS connection reported pending") ;
+    TESTCHECK(netreadaheadstats(sh, &st) && st.bytes==ECHO && st.buffered>=st.recvs/2,
+              "%lu TLS receives, %lu from the buffer, %lu bytes", st.recvs, st.buffered, st.bytes) ;
+    printf("readahead: TLS %lu netrecv() calls, %lu with records already read\n", st.recvs, st.buffered) ;
+    netclose(sh) ;
+  }
+
+  return testresult("readahead") ;
+}
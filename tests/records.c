@@ -0,0 +1,237 @@
+//
+// records.c
+//
+// Dynamic TLS record sizing: records stay small until the threshold has
+// been sent, shrink again after the connection idles, and return to full
+// size when disabled.  Also times the first byte of a 16KB echo with
+// full size and with small records, over loopback and through a relay
+// limiting the client's sends to LINKRATE, as a slow uplink would: the
+// peer can only decrypt a record once all of it has arrived.
+//
+
+#include "testsrv.h"
+
+#define SMALL 1369
+#define OVERHEAD 17    // TLS 1.3 content type and AEAD tag per record
+#define LINKRATE 1000000   // Bytes per second from client to peer
+#define LINKMTU 1460       // Bytes forwarded at a time
+#define TIMED 50
+
+static int maxrecord = 0 ;
+static int records = 0 ;
+
+static void onrecord(struct testpeer *p, int len)
+{
+  (void)p ;
+  __sync_fetch_and_add(&records, 1) ;
+  if (len>maxrecord) maxrecord = len ;
+}
+
+
+//
+// @brief Send len bytes and read back their echo
+// @param(out) ttfb Seconds until the first byte of the echo, if not NULL
+// @return true if the whole echo arrived
+//
+
+static int echo(NET *sh, int len, double *ttfb)
+{
+  static char buf[65536] ;
+  int sent = 0, got = 0 ;
+  memset(buf, 'r', sizeof(buf)) ;
+
+  double start = testnow() ;
+  while (sent<len) {
+    int r = netsend(sh, buf, len-sent>16384 ? 16384 : len-sent) ;
+    if (r<=0) return 0 ;
+    sent += r ;
+    if (ttfb && got==0) {
+      r = netrecv(sh, buf, sizeof(buf)) ;
+      if (r<=0) return 0 ;
+      *ttfb = testnow() - start ;
+      got += r ;
+    }
+  }
+  while (got<len) {
+    int r = netrecv(sh, buf, sizeof(buf)) ;
+    if (r<=0) return 0 ;
+    got += r ;
+  }
+  return 1 ;
+}
+
+
+struct link {
+  int listenfd ;
+  int port ;
+  int target ;          // Port forwarded to
+} ;
+
+struct pump {
+  int from ;
+  int to ;
+  int rate ;            // Bytes per second, 0 for unlimited
+} ;
+
+
+//
+// @brief Forward one direction until EOF, at most rate bytes a second
+//
+
+static void *pump(void *arg)
+{
+  struct pump *p = arg ;
+  char buf[65536] ;
+  double next = testnow() ;
+  int r ;
+
+  while ((r = read(p->from, buf, p->rate ? LINKMTU : sizeof(buf)))>0) {
+    if (p->rate) {
+      double now = testnow() ;
+      next = (next>now ? next : now) + (double)r / p->rate ;
+      if (next>now) usleep((next-now)*1e6) ;
+    }
+    if (!_testwriteall(p->to, buf, r)) break ;
+  }
+  shutdown(p->to, SHUT_WR) ;
+  return NULL ;
+}
+
+
+//
+// @brief Accept connections, relaying each to the target port with the
+//        client's direction throttled
+//
+
+static void *linkserve(void *arg)
+{
+  struct link *l = arg ;
+  int fd ;
+
+  while ((fd = accept(l->listenfd, NULL, NULL))>=0) {
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(l->target),
+                              .sin_addr.s_addr = htonl(INADDR_LOOPBACK) } ;
+    int one = 1, up = socket(AF_INET, SOCK_STREAM, 0) ;
+    if (connect(up, (struct sockaddr *)&sa, sizeof(sa))<0) {
+      close(fd) ;
+      close(up) ;
+      continue ;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) ;
+    setsockopt(up, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) ;
+
+    struct pump out = { fd, up, LINKRATE }, back = { up, fd, 0 } ;
+    pthread_t a, b ;
+    pthread_create(&a, NULL, pump, &out) ;
+    pthread_create(&b, NULL, pump, &back) ;
+    pthread_join(a, NULL) ;
+    pthread_join(b, NULL) ;
+    close(fd) ;
+    close(up) ;
+  }
+  return NULL ;
+}
+
+
+static void linkstart(struct link *l, int target)
+{
+  struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) } ;
+  socklen_t len = sizeof(sa) ;
+  pthread_t t ;
+
+  l->target = target ;
+  l->listenfd = socket(AF_INET, SOCK_STREAM, 0) ;
+  bind(l->listenfd, (struct sockaddr *)&sa, sizeof(sa)) ;
+  listen(l->listenfd, 16) ;
+  getsockname(l->listenfd, (struct sockaddr *)&sa, &len) ;
+  l->port = ntohs(sa.sin_port) ;
+  pthread_create(&t, NULL, linkserve, l) ;
+  pthread_detach(t) ;
+}
+
+
+//
+// @brief Time the first byte of a 16KB echo on fresh connections
+// @param(in) dynamic True to use the suggested record sizing
+// @return Mean microseconds, or -1 if any echo failed
+//
+
+static double timed(int port, int dynamic)
+{
+  double total = 0, ttfb = 0 ;
+  for (int i=0; i<TIMED; i++) {
+    NET *sh = netconnect("127.0.0.1", port, TLS|NOCERTCHAIN) ;
+    if (!sh) return -1 ;
+    if (dynamic) netrecordsizing(sh, NET_RECORD_SMALL, NET_RECORD_THRESHOLD, NET_RECORD_IDLEMS) ;
+    int ok = echo(sh, 16384, &ttfb) ;
+    netclose(sh) ;
+    if (!ok) return -1 ;
+    total += ttfb ;
+  }
+  return total / TIMED * 1e6 ;
+}
+
+
+static void reset()
+{
+  maxrecord = 0 ;
+  records = 0 ;
+}
+
+
+int main()
+{
+  struct testpeer tls = { .mode = TESTPEER_ECHO, .tls = 1, .tls13 = 1, .onrecord = onrecord } ;
+  testpeerstart(&tls) ;
+
+  NET *sh = netconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN) ;
+  TESTCHECK(sh!=NULL, "connect failed") ;
+  if (!sh) return testresult("records") ;
+  TESTCHECK(netrecordsizing(sh, SMALL, 65536, 200), "netrecordsizing failed") ;
+
+  reset() ;
+  TESTCHECK(echo(sh, 65536, NULL), "warm up echo failed") ;
+  TESTCHECK(maxrecord<=SMALL+OVERHEAD, "warming up sent a %d byte record", maxrecord) ;
+  TESTCHECK(records>=65536/SMALL, "warming up sent only %d records", records) ;
+
+  reset() ;
+  TESTCHECK(echo(sh, 65536, NULL), "full size echo failed") ;
+  TESTCHECK(maxrecord>SMALL+OVERHEAD, "past the threshold records stayed at %d bytes", maxrecord) ;
+
+  usleep(300000) ;
+  reset() ;
+  TESTCHECK(echo(sh, 16384, NULL), "echo after idle failed") ;
+  TESTCHECK(maxrecord<=SMALL+OVERHEAD, "after idling sent a %d byte record", maxrecord) ;
+
+  TESTCHECK(netrecordsizing(sh, 0, 0, 0), "disabling failed") ;
+  reset() ;
+  TESTCHECK(echo(sh, 65536, NULL), "echo after disabling failed") ;
+  TESTCHECK(maxrecord>SMALL+OVERHEAD, "disabled but records stayed at %d bytes", maxrecord) ;
+  netclose(sh) ;
+
+  // Plain connections have no records to size
+
+  struct testpeer plain = { .mode = TESTPEER_ECHO } ;
+  testpeerstart(&plain) ;
+  sh = netconnect("127.0.0.1", plain.port, OPEN) ;
+  TESTCHECK(sh && !netrecordsizing(sh, SMALL, 65536, 200), "plain connection accepted sizing") ;
+  if (sh) netclose(sh) ;
+
+  // Time to first byte of a 16KB echo.  Over loopback the records
+  // arrive at once and small ones only add overhead, while over a slow
+  // link the first small record is echoed long before a full size one
+  // has arrived.
+
+  struct link link ;
+  linkstart(&link, tls.port) ;
+  double full = timed(tls.port, 0), small = timed(tls.port, 1) ;
+  double linkfull = timed(link.port, 0), linksmall = timed(link.port, 1) ;
+  TESTCHECK(full>0 && small>0 && linkfull>0 && linksmall>0, "timed echoes failed") ;
+  TESTCHECK(linksmall<linkfull/2, "small records gave the first byte after %.0fus over the link, full size %.0fus",
+            linksmall, linkfull) ;
+  printf("records: 16KB echo first byte after %.0fus full size, %.0fus small over loopback\n", full, small) ;
+  printf("records: 16KB echo first byte after %.0fus full size, %.0fus small at %dKB/s\n",
+         linkfull, linksmall, LINKRATE/1000) ;
+
+  return testresult("records") ;
+}
@@ -0,0 +1,219 @@
+//
+// sched.c
+//
+// The connection scheduler: ping-pong on plain and TLS connections driven
+// entirely from callbacks, which must never run on two threads at once,
+// then explicit migration, removal from within a callback, and a worker
+// failing to start.  Linked with -Wl,--wrap=pthread_create so the last
+// can be forced.  Ends with the round trip rate for each number of
+// workers from one to the number of CPUs.
+//
+
+#include "testsrv.h"
+
+#define PLAIN 64
+#define SECURE 8
+#define CONNS (PLAIN+SECURE)
+#define ROUNDS 200
+#define MSG 64
+
+int __real_pthread_create(pthread_t *t, const pthread_attr_t *a, void *(*fn)(void *), void *arg) ;
+
+static int failcreate = 0 ;
+
+int __wrap_pthread_create(pthread_t *t, const pthread_attr_t *a, void *(*fn)(void *), void *arg)
+{
+  if (failcreate && --failcreate==0) return EAGAIN ;
+  return __real_pthread_create(t, a, fn, arg) ;
+}
+
+struct conn {
+  NETSCHED *s ;
+  NET *sh ;
+  int inside ;          // Callback running
+  int got ;             // Bytes of the current echo received
+  int rounds ;          // Echoes completed
+  int final ;           // Remove and close on the next echo
+  int sent ;            // The final send has returned
+} ;
+
+static struct conn conns[CONNS] ;
+static int done = 0 ;
+static int overlaps = 0 ;
+static int failures = 0 ;
+static char msg[MSG] ;
+
+
+static void onreadable(NET *sh, void *arg)
+{
+  struct conn *c = arg ;
+  char buf[4096] ;
+  int r ;
+
+  if (!__sync_bool_compare_and_swap(&c->inside, 0, 1)) __sync_fetch_and_add(&overlaps, 1) ;
+
+  while ((r = netrecv(sh, buf, sizeof(buf)))>0) c->got += r ;
+  if (r<0 && !netwouldblock(sh)) {
+    __sync_fetch_and_add(&failures, 1) ;
+    netschedremove(c->s, sh) ;
+  }
+
+  if (c->got>=MSG) {
+    c->got -= MSG ;
+    c->rounds++ ;
+    if (c->final) {
+      while (!__sync_fetch_and_add(&c->sent, 0)) usleep(100) ;
+      c->inside = 0 ;
+      netschedremove(c->s, sh) ;
+      netclose(sh) ;
+      c->sh = NULL ;
+      __sync_fetch_and_add(&done, 1) ;
+      return ;
+    }
+    if (c->rounds<ROUNDS) netsend(sh, msg, MSG) ;
+    else __sync_fetch_and_add(&done, 1) ;
+  }
+
+  c->inside = 0 ;
+}
+
+
+static int waitdone(int n)
+{
+  double end = testnow() + 30 ;
+  while (__sync_fetch_and_add(&done, 0)<n && testnow()<end) usleep(1000) ;
+  return __sync_fetch_and_add(&done, 0)==n ;
+}
+
+
+//
+// @brief Run ROUNDS ping-pongs on CONNS new connections
+// @param(in) workers Number of workers
+// @return Round trips per second, or -1 on failure
+//
+
+static double pingpong(int echoport, int tlsport, int workers)
+{
+  NETSCHED *s = netschedstart(workers, 0) ;
+  int i, n ;
+  if (!s) return -1 ;
+
+  memset(conns, 0, sizeof(conns)) ;
+  for (n=0; n<CONNS; n++) {
+    conns[n].s = s ;
+    conns[n].sh = (n<PLAIN) ? netconnect("127.0.0.1", echoport, NONBLOCK)
+                            : netconnect("127.0.0.1", tlsport, TLS|NOCERTCHAIN|NONBLOCK) ;
+    if (!conns[n].sh) break ;
+  }
+
+  done = 0 ;
+  double start = testnow() ;
+  for (i=0; i<n && n==CONNS; i++) {
+    while (netsend(conns[i].sh, msg, MSG)!=MSG) usleep(1000) ;
+    netschedadd(s, conns[i].sh, onreadable, &conns[i]) ;
+  }
+  int ok = (n==CONNS && waitdone(CONNS)) ;
+  double secs = testnow() - start ;
+
+  netschedstop(s) ;
+  for (i=0; i<n; i++) netclose(conns[i].sh) ;
+  return ok ? CONNS*ROUNDS/secs : -1 ;
+}
+
+
+int main()
+{
+  struct testpeer echo = { .mode = TESTPEER_ECHO } ;
+  struct testpeer tls = { .mode = TESTPEER_ECHO, .tls = 1 } ;
+  struct netschedstats st ;
+  int i ;
+
+  testpeerstart(&echo) ;
+  testpeerstart(&tls) ;
+  memset(msg, 'm', sizeof(msg)) ;
+  int base = testfds() ;
+
+  NETSCHED *s = netschedstart(4, 0) ;
+  TESTCHECK(s!=NULL, "netschedstart failed") ;
+  if (!s) return testresult("sched") ;
+  TESTCHECK(netschedworkers(s)==4, "netschedworkers %d", netschedworkers(s)) ;
+
+  for (i=0; i<CONNS; i++) {
+    conns[i].s = s ;
+    conns[i].sh = (i<PLAIN) ? netconnect("127.0.0.1", echo.port, NONBLOCK)
+                            : netconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN|NONBLOCK) ;
+    TESTCHECK(conns[i].sh!=NULL, "connect %d failed", i) ;
+    if (!conns[i].sh) return testresult("sched") ;
+  }
+
+  // The first message goes before the connection is handed over, after
+  // which only its callbacks touch it
+
+  double start = testnow() ;
+  for (i=0; i<CONNS; i++) {
+    while (netsend(conns[i].sh, msg, MSG)!=MSG) usleep(1000) ;
+    TESTCHECK(netschedadd(s, conns[i].sh, onreadable, &conns[i]), "netschedadd %d failed", i) ;
+  }
+  TESTCHECK(waitdone(CONNS), "only %d of %d connections finished", done, CONNS) ;
+  double secs = testnow() - start ;
+
+  for (i=0; i<CONNS; i++) TESTCHECK(conns[i].rounds==ROUNDS, "connection %d ran %d rounds", i, conns[i].rounds) ;
+  TESTCHECK(!overlaps, "%d callbacks overlapped on one connection", overlaps) ;
+  TESTCHECK(!failures, "%d connections failed", failures) ;
+
+  TESTCHECK(netschedstats(s, -1, &st), "netschedstats failed") ;
+  TESTCHECK(st.connections==CONNS, "stats report %d connections", st.connections) ;
+  TESTCHECK(st.events>=CONNS*ROUNDS, "stats report %lu events", st.events) ;
+  printf("sched: %.0f round trips/s over %d connections, %lu steals, %lu migrations\n",
+         CONNS*ROUNDS/secs, CONNS, st.steals, st.migrations) ;
+
+  // Everything idle now, so each connection can be moved.  Worker 3 may
+  // already have handed one back, as load balancing moves a connection
+  // every 100ms.
+
+  for (i=0; i<CONNS; i++) TESTCHECK(netschedmigrate(s, conns[i].sh, 3), "migrate %d failed", i) ;
+  TESTCHECK(netschedstats(s, 3, &st) && st.connections>=CONNS-1, "worker 3 owns %d", st.connections) ;
+  TESTCHECK(netschedstats(s, -1, &st) && st.connections==CONNS, "%d connections after migrating", st.connections) ;
+  TESTCHECK(!netschedmigrate(s, conns[0].sh, 4), "migrate to a missing worker succeeded") ;
+  TESTCHECK(!netschedstats(s, 4, &st), "stats for a missing worker succeeded") ;
+
+  // Each connection removes and closes itself from its callback, once
+  // the send that woke it has returned
+
+  done = 0 ;
+  for (i=0; i<CONNS; i++) {
+    conns[i].final = 1 ;
+    while (netsend(conns[i].sh, msg, MSG)!=MSG) usleep(1000) ;
+    __sync_fetch_and_add(&conns[i].sent, 1) ;
+  }
+  TESTCHECK(waitdone(CONNS), "only %d of %d connections closed themselves", done, CONNS) ;
+  TESTCHECK(netschedstats(s, -1, &st) && st.connections==0, "%d connections left", st.connections) ;
+  TESTCHECK(!netschedremove(s, conns[0].sh), "removing a closed connection succeeded") ;
+  netschedstop(s) ;
+
+  // A worker that cannot start takes its pipe and lock with it.  The peer
+  // closes its side of the connections in its own time, so wait for that
+  // first.
+
+  double end = testnow() + 2 ;
+  while (testfds()>base && testnow()<end) usleep(10000) ;
+  int fds = testfds() ;
+  for (i=0; i<20; i++) {
+    failcreate = 3 ;
+    errno = 0 ;
+    s = netschedstart(4, 0) ;
+    TESTCHECK(s==NULL && errno==EAGAIN, "start with a failing worker gave %p errno %d", (void *)s, errno) ;
+    if (s) netschedstop(s) ;
+  }
+  failcreate = 0 ;
+  TESTCHECK(testfds()==fds, "failed starts leaked %d fds", testfds()-fds) ;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN) ;
+  for (i=1; i<=cpus; i++) {
+    double rate = pingpong(echo.port, tls.port, i) ;
+    TESTCHECK(rate>0, "ping-pong with %d workers failed", i) ;
+    printf("sched: %2d workers %.0f round trips/s\n", i, rate) ;
+  }
+
+  return testresult("sched") ;
+}
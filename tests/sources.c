@@ -0,0 +1,110 @@
+//
+// sources.c
+//
+// Source address round-robin: with three loopback sources and a ten port
+// range, exactly thirty connections to one destination fit, ten from
+// each address, and the next fails only after trying every address.
+//
+
+#include "testsrv.h"
+
+#define LO 47100
+#define HI 47109
+#define NSRC 3
+
+static char *sources[NSRC] = { "127.0.0.1", "127.0.0.2", "127.0.0.3" } ;
+
+
+static void localaddr(NET *sh, char *addr, int len, int *port)
+{
+  struct sockaddr_in sa ;
+  socklen_t salen = sizeof(sa) ;
+  fd_set rd, wr ;
+  int l = 0 ;
+
+  // The handle's socket is the one netrdfdset() adds
+
+  FD_ZERO(&rd) ;
+  FD_ZERO(&wr) ;
+  netrdfdset(sh, &rd, &wr, &l) ;
+  getsockname(l, (struct sockaddr *)&sa, &salen) ;
+  inet_ntop(AF_INET, &sa.sin_addr, addr, len) ;
+  *port = ntohs(sa.sin_port) ;
+}
+
+
+int main()
+{
+  struct testpeer echo = { .mode = TESTPEER_ECHO } ;
+  struct netsourcestats st ;
+  NET *conns[NSRC*(HI-LO+1)] ;
+  int used[NSRC] = { 0 } ;
+  char addr[INET_ADDRSTRLEN] ;
+  int i, j, port, inrange = 0, n = 0 ;
+
+  testpeerstart(&echo) ;
+
+  char *bad[] = { "127.0.0.1", "not-an-address" } ;
+  TESTCHECK(!netsourceaddrs(bad, 2), "invalid source address accepted") ;
+  TESTCHECK(!netsourceportrange(HI, LO), "inverted port range accepted") ;
+
+  TESTCHECK(netsourceaddrs(sources, NSRC), "netsourceaddrs failed") ;
+  TESTCHECK(netsourceportrange(LO, HI), "netsourceportrange failed") ;
+
+  for (i=0; i<NSRC*(HI-LO+1); i++) {
+    conns[i] = netconnect("127.0.0.1", echo.port, OPEN) ;
+    if (!conns[i]) break ;
+    n++ ;
+    localaddr(conns[i], addr, sizeof(addr), &port) ;
+    TESTCHECK(netlocalport(conns[i])==port, "netlocalport %d, socket bound to %d", netlocalport(conns[i]), port) ;
+    if (port>=LO && port<=HI) inrange++ ;
+    for (j=0; j<NSRC; j++) if (!strcmp(addr, sources[j])) used[j]++ ;
+  }
+
+  if (n && !inrange) {
+
+    // Kernels before 6.3 ignore IP_LOCAL_PORT_RANGE, so there is no
+    // ceiling to reach
+
+    printf("sources: IP_LOCAL_PORT_RANGE not supported, port range checks skipped\n") ;
+    TESTCHECK(used[0]>0 && used[1]>0 && used[2]>0, "sources used %d/%d/%d", used[0], used[1], used[2]) ;
+
+  } else {
+
+    TESTCHECK(n==NSRC*(HI-LO+1), "%d connections fitted, expected %d", n, NSRC*(HI-LO+1)) ;
+    TESTCHECK(inrange==n, "%d of %d local ports outside %d-%d", n-inrange, n, LO, HI) ;
+    for (j=0; j<NSRC; j++) TESTCHECK(used[j]==HI-LO+1, "%s used %d times", sources[j], used[j]) ;
+
+    NET *over = netconnect("127.0.0.1", echo.port, OPEN) ;
+    TESTCHECK(over==NULL, "connection beyond the ceiling succeeded") ;
+    if (over) netclose(over) ;
+    for (j=0; j<NSRC; j++) {
+      TESTCHECK(netsourcestats(j, &st) && st.addrnotavail==1 && !strcmp(st.address, sources[j]),
+                "%s: %lu times without a port", st.address, st.addrnotavail) ;
+    }
+    TESTCHECK(netsourcestats(-1, &st) && st.addrnotavail==NSRC && st.connects==(unsigned long)n+NSRC,
+              "total %lu connects, %lu without a port", st.connects, st.addrnotavail) ;
+
+  }
+
+  TESTCHECK(!netsourcestats(NSRC, &st), "stats for a missing source succeeded") ;
+  for (i=0; i<n; i++) netclose(conns[i]) ;
+
+  // A source address this host does not own fails to bind
+
+  char *foreign[] = { "192.0.2.1" } ;
+  TESTCHECK(netsourceaddrs(foreign, 1), "netsourceaddrs failed") ;
+  NET *sh = netconnect("127.0.0.1", echo.port, OPEN) ;
+  TESTCHECK(sh==NULL, "connect from a foreign address succeeded") ;
+  if (sh) netclose(sh) ;
+  TESTCHECK(netsourcestats(0, &st) && st.bindfailures==1, "%lu bind failures", st.bindfailures) ;
+
+  // Back to the kernel's choice
+
+  TESTCHECK(netsourceaddrs(NULL, 0) && netsourceportrange(0, 0), "clearing sources failed") ;
+  sh = netconnect("127.0.0.1", echo.port, OPEN) ;
+  TESTCHECK(sh!=NULL, "connect without sources failed") ;
+  if (sh) netclose(sh) ;
+
+  return testresult("sources") ;
+}
@@ -0,0 +1,445 @@
+//
+// testsrv.h
+//
+// In-process peers for the tests.  The library only makes client
+// connections, so each test starts the servers it needs on threads of
+// its own, listening on loopback.
+//
+// int testpeerstart(struct testpeer *p)
+// double testnow()
+// int testfds()
+// int testtimewait(int port)
+// TESTCHECK(cond, fmt, ...)
+// int testresult(char *name)
+//
+// link with: ../lnet.a -lssl -lcrypto -lpthread
+//
+// NOTES
+//
+// A peer is described by a struct testpeer, zeroed and then filled in.
+// It listens on 127.0.0.1 (or addr, or the AF_UNIX path in unixpath,
+// "@name" for an abstract socket) and an ephemeral port unless port is
+// set, and serves each connection on its own thread:
+//
+//   TESTPEER_ECHO    Echo everything, after delayms, until the client closes
+//   TESTPEER_SILENT  Never read or close, holding the connection open
+//   TESTPEER_SINK    Read and count into bytes, until the client closes
+//   TESTPEER_RELAY   Pair each two connections, forwarding between them,
+//                    so two client handles can talk to each other
+//
+// With tls set, echo peers run TLS with a self-signed P-256 certificate
+// (so clients connect with NOCERTCHAIN), handshaking after hsdelayms,
+// optionally restricted by tls13, tls12, suites, ciphers and groups, and
+// report the length of every record received to onrecord.
+//
+
+#ifndef _TESTSRV_DEFINED
+#define _TESTSRV_DEFINED
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "../net.h"
+
+enum testpeermodes {
+  TESTPEER_ECHO = 0,
+  TESTPEER_SILENT = 1,
+  TESTPEER_SINK = 2,
+  TESTPEER_RELAY = 3
+} ;
+
+struct testpeer {
+  enum testpeermodes mode ;
+  char *addr ;                  // Address to listen on, NULL for 127.0.0.1
+  int port ;                    // Port, 0 for an ephemeral port
+  char *unixpath ;              // Listen on AF_UNIX instead
+  int delayms ;                 // Delay before each echo
+  int hsdelayms ;               // Delay before each TLS handshake
+  int tls ;                     // Serve TLS (echo only)
+  int tls13 ;                   // Refuse anything older than TLS 1.3
+  int tls12 ;                   // Refuse anything newer than TLS 1.2
+  char *suites ;                // TLS 1.3 ciphersuites, NULL for default
+  char *ciphers ;               // TLS 1.2 cipher list, NULL for default
+  char *groups ;                // Key exchange groups, NULL for default
+  void (*onrecord)(struct testpeer *p, int len) ;  // Record received
+  long bytes ;                  // Bytes received by a sink
+  int accepted ;                // Connections accepted
+  SSL_CTX *ctx ;
+  int listenfd ;
+  int relayfd ;                 // Relay connection awaiting its pair
+  pthread_mutex_t lock ;
+} ;
+
+static int _test_checks = 0 ;
+static int _test_failures = 0 ;
+
+
+//
+// @brief Record a check, reporting it if it failed
+//
+
+#define TESTCHECK(cond, ...) _testcheck((cond) ? 1 : 0, __FILE__, __LINE__, __VA_ARGS__)
+
+static inline void _testcheck(int ok, char *file, int line, char *fmt, ...)
+{
+  va_list ap ;
+  _test_checks++ ;
+  if (ok) return ;
+  _test_failures++ ;
+  printf("FAIL %s:%d: ", file, line) ;
+  va_start(ap, fmt) ;
+  vprintf(fmt, ap) ;
+  va_end(ap) ;
+  printf("\n") ;
+}
+
+
+//
+// @brief Report the outcome of a test program and exit
+// @param(in) name Name of the test
+// @return Never returns
+//
+// Exits with _exit(), as the peer threads are still running and would
+// race OpenSSL's atexit cleanup.
+//
+
+static inline int testresult(char *name)
+{
+  printf("%s: %d checks, %d failed\n", name, _test_checks, _test_failures) ;
+  fflush(stdout) ;
+  _exit(_test_failures ? 1 : 0) ;
+}
+
+
+//
+// @brief Monotonic time
+// @return Seconds
+//
+
+static inline double testnow()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return ts.tv_sec + ts.tv_nsec/1e9 ;
+}
+
+
+//
+// @brief Count the descriptors open in this process
+// @return Number of open descriptors
+//
+
+static inline int testfds()
+{
+  int n = 0 ;
+  DIR *d = opendir("/proc/self/fd") ;
+  if (!d) return -1 ;
+  while (readdir(d)) n++ ;
+  closedir(d) ;
+  return n - 3 ;  // ., .. and the directory itself
+}
+
+
+//
+// @brief Count IPv4 sockets in TIME_WAIT to a remote port
+// @param(in) port Remote port
+// @return Number of sockets
+//
+
+static inline int testtimewait(int port)
+{
+  char line[256] ;
+  unsigned int rport, state ;
+  int n = 0 ;
+  FILE *f = fopen("/proc/net/tcp", "r") ;
+  if (!f) return -1 ;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, " %*d: %*x:%*x %*x:%x %x", &rport, &state)==2 &&
+        (int)rport==port && state==6) n++ ;
+  }
+  fclose(f) ;
+  return n ;
+}
+
+
+static inline void _testfatal(char *what)
+{
+  printf("FAIL testsrv: %s: %s\n", what, strerror(errno)) ;
+  exit(1) ;
+}
+
+
+//
+// Peer threads
+//
+
+struct _testconn {
+  struct testpeer *p ;
+  int fd ;
+} ;
+
+static inline int _testwriteall(int fd, char *buf, int len)
+{
+  while (len>0) {
+    int w = write(fd, buf, len) ;
+    if (w<0 && errno==EINTR) continue ;
+    if (w<=0) return 0 ;
+    buf += w ;
+    len -= w ;
+  }
+  return 1 ;
+}
+
+static inline void _testrecordcb(int write_p, int version, int type, const void *buf, size_t len,
+                          SSL *ssl, void *arg)
+{
+  (void)version ; (void)arg ;
+  struct testpeer *p = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)) ;
+  const unsigned char *h = buf ;
+  if (write_p || type!=SSL3_RT_HEADER || len<5 || !p->onrecord) return ;
+  p->onrecord(p, (h[3]<<8) | h[4]) ;
+}
+
+static inline void _testtlsecho(struct testpeer *p, int fd)
+{
+  SSL *ssl = SSL_new(p->ctx) ;
+  int r = 0 ;
+  if (!ssl) return ;
+  SSL_set_fd(ssl, fd) ;
+  if (p->hsdelayms) usleep(p->hsdelayms*1000) ;
+  if (SSL_accept(ssl)==1) {
+    char *b = malloc(65536) ;
+    while ((r = SSL_read(ssl, b, 65536))>0) {
+      if (p->delayms) usleep(p->delayms*1000) ;
+      if (SSL_write(ssl, b, r)<=0) break ;
+    }
+    if (SSL_get_error(ssl, r)==SSL_ERROR_ZERO_RETURN) SSL_shutdown(ssl) ;
+    free(b) ;
+  }
+  SSL_free(ssl) ;
+}
+
+static inline void *_testserve(void *arg)
+{
+  struct _testconn *c = arg ;
+  struct testpeer *p = c->p ;
+  int fd = c->fd ;
+  char *buf = malloc(65536) ;
+  int r ;
+  free(c) ;
+
+  switch (p->mode) {
+
+  case TESTPEER_ECHO:
+    if (p->tls) {
+      _testtlsecho(p, fd) ;
+      break ;
+    }
+    while ((r = read(fd, buf, 65536))>0) {
+      if (p->delayms) usleep(p->delayms*1000) ;
+      if (!_testwriteall(fd, buf, r)) break ;
+    }
+    break ;
+
+  case TESTPEER_SILENT:
+    free(buf) ;
+    return NULL ;
+
+  case TESTPEER_SINK:
+    while ((r = read(fd, buf, 65536))>0) __sync_fetch_and_add(&p->bytes, r) ;
+    break ;
+
+  case TESTPEER_RELAY:
+    break ;
+
+  }
+
+  free(buf) ;
+  close(fd) ;
+  return NULL ;
+}
+
+static inline void *_testrelay(void *arg)
+{
+  int *fds = arg ;
+  char *buf = malloc(65536) ;
+  int open = 1 ;
+
+  while (open) {
+    fd_set rd ;
+    FD_ZERO(&rd) ;
+    FD_SET(fds[0], &rd) ;
+    FD_SET(fds[1], &rd) ;
+    if (select((fds[0]>fds[1] ? fds[0] : fds[1])+1, &rd, NULL, NULL, NULL)<0) break ;
+    for (int i=0; i<2 && open; i++) {
+      if (!FD_ISSET(fds[i], &rd)) continue ;
+      int r = read(fds[i], buf, 65536) ;
+      if (r<=0 || !_testwriteall(fds[1-i], buf, r)) open = 0 ;
+    }
+  }
+
+  close(fds[0]) ;
+  close(fds[1]) ;
+  free(fds) ;
+  free(buf) ;
+  return NULL ;
+}
+
+static inline void *_testlisten(void *arg)
+{
+  struct testpeer *p = arg ;
+  pthread_t t ;
+  int one = 1 ;
+
+  for (;;) {
+    int fd = accept(p->listenfd, NULL, NULL) ;
+    if (fd<0) {
+      if (errno==EINTR || errno==ECONNABORTED) continue ;
+      return NULL ;
+    }
+    if (!p->unixpath) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) ;
+    __sync_fetch_and_add(&p->accepted, 1) ;
+
+    if (p->mode==TESTPEER_RELAY) {
+      pthread_mutex_lock(&p->lock) ;
+      if (p->relayfd<0) {
+        p->relayfd = fd ;
+        fd = -1 ;
+      } else {
+        int *fds = malloc(2*sizeof(int)) ;
+        fds[0] = p->relayfd ;
+        fds[1] = fd ;
+        p->relayfd = -1 ;
+        if (pthread_create(&t, NULL, _testrelay, fds)==0) pthread_detach(t) ;
+      }
+      pthread_mutex_unlock(&p->lock) ;
+      continue ;
+    }
+
+    struct _testconn *c = malloc(sizeof(struct _testconn)) ;
+    c->p = p ;
+    c->fd = fd ;
+    if (pthread_create(&t, NULL, _testserve, c)==0) pthread_detach(t) ;
+    else { close(fd) ; free(c) ; }
+  }
+}
+
+
+//
+// @brief Build a TLS context with a fresh self-signed certificate
+//
+
+static inline SSL_CTX *_testtlsctx(struct testpeer *p)
+{
+  static EVP_PKEY *key = NULL ;
+  static X509 *cert = NULL ;
+
+  if (!key) {
+    key = EVP_EC_gen("P-256") ;
+    cert = X509_new() ;
+    if (!key || !cert) return NULL ;
+    X509_set_version(cert, 2) ;
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1) ;
+    X509_gmtime_adj(X509_getm_notBefore(cert), -3600) ;
+    X509_gmtime_adj(X509_getm_notAfter(cert), 86400) ;
+    X509_set_pubkey(cert, key) ;
+    X509_NAME *name = X509_get_subject_name(cert) ;
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char *)"localhost", -1, -1, 0) ;
+    X509_set_issuer_name(cert, name) ;
+    if (!X509_sign(cert, key, EVP_sha256())) return NULL ;
+  }
+
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method()) ;
+  if (!ctx) return NULL ;
+  if (!SSL_CTX_use_certificate(ctx, cert) || !SSL_CTX_use_PrivateKey(ctx, key) ||
+      (p->tls13 && !SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION)) ||
+      (p->tls12 && !SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION)) ||
+      (p->suites && !SSL_CTX_set_ciphersuites(ctx, p->suites)) ||
+      (p->ciphers && !SSL_CTX_set_cipher_list(ctx, p->ciphers)) ||
+      (p->groups && !SSL_CTX_set1_groups_list(ctx, p->groups))) {
+    SSL_CTX_free(ctx) ;
+    return NULL ;
+  }
+  SSL_CTX_set_app_data(ctx, p) ;
+  if (p->onrecord) SSL_CTX_set_msg_callback(ctx, _testrecordcb) ;
+  return ctx ;
+}
+
+
+//
+// @brief Start a peer
+// @param(in,out) p Peer description, which must outlive the test
+// @return Port listened on (0 for AF_UNIX).  Exits the test on failure.
+//
+
+static inline int testpeerstart(struct testpeer *p)
+{
+  pthread_t t ;
+  int one = 1 ;
+
+  // Peers write to connections the tests reset
+  signal(SIGPIPE, SIG_IGN) ;
+
+  pthread_mutex_init(&p->lock, NULL) ;
+  p->relayfd = -1 ;
+
+  if (p->tls && !(p->ctx = _testtlsctx(p))) _testfatal("tls context") ;
+
+  if (p->unixpath) {
+
+    struct sockaddr_un sa ;
+    memset(&sa, '\0', sizeof(sa)) ;
+    sa.sun_family = AF_UNIX ;
+    strncpy(sa.sun_path, p->unixpath, sizeof(sa.sun_path)-1) ;
+    socklen_t len = offsetof(struct sockaddr_un, sun_path) + strlen(p->unixpath) ;
+    if (sa.sun_path[0]=='@') sa.sun_path[0] = '\0' ;
+    else unlink(p->unixpath) ;
+    p->listenfd = socket(AF_UNIX, SOCK_STREAM, 0) ;
+    if (p->listenfd<0 || bind(p->listenfd, (struct sockaddr *)&sa, len)<0) _testfatal("bind") ;
+
+  } else {
+
+    struct sockaddr_in sa ;
+    socklen_t len = sizeof(sa) ;
+    memset(&sa, '\0', sizeof(sa)) ;
+    sa.sin_family = AF_INET ;
+    sa.sin_port = htons(p->port) ;
+    inet_pton(AF_INET, p->addr ? p->addr : "127.0.0.1", &sa.sin_addr) ;
+    p->listenfd = socket(AF_INET, SOCK_STREAM, 0) ;
+    if (p->listenfd<0) _testfatal("socket") ;
+    setsockopt(p->listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ;
+    if (bind(p->listenfd, (struct sockaddr *)&sa, sizeof(sa))<0) _testfatal("bind") ;
+    getsockname(p->listenfd, (struct sockaddr *)&sa, &len) ;
+    p->port = ntohs(sa.sin_port) ;
+
+  }
+
+  if (listen(p->listenfd, 1024)<0) _testfatal("listen") ;
+  if (pthread_create(&t, NULL, _testlisten, p)!=0) _testfatal("pthread_create") ;
+  pthread_detach(t) ;
+  return p->port ;
+}
+
+#endif
@@ -0,0 +1,163 @@
+//
+// timeouts.c
+//
+// Connection timeouts on the timer wheel: read, write and idle timeouts
+// of NONBLOCK connections expiring in a select() loop, each reported by
+// the next netrecv() or netsend() with its own error and then starting
+// again, data pushing a read timeout back, blocking calls bounded the
+// same way, and the wheel going quiet once every timeout is disabled.
+//
+
+#include "testsrv.h"
+
+#define MS 100
+#define SLACK 0.15    // Seconds an expiry may be late on a loaded host
+#define FILL (8<<20)
+
+
+//
+// @brief Run a select() loop until the connection is flagged
+// @param(in) write True to wait to send, false to wait to receive
+// @return Seconds waited, or -1 if not flagged within 2 seconds
+//
+
+static double waitflag(NET *sh, int write)
+{
+  double start = testnow() ;
+
+  while (testnow()-start<2) {
+    fd_set rd, wr ;
+    int l = 0, next = nettimernext() ;
+    FD_ZERO(&rd) ;
+    FD_ZERO(&wr) ;
+    if (write) netwrfdset(sh, &wr, &l) ;
+    else netrdfdset(sh, &rd, &wr, &l) ;
+    if (next<0 || next>MS) next = MS ;
+    struct timeval tv = { 0, next*1000 } ;
+    select(l+1, &rd, &wr, NULL, &tv) ;
+    nettimerexpire() ;
+    if (write ? netwrfdisset(sh, &wr) : netrdfdisset(sh, &rd, &wr)) return testnow() - start ;
+  }
+  return -1 ;
+}
+
+
+//
+// @brief Check a wait ended by a timeout of MS
+//
+
+static int ontime(double secs)
+{
+  return secs>=MS/1000.0*0.9 && secs<=MS/1000.0+SLACK ;
+}
+
+
+//
+// @brief Send until the socket buffers are full
+//
+
+static void fill(NET *sh)
+{
+  static char buf[65536] ;
+  long sent = 0 ;
+  while (sent<FILL) {
+    int r = netsend(sh, buf, sizeof(buf)) ;
+    if (r<(int)sizeof(buf)) break ;
+    sent += r ;
+  }
+}
+
+
+int main()
+{
+  struct testpeer silent = { .mode = TESTPEER_SILENT } ;
+  struct testpeer echo = { .mode = TESTPEER_ECHO } ;
+  char buf[64] = "timeouts" ;
+  double secs ;
+  int i, r ;
+
+  testpeerstart(&silent) ;
+  testpeerstart(&echo) ;
+
+  TESTCHECK(nettimernext()==-1, "a timer is due with no timeouts set") ;
+  TESTCHECK(!netsettimeout(NULL, NETTIMEOUT_READ, -1) && !netsettimeout(NULL, NETTIMEOUT_HANDSHAKE+1, MS),
+            "invalid timeouts accepted") ;
+
+  // Read timeout, reported and then started again
+
+  NET *sh = netconnect("127.0.0.1", silent.port, NONBLOCK) ;
+  TESTCHECK(sh && netsettimeout(sh, NETTIMEOUT_READ, MS), "read timeout not set") ;
+  TESTCHECK(nettimernext()>=0 && nettimernext()<=MS, "next timer due in %dms", nettimernext()) ;
+  for (i=0; i<2; i++) {
+    secs = waitflag(sh, 0) ;
+    TESTCHECK(ontime(secs), "read timeout %d flagged after %.0fms", i, secs*1e3) ;
+    r = netrecv(sh, buf, sizeof(buf)) ;
+    TESTCHECK(r==-1 && neterrno()==NET_ERR_INT+NET_ERR_READTIMEOUT, "read timeout %d gave %d, error %d", i, r, neterrno()) ;
+  }
+  netsettimeout(sh, NETTIMEOUT_READ, 0) ;
+  TESTCHECK(nettimernext()==-1, "a timer is due after disabling the read timeout") ;
+
+  // Write timeout, once the peer stops taking data
+
+  fill(sh) ;
+  TESTCHECK(netsettimeout(sh, NETTIMEOUT_WRITE, MS), "write timeout not set") ;
+  secs = waitflag(sh, 1) ;
+  TESTCHECK(ontime(secs), "write timeout flagged after %.0fms", secs*1e3) ;
+  r = netsend(sh, buf, sizeof(buf)) ;
+  TESTCHECK(r==-1 && neterrno()==NET_ERR_INT+NET_ERR_WRITETIMEOUT, "write timeout gave %d, error %d", r, neterrno()) ;
+  netclose(sh) ;
+  TESTCHECK(nettimernext()==-1, "a timer is due after closing") ;
+
+  // Idle timeout, and data received in time pushing a read timeout back
+
+  sh = netconnect("127.0.0.1", echo.port, NONBLOCK) ;
+  TESTCHECK(sh && netsettimeout(sh, NETTIMEOUT_IDLE, MS), "idle timeout not set") ;
+  secs = waitflag(sh, 0) ;
+  TESTCHECK(ontime(secs), "idle timeout flagged after %.0fms", secs*1e3) ;
+  r = netrecv(sh, buf, sizeof(buf)) ;
+  TESTCHECK(r==-1 && neterrno()==NET_ERR_INT+NET_ERR_IDLETIMEOUT, "idle timeout gave %d, error %d", r, neterrno()) ;
+  netsettimeout(sh, NETTIMEOUT_IDLE, 0) ;
+
+  netsettimeout(sh, NETTIMEOUT_READ, MS) ;
+  int echoed = 0 ;
+  for (i=0; i<5; i++) {
+    usleep(MS*600) ;
+    netsend(sh, buf, 8) ;
+    if (waitflag(sh, 0)>=0 && netrecv(sh, buf, sizeof(buf))==8) echoed++ ;
+  }
+  TESTCHECK(echoed==5, "%d of 5 echoes arrived before the read timeout", echoed) ;
+  netclose(sh) ;
+
+  // Blocking calls fail the same way once they wait too long
+
+  sh = netconnect("127.0.0.1", silent.port, OPEN) ;
+  TESTCHECK(sh && netsettimeout(sh, NETTIMEOUT_READ, MS) && netsettimeout(sh, NETTIMEOUT_WRITE, MS),
+            "blocking timeouts not set") ;
+  double start = testnow() ;
+  r = netrecv(sh, buf, sizeof(buf)) ;
+  secs = testnow() - start ;
+  TESTCHECK(r==-1 && neterrno()==NET_ERR_INT+NET_ERR_READTIMEOUT && ontime(secs),
+            "blocking read gave %d, error %d after %.0fms", r, neterrno(), secs*1e3) ;
+
+  // Sends cut short by the timeout return what they sent, until the
+  // buffers are full and one sends nothing
+
+  static char big[FILL] ;
+  int calls = 0 ;
+  while ((r = netsend(sh, big, FILL))>0 && ++calls<50) ;
+  TESTCHECK(r==-1 && neterrno()==NET_ERR_INT+NET_ERR_WRITETIMEOUT,
+            "blocking send gave %d, error %d after %d short sends", r, neterrno(), calls) ;
+  netclose(sh) ;
+
+  // Defaults apply to new connections
+
+  netsettimeout(NULL, NETTIMEOUT_READ, MS) ;
+  sh = netconnect("127.0.0.1", silent.port, NONBLOCK) ;
+  netsettimeout(NULL, NETTIMEOUT_READ, 0) ;
+  secs = sh ? waitflag(sh, 0) : -1 ;
+  TESTCHECK(ontime(secs) && netrecv(sh, buf, sizeof(buf))==-1 && neterrno()==NET_ERR_INT+NET_ERR_READTIMEOUT,
+            "default read timeout flagged after %.0fms", secs*1e3) ;
+  if (sh) netclose(sh) ;
+
+  return testresult("timeouts") ;
+}
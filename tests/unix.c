@@ -0,0 +1,101 @@
+//
+// unix.c
+//
+// unix: endpoints in netconnect(), by path and abstract name, plain and
+// TLS, and the 64 byte ping-pong round trip against TCP loopback.
+//
+
+#include "testsrv.h"
+
+#define ROUNDS 20000
+
+
+//
+// @brief Time a 64 byte ping-pong
+// @param(in) sh Handle of open connection
+// @return Mean round trip in microseconds, or -1 if an echo was wrong
+//
+
+static double pingpong(NET *sh)
+{
+  char out[64], in[64] ;
+  memset(out, 'p', sizeof(out)) ;
+
+  double start = testnow() ;
+  for (int i=0; i<ROUNDS; i++) {
+    int got = 0 ;
+    if (netsend(sh, out, sizeof(out))!=sizeof(out)) return -1 ;
+    while (got<(int)sizeof(in)) {
+      int r = netrecv(sh, in+got, sizeof(in)-got) ;
+      if (r<=0) return -1 ;
+      got += r ;
+    }
+  }
+  return (testnow()-start) * 1e6 / ROUNDS ;
+}
+
+
+//
+// @brief Check an endpoint echoes and reports itself as documented
+//
+
+static void endpoint(char *host, int port, int flags, char *peerip)
+{
+  char buf[16] = "" ;
+  NET *sh = netconnect(host, port, flags) ;
+  TESTCHECK(sh!=NULL, "%s: connect failed: %s", host, netstrerror()) ;
+  if (!sh) return ;
+  TESTCHECK(netsend(sh, "hello", 5)==5, "%s: send failed", host) ;
+  TESTCHECK(netrecv(sh, buf, sizeof(buf)-1)==5 && !strcmp(buf, "hello"), "%s: bad echo '%s'", host, buf) ;
+  TESTCHECK(netpeerip(sh) && !strcmp(netpeerip(sh), peerip), "%s: netpeerip '%s'", host, netpeerip(sh)) ;
+  TESTCHECK(netpeerport(sh)==0 && netlocalport(sh)==0, "%s: ports %d/%d", host,
+            netpeerport(sh), netlocalport(sh)) ;
+  netclose(sh) ;
+}
+
+
+int main()
+{
+  char path[64], tlspath[64], abstract[64], host[80] ;
+  snprintf(path, sizeof(path), "/tmp/lnet-test-%d.sock", (int)getpid()) ;
+  snprintf(tlspath, sizeof(tlspath), "/tmp/lnet-test-%d.tls", (int)getpid()) ;
+  snprintf(abstract, sizeof(abstract), "@lnet-test-%d", (int)getpid()) ;
+
+  struct testpeer byname = { .mode = TESTPEER_ECHO, .unixpath = path } ;
+  struct testpeer byabstract = { .mode = TESTPEER_ECHO, .unixpath = abstract } ;
+  struct testpeer tls = { .mode = TESTPEER_ECHO, .unixpath = tlspath, .tls = 1 } ;
+  struct testpeer tcp = { .mode = TESTPEER_ECHO } ;
+  testpeerstart(&byname) ;
+  testpeerstart(&byabstract) ;
+  testpeerstart(&tls) ;
+  testpeerstart(&tcp) ;
+
+  snprintf(host, sizeof(host), "unix:%s", path) ;
+  endpoint(host, 0, OPEN, path) ;
+  snprintf(host, sizeof(host), "unix:%s", abstract) ;
+  endpoint(host, 1234, OPEN, abstract) ;
+
+  // TLS runs over the unix socket unchanged
+
+  snprintf(host, sizeof(host), "unix:%s", tlspath) ;
+  endpoint(host, 0, TLS|NOCERTCHAIN, tlspath) ;
+
+  TESTCHECK(netconnect("unix:/nonexistent/lnet.sock", 0, OPEN)==NULL, "connect to missing path succeeded") ;
+  TESTCHECK(netconnect("unix:", 0, OPEN)==NULL, "connect to empty path succeeded") ;
+
+  snprintf(host, sizeof(host), "unix:%s", path) ;
+  NET *u = netconnect(host, 0, OPEN) ;
+  NET *t = netconnect("127.0.0.1", tcp.port, OPEN) ;
+  if (u && t) {
+    double urtt = pingpong(u) ;
+    double trtt = pingpong(t) ;
+    TESTCHECK(urtt>0 && trtt>0, "ping-pong echo failed") ;
+    printf("unix: 64 byte round trip %.1fus over unix, %.1fus over TCP loopback\n", urtt, trtt) ;
+  }
+  if (u) netclose(u) ;
+  if (t) netclose(t) ;
+
+  unlink(path) ;
+  unlink(tlspath) ;
+  return testresult("unix") ;
+}
@@ -0,0 +1,149 @@
+//
+// zerocopy.c
+//
+// MSG_ZEROCOPY sends: echoed data arrives intact when each buffer is only
+// reused after netzcdone(), small sends and gathered (corked) writes are
+// copied, and TLS refuses.  Then the sender CPU per GB, copied and zero
+// copy, at a few send sizes.
+//
+
+#include "testsrv.h"
+
+#define THRESHOLD 16384
+#define BENCHBYTES (256L<<20)
+
+
+//
+// @brief Read exactly len bytes
+//
+
+static int readall(NET *sh, char *buf, int len)
+{
+  int got = 0 ;
+  while (got<len) {
+    int r = netrecv(sh, buf+got, len-got) ;
+    if (r<=0) return 0 ;
+    got += r ;
+  }
+  return 1 ;
+}
+
+
+static double cputime()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) ;
+  return ts.tv_sec + ts.tv_nsec/1e9 ;
+}
+
+
+//
+// @brief Send BENCHBYTES to a sink, waiting for each buffer before reuse
+// @return Sender CPU seconds per GB, or -1 on failure
+//
+
+static double bench(int port, int size, int zerocopy)
+{
+  char *buf = malloc(size) ;
+  long sent = 0 ;
+  NET *sh = netconnect("127.0.0.1", port, OPEN) ;
+  if (!sh || !buf) return -1 ;
+  memset(buf, 'z', size) ;
+  if (zerocopy) netzerocopy(sh, THRESHOLD) ;
+
+  double start = cputime() ;
+  while (sent<BENCHBYTES) {
+    if (netsend(sh, buf, size)!=size) break ;
+    long id = netzclastid(sh) ;
+    if (id>=0 && netzcdone(sh, id, -1)!=1) break ;
+    sent += size ;
+  }
+  double secs = cputime() - start ;
+  netclose(sh) ;
+  free(buf) ;
+  return sent==BENCHBYTES ? secs * (1L<<30) / BENCHBYTES : -1 ;
+}
+
+
+int main()
+{
+  struct testpeer echo = { .mode = TESTPEER_ECHO } ;
+  struct testpeer tls = { .mode = TESTPEER_ECHO, .tls = 1 } ;
+  struct testpeer sink = { .mode = TESTPEER_SINK } ;
+  struct netzcstats st ;
+  static char out[65536], in[65536] ;
+  int i, bad ;
+
+  testpeerstart(&echo) ;
+  testpeerstart(&tls) ;
+  testpeerstart(&sink) ;
+
+  NET *sh = netconnect("127.0.0.1", tls.port, TLS|NOCERTCHAIN) ;
+  TESTCHECK(sh && !netzerocopy(sh, THRESHOLD), "zero copy enabled on TLS") ;
+  if (sh) netclose(sh) ;
+
+  sh = netconnect("127.0.0.1", echo.port, OPEN) ;
+  TESTCHECK(sh!=NULL, "connect failed") ;
+  if (!sh) return testresult("zerocopy") ;
+  TESTCHECK(!netzcstats(sh, &st), "stats before enabling") ;
+  TESTCHECK(netzerocopy(sh, THRESHOLD), "netzerocopy failed") ;
+
+  // The buffer is rewritten as soon as netzcdone() allows, so an early
+  // release shows up as a corrupt echo
+
+  for (i=0, bad=0; i<200; i++) {
+    memset(out, 'a' + i%26, sizeof(out)) ;
+    if (netsend(sh, out, sizeof(out))!=sizeof(out)) { bad++ ; break ; }
+    long id = netzclastid(sh) ;
+    TESTCHECK(id>=0, "send %d was copied", i) ;
+    TESTCHECK(netzcdone(sh, id, -1)==1, "send %d never completed", i) ;
+    memset(out, '!', sizeof(out)) ;
+    if (!readall(sh, in, sizeof(in))) { bad++ ; break ; }
+    for (int j=0; j<(int)sizeof(in); j++) if (in[j]!='a' + i%26) { bad++ ; break ; }
+  }
+  TESTCHECK(!bad, "zero copy echo corrupt or short") ;
+
+  TESTCHECK(netsend(sh, out, 100)==100 && netzclastid(sh)==-1, "small send not copied") ;
+  readall(sh, in, 100) ;
+
+  TESTCHECK(netzcstats(sh, &st), "netzcstats failed") ;
+  TESTCHECK(st.sends+st.fallbacks==200 && st.bytes==st.sends*sizeof(out),
+            "%lu sends, %lu fallbacks, %lu bytes", st.sends, st.fallbacks, st.bytes) ;
+  TESTCHECK(st.completions==st.sends && st.outstanding==0,
+            "%lu completions, %lu outstanding", st.completions, st.outstanding) ;
+  netclose(sh) ;
+
+  // Gathered writes are flushed from the library's own buffer, which is
+  // reused at once, so never with zero copy
+
+  sh = netconnect("127.0.0.1", echo.port, OPEN) ;
+  TESTCHECK(sh && netzerocopy(sh, 1024) && netsetcork(sh, 8192), "cork setup failed") ;
+  if (sh) {
+    long total = 0 ;
+    for (i=0, bad=0; i<2000; i++) {
+      char msg[100] ;
+      memset(msg, 'A' + i%26, sizeof(msg)) ;
+      if (netsend(sh, msg, sizeof(msg))!=sizeof(msg)) { bad++ ; break ; }
+      total += sizeof(msg) ;
+      if (total+100>(long)sizeof(in) || i==1999) {
+        netflush(sh) ;
+        if (!readall(sh, in, total)) { bad++ ; break ; }
+        for (int j=0; j<total; j++) if (in[j]!='A' + (i - (total-1-j)/100) % 26) { bad++ ; break ; }
+        total = 0 ;
+      }
+    }
+    TESTCHECK(!bad, "corked echo corrupt or short") ;
+    netclose(sh) ;
+  }
+
+  int sizes[] = { 16384, 65536, 1<<20, 4<<20 } ;
+  for (i=0; i<4; i++) {
+    double copy = bench(sink.port, sizes[i], 0) ;
+    double zc = bench(sink.port, sizes[i], 1) ;
+    TESTCHECK(copy>0 && zc>0, "benchmark at %d bytes failed", sizes[i]) ;
+    printf("zerocopy: %5dKB sends, sender CPU per GB %.3fs copied, %.3fs zero copy\n",
+           sizes[i]/1024, copy, zc) ;
+  }
+
+  return testresult("zerocopy") ;
+}